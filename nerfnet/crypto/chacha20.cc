@@ -0,0 +1,200 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/crypto/chacha20.h"
+
+#include <algorithm>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "nerfnet/util/encoding.h"
+
+namespace nerfnet {
+namespace {
+
+// The constant words at the start of the state, "expand 32-byte k".
+constexpr uint32_t kSigma[4] = {
+  0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+};
+
+// Populates the state from the constants, a key and four more words.
+void InitState(uint32_t* state, const uint8_t* key) {
+  std::copy(&kSigma[0], &kSigma[4], state);
+  for (size_t i = 0; i < 8; i++) {
+    state[4 + i] = ReadLittleEndianU32(&key[i * 4]);
+  }
+}
+
+uint32_t RotateLeft(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+void QuarterRound(uint32_t* x, int a, int b, int c, int d) {
+  x[a] += x[b]; x[d] = RotateLeft(x[d] ^ x[a], 16);
+  x[c] += x[d]; x[b] = RotateLeft(x[b] ^ x[c], 12);
+  x[a] += x[b]; x[d] = RotateLeft(x[d] ^ x[a], 8);
+  x[c] += x[d]; x[b] = RotateLeft(x[b] ^ x[c], 7);
+}
+
+// Applies the 20 rounds of the ChaCha permutation in place.
+void Permute(uint32_t* x) {
+  for (int i = 0; i < 10; i++) {
+    QuarterRound(x, 0, 4, 8, 12);
+    QuarterRound(x, 1, 5, 9, 13);
+    QuarterRound(x, 2, 6, 10, 14);
+    QuarterRound(x, 3, 7, 11, 15);
+    QuarterRound(x, 0, 5, 10, 15);
+    QuarterRound(x, 1, 6, 11, 12);
+    QuarterRound(x, 2, 7, 8, 13);
+    QuarterRound(x, 3, 4, 9, 14);
+  }
+}
+
+#if defined(__ARM_NEON)
+
+// Each row of the state is held in a vector so that the four quarter rounds
+// of a column or diagonal round are performed at once. The diagonals are
+// lined up as columns by rotating the rows between rounds.
+
+template <int kBits>
+uint32x4_t RotateLeft(uint32x4_t value) {
+  return vorrq_u32(vshlq_n_u32(value, kBits), vshrq_n_u32(value, 32 - kBits));
+}
+
+template <>
+uint32x4_t RotateLeft<16>(uint32x4_t value) {
+  return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(value)));
+}
+
+void QuarterRound(uint32x4_t& a, uint32x4_t& b, uint32x4_t& c,
+                  uint32x4_t& d) {
+  a = vaddq_u32(a, b); d = RotateLeft<16>(veorq_u32(d, a));
+  c = vaddq_u32(c, d); b = RotateLeft<12>(veorq_u32(b, c));
+  a = vaddq_u32(a, b); d = RotateLeft<8>(veorq_u32(d, a));
+  c = vaddq_u32(c, d); b = RotateLeft<7>(veorq_u32(b, c));
+}
+
+void Block(const uint32_t* state, uint8_t* block) {
+  const uint32x4_t a0 = vld1q_u32(&state[0]);
+  const uint32x4_t b0 = vld1q_u32(&state[4]);
+  const uint32x4_t c0 = vld1q_u32(&state[8]);
+  const uint32x4_t d0 = vld1q_u32(&state[12]);
+  uint32x4_t a = a0;
+  uint32x4_t b = b0;
+  uint32x4_t c = c0;
+  uint32x4_t d = d0;
+  for (int i = 0; i < 10; i++) {
+    QuarterRound(a, b, c, d);
+    b = vextq_u32(b, b, 1);
+    c = vextq_u32(c, c, 2);
+    d = vextq_u32(d, d, 3);
+    QuarterRound(a, b, c, d);
+    b = vextq_u32(b, b, 3);
+    c = vextq_u32(c, c, 2);
+    d = vextq_u32(d, d, 1);
+  }
+
+  // The keystream is serialized little-endian, which matches the lane order
+  // of NEON stores on the little-endian targets this runs on.
+  vst1q_u8(&block[0], vreinterpretq_u8_u32(vaddq_u32(a, a0)));
+  vst1q_u8(&block[16], vreinterpretq_u8_u32(vaddq_u32(b, b0)));
+  vst1q_u8(&block[32], vreinterpretq_u8_u32(vaddq_u32(c, c0)));
+  vst1q_u8(&block[48], vreinterpretq_u8_u32(vaddq_u32(d, d0)));
+}
+
+void XorBlock(uint8_t* data, const uint8_t* keystream, size_t size) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    vst1q_u8(&data[i], veorq_u8(vld1q_u8(&data[i]), vld1q_u8(&keystream[i])));
+  }
+
+  for (; i < size; i++) {
+    data[i] ^= keystream[i];
+  }
+}
+
+constexpr char kImplementation[] = "neon";
+
+#else
+
+void Block(const uint32_t* state, uint8_t* block) {
+  uint32_t x[16];
+  std::copy(&state[0], &state[16], x);
+  Permute(x);
+  for (size_t i = 0; i < 16; i++) {
+    WriteLittleEndianU32(&block[i * 4], x[i] + state[i]);
+  }
+}
+
+void XorBlock(uint8_t* data, const uint8_t* keystream, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    data[i] ^= keystream[i];
+  }
+}
+
+constexpr char kImplementation[] = "portable";
+
+#endif  // defined(__ARM_NEON)
+
+}  // anonymous namespace
+
+ChaCha20::ChaCha20(const uint8_t* key, const uint8_t* nonce,
+                   uint32_t counter) {
+  InitState(state_, key);
+  state_[12] = counter;
+  for (size_t i = 0; i < 3; i++) {
+    state_[13 + i] = ReadLittleEndianU32(&nonce[i * 4]);
+  }
+}
+
+void ChaCha20::Keystream(uint8_t* block) {
+  Block(state_, block);
+  state_[12]++;
+}
+
+void ChaCha20::Apply(uint8_t* data, size_t size) {
+  uint8_t block[kBlockSize];
+  while (size > 0) {
+    size_t chunk_size = std::min(size, kBlockSize);
+    Keystream(block);
+    XorBlock(data, block, chunk_size);
+    data += chunk_size;
+    size -= chunk_size;
+  }
+}
+
+void ChaCha20::HChaCha20(const uint8_t* key, const uint8_t* input,
+                         uint8_t* subkey) {
+  uint32_t x[16];
+  InitState(x, key);
+  for (size_t i = 0; i < 4; i++) {
+    x[12 + i] = ReadLittleEndianU32(&input[i * 4]);
+  }
+
+  Permute(x);
+  for (size_t i = 0; i < 4; i++) {
+    WriteLittleEndianU32(&subkey[i * 4], x[i]);
+    WriteLittleEndianU32(&subkey[16 + i * 4], x[12 + i]);
+  }
+}
+
+const char* ChaCha20::GetImplementation() {
+  return kImplementation;
+}
+
+}  // namespace nerfnet
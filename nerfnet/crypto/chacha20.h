@@ -0,0 +1,61 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_CRYPTO_CHACHA20_H_
+#define NERFNET_CRYPTO_CHACHA20_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nerfnet {
+
+// The ChaCha20 stream cipher as described in RFC 8439. The block function is
+// vectorized with NEON when the target supports it.
+class ChaCha20 {
+ public:
+  // The sizes of the key, nonce and keystream blocks.
+  static constexpr size_t kKeySize = 32;
+  static constexpr size_t kNonceSize = 12;
+  static constexpr size_t kBlockSize = 64;
+
+  // The size of the input and output of HChaCha20.
+  static constexpr size_t kHChaCha20InputSize = 16;
+
+  // Setup the cipher with a key and nonce, starting at the supplied block.
+  ChaCha20(const uint8_t* key, const uint8_t* nonce, uint32_t counter = 0);
+
+  // Writes the next block of keystream.
+  void Keystream(uint8_t* block);
+
+  // Encrypts or decrypts data in place. The unused keystream of a trailing
+  // partial block is discarded.
+  void Apply(uint8_t* data, size_t size);
+
+  // Derives a key from a key and a 16 byte input using HChaCha20.
+  static void HChaCha20(const uint8_t* key, const uint8_t* input,
+                        uint8_t* subkey);
+
+  // Returns the name of the block function implementation in use.
+  static const char* GetImplementation();
+
+ private:
+  // The state of the cipher. Word 12 is the block counter.
+  uint32_t state_[16];
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_CRYPTO_CHACHA20_H_
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/crypto/chacha20_poly1305.h"
+
+#include <algorithm>
+
+#include "nerfnet/crypto/chacha20.h"
+#include "nerfnet/crypto/poly1305.h"
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+namespace {
+
+// Computes the tag over the additional data and ciphertext. The cipher must
+// be at block zero, which is used to derive the one-time Poly1305 key.
+void ComputeTag(ChaCha20& cipher, const uint8_t* aad, size_t aad_size,
+                const uint8_t* data, size_t size, uint8_t* tag) {
+  uint8_t block[ChaCha20::kBlockSize];
+  cipher.Keystream(block);
+
+  Poly1305 poly1305(block);
+  poly1305.Update(aad, aad_size);
+  poly1305.PadToBlock();
+  poly1305.Update(data, size);
+  poly1305.PadToBlock();
+
+  uint8_t lengths[16];
+  WriteLittleEndianU64(&lengths[0], aad_size);
+  WriteLittleEndianU64(&lengths[8], size);
+  poly1305.Update(lengths, sizeof(lengths));
+  poly1305.Finish(tag);
+}
+
+}  // anonymous namespace
+
+void ChaCha20Poly1305::Seal(const uint8_t* key, const uint8_t* nonce,
+                            const uint8_t* aad, size_t aad_size,
+                            uint8_t* data, size_t size,
+                            uint8_t* tag, size_t tag_size) {
+  CHECK(tag_size <= kTagSize, "Invalid tag size %zu", tag_size);
+  ChaCha20 mac_cipher(key, nonce, 0);
+  ChaCha20 cipher(key, nonce, 1);
+  cipher.Apply(data, size);
+
+  uint8_t full_tag[kTagSize];
+  ComputeTag(mac_cipher, aad, aad_size, data, size, full_tag);
+  std::copy(&full_tag[0], &full_tag[tag_size], tag);
+}
+
+bool ChaCha20Poly1305::Open(const uint8_t* key, const uint8_t* nonce,
+                            const uint8_t* aad, size_t aad_size,
+                            uint8_t* data, size_t size,
+                            const uint8_t* tag, size_t tag_size) {
+  CHECK(tag_size <= kTagSize, "Invalid tag size %zu", tag_size);
+  ChaCha20 cipher(key, nonce, 0);
+  uint8_t full_tag[kTagSize];
+  ComputeTag(cipher, aad, aad_size, data, size, full_tag);
+
+  // Compare in constant time to avoid leaking how much of the tag matched.
+  uint8_t difference = 0;
+  for (size_t i = 0; i < tag_size; i++) {
+    difference |= full_tag[i] ^ tag[i];
+  }
+
+  if (difference != 0) {
+    return false;
+  }
+
+  cipher.Apply(data, size);
+  return true;
+}
+
+}  // namespace nerfnet
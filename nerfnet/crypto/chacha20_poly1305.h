@@ -0,0 +1,51 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_CRYPTO_CHACHA20_POLY1305_H_
+#define NERFNET_CRYPTO_CHACHA20_POLY1305_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nerfnet {
+
+// The ChaCha20-Poly1305 AEAD construction as described in RFC 8439. Tags may
+// be truncated to reduce overhead, at the cost of a higher forgery
+// probability of 2^-(8 * tag_size) per attempt.
+class ChaCha20Poly1305 {
+ public:
+  // The sizes of the key, nonce and complete tag.
+  static constexpr size_t kKeySize = 32;
+  static constexpr size_t kNonceSize = 12;
+  static constexpr size_t kTagSize = 16;
+
+  // Encrypts data in place and writes the first tag_size bytes of the tag.
+  static void Seal(const uint8_t* key, const uint8_t* nonce,
+                   const uint8_t* aad, size_t aad_size,
+                   uint8_t* data, size_t size,
+                   uint8_t* tag, size_t tag_size = kTagSize);
+
+  // Verifies a tag of tag_size bytes and decrypts data in place. Returns
+  // false and leaves the data untouched if the tag does not match.
+  static bool Open(const uint8_t* key, const uint8_t* nonce,
+                   const uint8_t* aad, size_t aad_size,
+                   uint8_t* data, size_t size,
+                   const uint8_t* tag, size_t tag_size = kTagSize);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_CRYPTO_CHACHA20_POLY1305_H_
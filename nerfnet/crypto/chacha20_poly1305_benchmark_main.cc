@@ -0,0 +1,112 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <tclap/CmdLine.h>
+#include <vector>
+
+#include "nerfnet/crypto/chacha20.h"
+#include "nerfnet/crypto/chacha20_poly1305.h"
+#include "nerfnet/util/cycle_counter.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/random.h"
+#include "nerfnet/util/time.h"
+
+// A description of the program.
+constexpr char kDescription[] =
+    "Measures the cost of ChaCha20-Poly1305 for the frame sizes carried by "
+    "nerfnet.";
+
+// The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+// The frame sizes to measure.
+constexpr size_t kFrameSizes[] = {32, 64, 128, 256, 512, 1024, 1500};
+
+int main(int argc, char** argv) {
+  // Parse command-line arguments.
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<uint32_t> iterations_arg("", "iterations",
+      "The number of frames to seal and open for each frame size.",
+      false, 20000, "count", cmd);
+  TCLAP::ValueArg<uint32_t> tag_size_arg("", "tag_size",
+      "The number of tag bytes to send with each frame.",
+      false, 8, "bytes", cmd);
+  TCLAP::ValueArg<double> cpu_mhz_arg("", "cpu_mhz",
+      "The clock frequency used to estimate cycles when the cycle counter is "
+      "not available. Read from cpufreq when not set.",
+      false, 0.0, "mhz", cmd);
+  cmd.parse(argc, argv);
+
+  const uint32_t iterations = iterations_arg.getValue();
+  const size_t tag_size = tag_size_arg.getValue();
+  CHECK(iterations > 0, "At least one iteration is required");
+  CHECK(tag_size <= nerfnet::ChaCha20Poly1305::kTagSize,
+      "Invalid tag size %zu", tag_size);
+
+  nerfnet::CycleCounter cycle_counter;
+  double cpu_mhz = cpu_mhz_arg.isSet()
+      ? cpu_mhz_arg.getValue() : nerfnet::GetCpuMhz();
+  LOGI("implementation: %s", nerfnet::ChaCha20::GetImplementation());
+  if (cycle_counter.IsAvailable()) {
+    LOGI("cycles: measured");
+  } else if (cpu_mhz > 0.0) {
+    LOGI("cycles: estimated at %.0f MHz", cpu_mhz);
+  } else {
+    LOGW("cycles: unavailable, set --cpu_mhz to estimate");
+  }
+
+  uint8_t key[nerfnet::ChaCha20Poly1305::kKeySize];
+  uint8_t nonce[nerfnet::ChaCha20Poly1305::kNonceSize] = {};
+  uint8_t header = 0;
+  nerfnet::GetRandomBytes(key, sizeof(key));
+
+  printf("%8s %12s %12s %12s\n", "size", "MB/s", "ns/byte", "cycles/byte");
+  for (size_t size : kFrameSizes) {
+    std::vector<uint8_t> frame(size + tag_size);
+    nerfnet::GetRandomBytes(frame.data(), frame.size());
+
+    // Each frame is sealed by the sender and opened by the receiver, so both
+    // are included in the cost of a frame.
+    if (cycle_counter.IsAvailable()) {
+      cycle_counter.Start();
+    }
+
+    uint64_t start_us = nerfnet::TimeNowUs();
+    for (uint32_t i = 0; i < iterations; i++) {
+      nonce[0] = i;
+      nerfnet::ChaCha20Poly1305::Seal(key, nonce, &header, 1,
+          frame.data(), size, &frame[size], tag_size);
+      CHECK(nerfnet::ChaCha20Poly1305::Open(key, nonce, &header, 1,
+          frame.data(), size, &frame[size], tag_size),
+          "Failed to open frame");
+    }
+
+    uint64_t elapsed_us = nerfnet::TimeNowUs() - start_us;
+    double bytes = static_cast<double>(size) * iterations;
+    double ns_per_byte = elapsed_us * 1000.0 / bytes;
+    double cycles_per_byte = 0.0;
+    if (cycle_counter.IsAvailable()) {
+      cycles_per_byte = cycle_counter.Stop() / bytes;
+    } else {
+      cycles_per_byte = ns_per_byte * cpu_mhz / 1000.0;
+    }
+
+    printf("%8zu %12.2f %12.2f %12.2f\n", size,
+        bytes / elapsed_us, ns_per_byte, cycles_per_byte);
+  }
+
+  return 0;
+}
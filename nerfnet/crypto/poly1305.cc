@@ -0,0 +1,177 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/crypto/poly1305.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/encoding.h"
+
+namespace nerfnet {
+namespace {
+
+// The mask for a 26-bit limb.
+constexpr uint32_t kLimbMask = 0x3ffffff;
+
+}  // anonymous namespace
+
+Poly1305::Poly1305(const uint8_t* key)
+    : h_(), buffer_size_(0) {
+  r_[0] = ReadLittleEndianU32(&key[0]) & 0x3ffffff;
+  r_[1] = (ReadLittleEndianU32(&key[3]) >> 2) & 0x3ffff03;
+  r_[2] = (ReadLittleEndianU32(&key[6]) >> 4) & 0x3ffc0ff;
+  r_[3] = (ReadLittleEndianU32(&key[9]) >> 6) & 0x3f03fff;
+  r_[4] = (ReadLittleEndianU32(&key[12]) >> 8) & 0x00fffff;
+  for (size_t i = 0; i < 4; i++) {
+    pad_[i] = ReadLittleEndianU32(&key[16 + i * 4]);
+  }
+}
+
+void Poly1305::Update(const uint8_t* data, size_t size) {
+  if (buffer_size_ > 0) {
+    size_t fill_size = std::min(size, kBlockSize - buffer_size_);
+    std::copy(data, data + fill_size, &buffer_[buffer_size_]);
+    buffer_size_ += fill_size;
+    data += fill_size;
+    size -= fill_size;
+    if (buffer_size_ < kBlockSize) {
+      return;
+    }
+
+    Blocks(buffer_, kBlockSize, 1 << 24);
+    buffer_size_ = 0;
+  }
+
+  size_t blocks_size = size & ~(kBlockSize - 1);
+  Blocks(data, blocks_size, 1 << 24);
+  std::copy(data + blocks_size, data + size, buffer_);
+  buffer_size_ = size - blocks_size;
+}
+
+void Poly1305::PadToBlock() {
+  if (buffer_size_ > 0) {
+    std::fill(&buffer_[buffer_size_], &buffer_[kBlockSize], 0);
+    Blocks(buffer_, kBlockSize, 1 << 24);
+    buffer_size_ = 0;
+  }
+}
+
+void Poly1305::Finish(uint8_t* tag) {
+  if (buffer_size_ > 0) {
+    buffer_[buffer_size_] = 1;
+    std::fill(&buffer_[buffer_size_ + 1], &buffer_[kBlockSize], 0);
+    Blocks(buffer_, kBlockSize, 0);
+    buffer_size_ = 0;
+  }
+
+  // Fully carry the accumulator.
+  uint32_t h0 = h_[0];
+  uint32_t h1 = h_[1];
+  uint32_t h2 = h_[2];
+  uint32_t h3 = h_[3];
+  uint32_t h4 = h_[4];
+  uint32_t c = h1 >> 26; h1 &= kLimbMask;
+  h2 += c; c = h2 >> 26; h2 &= kLimbMask;
+  h3 += c; c = h3 >> 26; h3 &= kLimbMask;
+  h4 += c; c = h4 >> 26; h4 &= kLimbMask;
+  h0 += c * 5; c = h0 >> 26; h0 &= kLimbMask;
+  h1 += c;
+
+  // Compute h - p and select it in constant time if it is not negative.
+  uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= kLimbMask;
+  uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= kLimbMask;
+  uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= kLimbMask;
+  uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= kLimbMask;
+  uint32_t g4 = h4 + c - (1 << 26);
+  uint32_t mask = (g4 >> 31) - 1;
+  h0 = (h0 & ~mask) | (g0 & mask);
+  h1 = (h1 & ~mask) | (g1 & mask);
+  h2 = (h2 & ~mask) | (g2 & mask);
+  h3 = (h3 & ~mask) | (g3 & mask);
+  h4 = (h4 & ~mask) | (g4 & mask);
+
+  // Pack into 32-bit words and add the pad modulo 2^128.
+  uint32_t words[4] = {
+    h0 | (h1 << 26),
+    (h1 >> 6) | (h2 << 20),
+    (h2 >> 12) | (h3 << 14),
+    (h3 >> 18) | (h4 << 8),
+  };
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < 4; i++) {
+    sum = static_cast<uint64_t>(words[i]) + pad_[i] + (sum >> 32);
+    WriteLittleEndianU32(&tag[i * 4], sum);
+  }
+}
+
+void Poly1305::Blocks(const uint8_t* data, size_t size, uint32_t high_bit) {
+  const uint32_t r0 = r_[0];
+  const uint32_t r1 = r_[1];
+  const uint32_t r2 = r_[2];
+  const uint32_t r3 = r_[3];
+  const uint32_t r4 = r_[4];
+  const uint32_t s1 = r1 * 5;
+  const uint32_t s2 = r2 * 5;
+  const uint32_t s3 = r3 * 5;
+  const uint32_t s4 = r4 * 5;
+
+  uint32_t h0 = h_[0];
+  uint32_t h1 = h_[1];
+  uint32_t h2 = h_[2];
+  uint32_t h3 = h_[3];
+  uint32_t h4 = h_[4];
+  for (size_t offset = 0; offset < size; offset += kBlockSize) {
+    const uint8_t* block = &data[offset];
+    h0 += ReadLittleEndianU32(&block[0]) & kLimbMask;
+    h1 += (ReadLittleEndianU32(&block[3]) >> 2) & kLimbMask;
+    h2 += (ReadLittleEndianU32(&block[6]) >> 4) & kLimbMask;
+    h3 += (ReadLittleEndianU32(&block[9]) >> 6) & kLimbMask;
+    h4 += (ReadLittleEndianU32(&block[12]) >> 8) | high_bit;
+
+    uint64_t d0 = static_cast<uint64_t>(h0) * r0
+        + static_cast<uint64_t>(h1) * s4 + static_cast<uint64_t>(h2) * s3
+        + static_cast<uint64_t>(h3) * s2 + static_cast<uint64_t>(h4) * s1;
+    uint64_t d1 = static_cast<uint64_t>(h0) * r1
+        + static_cast<uint64_t>(h1) * r0 + static_cast<uint64_t>(h2) * s4
+        + static_cast<uint64_t>(h3) * s3 + static_cast<uint64_t>(h4) * s2;
+    uint64_t d2 = static_cast<uint64_t>(h0) * r2
+        + static_cast<uint64_t>(h1) * r1 + static_cast<uint64_t>(h2) * r0
+        + static_cast<uint64_t>(h3) * s4 + static_cast<uint64_t>(h4) * s3;
+    uint64_t d3 = static_cast<uint64_t>(h0) * r3
+        + static_cast<uint64_t>(h1) * r2 + static_cast<uint64_t>(h2) * r1
+        + static_cast<uint64_t>(h3) * r0 + static_cast<uint64_t>(h4) * s4;
+    uint64_t d4 = static_cast<uint64_t>(h0) * r4
+        + static_cast<uint64_t>(h1) * r3 + static_cast<uint64_t>(h2) * r2
+        + static_cast<uint64_t>(h3) * r1 + static_cast<uint64_t>(h4) * r0;
+
+    uint32_t c = d0 >> 26; h0 = d0 & kLimbMask;
+    d1 += c; c = d1 >> 26; h1 = d1 & kLimbMask;
+    d2 += c; c = d2 >> 26; h2 = d2 & kLimbMask;
+    d3 += c; c = d3 >> 26; h3 = d3 & kLimbMask;
+    d4 += c; c = d4 >> 26; h4 = d4 & kLimbMask;
+    h0 += c * 5; c = h0 >> 26; h0 &= kLimbMask;
+    h1 += c;
+  }
+
+  h_[0] = h0;
+  h_[1] = h1;
+  h_[2] = h2;
+  h_[3] = h3;
+  h_[4] = h4;
+}
+
+}  // namespace nerfnet
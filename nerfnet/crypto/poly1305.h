@@ -0,0 +1,66 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_CRYPTO_POLY1305_H_
+#define NERFNET_CRYPTO_POLY1305_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nerfnet {
+
+// The Poly1305 one-time authenticator as described in RFC 8439. The
+// accumulator is held in 26-bit limbs so that only 32x32 bit multiplies are
+// required, which suits the 32-bit cores found in Raspberry Pis.
+class Poly1305 {
+ public:
+  // The sizes of the one-time key and the tag.
+  static constexpr size_t kKeySize = 32;
+  static constexpr size_t kTagSize = 16;
+
+  // Setup the authenticator with a one-time key.
+  explicit Poly1305(const uint8_t* key);
+
+  // Adds data to the message being authenticated.
+  void Update(const uint8_t* data, size_t size);
+
+  // Adds zeros to the message up to the next multiple of 16 bytes.
+  void PadToBlock();
+
+  // Computes the tag for the message.
+  void Finish(uint8_t* tag);
+
+ private:
+  // The size of a message block.
+  static constexpr size_t kBlockSize = 16;
+
+  // The clamped multiplier, the accumulator and the final pad.
+  uint32_t r_[5];
+  uint32_t h_[5];
+  uint32_t pad_[4];
+
+  // Message bytes that do not yet fill a block.
+  uint8_t buffer_[kBlockSize];
+  size_t buffer_size_;
+
+  // Adds complete blocks to the accumulator. The high bit is cleared for the
+  // final partial block, which is padded explicitly.
+  void Blocks(const uint8_t* data, size_t size, uint32_t high_bit);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_CRYPTO_POLY1305_H_
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/aead_codec.h"
+
+#include <algorithm>
+#include <cinttypes>
+
+#include "nerfnet/crypto/chacha20.h"
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/random.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+namespace {
+
+// The size of the nonces exchanged to agree a key. The response carries the
+// nonce of the request it answers followed by the nonce of the responder.
+constexpr size_t kRekeyNonceSize = 8;
+constexpr size_t kRekeyResponseSize = 2 * kRekeyNonceSize;
+
+// Populates the input to the key derivation function from the nonces chosen
+// by both sides of the link.
+void GetKdfInput(uint64_t primary_nonce, uint64_t secondary_nonce,
+                 uint8_t* input) {
+  WriteBigEndianU64(&input[0], primary_nonce);
+  WriteBigEndianU64(&input[8], secondary_nonce);
+}
+
+}  // anonymous namespace
+
+AeadCodec::AeadCodec(const std::array<uint8_t, kKeySize>& key, bool primary,
+                     size_t tag_size, uint64_t rekey_interval_us)
+    : key_(key),
+      primary_(primary),
+      tag_size_(tag_size),
+      rekey_interval_us_(rekey_interval_us),
+      control_channel_(nullptr),
+      rekey_request_us_(0),
+      last_rekey_us_(0),
+      counter_resyncs_(0),
+      rekey_timeouts_(0) {
+  CHECK(tag_size_ >= kMinTagSize && tag_size_ <= kMaxTagSize,
+      "Invalid tag size %zu", tag_size_);
+}
+
+FrameCodec::Result AeadCodec::Encode(std::vector<uint8_t>& frame) {
+  if (!current_key_.has_value()) {
+    return Result::Drop;
+  }
+
+  // The primary starts a rotation once the previous one has completed. The
+  // request is sent under the current key and traffic continues to flow
+  // while the next key is agreed. A request that is not answered in time is
+  // replaced, since a late response is told apart by the nonce it echoes.
+  uint64_t now_us = TimeNowUs();
+  if (primary_ && rekey_nonce_.has_value()
+      && now_us - rekey_request_us_ >= kRekeyTimeoutUs) {
+    LOGE("Rekey request timed out, retrying");
+    rekey_nonce_.reset();
+    rekey_timeouts_++;
+  }
+
+  if (primary_ && rekey_interval_us_ != 0 && control_channel_ != nullptr
+      && !rekey_nonce_.has_value() && !previous_key_.has_value()
+      && now_us - last_rekey_us_ >= rekey_interval_us_) {
+    rekey_nonce_ = RandomU64();
+    rekey_request_us_ = now_us;
+    std::vector<uint8_t> message(kRekeyNonceSize);
+    WriteBigEndianU64(message.data(), rekey_nonce_.value());
+    control_channel_->SendControlMessage(ControlMessageType::RekeyRequest,
+        std::move(message));
+  }
+
+  EpochKey& key = current_key_.value();
+  uint8_t nonce[ChaCha20Poly1305::kNonceSize];
+  GetNonce(primary_, key.tx_counter, nonce);
+  size_t size = frame.size();
+  frame.insert(frame.begin(),
+      kDispatch | key.GetEpochBit() | (key.tx_counter & kCounterMask));
+  frame.resize(1 + size + tag_size_);
+  ChaCha20Poly1305::Seal(key.key.data(), nonce, &frame[0], 1,
+      &frame[1], size, &frame[1 + size], tag_size_);
+  key.tx_counter++;
+  return Result::Forward;
+}
+
+bool AeadCodec::Decode(std::vector<uint8_t>& frame) {
+  if (frame.size() < 1 + tag_size_
+      || (frame[0] & kDispatchMask) != kDispatch) {
+    return false;
+  }
+
+  EpochKey* key = GetRxKey(frame[0]);
+  if (key == nullptr) {
+    return false;
+  }
+
+  // Frames are delivered in order, so the counter is the next one expected
+  // with matching low bits, unless the peer abandoned a whole range of frames
+  // since. Frames that are replayed map to a counter that has not been used
+  // yet and fail authentication.
+  uint64_t counter = key->rx_counter
+      + ((frame[0] - key->rx_counter) & kCounterMask);
+  size_t size = frame.size() - 1 - tag_size_;
+  uint64_t skips = 0;
+  while (true) {
+    uint8_t nonce[ChaCha20Poly1305::kNonceSize];
+    GetNonce(!primary_, counter, nonce);
+    if (ChaCha20Poly1305::Open(key->key.data(), nonce, &frame[0], 1,
+        &frame[1], size, &frame[1 + size], tag_size_)) {
+      break;
+    } else if (skips == kMaxCounterSkips) {
+      return false;
+    }
+
+    counter += kCounterMask + 1;
+    skips++;
+  }
+
+  if (skips != 0) {
+    LOGI("Skipped %" PRIu64 " frame counters abandoned by the peer",
+        counter - key->rx_counter);
+    counter_resyncs_++;
+  }
+
+  key->rx_counter = counter + 1;
+  frame.erase(frame.begin());
+  frame.resize(size);
+
+  // Frames arrive in order, so once the peer is seen using the newer of two
+  // keys the older one is no longer needed. The secondary confirms the switch
+  // so that the primary can discard the older key even when the secondary
+  // has no traffic to send.
+  if (next_key_.has_value() && key == &next_key_.value()) {
+    current_key_ = std::move(next_key_);
+    next_key_.reset();
+    control_channel_->SendControlMessage(ControlMessageType::RekeyConfirm, {});
+    LOGI("Rotated to key epoch %" PRIu64, current_key_->epoch);
+  } else if (previous_key_.has_value() && key == &current_key_.value()) {
+    previous_key_.reset();
+  }
+
+  return true;
+}
+
+void AeadCodec::Reset(const LinkSession& session) {
+  uint8_t input[ChaCha20::kHChaCha20InputSize];
+  GetKdfInput(session.primary_nonce, session.secondary_nonce, input);
+  current_key_.emplace();
+  current_key_->epoch = 0;
+  ChaCha20::HChaCha20(key_.data(), input, current_key_->key.data());
+  current_key_->tx_counter = 0;
+  current_key_->rx_counter = 0;
+  previous_key_.reset();
+  next_key_.reset();
+  rekey_nonce_.reset();
+  last_rekey_us_ = TimeNowUs();
+}
+
+bool AeadCodec::SaveState(LinkSnapshot& snapshot) const {
+  SaveKey(current_key_, snapshot);
+  SaveKey(previous_key_, snapshot);
+  SaveKey(next_key_, snapshot);
+  snapshot.PutU8(rekey_nonce_.has_value());
+  snapshot.PutU64(rekey_nonce_.value_or(0));
+  return true;
+}
+
+bool AeadCodec::RestoreState(LinkSnapshot& snapshot) {
+  uint8_t has_rekey_nonce;
+  uint64_t rekey_nonce;
+  if (!RestoreKey(snapshot, current_key_)
+      || !RestoreKey(snapshot, previous_key_)
+      || !RestoreKey(snapshot, next_key_)
+      || !snapshot.GetU8(has_rekey_nonce) || !snapshot.GetU64(rekey_nonce)) {
+    return false;
+  }
+
+  rekey_nonce_.reset();
+  if (has_rekey_nonce) {
+    rekey_nonce_ = rekey_nonce;
+  }
+
+  last_rekey_us_ = TimeNowUs();
+  rekey_request_us_ = last_rekey_us_;
+  return true;
+}
+
+void AeadCodec::SetControlChannel(ControlChannel* channel) {
+  control_channel_ = channel;
+}
+
+bool AeadCodec::HandleControlMessage(ControlMessageType type,
+                                     const uint8_t* data, size_t size) {
+  switch (type) {
+    case ControlMessageType::RekeyRequest:
+      if (primary_ || !current_key_.has_value() || size != kRekeyNonceSize) {
+        LOGE("Ignoring unexpected rekey request");
+      } else {
+        uint64_t secondary_nonce = RandomU64();
+        next_key_ = DeriveNextKey(ReadBigEndianU64(data), secondary_nonce);
+        std::vector<uint8_t> message(kRekeyResponseSize);
+        std::copy(data, data + kRekeyNonceSize, message.begin());
+        WriteBigEndianU64(&message[kRekeyNonceSize], secondary_nonce);
+        control_channel_->SendControlMessage(
+            ControlMessageType::RekeyResponse, std::move(message));
+      }
+      return true;
+    case ControlMessageType::RekeyResponse:
+      if (!rekey_nonce_.has_value() || size != kRekeyResponseSize
+          || ReadBigEndianU64(data) != rekey_nonce_.value()) {
+        LOGE("Ignoring unexpected rekey response");
+      } else {
+        // Switch to the new key immediately. The confirmation is the first
+        // frame sent under it and prompts the secondary to switch as well.
+        EpochKey next_key = DeriveNextKey(rekey_nonce_.value(),
+            ReadBigEndianU64(&data[kRekeyNonceSize]));
+        previous_key_ = std::move(current_key_);
+        current_key_ = next_key;
+        rekey_nonce_.reset();
+        last_rekey_us_ = TimeNowUs();
+        control_channel_->SendControlMessage(
+            ControlMessageType::RekeyConfirm, {});
+        LOGI("Rotated to key epoch %" PRIu64, current_key_->epoch);
+      }
+      return true;
+    case ControlMessageType::RekeyConfirm:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void AeadCodec::AddStats(LinkStats& stats) const {
+  stats.aead_counter_resyncs += counter_resyncs_;
+  stats.aead_rekey_timeouts += rekey_timeouts_;
+}
+
+AeadCodec::EpochKey AeadCodec::DeriveNextKey(uint64_t primary_nonce,
+    uint64_t secondary_nonce) const {
+  uint8_t input[ChaCha20::kHChaCha20InputSize];
+  GetKdfInput(primary_nonce, secondary_nonce, input);
+
+  EpochKey next_key;
+  next_key.epoch = current_key_->epoch + 1;
+  ChaCha20::HChaCha20(current_key_->key.data(), input, next_key.key.data());
+  next_key.tx_counter = 0;
+  next_key.rx_counter = 0;
+  return next_key;
+}
+
+AeadCodec::EpochKey* AeadCodec::GetRxKey(uint8_t header) {
+  uint8_t epoch_bit = header & kEpochBit;
+  if (current_key_.has_value() && current_key_->GetEpochBit() == epoch_bit) {
+    return &current_key_.value();
+  } else if (next_key_.has_value()
+      && next_key_->GetEpochBit() == epoch_bit) {
+    return &next_key_.value();
+  } else if (previous_key_.has_value()
+      && previous_key_->GetEpochBit() == epoch_bit) {
+    return &previous_key_.value();
+  }
+
+  return nullptr;
+}
+
+void AeadCodec::GetNonce(bool from_primary, uint64_t counter,
+                         uint8_t* nonce) const {
+  WriteLittleEndianU32(&nonce[0], from_primary ? 0 : 1);
+  WriteLittleEndianU64(&nonce[4], counter);
+}
+
+void AeadCodec::SaveKey(const std::optional<EpochKey>& key,
+                        LinkSnapshot& snapshot) {
+  snapshot.PutU8(key.has_value());
+  if (key.has_value()) {
+    snapshot.PutU64(key->epoch);
+    snapshot.PutBytes(key->key.data(), key->key.size());
+    snapshot.PutU64(key->tx_counter);
+    snapshot.PutU64(key->rx_counter);
+  }
+}
+
+bool AeadCodec::RestoreKey(LinkSnapshot& snapshot,
+                           std::optional<EpochKey>& key) {
+  uint8_t has_key;
+  if (!snapshot.GetU8(has_key)) {
+    return false;
+  }
+
+  key.reset();
+  if (!has_key) {
+    return true;
+  }
+
+  key.emplace();
+  return snapshot.GetU64(key->epoch)
+      && snapshot.GetBytes(key->key.data(), key->key.size())
+      && snapshot.GetU64(key->tx_counter)
+      && snapshot.GetU64(key->rx_counter);
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_AEAD_CODEC_H_
+#define NERFNET_NET_AEAD_CODEC_H_
+
+#include <array>
+#include <optional>
+
+#include "nerfnet/crypto/chacha20_poly1305.h"
+#include "nerfnet/net/frame_codec.h"
+
+namespace nerfnet {
+
+// Encrypts and authenticates every frame exchanged over a link with
+// ChaCha20-Poly1305. A key is derived for each connection from a pre-shared
+// key and the nonces exchanged when the connection is reset, so the frame
+// counters used as nonces never repeat under the same key. The counters are
+// implicit apart from their low bits, which are carried in a single byte
+// header along with a truncated tag.
+//
+// The primary periodically rotates the key without interrupting traffic. The
+// next key is agreed with control messages sent under the current key and
+// the header carries the parity of the key epoch, so frames sent under
+// either key are accepted until the peer is seen using the new one.
+class AeadCodec : public FrameCodec {
+ public:
+  // The size of the pre-shared key.
+  static constexpr size_t kKeySize = ChaCha20Poly1305::kKeySize;
+
+  // The range of supported tag sizes.
+  static constexpr size_t kMinTagSize = 4;
+  static constexpr size_t kMaxTagSize = ChaCha20Poly1305::kTagSize;
+
+  // Setup the codec with the pre-shared key for the link, the side of the
+  // link it is used on and the number of tag bytes to send with each frame.
+  // The key is rotated at the supplied interval if it is not zero.
+  AeadCodec(const std::array<uint8_t, kKeySize>& key, bool primary,
+            size_t tag_size, uint64_t rekey_interval_us = 0);
+
+  // FrameCodec methods.
+  Result Encode(std::vector<uint8_t>& frame) override;
+  bool Decode(std::vector<uint8_t>& frame) override;
+  void Reset(const LinkSession& session) override;
+  bool SaveState(LinkSnapshot& snapshot) const override;
+  bool RestoreState(LinkSnapshot& snapshot) override;
+  void SetControlChannel(ControlChannel* channel) override;
+  bool HandleControlMessage(ControlMessageType type,
+                            const uint8_t* data, size_t size) override;
+  void AddStats(LinkStats& stats) const override;
+
+ private:
+  // The header of an encrypted frame. The top two bits mark an encrypted
+  // frame, the next bit carries the parity of the key epoch and the low bits
+  // carry the low bits of the frame counter.
+  static constexpr uint8_t kDispatchMask = 0xc0;
+  static constexpr uint8_t kDispatch = 0xc0;
+  static constexpr uint8_t kEpochBit = 0x20;
+  static constexpr uint8_t kCounterMask = 0x1f;
+
+  // Frames that the peer abandons still use up their counters. A frame that
+  // fails to open under the expected counter is tried this many times again,
+  // each a full range of the low bits further on, before it is dropped.
+  static constexpr uint64_t kMaxCounterSkips = 16;
+
+  // The time that the primary waits for the response to a rekey request.
+  // Either message may be abandoned by the link, so the rotation is started
+  // again with a new nonce once this has passed.
+  static constexpr uint64_t kRekeyTimeoutUs = 10000000;
+
+  // A key and the counters of frames exchanged under it.
+  struct EpochKey {
+    // The number of key rotations since the connection was reset.
+    uint64_t epoch;
+
+    std::array<uint8_t, kKeySize> key;
+
+    // The counters of the next frame to send and the next frame expected.
+    uint64_t tx_counter;
+    uint64_t rx_counter;
+
+    // Returns the epoch bit of frames sent under this key.
+    uint8_t GetEpochBit() const { return (epoch & 1) ? kEpochBit : 0; }
+  };
+
+  // The pre-shared key.
+  const std::array<uint8_t, kKeySize> key_;
+
+  // Whether this codec is used by the primary side of the link.
+  const bool primary_;
+
+  // The number of tag bytes sent with each frame.
+  const size_t tag_size_;
+
+  // The interval to rotate keys at, zero if keys are not rotated.
+  const uint64_t rekey_interval_us_;
+
+  // The channel used to agree keys with the peer.
+  ControlChannel* control_channel_;
+
+  // The key used to send frames. Frames are not exchanged until the
+  // connection has been reset for the first time.
+  std::optional<EpochKey> current_key_;
+
+  // On the primary, the key that was replaced and is still accepted until the
+  // secondary is seen using the current key.
+  std::optional<EpochKey> previous_key_;
+
+  // On the secondary, the key that has been agreed and is switched to once
+  // the primary is seen using it.
+  std::optional<EpochKey> next_key_;
+
+  // On the primary, the nonce of a rotation that is awaiting a response and
+  // the time that it was requested.
+  std::optional<uint64_t> rekey_nonce_;
+  uint64_t rekey_request_us_;
+
+  // The time of the last key rotation or connection reset.
+  uint64_t last_rekey_us_;
+
+  // The number of times the receive counter skipped over abandoned frames
+  // and the number of rotations that timed out.
+  uint64_t counter_resyncs_;
+  uint64_t rekey_timeouts_;
+
+  // Derives the key for the epoch following the current one.
+  EpochKey DeriveNextKey(uint64_t primary_nonce,
+                         uint64_t secondary_nonce) const;
+
+  // Returns the key to open a frame with the supplied header or nullptr if no
+  // key matches.
+  EpochKey* GetRxKey(uint8_t header);
+
+  // Populates the nonce for a frame sent by one side of the link.
+  void GetNonce(bool from_primary, uint64_t counter, uint8_t* nonce) const;
+
+  // Saves and restores a key and its counters for a new process that takes
+  // over the link.
+  static void SaveKey(const std::optional<EpochKey>& key,
+                      LinkSnapshot& snapshot);
+  static bool RestoreKey(LinkSnapshot& snapshot,
+                         std::optional<EpochKey>& key);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_AEAD_CODEC_H_
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/broadcast_receiver.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/crc32c.h"
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+BroadcastReceiver::BroadcastReceiver(RadioInterface& radio_interface,
+                                     uint32_t address, ObjectHandler handler,
+                                     size_t max_object_size)
+    : radio_interface_(radio_interface),
+      handler_(std::move(handler)),
+      max_object_size_(max_object_size),
+      object_size_(0),
+      block_size_(0),
+      crc_(0),
+      decoded_count_(0),
+      delivered_(false) {
+  radio_interface_.SetBroadcastHandler(address,
+      [this](const uint8_t* data, size_t size) { HandlePacket(data, size); });
+  radio_interface_.SetDatagramHandler(BroadcastSender::kPort,
+      [this](const uint8_t* data, size_t size) { HandleMessage(data, size); });
+}
+
+size_t BroadcastReceiver::GetSourceCount(size_t block) const {
+  size_t symbol_count = (object_size_ + BroadcastSender::kSymbolSize - 1)
+      / BroadcastSender::kSymbolSize;
+  return std::min(block_size_, symbol_count - block * block_size_);
+}
+
+void BroadcastReceiver::HandlePacket(const uint8_t* data, size_t size) {
+  constexpr size_t kHeaderSize = BroadcastSender::kPacketHeaderSize;
+  if (size != kHeaderSize + BroadcastSender::kSymbolSize) {
+    return;
+  }
+
+  // The radio CRC is weak, so corrupted symbols are caught here rather than
+  // spoiling a whole block.
+  uint32_t crc = Crc32c(data, 4);
+  crc = Crc32c(&data[kHeaderSize], size - kHeaderSize, crc);
+  if (ReadBigEndianU16(&data[4]) != static_cast<uint16_t>(crc)) {
+    return;
+  }
+
+  uint16_t block_index = ReadBigEndianU16(&data[1]);
+  uint8_t index = data[3];
+  if (!object_id_.has_value() || data[0] != object_id_.value()
+      || block_index >= blocks_.size()) {
+    return;
+  }
+
+  Block& block = blocks_[block_index];
+  if (!block.sources.empty()
+      || std::any_of(block.symbols.begin(), block.symbols.end(),
+          [index](const ErasureCode::Symbol& symbol) {
+            return symbol.index == index;
+          })) {
+    return;
+  }
+
+  block.symbols.push_back({index,
+      std::vector<uint8_t>(&data[kHeaderSize], &data[size])});
+  if (ErasureCode::Decode(GetSourceCount(block_index), block.symbols,
+          block.sources)) {
+    block.symbols.clear();
+    block.symbols.shrink_to_fit();
+    decoded_count_++;
+    if (decoded_count_ == blocks_.size()) {
+      CompleteObject();
+    }
+  }
+}
+
+void BroadcastReceiver::HandleMessage(const uint8_t* data, size_t size) {
+  if (size < BroadcastSender::kAnnounceHeaderSize
+      || data[0] != BroadcastSender::kMessageAnnounce) {
+    return;
+  }
+
+  uint8_t object_id = data[1];
+  size_t object_size = ReadBigEndianU32(&data[2]);
+  size_t block_size = data[6];
+  uint32_t crc = ReadBigEndianU32(&data[7]);
+  if (object_size == 0 || object_size > BroadcastSender::kMaxObjectSize
+      || block_size == 0 || block_size > BroadcastSender::kMaxSourceSymbols) {
+    LOGE("Ignoring invalid broadcast announcement");
+    return;
+  }
+
+  // An object that is too large is declined by reporting it as delivered,
+  // so that the sender does not wait for this receiver.
+  if (object_size > max_object_size_) {
+    if (object_id_ != object_id || object_size_ != object_size) {
+      LOGE("Declining broadcast of %zu bytes, larger than the limit of %zu",
+          object_size, max_object_size_);
+      object_id_ = object_id;
+      object_size_ = object_size;
+      blocks_.clear();
+      delivered_ = true;
+    }
+
+    SendStatus();
+    return;
+  }
+
+  if (object_id_ != object_id || object_size_ != object_size
+      || block_size_ != block_size || crc_ != crc) {
+    object_id_ = object_id;
+    object_size_ = object_size;
+    block_size_ = block_size;
+    crc_ = crc;
+    name_.assign(&data[BroadcastSender::kAnnounceHeaderSize], &data[size]);
+    size_t symbol_count = (object_size_ + BroadcastSender::kSymbolSize - 1)
+        / BroadcastSender::kSymbolSize;
+    blocks_.assign((symbol_count + block_size_ - 1) / block_size_, Block());
+    decoded_count_ = 0;
+    delivered_ = false;
+    LOGI("Receiving broadcast '%s' (%zu bytes)", name_.c_str(),
+        object_size_);
+  }
+
+  SendStatus();
+}
+
+void BroadcastReceiver::CompleteObject() {
+  std::vector<uint8_t> object;
+  object.reserve(blocks_.size() * block_size_ * BroadcastSender::kSymbolSize);
+  for (const auto& block : blocks_) {
+    for (const auto& source : block.sources) {
+      object.insert(object.end(), source.begin(), source.end());
+    }
+  }
+
+  object.resize(object_size_);
+  if (Crc32c(object.data(), object.size()) != crc_) {
+    LOGE("Broadcast '%s' is corrupt, receiving it again", name_.c_str());
+    blocks_.assign(blocks_.size(), Block());
+    decoded_count_ = 0;
+    return;
+  }
+
+  // The object is only kept until it has been handed over.
+  blocks_.clear();
+  delivered_ = true;
+  LOGI("Received broadcast '%s'", name_.c_str());
+  handler_(name_, object);
+  SendStatus();
+}
+
+void BroadcastReceiver::SendStatus() {
+  std::vector<uint8_t> message = {BroadcastSender::kMessageStatus,
+      object_id_.value()};
+  for (size_t i = 0; !delivered_ && i < blocks_.size()
+       && message.size() < BroadcastSender::kStatusHeaderSize
+           + BroadcastSender::kMaxStatusEntries
+               * BroadcastSender::kStatusEntrySize; i++) {
+    const Block& block = blocks_[i];
+    if (block.sources.empty()) {
+      message.resize(message.size() + BroadcastSender::kStatusEntrySize);
+      uint8_t* entry = &message[message.size()
+          - BroadcastSender::kStatusEntrySize];
+      WriteBigEndianU16(entry, i);
+      entry[2] = GetSourceCount(i) - block.symbols.size();
+    }
+  }
+
+  radio_interface_.SendDatagram(BroadcastSender::kPort, message);
+}
+
+}  // namespace nerfnet
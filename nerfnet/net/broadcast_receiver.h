@@ -0,0 +1,99 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_BROADCAST_RECEIVER_H_
+#define NERFNET_NET_BROADCAST_RECEIVER_H_
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "nerfnet/net/broadcast_sender.h"
+#include "nerfnet/net/erasure_code.h"
+#include "nerfnet/net/radio_interface.h"
+
+namespace nerfnet {
+
+// Receives objects delivered by a BroadcastSender over the secondary side of
+// a link. Symbols are collected from broadcasts until each block can be
+// decoded, and the blocks that are still incomplete are reported to the
+// sender over the link whenever it asks.
+class BroadcastReceiver : public NonCopyable {
+ public:
+  // A handler for objects that have been received. Invoked from the thread
+  // servicing the link.
+  using ObjectHandler = std::function<void(const std::string& name,
+                                           const std::vector<uint8_t>& data)>;
+
+  // Setup a receiver for broadcasts sent to an address. Objects larger than
+  // max_object_size are ignored, which bounds the memory used to reassemble
+  // them. Must be created before the link is serviced.
+  BroadcastReceiver(RadioInterface& radio_interface, uint32_t address,
+                    ObjectHandler handler,
+                    size_t max_object_size = BroadcastSender::kMaxObjectSize);
+
+ private:
+  // A block of the object being received.
+  struct Block {
+    // The symbols received while the block is incomplete.
+    std::vector<ErasureCode::Symbol> symbols;
+
+    // The source symbols of the block once it has been decoded.
+    std::vector<std::vector<uint8_t>> sources;
+  };
+
+  // The link to the sender, the handler for received objects and the
+  // largest object that is received.
+  RadioInterface& radio_interface_;
+  const ObjectHandler handler_;
+  const size_t max_object_size_;
+
+  // The ID, size, source symbols per block, CRC32C and name of the object
+  // being received, once it has been announced.
+  std::optional<uint8_t> object_id_;
+  size_t object_size_;
+  size_t block_size_;
+  uint32_t crc_;
+  std::string name_;
+
+  // The blocks of the object and the number that have been decoded.
+  std::vector<Block> blocks_;
+  size_t decoded_count_;
+
+  // Set once the object has been passed to the handler.
+  bool delivered_;
+
+  // Returns the number of source symbols in a block.
+  size_t GetSourceCount(size_t block) const;
+
+  // Handles a packet broadcast by the sender.
+  void HandlePacket(const uint8_t* data, size_t size);
+
+  // Handles an announcement from the sender.
+  void HandleMessage(const uint8_t* data, size_t size);
+
+  // Checks the object once every block has been decoded and passes it to the
+  // handler. The blocks are received again if the object is corrupt.
+  void CompleteObject();
+
+  // Reports the incomplete blocks to the sender.
+  void SendStatus();
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_BROADCAST_RECEIVER_H_
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/broadcast_sender.h"
+
+#include <algorithm>
+
+#include "nerfnet/net/erasure_code.h"
+#include "nerfnet/util/crc32c.h"
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+
+BroadcastSender::BroadcastSender(RadioInterface& transmitter,
+                                 uint32_t address,
+                                 const std::vector<RadioInterface*>& links)
+    : links_(links),
+      busy_(false),
+      sending_(false),
+      object_id_(0),
+      crc_(0),
+      symbol_count_(0),
+      receivers_(links.size()),
+      announce_us_(0) {
+  transmitter.SetBroadcastSource(address,
+      [this](std::vector<uint8_t>& packet) { return GetPacket(packet); });
+  for (size_t i = 0; i < links_.size(); i++) {
+    links_[i]->SetDatagramHandler(kPort,
+        [this, i](const uint8_t* data, size_t size) {
+          HandleStatus(i, data, size);
+        });
+  }
+}
+
+bool BroadcastSender::Send(const std::string& name,
+                           std::vector<uint8_t> data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (busy_ || data.empty() || data.size() > kMaxObjectSize) {
+    return false;
+  }
+
+  object_ = std::move(data);
+  object_id_++;
+  name_ = name.substr(0, kMaxNameSize);
+  crc_ = Crc32c(object_.data(), object_.size());
+  symbol_count_ = (object_.size() + kSymbolSize - 1) / kSymbolSize;
+  busy_ = true;
+  sending_ = true;
+  receivers_.assign(links_.size(), Receiver());
+  missing_symbols_.clear();
+
+  // The first pass sends every source symbol, followed by a few repair
+  // symbols for each block.
+  pending_symbols_.clear();
+  next_repair_index_.clear();
+  for (size_t block = 0; block < GetBlockCount(); block++) {
+    size_t source_count = GetSourceCount(block);
+    for (size_t index = 0; index < source_count + kInitialRepairSymbols;
+         index++) {
+      pending_symbols_.push_back({static_cast<uint16_t>(block),
+          static_cast<uint8_t>(index)});
+    }
+
+    next_repair_index_.push_back(source_count + kInitialRepairSymbols);
+  }
+
+  LOGI("Broadcasting '%s' (%zu bytes in %zu blocks) to %zu receivers",
+      name_.c_str(), object_.size(), GetBlockCount(), links_.size());
+  SendAnnouncements();
+  return true;
+}
+
+bool BroadcastSender::WaitForDelivery() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  delivered_cv_.wait(lock, [this]() { return !busy_; });
+  return std::none_of(receivers_.begin(), receivers_.end(),
+      [](const Receiver& receiver) { return receiver.failed; });
+}
+
+size_t BroadcastSender::GetBlockCount() const {
+  return (symbol_count_ + kMaxSourceSymbols - 1) / kMaxSourceSymbols;
+}
+
+size_t BroadcastSender::GetSourceCount(size_t block) const {
+  return std::min(kMaxSourceSymbols,
+      symbol_count_ - block * kMaxSourceSymbols);
+}
+
+bool BroadcastSender::GetPacket(std::vector<uint8_t>& packet) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!busy_) {
+    return false;
+  }
+
+  CheckTimeouts(TimeNowUs());
+  if (!sending_ || pending_symbols_.empty()) {
+    return false;
+  }
+
+  PendingSymbol symbol = pending_symbols_.front();
+  pending_symbols_.pop_front();
+
+  // The last symbol of the object is padded with zeros.
+  size_t source_count = GetSourceCount(symbol.block);
+  std::vector<std::vector<uint8_t>> sources(source_count,
+      std::vector<uint8_t>(kSymbolSize, 0x00));
+  for (size_t i = 0; i < source_count; i++) {
+    size_t offset = (symbol.block * kMaxSourceSymbols + i) * kSymbolSize;
+    size_t size = std::min(kSymbolSize, object_.size() - offset);
+    std::copy(&object_[offset], &object_[offset + size], sources[i].begin());
+  }
+
+  std::vector<uint8_t> data;
+  if (symbol.index < source_count) {
+    data = std::move(sources[symbol.index]);
+  } else {
+    ErasureCode::EncodeRepair(sources, symbol.index, data);
+  }
+
+  packet.resize(kPacketHeaderSize);
+  packet[0] = object_id_;
+  WriteBigEndianU16(&packet[1], symbol.block);
+  packet[3] = symbol.index;
+  packet.insert(packet.end(), data.begin(), data.end());
+  uint32_t crc = Crc32c(packet.data(), 4);
+  crc = Crc32c(&packet[kPacketHeaderSize], kSymbolSize, crc);
+  WriteBigEndianU16(&packet[4], static_cast<uint16_t>(crc));
+
+  if (pending_symbols_.empty()) {
+    EndPass();
+  }
+
+  return true;
+}
+
+void BroadcastSender::SendAnnouncements() {
+  std::vector<uint8_t> message(kAnnounceHeaderSize);
+  message[0] = kMessageAnnounce;
+  message[1] = object_id_;
+  WriteBigEndianU32(&message[2], object_.size());
+  message[6] = kMaxSourceSymbols;
+  WriteBigEndianU32(&message[7], crc_);
+  message.insert(message.end(), name_.begin(), name_.end());
+  for (size_t i = 0; i < links_.size(); i++) {
+    Receiver& receiver = receivers_[i];
+    if (!receiver.answered && !receiver.complete && !receiver.failed) {
+      receiver.attempts++;
+      links_[i]->SendDatagram(kPort, message);
+    }
+  }
+
+  announce_us_ = TimeNowUs();
+}
+
+void BroadcastSender::HandleStatus(size_t receiver_index,
+                                   const uint8_t* data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Receiver& receiver = receivers_[receiver_index];
+  if (!busy_ || size < kStatusHeaderSize || data[0] != kMessageStatus
+      || data[1] != object_id_ || receiver.failed
+      || (size - kStatusHeaderSize) % kStatusEntrySize != 0) {
+    return;
+  }
+
+  receiver.answered = true;
+  receiver.attempts = 0;
+  if (size == kStatusHeaderSize) {
+    receiver.complete = true;
+  } else if (!sending_) {
+    // Reports that arrive while a pass is being sent were made before it
+    // and are not used.
+    for (size_t offset = kStatusHeaderSize; offset < size;
+         offset += kStatusEntrySize) {
+      uint16_t block = ReadBigEndianU16(&data[offset]);
+      uint8_t missing = data[offset + 2];
+      if (block < GetBlockCount()) {
+        uint8_t& max_missing = missing_symbols_[block];
+        max_missing = std::max(max_missing, missing);
+      }
+    }
+  }
+
+  CheckStatusReports();
+}
+
+void BroadcastSender::CheckTimeouts(uint64_t now_us) {
+  if (now_us - announce_us_ < kAnnounceIntervalUs) {
+    return;
+  }
+
+  for (size_t i = 0; i < receivers_.size(); i++) {
+    Receiver& receiver = receivers_[i];
+    if (!receiver.answered && !receiver.complete && !receiver.failed
+        && receiver.attempts >= kMaxAnnounceAttempts) {
+      LOGE("Giving up on broadcast receiver %zu", i);
+      receiver.failed = true;
+    }
+  }
+
+  SendAnnouncements();
+  CheckStatusReports();
+}
+
+void BroadcastSender::CheckStatusReports() {
+  bool all_answered = true;
+  bool all_complete = true;
+  for (const auto& receiver : receivers_) {
+    if (!receiver.complete && !receiver.failed) {
+      all_complete = false;
+      all_answered = all_answered && receiver.answered;
+    }
+  }
+
+  if (all_complete) {
+    size_t delivered = std::count_if(receivers_.begin(), receivers_.end(),
+        [](const Receiver& receiver) { return receiver.complete; });
+    LOGI("Broadcast '%s' delivered to %zu of %zu receivers", name_.c_str(),
+        delivered, receivers_.size());
+    busy_ = false;
+    sending_ = false;
+    pending_symbols_.clear();
+    object_.clear();
+    delivered_cv_.notify_all();
+    return;
+  }
+
+  if (sending_ || !all_answered) {
+    return;
+  }
+
+  // Fresh repair symbols are sent for each block, starting again from the
+  // first repair symbol once they have all been used.
+  for (const auto& [block, missing] : missing_symbols_) {
+    uint8_t source_count = GetSourceCount(block);
+    uint8_t& index = next_repair_index_[block];
+    for (uint8_t i = 0; i < missing; i++) {
+      pending_symbols_.push_back({block, index});
+      index = (index == ErasureCode::kMaxSymbols - 1)
+          ? source_count : index + 1;
+    }
+  }
+
+  missing_symbols_.clear();
+  if (!pending_symbols_.empty()) {
+    sending_ = true;
+  } else {
+    EndPass();
+  }
+}
+
+void BroadcastSender::EndPass() {
+  sending_ = false;
+  for (auto& receiver : receivers_) {
+    receiver.answered = false;
+    receiver.attempts = 0;
+  }
+
+  SendAnnouncements();
+}
+
+}  // namespace nerfnet
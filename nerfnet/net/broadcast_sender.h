@@ -0,0 +1,191 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_BROADCAST_SENDER_H_
+#define NERFNET_NET_BROADCAST_SENDER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nerfnet/net/radio_interface.h"
+
+namespace nerfnet {
+
+// Delivers an object, such as a firmware image, to the secondaries of a group
+// of links at once. The object is split into blocks of symbols that are
+// broadcast by the primary of one link and heard by every secondary on the
+// same channel and data rate, so the airtime is that of a single transfer
+// however many secondaries there are. Each block is followed by a few repair
+// symbols from an erasure code, and at the end of each pass the receivers
+// report how many symbols they are missing from each block over their own
+// links. The next pass sends as many new repair symbols for a block as the
+// receiver missing the most needs, since any repair symbol replaces any lost
+// symbol at every receiver.
+class BroadcastSender : public NonCopyable {
+ public:
+  // The port that announcements and status reports are exchanged on.
+  static constexpr uint8_t kPort = RadioInterface::kMaxDatagramPorts - 2;
+
+  // The size of the header of a broadcast packet, which carries the object
+  // ID, the block, the symbol index and the low bits of a CRC32C over the
+  // rest of the packet, and the size of the symbol that follows it.
+  static constexpr size_t kPacketHeaderSize = 6;
+  static constexpr size_t kSymbolSize =
+      RadioInterface::kMaxBroadcastSize - kPacketHeaderSize;
+
+  // The maximum number of source symbols in a block.
+  static constexpr size_t kMaxSourceSymbols = 32;
+
+  // The largest object that can be sent, which is limited by the block
+  // number carried in each packet.
+  static constexpr size_t kMaxObjectSize =
+      kSymbolSize * kMaxSourceSymbols * 0x10000;
+
+  // The types of message exchanged on the port. Announcements carry the
+  // object ID, size, source symbols per block, CRC32C and name. Status
+  // reports carry the object ID followed by the block number and the number
+  // of missing symbols for each incomplete block, and are empty once the
+  // object has been received.
+  static constexpr uint8_t kMessageAnnounce = 0;
+  static constexpr uint8_t kMessageStatus = 1;
+  static constexpr size_t kAnnounceHeaderSize = 11;
+  static constexpr size_t kStatusHeaderSize = 2;
+  static constexpr size_t kStatusEntrySize = 3;
+
+  // The longest name sent with an object and the largest number of blocks
+  // listed in a status report.
+  static constexpr size_t kMaxNameSize = 128;
+  static constexpr size_t kMaxStatusEntries = 64;
+
+  // Setup a sender that broadcasts over the primary side of the transmitter
+  // link to an address and exchanges messages with the receivers over the
+  // primary side of each of the supplied links, which may include the
+  // transmitter. Must be created before the links are serviced.
+  BroadcastSender(RadioInterface& transmitter, uint32_t address,
+                  const std::vector<RadioInterface*>& links);
+
+  // Starts delivering an object. Returns false if another object is still
+  // being delivered or the object is too large.
+  bool Send(const std::string& name, std::vector<uint8_t> data);
+
+  // Waits for the current object to be delivered. Returns true if every
+  // receiver reported that it received the object and false if any were
+  // given up on.
+  bool WaitForDelivery();
+
+ private:
+  // The number of repair symbols sent with each block in the first pass,
+  // which covers a low loss rate without waiting for a status report.
+  static constexpr size_t kInitialRepairSymbols = 2;
+
+  // The interval at which the announcement is sent again to receivers that
+  // have not answered it and the number of times it is sent before the
+  // receiver is given up on.
+  static constexpr uint64_t kAnnounceIntervalUs = 1000000;
+  static constexpr uint8_t kMaxAnnounceAttempts = 10;
+
+  // The progress of a receiver with the current object.
+  struct Receiver {
+    // Set once the receiver has answered the latest announcement.
+    bool answered = false;
+
+    // Set once the receiver has the object or has been given up on.
+    bool complete = false;
+    bool failed = false;
+
+    // The number of times the latest announcement has been sent.
+    uint8_t attempts = 0;
+  };
+
+  // A symbol to broadcast.
+  struct PendingSymbol {
+    uint16_t block;
+    uint8_t index;
+  };
+
+  // The links to the receivers.
+  const std::vector<RadioInterface*> links_;
+
+  // Guards the state below, which is shared with the thread servicing the
+  // links.
+  std::mutex mutex_;
+  std::condition_variable delivered_cv_;
+
+  // Set while an object is being delivered, and while the symbols of a pass
+  // are being broadcast rather than awaiting status reports.
+  bool busy_;
+  bool sending_;
+
+  // The current object, its ID, name, CRC32C and number of symbols.
+  std::vector<uint8_t> object_;
+  uint8_t object_id_;
+  std::string name_;
+  uint32_t crc_;
+  size_t symbol_count_;
+
+  // The progress of each receiver, indexed as the links.
+  std::vector<Receiver> receivers_;
+
+  // The symbols left to broadcast in this pass.
+  std::deque<PendingSymbol> pending_symbols_;
+
+  // The index of the next repair symbol to send for each block.
+  std::vector<uint8_t> next_repair_index_;
+
+  // The largest number of missing symbols reported for each block since the
+  // end of the last pass.
+  std::map<uint16_t, uint8_t> missing_symbols_;
+
+  // The time that the announcement was last sent.
+  uint64_t announce_us_;
+
+  // Returns the number of blocks in the object and the number of source
+  // symbols in a block, which is only smaller than the maximum for the last
+  // block.
+  size_t GetBlockCount() const;
+  size_t GetSourceCount(size_t block) const;
+
+  // Supplies the next packet to broadcast.
+  bool GetPacket(std::vector<uint8_t>& packet);
+
+  // Sends the announcement to each receiver that has not answered it. The
+  // mutex must be held.
+  void SendAnnouncements();
+
+  // Handles a status report from a receiver.
+  void HandleStatus(size_t receiver, const uint8_t* data, size_t size);
+
+  // Gives up on receivers that have not answered the announcement in time
+  // and sends it again to the rest. The mutex must be held.
+  void CheckTimeouts(uint64_t now_us);
+
+  // Starts the next pass once every receiver has reported its status, or
+  // ends the delivery once every receiver is complete. The mutex must be
+  // held.
+  void CheckStatusReports();
+
+  // Ends the current pass and asks the receivers for their status. The mutex
+  // must be held.
+  void EndPass();
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_BROADCAST_SENDER_H_
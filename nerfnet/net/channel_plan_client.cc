@@ -0,0 +1,121 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/channel_plan_client.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "nerfnet/net/channel_plan_server.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/string.h"
+
+namespace nerfnet {
+
+ChannelPlanClient::ChannelPlanClient(const std::string& path)
+    : path_(path),
+      socket_fd_(-1) {}
+
+ChannelPlanClient::~ChannelPlanClient() {
+  Disconnect();
+}
+
+bool ChannelPlanClient::Report(const std::string& name, uint8_t channel,
+                               uint32_t loss_ppm) {
+  if (!Connect()) {
+    return false;
+  }
+
+  std::string message = StringFormat("report %s %u %u", name.c_str(),
+      channel, loss_ppm);
+  CHECK(message.size() < ChannelPlanServer::kMaxMessageSize,
+      "Link name '%s' is too long", name.c_str());
+  if (send(socket_fd_, message.data(), message.size(),
+        MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    LOGE("Failed to send channel report: %s (%d)", strerror(errno), errno);
+    Disconnect();
+    return false;
+  }
+
+  return true;
+}
+
+std::vector<ChannelPlanner::Assignment>
+    ChannelPlanClient::ReceiveAssignments() {
+  std::vector<ChannelPlanner::Assignment> assignments;
+  while (socket_fd_ >= 0) {
+    char buffer[ChannelPlanServer::kMaxMessageSize + 1];
+    int size = recv(socket_fd_, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+    if (size < 0 && errno == EAGAIN) {
+      break;
+    } else if (size <= 0) {
+      LOGE("Lost connection to channel plan server");
+      Disconnect();
+      break;
+    }
+
+    buffer[size] = '\0';
+    char name[ChannelPlanServer::kMaxMessageSize];
+    unsigned int channel;
+    if (sscanf(buffer, "assign %127s %u", name, &channel) != 2
+        || channel > 127) {
+      LOGE("Ignoring invalid channel assignment '%s'", buffer);
+      continue;
+    }
+
+    assignments.push_back({name, static_cast<uint8_t>(channel)});
+  }
+
+  return assignments;
+}
+
+bool ChannelPlanClient::Connect() {
+  if (socket_fd_ >= 0) {
+    return true;
+  }
+
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path_.c_str(), sizeof(address.sun_path) - 1);
+  socket_fd_ = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (socket_fd_ < 0) {
+    LOGE("Failed to open socket: %s (%d)", strerror(errno), errno);
+    return false;
+  }
+
+  if (connect(socket_fd_, reinterpret_cast<struct sockaddr*>(&address),
+        sizeof(address)) != 0) {
+    LOGE("Failed to connect to channel plan server '%s': %s (%d)",
+        path_.c_str(), strerror(errno), errno);
+    Disconnect();
+    return false;
+  }
+
+  LOGI("Connected to channel plan server '%s'", path_.c_str());
+  return true;
+}
+
+void ChannelPlanClient::Disconnect() {
+  if (socket_fd_ >= 0) {
+    close(socket_fd_);
+    socket_fd_ = -1;
+  }
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_CHANNEL_PLAN_CLIENT_H_
+#define NERFNET_NET_CHANNEL_PLAN_CLIENT_H_
+
+#include <string>
+#include <vector>
+
+#include "nerfnet/net/channel_planner.h"
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// Reports links to a channel plan server and receives the channels that it
+// assigns to them. The client connects when it is first used and reconnects
+// if the server goes away, so the server may be started after its clients.
+class ChannelPlanClient : public NonCopyable {
+ public:
+  // Setup the client to connect to the server at the supplied path.
+  explicit ChannelPlanClient(const std::string& path);
+  ~ChannelPlanClient();
+
+  // Reports the channel of a link and the fraction of exchanges lost on it
+  // in parts per million. Returns false if the server is unavailable.
+  bool Report(const std::string& name, uint8_t channel, uint32_t loss_ppm);
+
+  // Returns the assignments received from the server without blocking.
+  std::vector<ChannelPlanner::Assignment> ReceiveAssignments();
+
+ private:
+  // The path of the server socket.
+  const std::string path_;
+
+  // The connection to the server, or negative if not connected.
+  int socket_fd_;
+
+  // Connects to the server if not connected. Returns false on failure.
+  bool Connect();
+
+  // Closes the connection to the server.
+  void Disconnect();
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_CHANNEL_PLAN_CLIENT_H_
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/channel_plan_server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/string.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+namespace {
+
+// Opens a socket listening at the supplied path. Quits and logs the error on
+// failure.
+int OpenListeningSocket(const std::string& path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  CHECK(path.size() < sizeof(address.sun_path),
+      "Socket path '%s' is too long", path.c_str());
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  CHECK(fd >= 0, "Failed to open socket: %s (%d)", strerror(errno), errno);
+  unlink(path.c_str());
+  CHECK(bind(fd, reinterpret_cast<struct sockaddr*>(&address),
+      sizeof(address)) == 0, "Failed to bind socket '%s': %s (%d)",
+      path.c_str(), strerror(errno), errno);
+  CHECK(listen(fd, 8) == 0, "Failed to listen on socket: %s (%d)",
+      strerror(errno), errno);
+  return fd;
+}
+
+}  // anonymous namespace
+
+ChannelPlanServer::ChannelPlanServer(const std::string& path,
+                                     uint8_t min_channel,
+                                     uint8_t max_channel)
+    : path_(path),
+      socket_fd_(OpenListeningSocket(path)),
+      planner_(min_channel, max_channel),
+      running_(true) {
+  server_thread_ = std::thread(&ChannelPlanServer::ServerThread, this);
+}
+
+ChannelPlanServer::~ChannelPlanServer() {
+  running_ = false;
+  server_thread_.join();
+  close(socket_fd_);
+  unlink(path_.c_str());
+}
+
+void ChannelPlanServer::ServerThread() {
+  std::vector<struct pollfd> fds = {{socket_fd_, POLLIN, 0}};
+  uint64_t next_plan_us = TimeNowUs() + kPlanIntervalUs;
+  while (running_) {
+    int status = poll(fds.data(), fds.size(), kPollTimeoutMs);
+    if (status < 0) {
+      LOGE("Failed to poll sockets: %s (%d)", strerror(errno), errno);
+      continue;
+    }
+
+    for (size_t i = 1; i < fds.size();) {
+      if (fds[i].revents == 0) {
+        i++;
+        continue;
+      }
+
+      char buffer[kMaxMessageSize];
+      int size = recv(fds[i].fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (size > 0) {
+        HandleMessage(fds[i].fd, std::string(buffer, size));
+        i++;
+      } else if (size < 0 && errno == EAGAIN) {
+        i++;
+      } else {
+        for (auto link = link_clients_.begin();
+             link != link_clients_.end();) {
+          if (link->second == fds[i].fd) {
+            link = link_clients_.erase(link);
+          } else {
+            link++;
+          }
+        }
+
+        close(fds[i].fd);
+        fds.erase(fds.begin() + i);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int client_fd = accept(socket_fd_, nullptr, nullptr);
+      if (client_fd < 0) {
+        LOGE("Failed to accept client: %s (%d)", strerror(errno), errno);
+      } else if (fds.size() > kMaxClients) {
+        LOGE("Too many channel plan clients");
+        close(client_fd);
+      } else {
+        fds.push_back({client_fd, POLLIN, 0});
+      }
+    }
+
+    if (TimeNowUs() >= next_plan_us) {
+      SendAssignments();
+      next_plan_us = TimeNowUs() + kPlanIntervalUs;
+    }
+  }
+
+  for (size_t i = 1; i < fds.size(); i++) {
+    close(fds[i].fd);
+  }
+}
+
+void ChannelPlanServer::HandleMessage(int client_fd,
+                                      const std::string& message) {
+  char name[kMaxMessageSize];
+  unsigned int channel;
+  unsigned int loss_ppm;
+  if (sscanf(message.c_str(), "report %127s %u %u",
+        name, &channel, &loss_ppm) != 3 || channel > 127) {
+    LOGE("Ignoring invalid channel plan message '%s'", message.c_str());
+    return;
+  }
+
+  link_clients_[name] = client_fd;
+  planner_.Report(name, channel, loss_ppm, TimeNowUs());
+}
+
+void ChannelPlanServer::SendAssignments() {
+  for (const auto& assignment : planner_.Plan(TimeNowUs())) {
+    auto client = link_clients_.find(assignment.name);
+    if (client == link_clients_.end()) {
+      continue;
+    }
+
+    LOGI("Assigning channel %u to link '%s'", assignment.channel,
+        assignment.name.c_str());
+    std::string reply = StringFormat("assign %s %u",
+        assignment.name.c_str(), assignment.channel);
+    if (send(client->second, reply.data(), reply.size(),
+          MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+      LOGE("Failed to send channel assignment: %s (%d)",
+          strerror(errno), errno);
+    }
+  }
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_CHANNEL_PLAN_SERVER_H_
+#define NERFNET_NET_CHANNEL_PLAN_SERVER_H_
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+
+#include "nerfnet/net/channel_planner.h"
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// Serves a channel planner on a unix socket so that links in several
+// processes on a host, or on gateways that forward the socket, share one
+// channel plan. Clients send messages of the form
+// "report <name> <channel> <loss_ppm>" and are sent messages of the form
+// "assign <name> <channel>" when one of their links should move.
+class ChannelPlanServer : public NonCopyable {
+ public:
+  // Listens on the socket at the supplied path, replacing any stale socket,
+  // and plans channels between min_channel and max_channel inclusive. Quits
+  // and logs the error on failure.
+  ChannelPlanServer(const std::string& path, uint8_t min_channel,
+                    uint8_t max_channel);
+  ~ChannelPlanServer();
+
+  // The largest message exchanged over the socket.
+  static constexpr size_t kMaxMessageSize = 128;
+
+ private:
+  // The maximum number of clients that may be connected at once.
+  static constexpr size_t kMaxClients = 32;
+
+  // The interval at which the server checks whether it should stop.
+  static constexpr int kPollTimeoutMs = 100;
+
+  // The interval between plans, which allows every link to report between
+  // plans so that links are not moved before all of them are known.
+  static constexpr uint64_t kPlanIntervalUs = 10000000;
+
+  // The path of the socket and the socket listened on.
+  const std::string path_;
+  const int socket_fd_;
+
+  // The planner shared by all clients.
+  ChannelPlanner planner_;
+
+  // The socket of the client that last reported each link.
+  std::map<std::string, int> link_clients_;
+
+  // The thread serving clients.
+  std::thread server_thread_;
+  std::atomic<bool> running_;
+
+  // Accepts clients, handles their reports and sends them assignments.
+  void ServerThread();
+
+  // Handles a message from a client.
+  void HandleMessage(int client_fd, const std::string& message);
+
+  // Plans channels and sends the assignments to the clients of the links.
+  void SendAssignments();
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_CHANNEL_PLAN_SERVER_H_
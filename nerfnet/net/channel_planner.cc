@@ -0,0 +1,168 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/channel_planner.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+ChannelPlanner::ChannelPlanner(uint8_t min_channel, uint8_t max_channel)
+    : min_channel_(min_channel),
+      max_channel_(max_channel),
+      channel_losses_(max_channel + 1) {
+  CHECK(min_channel <= max_channel, "Invalid channel range %u-%u",
+      min_channel, max_channel);
+}
+
+void ChannelPlanner::Report(const std::string& name, uint8_t channel,
+                            uint32_t loss_ppm, uint64_t now_us) {
+  auto& link = links_[name];
+  link.channel = channel;
+  link.last_report_us = now_us;
+  if (link.assigned_channel == channel) {
+    link.assigned_us = 0;
+  }
+
+  if (channel < channel_losses_.size()) {
+    auto& loss = channel_losses_[channel];
+    loss.loss_ppm = (loss.last_report_us == 0) ? loss_ppm
+        : kLossDecay * loss.loss_ppm + (1.0 - kLossDecay) * loss_ppm;
+    loss.last_report_us = now_us;
+  }
+}
+
+std::vector<ChannelPlanner::Assignment> ChannelPlanner::Plan(
+    uint64_t now_us) {
+  for (auto link = links_.begin(); link != links_.end();) {
+    if (now_us - link->second.last_report_us > kLinkTimeoutUs) {
+      LOGI("Forgetting link '%s'", link->first.c_str());
+      link = links_.erase(link);
+    } else {
+      link++;
+    }
+  }
+
+  if (links_.empty()) {
+    return {};
+  }
+
+  // Links that have been asked to move are planned as if they had.
+  struct PlannedLink {
+    const std::string* name;
+    Link* link;
+    uint8_t channel;
+  };
+
+  std::vector<PlannedLink> planned_links;
+  for (auto& [name, link] : links_) {
+    bool moving = link.assigned_us != 0
+        && now_us - link.assigned_us < kAssignmentTimeoutUs;
+    planned_links.push_back({&name, &link,
+        moving ? link.assigned_channel : link.channel});
+  }
+
+  // Keeping the order of the links along the band minimizes the number of
+  // links that move.
+  std::stable_sort(planned_links.begin(), planned_links.end(),
+      [](const PlannedLink& a, const PlannedLink& b) {
+        return a.channel < b.channel;
+      });
+  std::vector<uint8_t> current_channels;
+  for (const auto& planned_link : planned_links) {
+    current_channels.push_back(planned_link.channel);
+  }
+
+  // Evenly spaced channels maximize the smallest separation, which leaves a
+  // choice of where to place them in the band. Each placement is charged for
+  // the loss expected on its channels and the links that it moves.
+  size_t count = planned_links.size();
+  uint32_t range = max_channel_ - min_channel_;
+  if (count > range + 1) {
+    LOGE("Too many links (%zu) for the channel range", count);
+    return {};
+  }
+
+  uint32_t spacing = (count > 1) ? range / (count - 1) : 0;
+  std::vector<uint8_t> best_channels;
+  double best_cost = std::numeric_limits<double>::max();
+  size_t best_moves = 0;
+  for (uint32_t offset = min_channel_;
+       offset + spacing * (count - 1) <= max_channel_; offset++) {
+    std::vector<uint8_t> channels;
+    size_t moves = 0;
+    for (size_t i = 0; i < count; i++) {
+      channels.push_back(offset + spacing * i);
+      moves += (channels.back() != current_channels[i]);
+    }
+
+    double cost = GetLoss(channels, now_us) + moves * kMoveCostPpm;
+    if (cost < best_cost) {
+      best_channels = std::move(channels);
+      best_cost = cost;
+      best_moves = moves;
+    }
+  }
+
+  // The current channels are kept if they are as well separated and not
+  // worth moving away from.
+  if (best_moves == 0
+      || (GetMinSeparation(best_channels) <= GetMinSeparation(current_channels)
+          && GetLoss(current_channels, now_us) <= best_cost)) {
+    return {};
+  }
+
+  std::vector<Assignment> assignments;
+  for (size_t i = 0; i < count; i++) {
+    auto& planned_link = planned_links[i];
+    if (best_channels[i] != planned_link.channel) {
+      planned_link.link->assigned_channel = best_channels[i];
+      planned_link.link->assigned_us = now_us;
+      assignments.push_back({*planned_link.name, best_channels[i]});
+    }
+  }
+
+  return assignments;
+}
+
+uint32_t ChannelPlanner::GetMinSeparation(
+    const std::vector<uint8_t>& channels) {
+  uint32_t separation = std::numeric_limits<uint32_t>::max();
+  for (size_t i = 1; i < channels.size(); i++) {
+    separation = std::min<uint32_t>(separation, channels[i] - channels[i - 1]);
+  }
+
+  return separation;
+}
+
+double ChannelPlanner::GetLoss(const std::vector<uint8_t>& channels,
+                               uint64_t now_us) const {
+  double loss = 0.0;
+  for (uint8_t channel : channels) {
+    const auto& channel_loss = channel_losses_[channel];
+    if (channel_loss.last_report_us != 0
+        && now_us - channel_loss.last_report_us < kLinkTimeoutUs) {
+      loss += channel_loss.loss_ppm;
+    }
+  }
+
+  return loss;
+}
+
+}  // namespace nerfnet
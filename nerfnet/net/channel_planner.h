@@ -0,0 +1,110 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_CHANNEL_PLANNER_H_
+#define NERFNET_NET_CHANNEL_PLANNER_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace nerfnet {
+
+// Assigns channels to co-located links so that they are spread as far apart
+// as possible, which limits the throughput that each link loses to
+// adjacent-channel interference from the others. Links report the channel
+// that they operate on and the fraction of exchanges that they lose, which is
+// used to steer links away from channels that are busy with other traffic.
+class ChannelPlanner {
+ public:
+  // A channel assigned to a link.
+  struct Assignment {
+    std::string name;
+    uint8_t channel;
+  };
+
+  // Setup the planner to assign channels between min_channel and
+  // max_channel inclusive.
+  ChannelPlanner(uint8_t min_channel, uint8_t max_channel);
+
+  // Records the channel of a link and the fraction of exchanges lost on it
+  // in parts per million, registering the link if it is new.
+  void Report(const std::string& name, uint8_t channel, uint32_t loss_ppm,
+              uint64_t now_us);
+
+  // Plans channels for the links that have reported recently. Returns the
+  // links that should move and their new channels. A link that has been
+  // asked to move is not asked again until it reports the new channel or the
+  // request times out. Links are moved to increase the separation between
+  // them, or to avoid enough loss to be worth the disruption.
+  std::vector<Assignment> Plan(uint64_t now_us);
+
+ private:
+  // The time after which a link that has not reported is forgotten.
+  static constexpr uint64_t kLinkTimeoutUs = 60000000;
+
+  // The time to wait for a link to move to an assigned channel before
+  // assigning channels to it again.
+  static constexpr uint64_t kAssignmentTimeoutUs = 10000000;
+
+  // The weight given to the loss previously recorded on a channel when a
+  // new report arrives.
+  static constexpr double kLossDecay = 0.75;
+
+  // The reduction in the total loss of the links in parts per million that
+  // justifies moving a link without increasing the separation.
+  static constexpr double kMoveCostPpm = 50000.0;
+
+  // A link known to the planner.
+  struct Link {
+    uint8_t channel = 0;
+    uint64_t last_report_us = 0;
+
+    // The channel that the link has been asked to move to and when.
+    uint8_t assigned_channel = 0;
+    uint64_t assigned_us = 0;
+  };
+
+  // The range of channels to assign.
+  const uint8_t min_channel_;
+  const uint8_t max_channel_;
+
+  // The links known to the planner, ordered by name so that plans are
+  // deterministic.
+  std::map<std::string, Link> links_;
+
+  // The loss recently reported on a channel.
+  struct ChannelLoss {
+    double loss_ppm = 0.0;
+    uint64_t last_report_us = 0;
+  };
+
+  // The loss reported on each channel.
+  std::vector<ChannelLoss> channel_losses_;
+
+  // Returns the smallest separation between any two of the supplied
+  // channels, which must be sorted.
+  static uint32_t GetMinSeparation(const std::vector<uint8_t>& channels);
+
+  // Returns the total loss expected on the supplied channels. Loss that has
+  // not been reported recently is assumed to have gone away.
+  double GetLoss(const std::vector<uint8_t>& channels, uint64_t now_us) const;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_CHANNEL_PLANNER_H_
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/clock_sync.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace nerfnet {
+
+ClockSync::ClockSync()
+    : filter_index_(0),
+      filter_count_(0),
+      reference_us_(0),
+      reference_offset_us_(0.0),
+      drift_(0.0),
+      tx_delay_us_(0.0),
+      rx_delay_us_(0.0) {}
+
+void ClockSync::AddSample(uint64_t origin_us, uint64_t receive_us,
+                          uint64_t transmit_us, uint64_t destination_us) {
+  // The differences are taken between times on the same clock before they
+  // are combined, so that the large arbitrary offset cancels out exactly.
+  double outbound_us = static_cast<double>(
+      static_cast<int64_t>(receive_us - origin_us));
+  double inbound_us = static_cast<double>(
+      static_cast<int64_t>(destination_us - transmit_us));
+  double turnaround_us = static_cast<double>(transmit_us - receive_us);
+  double round_trip_us = static_cast<double>(destination_us - origin_us);
+
+  Sample sample;
+  sample.local_us = destination_us;
+  sample.offset_us = (outbound_us - inbound_us) / 2.0;
+  sample.delay_us = std::max(round_trip_us - turnaround_us, 0.0);
+  filter_[filter_index_] = sample;
+  filter_index_ = (filter_index_ + 1) % kFilterSize;
+  filter_count_ = std::min(filter_count_ + 1, kFilterSize);
+
+  // The exchange with the shortest round trip is the least affected by
+  // queueing. It is only trusted once, when it is first chosen.
+  const Sample* best = &filter_[0];
+  for (size_t i = 1; i < filter_count_; i++) {
+    if (filter_[i].delay_us < best->delay_us) {
+      best = &filter_[i];
+    }
+  }
+
+  if (fit_points_.empty() || best->local_us > fit_points_.back().local_us) {
+    fit_points_.push_back(*best);
+    if (fit_points_.size() > kMaxFitPoints) {
+      fit_points_.pop_front();
+    }
+
+    UpdateEstimate();
+  }
+
+  // The one-way delays of every exchange are tracked, including any time
+  // spent queued, using the offset expected at the time of the exchange.
+  double offset_us = GetOffsetUs(destination_us);
+  double tx_delay_us = std::max(outbound_us - offset_us, 0.0);
+  double rx_delay_us = std::max(inbound_us + offset_us, 0.0);
+  if (filter_count_ == 1) {
+    tx_delay_us_ = tx_delay_us;
+    rx_delay_us_ = rx_delay_us;
+  } else {
+    tx_delay_us_ += kDelayWeight * (tx_delay_us - tx_delay_us_);
+    rx_delay_us_ += kDelayWeight * (rx_delay_us - rx_delay_us_);
+  }
+}
+
+int64_t ClockSync::GetOffsetUs(uint64_t local_us) const {
+  double elapsed_us = static_cast<double>(
+      static_cast<int64_t>(local_us - reference_us_));
+  return std::llround(reference_offset_us_ + drift_ * elapsed_us);
+}
+
+uint64_t ClockSync::ToPeerTimeUs(uint64_t local_us) const {
+  return local_us + GetOffsetUs(local_us);
+}
+
+uint64_t ClockSync::ToLocalTimeUs(uint64_t peer_us) const {
+  // Inverts the offset, which is a linear function of the local time.
+  double peer_elapsed_us = static_cast<double>(
+      static_cast<int64_t>(peer_us - reference_us_)) - reference_offset_us_;
+  return reference_us_ + std::llround(peer_elapsed_us / (1.0 + drift_));
+}
+
+int64_t ClockSync::GetDriftPpb() const {
+  return std::llround(drift_ * 1e9);
+}
+
+void ClockSync::UpdateEstimate() {
+  const Sample& latest = fit_points_.back();
+  reference_us_ = latest.local_us;
+  uint64_t span_us = latest.local_us - fit_points_.front().local_us;
+  if (span_us < kMinFitSpanUs) {
+    reference_offset_us_ = latest.offset_us;
+    drift_ = 0.0;
+    return;
+  }
+
+  // A least squares line through the trusted offsets, with time measured
+  // back from the latest so that the intercept is the offset now.
+  double sum_t = 0.0;
+  double sum_offset = 0.0;
+  for (const auto& point : fit_points_) {
+    sum_t -= static_cast<double>(latest.local_us - point.local_us);
+    sum_offset += point.offset_us;
+  }
+
+  double count = static_cast<double>(fit_points_.size());
+  double mean_t = sum_t / count;
+  double mean_offset = sum_offset / count;
+  double covariance = 0.0;
+  double variance = 0.0;
+  for (const auto& point : fit_points_) {
+    double t = -static_cast<double>(latest.local_us - point.local_us) - mean_t;
+    covariance += t * (point.offset_us - mean_offset);
+    variance += t * t;
+  }
+
+  drift_ = covariance / variance;
+  reference_offset_us_ = mean_offset - drift_ * mean_t;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_CLOCK_SYNC_H_
+#define NERFNET_NET_CLOCK_SYNC_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace nerfnet {
+
+// Estimates the offset and drift of the clock of the peer relative to the
+// local clock from timestamps exchanged NTP-style. Each exchange yields the
+// time that a request left this side, the times that the peer received it
+// and sent its response and the time that the response arrived. Exchanges
+// that waited behind other traffic see longer round trips and skewed
+// offsets, so only the exchange with the shortest round trip among recent
+// ones is trusted, and the drift is fitted to the trusted offsets over a
+// longer window. No external time source is needed.
+class ClockSync {
+ public:
+  ClockSync();
+
+  // Adds the timestamps of an exchange. The origin and destination times are
+  // local, the receive and transmit times are those of the peer.
+  void AddSample(uint64_t origin_us, uint64_t receive_us,
+                 uint64_t transmit_us, uint64_t destination_us);
+
+  // Returns true once an offset has been estimated.
+  bool IsSynchronized() const { return !fit_points_.empty(); }
+
+  // Returns the estimated offset of the peer clock from the local clock at a
+  // local time, such that the peer time is the local time plus the offset.
+  int64_t GetOffsetUs(uint64_t local_us) const;
+
+  // Converts between local times and times of the peer.
+  uint64_t ToPeerTimeUs(uint64_t local_us) const;
+  uint64_t ToLocalTimeUs(uint64_t peer_us) const;
+
+  // Returns the estimated rate at which the peer clock gains on the local
+  // clock in parts per billion.
+  int64_t GetDriftPpb() const;
+
+  // Returns the smoothed one-way delays of exchanges sent to and received
+  // from the peer, which rely on the offset estimate.
+  uint64_t GetTxDelayUs() const { return tx_delay_us_; }
+  uint64_t GetRxDelayUs() const { return rx_delay_us_; }
+
+ private:
+  // The number of recent exchanges that the exchange with the shortest round
+  // trip is chosen from.
+  static constexpr size_t kFilterSize = 8;
+
+  // The number of trusted offsets that the drift is fitted to and the span of
+  // time that they must cover before a drift is estimated.
+  static constexpr size_t kMaxFitPoints = 64;
+  static constexpr uint64_t kMinFitSpanUs = 10000000;
+
+  // The weight given to each new one-way delay.
+  static constexpr double kDelayWeight = 0.125;
+
+  // An offset measured by an exchange.
+  struct Sample {
+    // The local time that the exchange completed.
+    uint64_t local_us = 0;
+
+    // The offset and round-trip delay measured by the exchange.
+    double offset_us = 0.0;
+    double delay_us = 0.0;
+  };
+
+  // The most recent exchanges and the index to write the next one at.
+  std::array<Sample, kFilterSize> filter_;
+  size_t filter_index_;
+  size_t filter_count_;
+
+  // The trusted offsets that the drift is fitted to, oldest first.
+  std::deque<Sample> fit_points_;
+
+  // The fitted offset at the time of the most recent trusted offset and the
+  // drift of the peer clock as a ratio.
+  uint64_t reference_us_;
+  double reference_offset_us_;
+  double drift_;
+
+  // The smoothed one-way delays to and from the peer.
+  double tx_delay_us_;
+  double rx_delay_us_;
+
+  // Fits the offset and drift to the trusted offsets.
+  void UpdateEstimate();
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_CLOCK_SYNC_H_
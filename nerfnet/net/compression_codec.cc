@@ -0,0 +1,267 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/compression_codec.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+namespace {
+
+// The empty stored block that ends the output of a sync flush. It is the same
+// for every frame, so it is removed before sending and restored before
+// decompressing.
+constexpr uint8_t kSyncFlushTrailer[] = {0x00, 0x00, 0xff, 0xff};
+
+// The space to reserve for compressed output beyond the size of the frame.
+constexpr size_t kDeflateSlack = 16;
+
+}  // anonymous namespace
+
+CompressionCodec::CompressionCodec(std::vector<uint8_t> dictionary)
+    : dictionary_(std::move(dictionary)),
+      tx_epoch_(0),
+      tx_counter_(0),
+      rx_epoch_(0),
+      rx_counter_(0),
+      rx_reset_pending_(false),
+      rx_dropped_frames_(0) {
+  CHECK(dictionary_.size() <= kMaxDictionarySize,
+      "Compression dictionary is too large (%zu vs %zu)",
+      dictionary_.size(), kMaxDictionarySize);
+
+  // Raw streams are used since the frames are checked by the link.
+  deflate_stream_ = {};
+  CHECK(deflateInit2(&deflate_stream_, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+      -kWindowBits, kMemLevel, Z_DEFAULT_STRATEGY) == Z_OK,
+      "Failed to initialize compressor");
+  inflate_stream_ = {};
+  CHECK(inflateInit2(&inflate_stream_, -kWindowBits) == Z_OK,
+      "Failed to initialize decompressor");
+  ResetDeflate();
+  ResetInflate();
+}
+
+CompressionCodec::~CompressionCodec() {
+  deflateEnd(&deflate_stream_);
+  inflateEnd(&inflate_stream_);
+}
+
+FrameCodec::Result CompressionCodec::Encode(std::vector<uint8_t>& frame) {
+  if (frame.size() > kMaxCompressedFrameSize) {
+    frame.insert(frame.begin(), GetHeader(/*bypass=*/true, tx_epoch_, 0));
+    return Result::Forward;
+  }
+
+  std::vector<uint8_t> encoded(1 + frame.size() + kDeflateSlack);
+  deflate_stream_.next_in = frame.data();
+  deflate_stream_.avail_in = frame.size();
+  size_t size = 1;
+  do {
+    if (size == encoded.size()) {
+      encoded.resize(encoded.size() * 2);
+    }
+
+    deflate_stream_.next_out = &encoded[size];
+    deflate_stream_.avail_out = encoded.size() - size;
+    int result = deflate(&deflate_stream_, Z_SYNC_FLUSH);
+    size = encoded.size() - deflate_stream_.avail_out;
+    if (result != Z_OK && result != Z_BUF_ERROR) {
+      // The peer sees the first frame of a new epoch next and follows.
+      LOGE("Failed to compress frame: %d", result);
+      tx_epoch_ = (tx_epoch_ + 1) & kEpochMask;
+      ResetDeflate();
+      return Result::Drop;
+    }
+  } while (deflate_stream_.avail_out == 0);
+
+  // The context now holds a frame that the peer cannot follow without the
+  // trailer, so the frame is sent uncompressed and a new epoch is started.
+  size_t trailer_size = sizeof(kSyncFlushTrailer);
+  if (size < 1 + trailer_size || !std::equal(
+      kSyncFlushTrailer, kSyncFlushTrailer + trailer_size,
+      &encoded[size - trailer_size])) {
+    LOGE("Missing sync flush trailer, sending frame uncompressed");
+    tx_epoch_ = (tx_epoch_ + 1) & kEpochMask;
+    ResetDeflate();
+    frame.insert(frame.begin(), GetHeader(/*bypass=*/true, tx_epoch_, 0));
+    return Result::Forward;
+  }
+
+  encoded.resize(size - trailer_size);
+  encoded[0] = GetHeader(/*bypass=*/false, tx_epoch_, tx_counter_);
+  tx_counter_ = NextCounter(tx_counter_);
+  frame.assign(encoded.begin(), encoded.end());
+  return Result::Forward;
+}
+
+bool CompressionCodec::Decode(std::vector<uint8_t>& frame) {
+  if (frame.empty() || (frame[0] & kDispatchMask) != kDispatch) {
+    return false;
+  }
+
+  uint8_t epoch = (frame[0] >> kEpochShift) & kEpochMask;
+  uint8_t counter = frame[0] & kCounterMask;
+  if (frame[0] & kBypassBit) {
+    frame.erase(frame.begin());
+    return true;
+  }
+
+  // The first frame of a new epoch restarts the context, whether or not it
+  // was requested.
+  if (epoch != rx_epoch_ && counter == 0) {
+    ResetInflate();
+    rx_epoch_ = epoch;
+    rx_counter_ = 0;
+    rx_reset_pending_ = false;
+  }
+
+  if (rx_reset_pending_ || epoch != rx_epoch_ || counter != rx_counter_) {
+    LOGE("Compressed frame out of sequence");
+    RequestReset(epoch);
+    return false;
+  }
+
+  frame.insert(frame.end(), std::begin(kSyncFlushTrailer),
+      std::end(kSyncFlushTrailer));
+  std::vector<uint8_t> decoded(kMaxCompressedFrameSize + 1);
+  inflate_stream_.next_in = &frame[1];
+  inflate_stream_.avail_in = frame.size() - 1;
+  inflate_stream_.next_out = decoded.data();
+  inflate_stream_.avail_out = decoded.size();
+  int result = inflate(&inflate_stream_, Z_SYNC_FLUSH);
+  if ((result != Z_OK && result != Z_BUF_ERROR)
+      || inflate_stream_.avail_in != 0 || inflate_stream_.avail_out == 0) {
+    LOGE("Failed to decompress frame: %d", result);
+    RequestReset(epoch);
+    return false;
+  }
+
+  decoded.resize(decoded.size() - inflate_stream_.avail_out);
+  rx_counter_ = NextCounter(rx_counter_);
+  frame.assign(decoded.begin(), decoded.end());
+  return true;
+}
+
+void CompressionCodec::Reset(const LinkSession& session) {
+  tx_epoch_ = 0;
+  tx_counter_ = 0;
+  rx_epoch_ = 0;
+  rx_counter_ = 0;
+  rx_reset_pending_ = false;
+  rx_dropped_frames_ = 0;
+  ResetDeflate();
+  ResetInflate();
+}
+
+bool CompressionCodec::SaveState(LinkSnapshot& snapshot) const {
+  // The contexts cannot be saved, so only the epochs are handed over and a
+  // new epoch is started in each direction. The frames compressed in the
+  // old contexts that are still in flight are lost.
+  snapshot.PutU8(tx_epoch_);
+  snapshot.PutU8(rx_epoch_);
+  return true;
+}
+
+bool CompressionCodec::RestoreState(LinkSnapshot& snapshot) {
+  uint8_t tx_epoch;
+  uint8_t rx_epoch;
+  if (!snapshot.GetU8(tx_epoch) || !snapshot.GetU8(rx_epoch)) {
+    return false;
+  }
+
+  // The peer follows the first frame of the next epoch that is sent, and
+  // restarts its own context when asked.
+  tx_epoch_ = (tx_epoch + 1) & kEpochMask;
+  ResetDeflate();
+  rx_epoch_ = rx_epoch & kEpochMask;
+  rx_counter_ = 0;
+  rx_reset_pending_ = false;
+  ResetInflate();
+  RequestReset(rx_epoch_);
+  return true;
+}
+
+void CompressionCodec::SetControlChannel(ControlChannel* channel) {
+  control_channel_ = channel;
+}
+
+bool CompressionCodec::HandleControlMessage(ControlMessageType type,
+                                            const uint8_t* data,
+                                            size_t size) {
+  if (type != ControlMessageType::CompressionReset) {
+    return false;
+  }
+
+  // Requests that refer to an earlier epoch have already been served.
+  if (size != 1) {
+    LOGE("Ignoring invalid compression reset");
+  } else if (data[0] == tx_epoch_) {
+    LOGI("Restarting compression context");
+    tx_epoch_ = (tx_epoch_ + 1) & kEpochMask;
+    ResetDeflate();
+  }
+
+  return true;
+}
+
+void CompressionCodec::ResetDeflate() {
+  CHECK(deflateReset(&deflate_stream_) == Z_OK,
+      "Failed to reset compressor");
+  if (!dictionary_.empty()) {
+    CHECK(deflateSetDictionary(&deflate_stream_, dictionary_.data(),
+        dictionary_.size()) == Z_OK, "Failed to set compressor dictionary");
+  }
+
+  tx_counter_ = 0;
+}
+
+void CompressionCodec::ResetInflate() {
+  CHECK(inflateReset(&inflate_stream_) == Z_OK,
+      "Failed to reset decompressor");
+  if (!dictionary_.empty()) {
+    CHECK(inflateSetDictionary(&inflate_stream_, dictionary_.data(),
+        dictionary_.size()) == Z_OK, "Failed to set decompressor dictionary");
+  }
+}
+
+void CompressionCodec::RequestReset(uint8_t epoch) {
+  if (rx_reset_pending_ && ++rx_dropped_frames_ < kResetRetryFrames) {
+    return;
+  }
+
+  rx_reset_pending_ = true;
+  rx_dropped_frames_ = 0;
+  if (control_channel_ != nullptr) {
+    control_channel_->SendControlMessage(ControlMessageType::CompressionReset,
+        {epoch});
+  }
+}
+
+uint8_t CompressionCodec::NextCounter(uint8_t counter) {
+  // The counter skips zero when it wraps, since zero marks a new context.
+  return (counter == kCounterMask) ? 1 : counter + 1;
+}
+
+uint8_t CompressionCodec::GetHeader(bool bypass, uint8_t epoch,
+                                    uint8_t counter) {
+  return kDispatch | (bypass ? kBypassBit : 0) | (epoch << kEpochShift)
+      | counter;
+}
+
+}  // namespace nerfnet
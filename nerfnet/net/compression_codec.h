@@ -0,0 +1,122 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_COMPRESSION_CODEC_H_
+#define NERFNET_NET_COMPRESSION_CODEC_H_
+
+#include <zlib.h>
+
+#include "nerfnet/net/frame_codec.h"
+
+namespace nerfnet {
+
+// Compresses frames with DEFLATE using a context that is carried from one
+// frame to the next, so that a small frame can refer to the contents of the
+// frames sent before it. The context of each direction starts from a preset
+// dictionary that is built from representative traffic and shared by both
+// sides, so even the first frames of a connection compress well.
+//
+// The encoded frame is laid out as follows.
+//
+//   byte 0: 0b1 | bypass (1 bit) | epoch (2 bits) | counter (4 bits)
+//   compressed frame or original frame if bypassed (remaining bytes)
+//
+// Frames that are too large to be worth compressing, such as those of bulk
+// transfers, bypass the context so that it keeps the contents of small
+// frames. The counter numbers the frames compressed in the epoch and is only
+// zero for the first of them. A receiver that misses a frame can no longer
+// decode the frames that follow it, so it asks the sender to restart its
+// context in a new epoch and drops frames until the new epoch begins.
+class CompressionCodec : public FrameCodec {
+ public:
+  // The size of the context window and the largest useful dictionary.
+  static constexpr int kWindowBits = 13;
+  static constexpr size_t kMaxDictionarySize = 1 << kWindowBits;
+
+  // The size of the largest frame that is compressed.
+  static constexpr size_t kMaxCompressedFrameSize = 512;
+
+  // Setup the codec with a preset dictionary, which may be empty. Both sides
+  // of the link must use the same dictionary.
+  explicit CompressionCodec(std::vector<uint8_t> dictionary);
+  ~CompressionCodec();
+
+  // FrameCodec methods.
+  Result Encode(std::vector<uint8_t>& frame) override;
+  bool Decode(std::vector<uint8_t>& frame) override;
+  void Reset(const LinkSession& session) override;
+  bool SaveState(LinkSnapshot& snapshot) const override;
+  bool RestoreState(LinkSnapshot& snapshot) override;
+  void SetControlChannel(ControlChannel* channel) override;
+  bool HandleControlMessage(ControlMessageType type,
+                            const uint8_t* data, size_t size) override;
+
+ private:
+  // The memory level of the compressor, which trades compression for memory.
+  static constexpr int kMemLevel = 6;
+
+  // The bits of the first byte of an encoded frame.
+  static constexpr uint8_t kDispatchMask = 0x80;
+  static constexpr uint8_t kDispatch = 0x80;
+  static constexpr uint8_t kBypassBit = 0x40;
+  static constexpr uint8_t kEpochShift = 4;
+  static constexpr uint8_t kEpochMask = 0x03;
+  static constexpr uint8_t kCounterMask = 0x0f;
+
+  // The number of frames dropped while waiting for a new epoch before the
+  // request for it is sent again, in case the request was lost.
+  static constexpr uint32_t kResetRetryFrames = 16;
+
+  // The preset dictionary.
+  const std::vector<uint8_t> dictionary_;
+
+  // The channel used to ask the peer to restart its context.
+  ControlChannel* control_channel_ = nullptr;
+
+  // The contexts of frames sent to and received from the peer.
+  z_stream deflate_stream_;
+  z_stream inflate_stream_;
+
+  // The epoch and counter of the next frame to send.
+  uint8_t tx_epoch_;
+  uint8_t tx_counter_;
+
+  // The epoch and counter of the next frame expected from the peer.
+  uint8_t rx_epoch_;
+  uint8_t rx_counter_;
+
+  // Set while waiting for the peer to start a new epoch and the number of
+  // frames dropped since the request was last sent.
+  bool rx_reset_pending_;
+  uint32_t rx_dropped_frames_;
+
+  // Restarts a context from the dictionary.
+  void ResetDeflate();
+  void ResetInflate();
+
+  // Asks the peer to restart its context after the supplied epoch.
+  void RequestReset(uint8_t epoch);
+
+  // Returns the counter of the frame after one with the supplied counter.
+  static uint8_t NextCounter(uint8_t counter);
+
+  // Returns the header byte of a frame.
+  static uint8_t GetHeader(bool bypass, uint8_t epoch, uint8_t counter);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_COMPRESSION_CODEC_H_
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <tclap/CmdLine.h>
+#include <unordered_map>
+#include <vector>
+
+#include "nerfnet/net/compression_codec.h"
+#include "nerfnet/util/log.h"
+
+// A description of the program.
+constexpr char kDescription[] =
+    "Trains a preset compression dictionary from the frames in a pcap file "
+    "and reports the airtime that it is expected to save.";
+
+// The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+// The size of the substrings that are counted to find common content, and
+// the size of the segments of frames that are copied into the dictionary.
+constexpr size_t kDmerSize = 8;
+constexpr size_t kSegmentSize = 64;
+
+// The number of frame bytes carried by each packet sent over the air.
+constexpr size_t kPacketPayloadSize = 30;
+
+// The pcap link types that are understood and the size of their headers.
+constexpr uint32_t kLinkTypeNull = 0;
+constexpr uint32_t kLinkTypeEthernet = 1;
+constexpr uint32_t kLinkTypeRaw = 101;
+constexpr uint32_t kLinkTypeLinuxSll = 113;
+constexpr uint32_t kLinkTypeIpv4 = 228;
+constexpr uint32_t kLinkTypeIpv6 = 229;
+
+// Reads a 32-bit integer from a pcap header in the byte order of the file.
+uint32_t ReadPcapU32(const uint8_t* data, bool swapped) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return swapped ? __builtin_bswap32(value) : value;
+}
+
+// Reads the frames captured in a pcap file, removing the link header unless
+// keep_ethernet is set for an Ethernet capture. Quits and logs the error on
+// failure.
+std::vector<std::vector<uint8_t>> ReadPcapFile(const std::string& path,
+                                               bool keep_ethernet) {
+  std::ifstream file(path, std::ios::binary);
+  CHECK(file.good(), "Failed to open pcap file '%s'", path.c_str());
+
+  uint8_t header[24];
+  CHECK(file.read(reinterpret_cast<char*>(header), sizeof(header)),
+      "Failed to read pcap header");
+  uint32_t magic = ReadPcapU32(header, false);
+  bool swapped = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+  CHECK(swapped || magic == 0xa1b2c3d4 || magic == 0xa1b23c4d,
+      "'%s' is not a pcap file", path.c_str());
+
+  size_t link_header_size = 0;
+  uint32_t link_type = ReadPcapU32(&header[20], swapped);
+  switch (link_type) {
+    case kLinkTypeNull:
+      link_header_size = 4;
+      break;
+    case kLinkTypeEthernet:
+      link_header_size = keep_ethernet ? 0 : 14;
+      break;
+    case kLinkTypeRaw:
+    case kLinkTypeIpv4:
+    case kLinkTypeIpv6:
+      break;
+    case kLinkTypeLinuxSll:
+      link_header_size = 16;
+      break;
+    default:
+      CHECK(false, "Unsupported pcap link type %u", link_type);
+  }
+
+  std::vector<std::vector<uint8_t>> frames;
+  uint8_t record[16];
+  while (file.read(reinterpret_cast<char*>(record), sizeof(record))) {
+    uint32_t size = ReadPcapU32(&record[8], swapped);
+    std::vector<uint8_t> frame(size);
+    CHECK(file.read(reinterpret_cast<char*>(frame.data()), size),
+        "Truncated pcap record");
+    if (frame.size() > link_header_size) {
+      frame.erase(frame.begin(), frame.begin() + link_header_size);
+      frames.push_back(std::move(frame));
+    }
+  }
+
+  return frames;
+}
+
+// Returns the substring of a frame at the supplied offset as an integer.
+uint64_t GetDmer(const uint8_t* data) {
+  uint64_t dmer;
+  memcpy(&dmer, data, sizeof(dmer));
+  return dmer;
+}
+
+// Builds a dictionary from segments of the frames that contain the substrings
+// shared by the most frames. The frames are divided into one epoch for each
+// segment of the dictionary and the best segment of each epoch is chosen, so
+// the dictionary covers the whole capture. Substrings that have been chosen
+// are not counted again. The most valuable segments are placed at the end of
+// the dictionary, where they are cheapest to refer to.
+std::vector<uint8_t> TrainDictionary(
+    const std::vector<std::vector<uint8_t>>& frames, size_t dictionary_size) {
+  std::unordered_map<uint64_t, uint32_t> frequencies;
+  size_t total_size = 0;
+  for (const auto& frame : frames) {
+    total_size += frame.size();
+    if (frame.size() < kDmerSize) {
+      continue;
+    }
+
+    std::vector<uint64_t> dmers;
+    for (size_t i = 0; i + kDmerSize <= frame.size(); i++) {
+      dmers.push_back(GetDmer(&frame[i]));
+    }
+
+    std::sort(dmers.begin(), dmers.end());
+    dmers.erase(std::unique(dmers.begin(), dmers.end()), dmers.end());
+    for (uint64_t dmer : dmers) {
+      frequencies[dmer]++;
+    }
+  }
+
+  // A substring that only appears in a single frame does not help.
+  auto get_score = [&](const uint8_t* data) -> uint64_t {
+    auto frequency = frequencies.find(GetDmer(data));
+    return (frequency == frequencies.end() || frequency->second < 2)
+        ? 0 : frequency->second;
+  };
+
+  struct Segment {
+    uint64_t score;
+    const uint8_t* data;
+    size_t size;
+  };
+
+  std::vector<Segment> segments;
+  size_t epoch_count = std::max<size_t>(1, dictionary_size / kSegmentSize);
+  size_t epoch_size = std::max<size_t>(1, total_size / epoch_count);
+  size_t frame_index = 0;
+  while (frame_index < frames.size()) {
+    Segment best = {0, nullptr, 0};
+    size_t epoch_bytes = 0;
+    for (; frame_index < frames.size() && epoch_bytes < epoch_size;
+         frame_index++) {
+      const auto& frame = frames[frame_index];
+      epoch_bytes += frame.size();
+      if (frame.size() < kDmerSize) {
+        continue;
+      }
+
+      // Slide a window of the substrings in a segment over the frame.
+      size_t dmer_count = frame.size() - kDmerSize + 1;
+      size_t window = std::min(kSegmentSize, frame.size()) - kDmerSize + 1;
+      std::vector<uint64_t> scores(dmer_count);
+      uint64_t score = 0;
+      for (size_t i = 0; i < dmer_count; i++) {
+        scores[i] = get_score(&frame[i]);
+        score += scores[i];
+        if (i >= window) {
+          score -= scores[i - window];
+        }
+
+        if (i + 1 >= window && score > best.score) {
+          best = {score, &frame[i + 1 - window], window + kDmerSize - 1};
+        }
+      }
+    }
+
+    if (best.score == 0) {
+      continue;
+    }
+
+    for (size_t i = 0; i + kDmerSize <= best.size; i++) {
+      frequencies.erase(GetDmer(&best.data[i]));
+    }
+
+    segments.push_back(best);
+  }
+
+  std::stable_sort(segments.begin(), segments.end(),
+      [](const Segment& a, const Segment& b) { return a.score < b.score; });
+  std::vector<uint8_t> dictionary;
+  for (const auto& segment : segments) {
+    dictionary.insert(dictionary.end(), segment.data,
+        segment.data + segment.size);
+  }
+
+  if (dictionary.size() > dictionary_size) {
+    dictionary.erase(dictionary.begin(),
+        dictionary.end() - dictionary_size);
+  }
+
+  return dictionary;
+}
+
+// The amount of data sent over the air for a set of frames.
+struct AirtimeCost {
+  size_t bytes = 0;
+  size_t packets = 0;
+
+  // Adds a frame of the supplied size.
+  void Add(size_t size) {
+    bytes += size;
+    packets += (size + kPacketPayloadSize - 1) / kPacketPayloadSize;
+  }
+};
+
+// Compresses the frames in order with a streaming context and checks that
+// they are restored by the peer. Returns the cost of sending them.
+AirtimeCost MeasureCompression(
+    const std::vector<std::vector<uint8_t>>& frames,
+    const std::vector<uint8_t>& dictionary) {
+  nerfnet::CompressionCodec encoder(dictionary);
+  nerfnet::CompressionCodec decoder(dictionary);
+  AirtimeCost cost;
+  for (const auto& frame : frames) {
+    std::vector<uint8_t> encoded = frame;
+    CHECK(encoder.Encode(encoded) == nerfnet::FrameCodec::Result::Forward,
+        "Failed to compress frame");
+    cost.Add(encoded.size());
+    CHECK(decoder.Decode(encoded) && encoded == frame,
+        "Failed to decompress frame");
+  }
+
+  return cost;
+}
+
+// Prints a row of the report.
+void PrintCost(const char* name, const AirtimeCost& cost,
+               const AirtimeCost& baseline) {
+  printf("%-12s %12zu %12zu %11.1f%%\n", name, cost.bytes, cost.packets,
+      100.0 - 100.0 * cost.packets / baseline.packets);
+}
+
+int main(int argc, char** argv) {
+  // Parse command-line arguments.
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<std::string> pcap_arg("", "pcap",
+      "A pcap file of traffic that is representative of the link.",
+      true, "", "path", cmd);
+  TCLAP::ValueArg<std::string> output_arg("", "output",
+      "The file to write the dictionary to.", false, "", "path", cmd);
+  TCLAP::ValueArg<uint32_t> dictionary_size_arg("", "dictionary_size",
+      "The maximum size of the dictionary.", false,
+      nerfnet::CompressionCodec::kMaxDictionarySize, "bytes", cmd);
+  TCLAP::SwitchArg tap_arg("", "tap",
+      "Set to keep the Ethernet headers of an Ethernet capture, for links "
+      "that use TAP devices.", cmd);
+  cmd.parse(argc, argv);
+
+  const size_t dictionary_size = dictionary_size_arg.getValue();
+  CHECK(dictionary_size <= nerfnet::CompressionCodec::kMaxDictionarySize,
+      "Dictionary size must be at most %zu bytes",
+      nerfnet::CompressionCodec::kMaxDictionarySize);
+
+  // Every other frame is held out to evaluate the dictionary on traffic
+  // that it was not trained on.
+  auto frames = ReadPcapFile(pcap_arg.getValue(), tap_arg.getValue());
+  std::vector<std::vector<uint8_t>> training_frames;
+  std::vector<std::vector<uint8_t>> test_frames;
+  for (size_t i = 0; i < frames.size(); i++) {
+    (i % 2 == 0 ? training_frames : test_frames).push_back(frames[i]);
+  }
+
+  CHECK(!test_frames.empty(), "At least two frames are required");
+  auto dictionary = TrainDictionary(training_frames, dictionary_size);
+  LOGI("trained a %zu byte dictionary from %zu frames", dictionary.size(),
+      training_frames.size());
+  if (!output_arg.getValue().empty()) {
+    std::ofstream file(output_arg.getValue(), std::ios::binary);
+    file.write(reinterpret_cast<const char*>(dictionary.data()),
+        dictionary.size());
+    CHECK(file.good(), "Failed to write dictionary to '%s'",
+        output_arg.getValue().c_str());
+  }
+
+  AirtimeCost uncompressed;
+  for (const auto& frame : test_frames) {
+    uncompressed.Add(frame.size());
+  }
+
+  printf("%-12s %12s %12s %12s\n", "mode", "bytes", "packets", "saved");
+  PrintCost("none", uncompressed, uncompressed);
+  PrintCost("stream", MeasureCompression(test_frames, {}), uncompressed);
+  PrintCost("dictionary", MeasureCompression(test_frames, dictionary),
+      uncompressed);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_CONTROL_CHANNEL_H_
+#define NERFNET_NET_CONTROL_CHANNEL_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace nerfnet {
+
+// The types of control messages exchanged between the two sides of a link.
+// The type is carried in the low bits of the first byte of a control frame.
+enum class ControlMessageType : uint8_t {
+  // Starts a key rotation with a nonce chosen by the initiator.
+  RekeyRequest = 0,
+
+  // Completes a key agreement with a nonce chosen by the responder.
+  RekeyResponse = 1,
+
+  // Sent as the first frame under a new key by each side.
+  RekeyConfirm = 2,
+
+  // Asks the peer to stop referring to a dedup cache entry that differs
+  // between the two sides.
+  DedupInvalidate = 3,
+
+  // Asks the peer to restart its compression context in a new epoch.
+  CompressionReset = 4,
+
+  // Announces that the primary moves the link to a new channel and data rate
+  // once the message is delivered. Sent by the secondary to ask the primary
+  // to move the link.
+  ChannelSwitch = 5,
+
+  // Carries the times that the sender sent the message and the delay of its
+  // transmit queue, which the peer answers with a ClockResponse.
+  ClockRequest = 6,
+
+  // Answers a ClockRequest with the send time of the request, the time that
+  // it was received and the times of the response itself.
+  ClockResponse = 7,
+
+  // Reports the quality of the beacons heard from each gateway of a roaming
+  // link and, when the secondary wants to move, the gateway to move to. Sent
+  // by the secondary.
+  RoamReport = 8,
+
+  // Reports the number of bytes that the sender has waiting to be sent,
+  // which the hub of a TDMA cell sizes the slot of the link by. Sent by the
+  // secondary.
+  Backlog = 9,
+
+  // Asks the peer to stop referring to an Ethernet address table entry that
+  // is not known to the sender, so that the address is sent inline again.
+  EthernetInvalidate = 10,
+};
+
+// Sends control messages to the peer.
+class ControlChannel {
+ public:
+  virtual ~ControlChannel() = default;
+
+  // The number of control message types that can be carried.
+  static constexpr uint8_t kMaxControlMessageTypes = 16;
+
+  // Queues a control message for the peer. Control messages are sent ahead of
+  // other queued frames and pass through the link codecs. Must only be called
+  // while the link is being serviced, such as from codec methods.
+  virtual void SendControlMessage(ControlMessageType type,
+                                  std::vector<uint8_t> message) = 0;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_CONTROL_CHANNEL_H_
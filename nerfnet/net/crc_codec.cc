@@ -0,0 +1,46 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/crc_codec.h"
+
+#include "nerfnet/util/crc32c.h"
+#include "nerfnet/util/encoding.h"
+
+namespace nerfnet {
+
+FrameCodec::Result CrcCodec::Encode(std::vector<uint8_t>& frame) {
+  uint32_t crc = Crc32c(frame.data(), frame.size());
+  size_t size = frame.size();
+  frame.resize(size + kTrailerSize);
+  WriteLittleEndianU32(&frame[size], crc);
+  return Result::Forward;
+}
+
+bool CrcCodec::Decode(std::vector<uint8_t>& frame) {
+  if (frame.size() < kTrailerSize) {
+    return false;
+  }
+
+  size_t size = frame.size() - kTrailerSize;
+  if (Crc32c(frame.data(), size) != ReadLittleEndianU32(&frame[size])) {
+    return false;
+  }
+
+  frame.resize(size);
+  return true;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_CRC_CODEC_H_
+#define NERFNET_NET_CRC_CODEC_H_
+
+#include "nerfnet/net/frame_codec.h"
+
+namespace nerfnet {
+
+// Appends a CRC32C trailer to every frame exchanged over a link. The radio
+// only protects packets with an 8-bit CRC, so this catches the corrupted
+// packets that it misses before they are reassembled into a frame that is
+// passed on. Frames that fail the check are sent again by the peer.
+class CrcCodec : public FrameCodec {
+ public:
+  // The size of the trailer.
+  static constexpr size_t kTrailerSize = 4;
+
+  // FrameCodec methods.
+  Result Encode(std::vector<uint8_t>& frame) override;
+  bool Decode(std::vector<uint8_t>& frame) override;
+  void Reset(const LinkSession& session) override {}
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_CRC_CODEC_H_
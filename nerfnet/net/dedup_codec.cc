@@ -0,0 +1,389 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/dedup_codec.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/crc32c.h"
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+namespace {
+
+// The shortest run of matching bytes that ends a literal run of a delta. A
+// shorter match costs more to encode as a copy than as literal bytes.
+constexpr size_t kMinDeltaMatch = 3;
+
+// Appends a variable length integer with 7 bits per byte, least significant
+// first.
+void AppendVarint(std::vector<uint8_t>& buffer, size_t value) {
+  while (value >= 0x80) {
+    buffer.push_back(static_cast<uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+
+  buffer.push_back(static_cast<uint8_t>(value));
+}
+
+// Reads a variable length integer, advancing the offset. Returns false if the
+// buffer ends before the integer.
+bool ReadVarint(const uint8_t* data, size_t size, size_t& offset,
+                size_t& value) {
+  value = 0;
+  for (size_t shift = 0; offset < size && shift < 32; shift += 7) {
+    uint8_t byte = data[offset++];
+    value |= static_cast<size_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Returns the number of bytes that match between the frame and the base
+// starting at the supplied offset.
+size_t GetMatchLength(const std::vector<uint8_t>& frame,
+                      const std::vector<uint8_t>& base, size_t offset) {
+  size_t end = std::min(frame.size(), base.size());
+  size_t length = 0;
+  while (offset + length < end
+      && frame[offset + length] == base[offset + length]) {
+    length++;
+  }
+
+  return length;
+}
+
+}  // anonymous namespace
+
+FrameCodec::Result DedupCodec::Encode(std::vector<uint8_t>& frame) {
+  if (frame.empty() || frame.size() > kMaxEntrySize) {
+    // Frames that are not cached must not be mistaken for encoded frames.
+    // Codecs that run before this one never produce them.
+    if (!frame.empty() && (frame[0] & kDispatchMask) == kDispatch) {
+      return Result::Drop;
+    }
+
+    return Result::Forward;
+  }
+
+  uint32_t crc = Crc32c(frame.data(), frame.size());
+  for (uint8_t slot = 0; slot < kCacheSize; slot++) {
+    const auto& entry = tx_cache_.entries[slot];
+    if (entry.has_value() && entry->crc == crc && entry->data == frame) {
+      tx_cache_.Touch(slot);
+      frame.clear();
+      frame.push_back(kDispatch | (static_cast<uint8_t>(FrameType::Reference)
+          << kTypeShift) | slot);
+      AppendBigEndianU16(frame, GetCheck(*entry));
+      return Result::Forward;
+    }
+  }
+
+  // Find the entry that yields the smallest delta, if any is smaller than
+  // sending the frame as a literal.
+  std::optional<uint8_t> delta_slot;
+  std::vector<uint8_t> delta;
+  std::vector<uint8_t> candidate;
+  size_t literal_size = 1 + frame.size();
+  size_t max_delta_size = literal_size > kCheckHeaderSize
+      ? literal_size - kCheckHeaderSize : 0;
+  for (uint8_t slot = 0; slot < kCacheSize; slot++) {
+    const auto& entry = tx_cache_.entries[slot];
+    if (entry.has_value()
+        && EncodeDelta(frame, entry->data, max_delta_size, candidate)) {
+      delta_slot = slot;
+      max_delta_size = candidate.size();
+      delta.swap(candidate);
+    }
+  }
+
+  std::vector<uint8_t> encoded;
+  if (delta_slot.has_value()) {
+    uint8_t slot = delta_slot.value();
+    encoded.reserve(kCheckHeaderSize + delta.size());
+    encoded.push_back(kDispatch | (static_cast<uint8_t>(FrameType::Delta)
+        << kTypeShift) | slot);
+    AppendBigEndianU16(encoded, GetCheck(*tx_cache_.entries[slot]));
+    encoded.insert(encoded.end(), delta.begin(), delta.end());
+    tx_cache_.Store(slot, frame, crc);
+  } else {
+    uint8_t slot = tx_cache_.Allocate();
+    encoded.reserve(1 + frame.size());
+    encoded.push_back(kDispatch | (static_cast<uint8_t>(FrameType::Literal)
+        << kTypeShift) | slot);
+    encoded.insert(encoded.end(), frame.begin(), frame.end());
+    tx_cache_.Store(slot, frame, crc);
+  }
+
+  frame.assign(encoded.begin(), encoded.end());
+  return Result::Forward;
+}
+
+bool DedupCodec::Decode(std::vector<uint8_t>& frame) {
+  if (frame.empty() || (frame[0] & kDispatchMask) != kDispatch) {
+    return true;
+  }
+
+  auto type = static_cast<FrameType>((frame[0] >> kTypeShift) & kTypeMask);
+  uint8_t slot = frame[0] & kSlotMask;
+  if (type == FrameType::Literal) {
+    if (frame.size() < 2 || frame.size() - 1 > kMaxEntrySize) {
+      return false;
+    }
+
+    frame.erase(frame.begin());
+    rx_cache_.Store(slot, frame, Crc32c(frame.data(), frame.size()));
+    return true;
+  } else if (frame.size() < kCheckHeaderSize) {
+    return false;
+  }
+
+  const Entry* entry = GetRxEntry(slot, &frame[1]);
+  if (entry == nullptr) {
+    return false;
+  }
+
+  if (type == FrameType::Reference) {
+    frame.assign(entry->data.begin(), entry->data.end());
+  } else if (type == FrameType::Delta) {
+    std::vector<uint8_t> decoded;
+    if (!DecodeDelta(&frame[kCheckHeaderSize],
+            frame.size() - kCheckHeaderSize, entry->data, decoded)
+        || decoded.empty() || decoded.size() > kMaxEntrySize) {
+      return false;
+    }
+
+    frame.assign(decoded.begin(), decoded.end());
+    rx_cache_.Store(slot, std::move(decoded),
+        Crc32c(frame.data(), frame.size()));
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+void DedupCodec::Reset(const LinkSession& session) {
+  tx_cache_.Reset();
+  rx_cache_.Reset();
+}
+
+bool DedupCodec::SaveState(LinkSnapshot& snapshot) const {
+  tx_cache_.Save(snapshot);
+  rx_cache_.Save(snapshot);
+  return true;
+}
+
+bool DedupCodec::RestoreState(LinkSnapshot& snapshot) {
+  return tx_cache_.Restore(snapshot) && rx_cache_.Restore(snapshot);
+}
+
+void DedupCodec::SetControlChannel(ControlChannel* channel) {
+  control_channel_ = channel;
+}
+
+bool DedupCodec::HandleControlMessage(ControlMessageType type,
+                                      const uint8_t* data, size_t size) {
+  if (type != ControlMessageType::DedupInvalidate) {
+    return false;
+  }
+
+  if (size != 1 || data[0] >= kCacheSize) {
+    LOGE("Ignoring invalid dedup invalidation");
+  } else {
+    tx_cache_.entries[data[0]].reset();
+  }
+
+  return true;
+}
+
+void DedupCodec::Cache::Reset() {
+  entries.fill(std::nullopt);
+  last_used.fill(0);
+  use_count = 0;
+}
+
+uint8_t DedupCodec::Cache::Allocate() {
+  uint8_t slot = 0;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (!entries[i].has_value()) {
+      return i;
+    } else if (last_used[i] < last_used[slot]) {
+      slot = i;
+    }
+  }
+
+  return slot;
+}
+
+void DedupCodec::Cache::Store(uint8_t slot, std::vector<uint8_t> data,
+                              uint32_t crc) {
+  entries[slot] = Entry{std::move(data), crc};
+  Touch(slot);
+}
+
+void DedupCodec::Cache::Touch(uint8_t slot) {
+  last_used[slot] = ++use_count;
+}
+
+void DedupCodec::Cache::Save(LinkSnapshot& snapshot) const {
+  snapshot.PutU64(use_count);
+  for (size_t i = 0; i < entries.size(); i++) {
+    snapshot.PutU8(entries[i].has_value());
+    if (entries[i].has_value()) {
+      snapshot.PutBytes(entries[i]->data);
+      snapshot.PutU32(entries[i]->crc);
+    }
+
+    snapshot.PutU64(last_used[i]);
+  }
+}
+
+bool DedupCodec::Cache::Restore(LinkSnapshot& snapshot) {
+  Reset();
+  if (!snapshot.GetU64(use_count)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    uint8_t has_entry;
+    if (!snapshot.GetU8(has_entry)) {
+      return false;
+    }
+
+    if (has_entry) {
+      Entry entry;
+      if (!snapshot.GetBytes(entry.data) || !snapshot.GetU32(entry.crc)) {
+        return false;
+      }
+
+      entries[i] = std::move(entry);
+    }
+
+    if (!snapshot.GetU64(last_used[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+uint16_t DedupCodec::GetCheck(const Entry& entry) {
+  return static_cast<uint16_t>(entry.crc);
+}
+
+bool DedupCodec::EncodeDelta(const std::vector<uint8_t>& frame,
+                             const std::vector<uint8_t>& base,
+                             size_t max_size, std::vector<uint8_t>& delta) {
+  // The delta is the size of the frame followed by runs of bytes copied from
+  // the same offset in the base, each followed by a run of literal bytes. Any
+  // bytes after the last run are copied from the base.
+  delta.clear();
+  AppendVarint(delta, frame.size());
+  size_t offset = 0;
+  while (offset < frame.size()) {
+    size_t copy_size = GetMatchLength(frame, base, offset);
+    if (offset + copy_size == frame.size()) {
+      break;
+    }
+
+    // Extend the literal run until a long enough match starts, or a match
+    // runs to the end of the frame.
+    size_t literal_start = offset + copy_size;
+    size_t literal_end = literal_start + 1;
+    while (literal_end < frame.size()) {
+      size_t match = GetMatchLength(frame, base, literal_end);
+      if (match >= kMinDeltaMatch || literal_end + match == frame.size()) {
+        break;
+      }
+
+      literal_end++;
+    }
+
+    AppendVarint(delta, copy_size);
+    AppendVarint(delta, literal_end - literal_start);
+    delta.insert(delta.end(), frame.begin() + literal_start,
+        frame.begin() + literal_end);
+    if (delta.size() >= max_size) {
+      return false;
+    }
+
+    offset = literal_end;
+  }
+
+  return delta.size() < max_size;
+}
+
+bool DedupCodec::DecodeDelta(const uint8_t* delta, size_t size,
+                             const std::vector<uint8_t>& base,
+                             std::vector<uint8_t>& frame) {
+  size_t offset = 0;
+  size_t frame_size;
+  if (!ReadVarint(delta, size, offset, frame_size)
+      || frame_size > kMaxEntrySize) {
+    return false;
+  }
+
+  frame.clear();
+  frame.reserve(frame_size);
+  while (offset < size) {
+    size_t copy_size;
+    size_t literal_size;
+    if (!ReadVarint(delta, size, offset, copy_size)
+        || !ReadVarint(delta, size, offset, literal_size)
+        || frame.size() + copy_size > base.size()
+        || frame.size() + copy_size + literal_size > frame_size
+        || offset + literal_size > size) {
+      return false;
+    }
+
+    frame.insert(frame.end(), base.begin() + frame.size(),
+        base.begin() + frame.size() + copy_size);
+    frame.insert(frame.end(), delta + offset, delta + offset + literal_size);
+    offset += literal_size;
+  }
+
+  if (frame_size > base.size()) {
+    return frame.size() == frame_size;
+  }
+
+  frame.insert(frame.end(), base.begin() + frame.size(),
+      base.begin() + frame_size);
+  return true;
+}
+
+const DedupCodec::Entry* DedupCodec::GetRxEntry(uint8_t slot,
+                                                const uint8_t* check) {
+  const auto& entry = rx_cache_.entries[slot];
+  if (entry.has_value() && GetCheck(*entry) == ReadBigEndianU16(check)) {
+    return &entry.value();
+  }
+
+  LOGE("Dedup cache entry %u does not match the peer", slot);
+  rx_cache_.entries[slot].reset();
+  if (control_channel_ != nullptr) {
+    control_channel_->SendControlMessage(ControlMessageType::DedupInvalidate,
+        {slot});
+  }
+
+  return nullptr;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_DEDUP_CODEC_H_
+#define NERFNET_NET_DEDUP_CODEC_H_
+
+#include <array>
+#include <optional>
+
+#include "nerfnet/net/frame_codec.h"
+
+namespace nerfnet {
+
+// Replaces frames that repeat recently sent frames with references to them.
+// Small frames are stored in a cache that is mirrored by the peer and keyed
+// by a CRC32C of their contents. A frame that matches an entry is sent as a
+// reference to it and a frame that differs from an entry in a few places,
+// such as a keepalive with a new sequence number and checksum, is sent as a
+// delta against it that replaces the entry.
+//
+// The encoded frame is laid out as follows.
+//
+//   byte 0: 0b11 | type (2 bits) | slot (4 bits)
+//   check (2 bytes, the low bits of the CRC of the entry, if not a literal)
+//   literal frame or delta (remaining bytes)
+//
+// A literal frame is stored into the slot, a reference is replaced with the
+// entry in the slot and a delta is applied to the entry in the slot and
+// replaces it. Frames that are too large to be cached are sent unchanged. The
+// check detects a peer whose cache has diverged, such as after a frame was
+// lost, in which case the peer asks for the slot to be invalidated.
+class DedupCodec : public FrameCodec {
+ public:
+  // FrameCodec methods.
+  Result Encode(std::vector<uint8_t>& frame) override;
+  bool Decode(std::vector<uint8_t>& frame) override;
+  void Reset(const LinkSession& session) override;
+  bool SaveState(LinkSnapshot& snapshot) const override;
+  bool RestoreState(LinkSnapshot& snapshot) override;
+  void SetControlChannel(ControlChannel* channel) override;
+  bool HandleControlMessage(ControlMessageType type,
+                            const uint8_t* data, size_t size) override;
+
+ private:
+  // The number of entries in each cache and the size of the largest frame
+  // that is stored, which bounds the memory used by the cache.
+  static constexpr size_t kCacheSize = 16;
+  static constexpr size_t kMaxEntrySize = 512;
+
+  // The bits of the first byte of an encoded frame.
+  static constexpr uint8_t kDispatchMask = 0xc0;
+  static constexpr uint8_t kDispatch = 0xc0;
+  static constexpr uint8_t kTypeShift = 4;
+  static constexpr uint8_t kTypeMask = 0x03;
+  static constexpr uint8_t kSlotMask = 0x0f;
+
+  // The size of the header of references and deltas.
+  static constexpr size_t kCheckHeaderSize = 3;
+
+  // The types of encoded frames.
+  enum class FrameType : uint8_t {
+    Literal = 0,
+    Reference = 1,
+    Delta = 2,
+  };
+
+  // A frame stored in the cache.
+  struct Entry {
+    std::vector<uint8_t> data;
+    uint32_t crc;
+  };
+
+  // A cache of frames mirrored with the peer.
+  struct Cache {
+    std::array<std::optional<Entry>, kCacheSize> entries;
+    std::array<uint64_t, kCacheSize> last_used;
+    uint64_t use_count;
+
+    // Clears all entries.
+    void Reset();
+
+    // Returns the least recently used slot to store a new frame in.
+    uint8_t Allocate();
+
+    // Stores a frame and marks it as recently used.
+    void Store(uint8_t slot, std::vector<uint8_t> data, uint32_t crc);
+
+    // Marks an entry as recently used.
+    void Touch(uint8_t slot);
+
+    // Saves and restores the entries for a new process that takes over the
+    // link.
+    void Save(LinkSnapshot& snapshot) const;
+    bool Restore(LinkSnapshot& snapshot);
+  };
+
+  // The channel used to ask the peer to invalidate entries.
+  ControlChannel* control_channel_ = nullptr;
+
+  // The caches of frames sent to and received from the peer.
+  Cache tx_cache_;
+  Cache rx_cache_;
+
+  // Returns the check carried by references and deltas to an entry.
+  static uint16_t GetCheck(const Entry& entry);
+
+  // Encodes the differences between a frame and an entry. Returns false if
+  // the delta would not be smaller than max_size.
+  static bool EncodeDelta(const std::vector<uint8_t>& frame,
+                          const std::vector<uint8_t>& base, size_t max_size,
+                          std::vector<uint8_t>& delta);
+
+  // Applies a delta to an entry. Returns false if the delta is malformed.
+  static bool DecodeDelta(const uint8_t* delta, size_t size,
+                          const std::vector<uint8_t>& base,
+                          std::vector<uint8_t>& frame);
+
+  // Returns the entry received in a slot if it matches the check, otherwise
+  // invalidates it on both sides and returns nullptr.
+  const Entry* GetRxEntry(uint8_t slot, const uint8_t* check);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_DEDUP_CODEC_H_
@@ -0,0 +1,199 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/erasure_code.h"
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+namespace {
+
+// Log and antilog tables for GF(256) with the polynomial x^8 + x^4 + x^3 +
+// x^2 + 1. The antilog table is doubled so that the sum of two logs can be
+// looked up without reduction.
+struct GaloisField {
+  uint8_t exp[510];
+  uint8_t log[256];
+
+  GaloisField() {
+    uint16_t value = 1;
+    for (int i = 0; i < 255; i++) {
+      exp[i] = value;
+      exp[i + 255] = value;
+      log[value] = i;
+      value <<= 1;
+      if (value & 0x100) {
+        value ^= 0x11d;
+      }
+    }
+
+    log[0] = 0;
+  }
+};
+
+const GaloisField& GetField() {
+  static const GaloisField field;
+  return field;
+}
+
+uint8_t Multiply(uint8_t a, uint8_t b) {
+  const GaloisField& field = GetField();
+  if (a == 0 || b == 0) {
+    return 0;
+  }
+
+  return field.exp[field.log[a] + field.log[b]];
+}
+
+uint8_t Inverse(uint8_t a) {
+  const GaloisField& field = GetField();
+  return field.exp[255 - field.log[a]];
+}
+
+// Adds a symbol multiplied by a coefficient to another symbol.
+void AddScaled(std::vector<uint8_t>& symbol, const std::vector<uint8_t>& other,
+               uint8_t coefficient) {
+  if (coefficient == 0) {
+    return;
+  }
+
+  const GaloisField& field = GetField();
+  uint8_t coefficient_log = field.log[coefficient];
+  for (size_t i = 0; i < symbol.size(); i++) {
+    if (other[i] != 0) {
+      symbol[i] ^= field.exp[field.log[other[i]] + coefficient_log];
+    }
+  }
+}
+
+// Multiplies a symbol by a coefficient.
+void Scale(std::vector<uint8_t>& symbol, uint8_t coefficient) {
+  for (auto& value : symbol) {
+    value = Multiply(value, coefficient);
+  }
+}
+
+// Returns the coefficient of a source symbol in a repair symbol. The row and
+// column elements of the Cauchy matrix are the symbol indices, which differ
+// since repair indices follow the source indices.
+uint8_t GetCoefficient(uint8_t repair_index, uint8_t source_index) {
+  return Inverse(repair_index ^ source_index);
+}
+
+}  // anonymous namespace
+
+void ErasureCode::EncodeRepair(
+    const std::vector<std::vector<uint8_t>>& sources, uint8_t index,
+    std::vector<uint8_t>& repair) {
+  CHECK(index >= sources.size(), "Symbol %u is a source symbol", index);
+  repair.assign(sources.front().size(), 0x00);
+  for (size_t i = 0; i < sources.size(); i++) {
+    AddScaled(repair, sources[i], GetCoefficient(index, i));
+  }
+}
+
+bool ErasureCode::Decode(size_t source_count,
+                         const std::vector<Symbol>& symbols,
+                         std::vector<std::vector<uint8_t>>& sources) {
+  if (symbols.size() < source_count) {
+    return false;
+  }
+
+  // Source symbols are used directly and the missing ones are solved for
+  // from repair symbols, which is cheap when few symbols were lost.
+  sources.assign(source_count, {});
+  std::vector<const Symbol*> repairs;
+  for (const auto& symbol : symbols) {
+    if (symbol.index < source_count) {
+      sources[symbol.index] = symbol.data;
+    } else {
+      repairs.push_back(&symbol);
+    }
+  }
+
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < source_count; i++) {
+    if (sources[i].empty()) {
+      missing.push_back(i);
+    }
+  }
+
+  if (missing.empty()) {
+    return true;
+  } else if (repairs.size() < missing.size()) {
+    return false;
+  }
+
+  // Remove the known source symbols from the repair symbols, leaving a
+  // square system in the missing source symbols.
+  size_t symbol_size = repairs.front()->data.size();
+  size_t count = missing.size();
+  std::vector<std::vector<uint8_t>> matrix(count,
+      std::vector<uint8_t>(count));
+  std::vector<std::vector<uint8_t>> values(count);
+  for (size_t row = 0; row < count; row++) {
+    const Symbol& repair = *repairs[row];
+    values[row] = repair.data;
+    for (size_t i = 0; i < source_count; i++) {
+      if (!sources[i].empty()) {
+        AddScaled(values[row], sources[i], GetCoefficient(repair.index, i));
+      }
+    }
+
+    for (size_t column = 0; column < count; column++) {
+      matrix[row][column] = GetCoefficient(repair.index, missing[column]);
+    }
+  }
+
+  // Every square submatrix of a Cauchy matrix is invertible, so a pivot is
+  // always found.
+  for (size_t column = 0; column < count; column++) {
+    size_t pivot = column;
+    while (matrix[pivot][column] == 0) {
+      pivot++;
+    }
+
+    std::swap(matrix[pivot], matrix[column]);
+    std::swap(values[pivot], values[column]);
+    uint8_t inverse = Inverse(matrix[column][column]);
+    for (auto& value : matrix[column]) {
+      value = Multiply(value, inverse);
+    }
+
+    Scale(values[column], inverse);
+    for (size_t row = 0; row < count; row++) {
+      uint8_t factor = matrix[row][column];
+      if (row == column || factor == 0) {
+        continue;
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        matrix[row][i] ^= Multiply(factor, matrix[column][i]);
+      }
+
+      AddScaled(values[row], values[column], factor);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    sources[missing[i]] = std::move(values[i]);
+    sources[missing[i]].resize(symbol_size);
+  }
+
+  return true;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_ERASURE_CODE_H_
+#define NERFNET_NET_ERASURE_CODE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nerfnet {
+
+// A systematic erasure code over GF(256) for blocks of equally sized
+// symbols. The source symbols of a block are sent as they are and may be
+// followed by any number of repair symbols, each combining all of the source
+// symbols with coefficients from a Cauchy matrix. Any source_count distinct
+// symbols of a block recover it, so a single repair symbol replaces a
+// different lost symbol at each receiver.
+class ErasureCode {
+ public:
+  // The number of distinct symbols in a block, including source symbols.
+  static constexpr size_t kMaxSymbols = 256;
+
+  // A symbol of a block. Indices below the number of source symbols are
+  // source symbols and the rest are repair symbols.
+  struct Symbol {
+    uint8_t index;
+    std::vector<uint8_t> data;
+  };
+
+  // Computes the repair symbol with the supplied index from the source
+  // symbols of a block. The index must not be that of a source symbol.
+  static void EncodeRepair(const std::vector<std::vector<uint8_t>>& sources,
+                           uint8_t index, std::vector<uint8_t>& repair);
+
+  // Recovers the source symbols of a block from symbols with distinct
+  // indices. Returns false if fewer than source_count symbols are supplied.
+  static bool Decode(size_t source_count, const std::vector<Symbol>& symbols,
+                     std::vector<std::vector<uint8_t>>& sources);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_ERASURE_CODE_H_
@@ -0,0 +1,396 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/ethernet_codec.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/macros.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+namespace {
+
+// The dispatch bits that mark a compressed Ethernet frame.
+constexpr uint8_t kDispatchMask = 0xc0;
+constexpr uint8_t kDispatch = 0x80;
+
+// Flags in the first header byte.
+constexpr uint8_t kDstInlineFlag = 0x20;
+constexpr uint8_t kSrcInlineFlag = 0x10;
+constexpr uint8_t kEthertypeMask = 0x0f;
+
+// The address used for broadcast frames.
+constexpr std::array<uint8_t, 6> kBroadcastAddress = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+// Ethertypes with short codes. The code is the index into this table plus one.
+constexpr uint16_t kEthertypeArp = 0x0806;
+constexpr uint16_t kEthertypes[] = {
+  0x0800,  // IPv4
+  kEthertypeArp,
+  0x86dd,  // IPv6
+  0x8100,  // 802.1Q
+};
+
+// Offsets and values of ARP fields for IPv4 over Ethernet.
+constexpr size_t kArpSize = 28;
+constexpr size_t kArpOperOffset = 6;
+constexpr size_t kArpShaOffset = 8;
+constexpr size_t kArpSpaOffset = 14;
+constexpr size_t kArpThaOffset = 18;
+constexpr size_t kArpTpaOffset = 24;
+constexpr uint16_t kArpOperRequest = 1;
+constexpr uint16_t kArpOperReply = 2;
+constexpr uint8_t kArpHeader[] = {
+  0x00, 0x01,  // Ethernet
+  0x08, 0x00,  // IPv4
+  0x06,        // Hardware address length
+  0x04,        // Protocol address length
+};
+
+// Returns a pointer to the IPv4 ARP payload of a frame or nullptr if the frame
+// does not contain one.
+const uint8_t* GetArpPayload(const std::vector<uint8_t>& frame) {
+  if (frame.size() < 14 + kArpSize
+      || ReadBigEndianU16(&frame[12]) != kEthertypeArp
+      || !std::equal(std::begin(kArpHeader), std::end(kArpHeader),
+                     &frame[14])) {
+    return nullptr;
+  }
+
+  return &frame[14];
+}
+
+}  // anonymous namespace
+
+EthernetCodec::EthernetCodec(bool forward_multicast)
+    : forward_multicast_(forward_multicast) {
+  Reset(LinkSession());
+}
+
+FrameCodec::Result EthernetCodec::Encode(std::vector<uint8_t>& frame) {
+  tx_undo_.clear();
+  if (frame.size() < kHeaderSize) {
+    return Result::Drop;
+  }
+
+  MacAddress dst, src;
+  std::copy(&frame[0], &frame[6], dst.begin());
+  std::copy(&frame[6], &frame[12], src.begin());
+  uint16_t ethertype = ReadBigEndianU16(&frame[12]);
+  if (dst[0] & 0x01) {
+    if (ethertype == kEthertypeArp) {
+      Result result = HandleArpRequest(frame);
+      if (result != Result::Forward) {
+        return result;
+      }
+    } else if (!forward_multicast_ || dst == kBroadcastAddress) {
+      return Result::Drop;
+    }
+  }
+
+  std::vector<uint8_t> header(2, 0x00);
+  header[0] = kDispatch;
+  uint8_t dst_index, src_index;
+  if (EncodeAddress(dst, dst_index)) {
+    header[0] |= kDstInlineFlag;
+    header.insert(header.end(), dst.begin(), dst.end());
+  }
+
+  if (EncodeAddress(src, src_index)) {
+    header[0] |= kSrcInlineFlag;
+    header.insert(header.end(), src.begin(), src.end());
+  }
+
+  header[1] = (dst_index << 4) | src_index;
+  const uint16_t* code = std::find(std::begin(kEthertypes),
+      std::end(kEthertypes), ethertype);
+  if (code != std::end(kEthertypes)) {
+    header[0] |= (code - std::begin(kEthertypes)) + 1;
+  } else {
+    header.insert(header.end(), &frame[12], &frame[14]);
+  }
+
+  frame.erase(frame.begin(), frame.begin() + kHeaderSize);
+  frame.insert(frame.begin(), header.begin(), header.end());
+  return Result::Forward;
+}
+
+bool EthernetCodec::Decode(std::vector<uint8_t>& frame) {
+  if (frame.size() < 2 || (frame[0] & kDispatchMask) != kDispatch) {
+    return false;
+  }
+
+  uint8_t flags = frame[0];
+  uint8_t dst_index = frame[1] >> 4;
+  uint8_t src_index = frame[1] & 0x0f;
+  uint8_t ethertype_code = flags & kEthertypeMask;
+  size_t offset = 2;
+  size_t header_size = offset
+      + ((flags & kDstInlineFlag) ? 6 : 0)
+      + ((flags & kSrcInlineFlag) ? 6 : 0)
+      + ((ethertype_code == 0) ? 2 : 0);
+  if (frame.size() < header_size
+      || ethertype_code > ARRAY_SIZE(kEthertypes)) {
+    return false;
+  }
+
+  uint8_t header[kHeaderSize];
+  const uint8_t inline_flags[] = { kDstInlineFlag, kSrcInlineFlag };
+  const uint8_t indices[] = { dst_index, src_index };
+  for (size_t i = 0; i < ARRAY_SIZE(indices); i++) {
+    MacAddress address;
+    if (flags & inline_flags[i]) {
+      if (indices[i] == 0) {
+        return false;
+      }
+
+      std::copy(&frame[offset], &frame[offset + 6], address.begin());
+      rx_table_.Store(indices[i], address);
+      offset += 6;
+    } else if (rx_table_.entries[indices[i]].has_value()) {
+      address = *rx_table_.entries[indices[i]];
+    } else {
+      LOGE("Ethernet address table entry %u is not known", indices[i]);
+      if (control_channel_ != nullptr) {
+        control_channel_->SendControlMessage(
+            ControlMessageType::EthernetInvalidate, {indices[i]});
+      }
+
+      return false;
+    }
+
+    std::copy(address.begin(), address.end(), &header[i * 6]);
+  }
+
+  if (ethertype_code == 0) {
+    header[12] = frame[offset];
+    header[13] = frame[offset + 1];
+    offset += 2;
+  } else {
+    WriteBigEndianU16(&header[12], kEthertypes[ethertype_code - 1]);
+  }
+
+  frame.erase(frame.begin(), frame.begin() + offset);
+  frame.insert(frame.begin(), std::begin(header), std::end(header));
+  LearnArpSender(frame);
+  return true;
+}
+
+void EthernetCodec::Reset(const LinkSession& session) {
+  tx_table_.Reset();
+  rx_table_.Reset();
+  tx_undo_.clear();
+  arp_forward_times_.clear();
+}
+
+bool EthernetCodec::SaveState(LinkSnapshot& snapshot) const {
+  // The hosts learned from ARP are local to this side and are learned
+  // again.
+  tx_table_.Save(snapshot);
+  rx_table_.Save(snapshot);
+  return true;
+}
+
+bool EthernetCodec::RestoreState(LinkSnapshot& snapshot) {
+  tx_undo_.clear();
+  return tx_table_.Restore(snapshot) && rx_table_.Restore(snapshot);
+}
+
+void EthernetCodec::SetControlChannel(ControlChannel* channel) {
+  control_channel_ = channel;
+}
+
+bool EthernetCodec::HandleControlMessage(ControlMessageType type,
+                                         const uint8_t* data, size_t size) {
+  if (type != ControlMessageType::EthernetInvalidate) {
+    return false;
+  }
+
+  // Index zero always holds the broadcast address and is never sent inline.
+  if (size != 1 || data[0] == 0 || data[0] >= kAddressTableSize) {
+    LOGE("Invalid Ethernet invalidate message");
+    return true;
+  }
+
+  tx_table_.entries[data[0]].reset();
+  return true;
+}
+
+void EthernetCodec::AbandonFrame() {
+  // Restore in reverse order in case both addresses replaced the same entry.
+  for (auto undo = tx_undo_.rbegin(); undo != tx_undo_.rend(); undo++) {
+    tx_table_.entries[undo->first] = undo->second;
+  }
+
+  tx_undo_.clear();
+}
+
+void EthernetCodec::AddressTable::Reset() {
+  entries.fill(std::nullopt);
+  last_used.fill(0);
+  use_count = 0;
+  entries[0] = kBroadcastAddress;
+}
+
+std::optional<uint8_t> EthernetCodec::AddressTable::Find(
+    const MacAddress& address) {
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].has_value() && *entries[i] == address) {
+      last_used[i] = ++use_count;
+      return i;
+    }
+  }
+
+  return std::nullopt;
+}
+
+uint8_t EthernetCodec::AddressTable::Allocate() {
+  uint8_t index = 1;
+  for (size_t i = 1; i < entries.size(); i++) {
+    if (!entries[i].has_value()) {
+      return i;
+    } else if (last_used[i] < last_used[index]) {
+      index = i;
+    }
+  }
+
+  return index;
+}
+
+void EthernetCodec::AddressTable::Store(uint8_t index,
+                                        const MacAddress& address) {
+  entries[index] = address;
+  last_used[index] = ++use_count;
+}
+
+void EthernetCodec::AddressTable::Save(LinkSnapshot& snapshot) const {
+  snapshot.PutU64(use_count);
+  for (size_t i = 0; i < entries.size(); i++) {
+    snapshot.PutU8(entries[i].has_value());
+    if (entries[i].has_value()) {
+      snapshot.PutBytes(entries[i]->data(), entries[i]->size());
+    }
+
+    snapshot.PutU64(last_used[i]);
+  }
+}
+
+bool EthernetCodec::AddressTable::Restore(LinkSnapshot& snapshot) {
+  Reset();
+  if (!snapshot.GetU64(use_count)) {
+    return false;
+  }
+
+  for (size_t i = 0; i < entries.size(); i++) {
+    uint8_t has_entry;
+    if (!snapshot.GetU8(has_entry)) {
+      return false;
+    }
+
+    entries[i].reset();
+    if (has_entry) {
+      entries[i].emplace();
+      if (!snapshot.GetBytes(entries[i]->data(), entries[i]->size())) {
+        return false;
+      }
+    }
+
+    if (!snapshot.GetU64(last_used[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+FrameCodec::Result EthernetCodec::HandleArpRequest(
+    std::vector<uint8_t>& frame) {
+  const uint8_t* arp = GetArpPayload(frame);
+  if (arp == nullptr
+      || ReadBigEndianU16(&arp[kArpOperOffset]) != kArpOperRequest) {
+    return Result::Forward;
+  }
+
+  uint32_t target = ReadBigEndianU32(&arp[kArpTpaOffset]);
+  auto host = remote_hosts_.find(target);
+  if (host != remote_hosts_.end()) {
+    // Reply on behalf of the remote host without using the radio.
+    std::vector<uint8_t> reply(14 + kArpSize);
+    std::copy(&arp[kArpShaOffset], &arp[kArpShaOffset + 6], &reply[0]);
+    std::copy(host->second.begin(), host->second.end(), &reply[6]);
+    WriteBigEndianU16(&reply[12], kEthertypeArp);
+    uint8_t* reply_arp = &reply[14];
+    std::copy(std::begin(kArpHeader), std::end(kArpHeader), reply_arp);
+    WriteBigEndianU16(&reply_arp[kArpOperOffset], kArpOperReply);
+    std::copy(host->second.begin(), host->second.end(),
+        &reply_arp[kArpShaOffset]);
+    std::copy(&arp[kArpTpaOffset], &arp[kArpTpaOffset + 4],
+        &reply_arp[kArpSpaOffset]);
+    std::copy(&arp[kArpShaOffset], &arp[kArpShaOffset + 10],
+        &reply_arp[kArpThaOffset]);
+    frame.assign(reply.begin(), reply.end());
+    return Result::Reply;
+  }
+
+  uint64_t now_us = TimeNowUs();
+  auto forward_time = arp_forward_times_.find(target);
+  if (forward_time != arp_forward_times_.end()
+      && now_us - forward_time->second < kArpForwardIntervalUs) {
+    return Result::Drop;
+  }
+
+  if (arp_forward_times_.size() >= kMaxRemoteHosts) {
+    arp_forward_times_.clear();
+  }
+
+  arp_forward_times_[target] = now_us;
+  return Result::Forward;
+}
+
+void EthernetCodec::LearnArpSender(const std::vector<uint8_t>& frame) {
+  const uint8_t* arp = GetArpPayload(frame);
+  if (arp == nullptr) {
+    return;
+  }
+
+  if (remote_hosts_.size() >= kMaxRemoteHosts) {
+    remote_hosts_.clear();
+  }
+
+  MacAddress address;
+  std::copy(&arp[kArpShaOffset], &arp[kArpShaOffset + 6], address.begin());
+  remote_hosts_[ReadBigEndianU32(&arp[kArpSpaOffset])] = address;
+}
+
+bool EthernetCodec::EncodeAddress(const MacAddress& address, uint8_t& index) {
+  std::optional<uint8_t> existing_index = tx_table_.Find(address);
+  if (existing_index.has_value()) {
+    index = *existing_index;
+    return false;
+  }
+
+  index = tx_table_.Allocate();
+  tx_undo_.emplace_back(index, tx_table_.entries[index]);
+  tx_table_.Store(index, address);
+  return true;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_ETHERNET_CODEC_H_
+#define NERFNET_NET_ETHERNET_CODEC_H_
+
+#include <array>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "nerfnet/net/frame_codec.h"
+
+namespace nerfnet {
+
+// Compresses the Ethernet header of frames read from a TAP device. MAC
+// addresses are replaced with indices into tables that are learned in-band and
+// mirrored by the peer, and common ethertypes are replaced with short codes.
+// A frame between two known hosts carries a 2 byte header rather than 14.
+//
+// Broadcast and multicast frames are dropped, except for ARP requests. ARP
+// requests for hosts that have been learned from the peer are answered locally
+// and other requests are rate limited per target address.
+//
+// The compressed header is laid out as follows.
+//
+//   byte 0: 0b10 | dst inline (1 bit) | src inline (1 bit) | ethertype (4 bits)
+//   byte 1: dst index (4 bits) | src index (4 bits)
+//   dst address (6 bytes, if inline)
+//   src address (6 bytes, if inline)
+//   ethertype (2 bytes, if the ethertype code is zero)
+//
+// An inline address is stored into the supplied index of the table by the
+// receiver and can be referred to by index in subsequent frames. Entries
+// stored for a frame that is never decoded by the peer are rolled back, and
+// the receiver asks the peer to invalidate entries that it does not know.
+class EthernetCodec : public FrameCodec {
+ public:
+  // Setup the codec. Multicast frames are forwarded if forward_multicast is
+  // set.
+  explicit EthernetCodec(bool forward_multicast);
+
+  // FrameCodec methods.
+  Result Encode(std::vector<uint8_t>& frame) override;
+  bool Decode(std::vector<uint8_t>& frame) override;
+  void Reset(const LinkSession& session) override;
+  bool SaveState(LinkSnapshot& snapshot) const override;
+  bool RestoreState(LinkSnapshot& snapshot) override;
+  void SetControlChannel(ControlChannel* channel) override;
+  bool HandleControlMessage(ControlMessageType type,
+                            const uint8_t* data, size_t size) override;
+  void AbandonFrame() override;
+
+ private:
+  // The size of an Ethernet header.
+  static constexpr size_t kHeaderSize = 14;
+
+  // The number of entries in the address tables. Index zero always holds the
+  // broadcast address.
+  static constexpr size_t kAddressTableSize = 16;
+
+  // The minimum interval between forwarding ARP requests for the same target.
+  static constexpr uint64_t kArpForwardIntervalUs = 1000000;
+
+  // The maximum number of remote hosts to remember for ARP replies.
+  static constexpr size_t kMaxRemoteHosts = 256;
+
+  using MacAddress = std::array<uint8_t, 6>;
+
+  // A table of MAC addresses mirrored with the peer.
+  struct AddressTable {
+    std::array<std::optional<MacAddress>, kAddressTableSize> entries;
+    std::array<uint64_t, kAddressTableSize> last_used;
+    uint64_t use_count;
+
+    // Clears all learned entries.
+    void Reset();
+
+    // Returns the index of an address or nullopt if it is not in the table.
+    std::optional<uint8_t> Find(const MacAddress& address);
+
+    // Returns the least recently used index to store a new address in.
+    uint8_t Allocate();
+
+    // Stores an address and marks it as recently used.
+    void Store(uint8_t index, const MacAddress& address);
+
+    // Saves and restores the addresses for a new process that takes over
+    // the link.
+    void Save(LinkSnapshot& snapshot) const;
+    bool Restore(LinkSnapshot& snapshot);
+  };
+
+  // Whether to forward multicast frames.
+  const bool forward_multicast_;
+
+  // The tables of addresses sent to and received from the peer.
+  AddressTable tx_table_;
+  AddressTable rx_table_;
+
+  // The entries of the tx table replaced by the last encoded frame and their
+  // previous addresses, which are restored if the frame is abandoned.
+  std::vector<std::pair<uint8_t, std::optional<MacAddress>>> tx_undo_;
+
+  // The channel used to ask the peer to invalidate entries.
+  ControlChannel* control_channel_ = nullptr;
+
+  // IPv4 to MAC address mappings learned from ARP frames sent by the peer.
+  std::unordered_map<uint32_t, MacAddress> remote_hosts_;
+
+  // The last time an ARP request was forwarded for a given target address.
+  std::unordered_map<uint32_t, uint64_t> arp_forward_times_;
+
+  // Handles an ARP request sent by a local host.
+  Result HandleArpRequest(std::vector<uint8_t>& frame);
+
+  // Learns the sender of an ARP frame received from the peer.
+  void LearnArpSender(const std::vector<uint8_t>& frame);
+
+  // Encodes an address into the header, returning true if it is inline.
+  bool EncodeAddress(const MacAddress& address, uint8_t& index);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_ETHERNET_CODEC_H_
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_FRAME_CODEC_H_
+#define NERFNET_NET_FRAME_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "nerfnet/net/control_channel.h"
+#include "nerfnet/net/link_snapshot.h"
+#include "nerfnet/net/link_stats.h"
+
+namespace nerfnet {
+
+// The parameters of a connection, chosen by both sides of the link when the
+// connection is reset.
+struct LinkSession {
+  // Random values chosen by each side for every connection.
+  uint64_t primary_nonce = 0;
+  uint64_t secondary_nonce = 0;
+};
+
+// A transformation applied to frames as they move between the tunnel and the
+// radio. Frames are encoded when they reach the head of the transmit queue
+// and decoded once completely received, so codecs may keep state that mirrors
+// the peer as long as it is discarded on Reset.
+class FrameCodec {
+ public:
+  virtual ~FrameCodec() = default;
+
+  // The possible outcomes of encoding a frame.
+  enum class Result {
+    // The frame was encoded and should be transmitted.
+    Forward,
+
+    // The frame should be dropped without being transmitted.
+    Drop,
+
+    // The frame was replaced with a reply that should be written back to the
+    // tunnel without being transmitted.
+    Reply,
+  };
+
+  // Encodes a frame read from the tunnel in place. Codecs write their output
+  // into the frame rather than replacing it, which keeps the storage that
+  // the link allocated for it.
+  virtual Result Encode(std::vector<uint8_t>& frame) = 0;
+
+  // Decodes a frame received from the radio in place. Returns false if the
+  // frame is malformed and should be dropped.
+  virtual bool Decode(std::vector<uint8_t>& frame) = 0;
+
+  // Discards any state shared with the peer. Invoked when the connection is
+  // reset with the parameters of the new connection.
+  virtual void Reset(const LinkSession& session) = 0;
+
+  // Saves the state shared with the peer for a new process that takes over
+  // the link. Returns false if it cannot be saved, in which case the new
+  // process resets the connection. Codecs that keep no such state save
+  // nothing.
+  virtual bool SaveState(LinkSnapshot& snapshot) const { return true; }
+
+  // Restores the state saved by SaveState in a new process. Control messages
+  // may be sent to bring the peer back in step. Returns false if the state
+  // is malformed.
+  virtual bool RestoreState(LinkSnapshot& snapshot) { return true; }
+
+  // Supplies the channel used to send control messages to the peer codec.
+  // Invoked when the codec is added to a link.
+  virtual void SetControlChannel(ControlChannel* channel) {}
+
+  // Handles a control message received from the peer. Returns true if the
+  // message was consumed by this codec.
+  virtual bool HandleControlMessage(ControlMessageType type,
+                                    const uint8_t* data, size_t size) {
+    return false;
+  }
+
+  // Adds the counters kept by the codec to the stats of the link.
+  virtual void AddStats(LinkStats& stats) const {}
+
+  // Invoked when the last frame passed to Encode will not be decoded by the
+  // peer, either because a later codec dropped it or because it was abandoned
+  // after too many retransmissions. Only one frame is encoded at a time, so
+  // codecs may undo the changes that it made to state mirrored by the peer.
+  virtual void AbandonFrame() {}
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_FRAME_CODEC_H_
@@ -0,0 +1,482 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/iphc_codec.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/encoding.h"
+
+namespace nerfnet {
+namespace {
+
+// The size of an uncompressed IPv6 header.
+constexpr size_t kIPv6HeaderSize = 40;
+
+// The size of an uncompressed UDP header.
+constexpr size_t kUdpHeaderSize = 8;
+
+// The next header value for UDP.
+constexpr uint8_t kNextHeaderUdp = 17;
+
+// The dispatch bits that mark an IPHC header.
+constexpr uint8_t kDispatchMask = 0xe0;
+constexpr uint8_t kDispatch = 0x60;
+
+// The dispatch bits that mark a UDP next header encoding.
+constexpr uint8_t kUdpDispatchMask = 0xf8;
+constexpr uint8_t kUdpDispatch = 0xf0;
+
+// Fields of the IPHC header.
+constexpr uint8_t kNextHeaderFlag = 0x04;
+constexpr uint8_t kMulticastFlag = 0x08;
+
+// Hop limits that can be elided, indexed by the HLIM field.
+constexpr uint8_t kHopLimits[] = { 0, 1, 64, 255 };
+
+// The prefix of link-local addresses.
+constexpr uint8_t kLinkLocalPrefix[8] = { 0xfe, 0x80 };
+
+// The prefix of interface identifiers that can be compressed to 16 bits.
+constexpr uint8_t kShortIIDPrefix[6] = { 0x00, 0x00, 0x00, 0xff, 0xfe, 0x00 };
+
+// Returns a pointer to the next size bytes of the input and advances the
+// offset, or nullptr if the input is too short.
+const uint8_t* Consume(const std::vector<uint8_t>& input, size_t& offset,
+                       size_t size) {
+  if (offset + size > input.size()) {
+    return nullptr;
+  }
+
+  const uint8_t* data = &input[offset];
+  offset += size;
+  return data;
+}
+
+}  // anonymous namespace
+
+IphcCodec::IphcCodec(
+    uint32_t local_addr, uint32_t peer_addr,
+    const std::optional<std::array<uint8_t, 8>>& context_prefix)
+    : local_iid_(GetInterfaceID(local_addr)),
+      peer_iid_(GetInterfaceID(peer_addr)),
+      context_prefix_(context_prefix) {}
+
+std::array<uint8_t, 8> IphcCodec::GetInterfaceID(uint32_t radio_addr) {
+  return {
+    0x00, 0x00, 0x00, 0xff, 0xfe, 0x00,
+    static_cast<uint8_t>(radio_addr >> 8),
+    static_cast<uint8_t>(radio_addr),
+  };
+}
+
+FrameCodec::Result IphcCodec::Encode(std::vector<uint8_t>& frame) {
+  if (frame.empty() || (frame[0] >> 4) != 6) {
+    return Result::Forward;
+  }
+
+  if (frame.size() < kIPv6HeaderSize
+      || ReadBigEndianU16(&frame[4]) + kIPv6HeaderSize != frame.size()) {
+    return Result::Drop;
+  }
+
+  const uint8_t* header = frame.data();
+  uint8_t traffic_class = (header[0] << 4) | (header[1] >> 4);
+  uint8_t ecn = traffic_class & 0x03;
+  uint8_t dscp = traffic_class >> 2;
+  uint32_t flow_label = ((header[1] & 0x0f) << 16) | (header[2] << 8)
+      | header[3];
+  uint8_t next_header = header[6];
+  uint8_t hop_limit = header[7];
+  const uint8_t* src = &header[8];
+  const uint8_t* dst = &header[24];
+
+  std::vector<uint8_t> output(2, 0x00);
+  output.reserve(frame.size());
+  output[0] = kDispatch;
+  if (traffic_class == 0 && flow_label == 0) {
+    output[0] |= 0x18;
+  } else if (flow_label == 0) {
+    output[0] |= 0x10;
+    output.push_back((ecn << 6) | dscp);
+  } else if (dscp == 0) {
+    output[0] |= 0x08;
+    output.push_back((ecn << 6) | (flow_label >> 16));
+    AppendBigEndianU16(output, flow_label);
+  } else {
+    output.push_back((ecn << 6) | dscp);
+    output.push_back(flow_label >> 16);
+    AppendBigEndianU16(output, flow_label);
+  }
+
+  const uint8_t* udp = &header[kIPv6HeaderSize];
+  bool compress_udp = next_header == kNextHeaderUdp
+      && frame.size() >= kIPv6HeaderSize + kUdpHeaderSize
+      && ReadBigEndianU16(&udp[4]) == frame.size() - kIPv6HeaderSize;
+  if (compress_udp) {
+    output[0] |= kNextHeaderFlag;
+  } else {
+    output.push_back(next_header);
+  }
+
+  const uint8_t* hop_limit_code = std::find(std::begin(kHopLimits) + 1,
+      std::end(kHopLimits), hop_limit);
+  if (hop_limit_code != std::end(kHopLimits)) {
+    output[0] |= hop_limit_code - std::begin(kHopLimits);
+  } else {
+    output.push_back(hop_limit);
+  }
+
+  output[1] |= EncodeUnicastAddress(src, local_iid_, output) << 4;
+  if (dst[0] == 0xff) {
+    output[1] |= kMulticastFlag | EncodeMulticastAddress(dst, output);
+  } else {
+    output[1] |= EncodeUnicastAddress(dst, peer_iid_, output);
+  }
+
+  size_t payload_offset = kIPv6HeaderSize;
+  if (compress_udp) {
+    uint16_t src_port = ReadBigEndianU16(&udp[0]);
+    uint16_t dst_port = ReadBigEndianU16(&udp[2]);
+    size_t udp_dispatch_offset = output.size();
+    output.push_back(kUdpDispatch);
+    if ((src_port & 0xfff0) == 0xf0b0 && (dst_port & 0xfff0) == 0xf0b0) {
+      output[udp_dispatch_offset] |= 0x03;
+      output.push_back(((src_port & 0x0f) << 4) | (dst_port & 0x0f));
+    } else if ((src_port & 0xff00) == 0xf000) {
+      output[udp_dispatch_offset] |= 0x02;
+      output.push_back(src_port);
+      AppendBigEndianU16(output, dst_port);
+    } else if ((dst_port & 0xff00) == 0xf000) {
+      output[udp_dispatch_offset] |= 0x01;
+      AppendBigEndianU16(output, src_port);
+      output.push_back(dst_port);
+    } else {
+      AppendBigEndianU16(output, src_port);
+      AppendBigEndianU16(output, dst_port);
+    }
+
+    // The checksum is always carried inline.
+    output.insert(output.end(), &udp[6], &udp[8]);
+    payload_offset += kUdpHeaderSize;
+  }
+
+  output.insert(output.end(), frame.begin() + payload_offset, frame.end());
+  frame.assign(output.begin(), output.end());
+  return Result::Forward;
+}
+
+bool IphcCodec::Decode(std::vector<uint8_t>& frame) {
+  if (frame.empty() || (frame[0] & kDispatchMask) != kDispatch) {
+    return true;
+  } else if (frame.size() < 2) {
+    return false;
+  }
+
+  uint8_t iphc[2] = { frame[0], frame[1] };
+  size_t offset = 2;
+  uint8_t header[kIPv6HeaderSize] = {};
+
+  uint8_t ecn = 0;
+  uint8_t dscp = 0;
+  uint32_t flow_label = 0;
+  const uint8_t* field = nullptr;
+  switch ((iphc[0] >> 3) & 0x03) {
+    case 0:
+      field = Consume(frame, offset, 4);
+      if (field == nullptr) {
+        return false;
+      }
+
+      ecn = field[0] >> 6;
+      dscp = field[0] & 0x3f;
+      flow_label = ((field[1] & 0x0f) << 16) | ReadBigEndianU16(&field[2]);
+      break;
+    case 1:
+      field = Consume(frame, offset, 3);
+      if (field == nullptr) {
+        return false;
+      }
+
+      ecn = field[0] >> 6;
+      flow_label = ((field[0] & 0x0f) << 16) | ReadBigEndianU16(&field[1]);
+      break;
+    case 2:
+      field = Consume(frame, offset, 1);
+      if (field == nullptr) {
+        return false;
+      }
+
+      ecn = field[0] >> 6;
+      dscp = field[0] & 0x3f;
+      break;
+  }
+
+  uint8_t traffic_class = (dscp << 2) | ecn;
+  header[0] = 0x60 | (traffic_class >> 4);
+  header[1] = (traffic_class << 4) | (flow_label >> 16);
+  WriteBigEndianU16(&header[2], flow_label);
+
+  bool compressed_udp = iphc[0] & kNextHeaderFlag;
+  if (compressed_udp) {
+    header[6] = kNextHeaderUdp;
+  } else {
+    field = Consume(frame, offset, 1);
+    if (field == nullptr) {
+      return false;
+    }
+
+    header[6] = field[0];
+  }
+
+  uint8_t hop_limit_code = iphc[0] & 0x03;
+  if (hop_limit_code != 0) {
+    header[7] = kHopLimits[hop_limit_code];
+  } else {
+    field = Consume(frame, offset, 1);
+    if (field == nullptr) {
+      return false;
+    }
+
+    header[7] = field[0];
+  }
+
+  if (!DecodeUnicastAddress((iphc[1] >> 4) & 0x07, peer_iid_, frame, offset,
+                            &header[8])) {
+    return false;
+  }
+
+  if (iphc[1] & kMulticastFlag) {
+    if (!DecodeMulticastAddress(iphc[1] & 0x07, frame, offset, &header[24])) {
+      return false;
+    }
+  } else if (!DecodeUnicastAddress(iphc[1] & 0x07, local_iid_, frame, offset,
+                                   &header[24])) {
+    return false;
+  }
+
+  uint8_t udp[kUdpHeaderSize];
+  if (compressed_udp) {
+    field = Consume(frame, offset, 1);
+    if (field == nullptr || (field[0] & kUdpDispatchMask) != kUdpDispatch
+        || (field[0] & 0x04) != 0) {
+      return false;
+    }
+
+    uint8_t ports_mode = field[0] & 0x03;
+    const size_t kPortsSizes[] = { 4, 3, 3, 1 };
+    const uint8_t* ports = Consume(frame, offset, kPortsSizes[ports_mode]);
+    const uint8_t* checksum = Consume(frame, offset, 2);
+    if (ports == nullptr || checksum == nullptr) {
+      return false;
+    }
+
+    uint16_t src_port, dst_port;
+    switch (ports_mode) {
+      case 0:
+        src_port = ReadBigEndianU16(&ports[0]);
+        dst_port = ReadBigEndianU16(&ports[2]);
+        break;
+      case 1:
+        src_port = ReadBigEndianU16(&ports[0]);
+        dst_port = 0xf000 | ports[2];
+        break;
+      case 2:
+        src_port = 0xf000 | ports[0];
+        dst_port = ReadBigEndianU16(&ports[1]);
+        break;
+      default:
+        src_port = 0xf0b0 | (ports[0] >> 4);
+        dst_port = 0xf0b0 | (ports[0] & 0x0f);
+        break;
+    }
+
+    WriteBigEndianU16(&udp[0], src_port);
+    WriteBigEndianU16(&udp[2], dst_port);
+    WriteBigEndianU16(&udp[4], frame.size() - offset + kUdpHeaderSize);
+    udp[6] = checksum[0];
+    udp[7] = checksum[1];
+  }
+
+  size_t payload_size = frame.size() - offset
+      + (compressed_udp ? kUdpHeaderSize : 0);
+  if (payload_size > UINT16_MAX) {
+    return false;
+  }
+
+  WriteBigEndianU16(&header[4], payload_size);
+  std::vector<uint8_t> output;
+  output.reserve(kIPv6HeaderSize + payload_size);
+  output.insert(output.end(), std::begin(header), std::end(header));
+  if (compressed_udp) {
+    output.insert(output.end(), std::begin(udp), std::end(udp));
+  }
+
+  output.insert(output.end(), frame.begin() + offset, frame.end());
+  frame.assign(output.begin(), output.end());
+  return true;
+}
+
+uint8_t IphcCodec::EncodeUnicastAddress(const uint8_t* address,
+                                        const InterfaceID& iid,
+                                        std::vector<uint8_t>& output) const {
+  if (std::all_of(address, address + 16, [](uint8_t b) { return b == 0; })) {
+    // The unspecified address.
+    return 0x04;
+  }
+
+  uint8_t context = 0x00;
+  if (std::equal(address, address + 8, std::begin(kLinkLocalPrefix))) {
+    context = 0x00;
+  } else if (context_prefix_.has_value()
+      && std::equal(address, address + 8, context_prefix_->begin())) {
+    context = 0x04;
+  } else {
+    output.insert(output.end(), address, address + 16);
+    return 0x00;
+  }
+
+  const uint8_t* address_iid = address + 8;
+  if (std::equal(address_iid, address_iid + 8, iid.begin())) {
+    return context | 0x03;
+  } else if (std::equal(std::begin(kShortIIDPrefix), std::end(kShortIIDPrefix),
+                        address_iid)) {
+    output.insert(output.end(), address_iid + 6, address_iid + 8);
+    return context | 0x02;
+  }
+
+  output.insert(output.end(), address_iid, address_iid + 8);
+  return context | 0x01;
+}
+
+uint8_t IphcCodec::EncodeMulticastAddress(const uint8_t* address,
+                                          std::vector<uint8_t>& output) const {
+  auto is_zero = [address](size_t start, size_t end) {
+    return std::all_of(address + start, address + end,
+        [](uint8_t b) { return b == 0; });
+  };
+
+  if (address[1] == 0x02 && is_zero(2, 15)) {
+    // ff02::00XX
+    output.push_back(address[15]);
+    return 0x03;
+  } else if (is_zero(2, 13)) {
+    // ffXX::00XX:XXXX
+    output.push_back(address[1]);
+    output.insert(output.end(), address + 13, address + 16);
+    return 0x02;
+  } else if (is_zero(2, 11)) {
+    // ffXX::00XX:XXXX:XXXX
+    output.push_back(address[1]);
+    output.insert(output.end(), address + 11, address + 16);
+    return 0x01;
+  }
+
+  output.insert(output.end(), address, address + 16);
+  return 0x00;
+}
+
+bool IphcCodec::DecodeUnicastAddress(uint8_t mode, const InterfaceID& iid,
+                                     const std::vector<uint8_t>& input,
+                                     size_t& offset, uint8_t* address) const {
+  std::fill(address, address + 16, 0x00);
+  bool stateful = mode & 0x04;
+  uint8_t address_mode = mode & 0x03;
+  if (address_mode == 0) {
+    if (stateful) {
+      // The unspecified address.
+      return true;
+    }
+
+    const uint8_t* field = Consume(input, offset, 16);
+    if (field == nullptr) {
+      return false;
+    }
+
+    std::copy(field, field + 16, address);
+    return true;
+  }
+
+  if (stateful) {
+    if (!context_prefix_.has_value()) {
+      return false;
+    }
+
+    std::copy(context_prefix_->begin(), context_prefix_->end(), address);
+  } else {
+    std::copy(std::begin(kLinkLocalPrefix), std::end(kLinkLocalPrefix),
+        address);
+  }
+
+  uint8_t* address_iid = address + 8;
+  if (address_mode == 3) {
+    std::copy(iid.begin(), iid.end(), address_iid);
+  } else if (address_mode == 2) {
+    const uint8_t* field = Consume(input, offset, 2);
+    if (field == nullptr) {
+      return false;
+    }
+
+    std::copy(std::begin(kShortIIDPrefix), std::end(kShortIIDPrefix),
+        address_iid);
+    address_iid[6] = field[0];
+    address_iid[7] = field[1];
+  } else {
+    const uint8_t* field = Consume(input, offset, 8);
+    if (field == nullptr) {
+      return false;
+    }
+
+    std::copy(field, field + 8, address_iid);
+  }
+
+  return true;
+}
+
+bool IphcCodec::DecodeMulticastAddress(uint8_t mode,
+                                       const std::vector<uint8_t>& input,
+                                       size_t& offset,
+                                       uint8_t* address) const {
+  const size_t kFieldSizes[] = { 16, 6, 4, 1 };
+  const uint8_t* field = Consume(input, offset, kFieldSizes[mode]);
+  if (field == nullptr) {
+    return false;
+  }
+
+  std::fill(address, address + 16, 0x00);
+  address[0] = 0xff;
+  switch (mode) {
+    case 0:
+      std::copy(field, field + 16, address);
+      break;
+    case 1:
+      address[1] = field[0];
+      std::copy(field + 1, field + 6, address + 11);
+      break;
+    case 2:
+      address[1] = field[0];
+      std::copy(field + 1, field + 4, address + 13);
+      break;
+    case 3:
+      address[1] = 0x02;
+      address[15] = field[0];
+      break;
+  }
+
+  return true;
+}
+
+}  // namespace nerfnet
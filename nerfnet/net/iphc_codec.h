@@ -0,0 +1,84 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_IPHC_CODEC_H_
+#define NERFNET_NET_IPHC_CODEC_H_
+
+#include <array>
+#include <optional>
+
+#include "nerfnet/net/frame_codec.h"
+
+namespace nerfnet {
+
+// Compresses IPv6 headers using the IPHC encoding from RFC 6282, as used by
+// 6LoWPAN. The traffic class, flow label, hop limit and next header fields are
+// elided when they take common values and UDP headers are compressed with the
+// UDP next header encoding, carrying the checksum inline. Link-local addresses
+// and addresses within the shared context prefix are compressed to 8 or 2
+// bytes, or elided entirely when the interface identifier is derived from the
+// radio address of the sender or receiver. IPv4 packets are passed through
+// unmodified.
+class IphcCodec : public FrameCodec {
+ public:
+  // Setup the codec with the radio addresses of this side of the link and the
+  // peer, and an optional /64 prefix shared by both sides to use as context 0.
+  IphcCodec(uint32_t local_addr, uint32_t peer_addr,
+            const std::optional<std::array<uint8_t, 8>>& context_prefix);
+
+  // Returns the interface identifier that is elided for the supplied radio
+  // address, of the form 0000:00ff:fe00:XXXX.
+  static std::array<uint8_t, 8> GetInterfaceID(uint32_t radio_addr);
+
+  // FrameCodec methods.
+  Result Encode(std::vector<uint8_t>& frame) override;
+  bool Decode(std::vector<uint8_t>& frame) override;
+  void Reset(const LinkSession& session) override {}
+
+ private:
+  using InterfaceID = std::array<uint8_t, 8>;
+
+  // The interface identifiers derived from the radio addresses.
+  const InterfaceID local_iid_;
+  const InterfaceID peer_iid_;
+
+  // The prefix of context 0, if configured.
+  const std::optional<std::array<uint8_t, 8>> context_prefix_;
+
+  // Encodes a unicast address, returning the address compression bits (AC in
+  // bit 2 and AM in bits 0-1) and appending any inline bytes.
+  uint8_t EncodeUnicastAddress(const uint8_t* address, const InterfaceID& iid,
+                               std::vector<uint8_t>& output) const;
+
+  // Encodes a multicast destination address, returning the DAM bits and
+  // appending any inline bytes.
+  uint8_t EncodeMulticastAddress(const uint8_t* address,
+                                 std::vector<uint8_t>& output) const;
+
+  // Decodes a unicast address given its address compression bits. Returns
+  // false if the input is too short or the encoding is invalid.
+  bool DecodeUnicastAddress(uint8_t mode, const InterfaceID& iid,
+                            const std::vector<uint8_t>& input, size_t& offset,
+                            uint8_t* address) const;
+
+  // Decodes a multicast destination address given its DAM bits.
+  bool DecodeMulticastAddress(uint8_t mode, const std::vector<uint8_t>& input,
+                              size_t& offset, uint8_t* address) const;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_IPHC_CODEC_H_
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/link_handover.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+namespace {
+
+// The offsets of the size of the state, whether a tunnel is passed and the
+// name of the link in the message that starts each link.
+constexpr size_t kStateSizeOffset = 0;
+constexpr size_t kHasTunnelOffset = 4;
+constexpr size_t kNameOffset = 5;
+
+// Returns the address of the socket at the supplied path. Quits and logs the
+// error if the path is too long.
+struct sockaddr_un GetSocketAddress(const std::string& path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  CHECK(path.size() < sizeof(address.sun_path),
+      "Socket path '%s' is too long", path.c_str());
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+// Opens a socket listening at the supplied path. Quits and logs the error on
+// failure.
+int OpenListeningSocket(const std::string& path) {
+  struct sockaddr_un address = GetSocketAddress(path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  CHECK(fd >= 0, "Failed to open socket: %s (%d)", strerror(errno), errno);
+  unlink(path.c_str());
+  CHECK(bind(fd, reinterpret_cast<struct sockaddr*>(&address),
+      sizeof(address)) == 0, "Failed to bind socket '%s': %s (%d)",
+      path.c_str(), strerror(errno), errno);
+  CHECK(listen(fd, 1) == 0, "Failed to listen on socket: %s (%d)",
+      strerror(errno), errno);
+  return fd;
+}
+
+}  // anonymous namespace
+
+LinkHandover::LinkHandover(const std::string& path)
+    : path_(path),
+      socket_fd_(OpenListeningSocket(path)),
+      client_fd_(-1) {}
+
+LinkHandover::~LinkHandover() {
+  // The socket is removed before the new process is told that this one is
+  // exiting, since it listens at the same path once it has taken over.
+  unlink(path_.c_str());
+  close(socket_fd_);
+  if (client_fd_ >= 0) {
+    close(client_fd_);
+  }
+}
+
+bool LinkHandover::IsRequested() {
+  if (client_fd_ >= 0) {
+    return true;
+  }
+
+  struct pollfd socket_poll = {socket_fd_, POLLIN, 0};
+  if (poll(&socket_poll, 1, 0) <= 0) {
+    return false;
+  }
+
+  client_fd_ = accept(socket_fd_, nullptr, nullptr);
+  if (client_fd_ < 0) {
+    LOGE("Failed to accept handover: %s (%d)", strerror(errno), errno);
+    return false;
+  }
+
+  LOGI("Handing links over to a new process");
+  return true;
+}
+
+bool LinkHandover::Send(const std::vector<Link>& links) {
+  CHECK(client_fd_ >= 0, "No process to hand links over to");
+  std::vector<uint8_t> message(4);
+  WriteBigEndianU32(message.data(), links.size());
+  if (!SendMessage(client_fd_, message, -1)) {
+    return Disconnect();
+  }
+
+  for (const auto& link : links) {
+    message.resize(kNameOffset);
+    WriteBigEndianU32(&message[kStateSizeOffset], link.state.size());
+    message[kHasTunnelOffset] = link.tunnel_fd >= 0;
+    message.insert(message.end(), link.name.begin(), link.name.end());
+    if (!SendMessage(client_fd_, message, link.tunnel_fd)) {
+      return Disconnect();
+    }
+
+    for (size_t offset = 0; offset < link.state.size();
+         offset += kMaxChunkSize) {
+      size_t size = std::min(kMaxChunkSize, link.state.size() - offset);
+      message.assign(&link.state[offset], &link.state[offset + size]);
+      if (!SendMessage(client_fd_, message, -1)) {
+        return Disconnect();
+      }
+    }
+  }
+
+  LOGI("Handed over %zu links", links.size());
+  return true;
+}
+
+bool LinkHandover::Receive(const std::string& path,
+                           std::vector<Link>& links) {
+  struct sockaddr_un address = GetSocketAddress(path);
+  int socket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (socket_fd < 0) {
+    LOGE("Failed to open socket: %s (%d)", strerror(errno), errno);
+    return false;
+  }
+
+  if (connect(socket_fd, reinterpret_cast<struct sockaddr*>(&address),
+        sizeof(address)) != 0) {
+    LOGE("Failed to connect to handover socket '%s': %s (%d)",
+        path.c_str(), strerror(errno), errno);
+    close(socket_fd);
+    return false;
+  }
+
+  std::vector<uint8_t> message;
+  int fd = -1;
+  bool success = ReceiveMessage(socket_fd, message, fd, kReceiveTimeoutMs)
+      && message.size() == 4;
+  uint32_t link_count = success ? ReadBigEndianU32(message.data()) : 0;
+  for (uint32_t i = 0; success && i < link_count; i++) {
+    fd = -1;
+    success = ReceiveMessage(socket_fd, message, fd, kReceiveTimeoutMs)
+        && message.size() >= kNameOffset
+        && (message[kHasTunnelOffset] != 0) == (fd >= 0);
+    if (!success) {
+      if (fd >= 0) {
+        close(fd);
+      }
+
+      break;
+    }
+
+    links.emplace_back();
+    Link& link = links.back();
+    link.name.assign(message.begin() + kNameOffset, message.end());
+    link.tunnel_fd = fd;
+    size_t state_size = ReadBigEndianU32(&message[kStateSizeOffset]);
+    while (success && link.state.size() < state_size) {
+      fd = -1;
+      success = ReceiveMessage(socket_fd, message, fd, kReceiveTimeoutMs)
+          && fd < 0 && link.state.size() + message.size() <= state_size;
+      link.state.insert(link.state.end(), message.begin(), message.end());
+    }
+  }
+
+  // The radios are only free once the running process has exited, which
+  // closes the connection without sending anything more.
+  if (success) {
+    LOGI("Received %zu links, waiting for the running process to exit",
+        links.size());
+    struct pollfd socket_poll = {socket_fd, POLLIN, 0};
+    uint8_t byte;
+    success = poll(&socket_poll, 1, kExitTimeoutMs) > 0
+        && recv(socket_fd, &byte, sizeof(byte), 0) == 0;
+    if (!success) {
+      LOGE("The running process did not exit");
+    }
+  } else {
+    LOGE("Failed to receive links from the running process");
+  }
+
+  close(socket_fd);
+  if (!success) {
+    for (const auto& link : links) {
+      if (link.tunnel_fd >= 0) {
+        close(link.tunnel_fd);
+      }
+    }
+
+    links.clear();
+  }
+
+  return success;
+}
+
+bool LinkHandover::SendMessage(int socket_fd,
+                               const std::vector<uint8_t>& message, int fd) {
+  struct iovec iov = {};
+  iov.iov_base = const_cast<uint8_t*>(message.data());
+  iov.iov_len = message.size();
+
+  struct msghdr header = {};
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+
+  // The control buffer is aligned as required for a cmsghdr.
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control = {};
+  if (fd >= 0) {
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  if (sendmsg(socket_fd, &header, MSG_NOSIGNAL)
+      != static_cast<ssize_t>(message.size())) {
+    LOGE("Failed to send handover message: %s (%d)", strerror(errno), errno);
+    return false;
+  }
+
+  return true;
+}
+
+bool LinkHandover::ReceiveMessage(int socket_fd,
+                                  std::vector<uint8_t>& message, int& fd,
+                                  int timeout_ms) {
+  message.clear();
+  struct pollfd socket_poll = {socket_fd, POLLIN, 0};
+  int result = poll(&socket_poll, 1, timeout_ms);
+  if (result <= 0) {
+    LOGE("Timed out waiting for handover message");
+    return false;
+  }
+
+  message.resize(kMaxChunkSize);
+  struct iovec iov = {};
+  iov.iov_base = message.data();
+  iov.iov_len = message.size();
+
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control = {};
+  struct msghdr header = {};
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control.buffer;
+  header.msg_controllen = sizeof(control.buffer);
+
+  ssize_t size = recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC);
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&header, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+
+  if (size <= 0 || (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+    message.clear();
+    if (size < 0) {
+      LOGE("Failed to receive handover message: %s (%d)",
+          strerror(errno), errno);
+    }
+
+    return false;
+  }
+
+  message.resize(size);
+  return true;
+}
+
+bool LinkHandover::Disconnect() {
+  LOGE("Failed to hand links over");
+  close(client_fd_);
+  client_fd_ = -1;
+  return false;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_LINK_HANDOVER_H_
+#define NERFNET_NET_LINK_HANDOVER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// Hands the links of a running process over to a new process over a unix
+// socket, so that the binary can be upgraded without resetting the
+// connections. The running process listens on the socket and, once a new
+// process connects, passes it the tunnel of each link and the state saved
+// from it. The new process waits for the running process to exit before it
+// takes over the radios.
+class LinkHandover : public NonCopyable {
+ public:
+  // A link that is handed over.
+  struct Link {
+    // The name of the link.
+    std::string name;
+
+    // The tunnel of the link, or negative if the link has no tunnel.
+    int tunnel_fd = -1;
+
+    // The state saved from the link, which is empty if the link could not
+    // save its state and must reset its connection.
+    std::vector<uint8_t> state;
+  };
+
+  // Listens on the socket at the supplied path, replacing any stale socket.
+  // Quits and logs the error on failure.
+  explicit LinkHandover(const std::string& path);
+  ~LinkHandover();
+
+  // Returns true once a new process has connected to take over the links.
+  // Does not block.
+  bool IsRequested();
+
+  // Sends the links to the new process. The connection is held open until
+  // this object is destroyed, which tells the new process that the radios
+  // are free. Returns false on failure.
+  bool Send(const std::vector<Link>& links);
+
+  // Connects to the process listening at the supplied path, receives its
+  // links and waits for it to exit. The tunnels received are owned by the
+  // caller. Returns false on failure.
+  static bool Receive(const std::string& path, std::vector<Link>& links);
+
+ private:
+  // The largest piece of state sent in one message.
+  static constexpr size_t kMaxChunkSize = 65536;
+
+  // The time allowed for the running process to send its links and to exit
+  // once it has sent them.
+  static constexpr int kReceiveTimeoutMs = 5000;
+  static constexpr int kExitTimeoutMs = 10000;
+
+  // The path of the socket, the socket listened on and the connection to
+  // the new process, or negative if not connected.
+  const std::string path_;
+  const int socket_fd_;
+  int client_fd_;
+
+  // Sends a message, passing a file descriptor with it if fd is not
+  // negative. Returns false on failure.
+  static bool SendMessage(int socket_fd, const std::vector<uint8_t>& message,
+                          int fd);
+
+  // Receives a message within the timeout, storing any file descriptor
+  // passed with it in fd. Returns false on failure or if the peer has closed
+  // the connection.
+  static bool ReceiveMessage(int socket_fd, std::vector<uint8_t>& message,
+                             int& fd, int timeout_ms);
+
+  // Closes the connection to the new process after a failed handover.
+  // Returns false.
+  bool Disconnect();
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_LINK_HANDOVER_H_
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/link_manager.h"
+
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/resource.h>
+
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+
+LinkManager::LinkManager(uint64_t stats_interval_us,
+                         const std::string& stats_path)
+    : stats_interval_us_(stats_interval_us),
+      stats_path_(stats_path),
+      next_handover_check_us_(0),
+      next_channel_report_us_(0),
+      next_channel_assignment_us_(0),
+      tdma_address_(0),
+      superframe_us_(0),
+      superframe_start_us_(0),
+      next_slot_(0),
+      wake_pending_(false) {}
+
+void LinkManager::AddLink(const std::string& name,
+                          std::unique_ptr<RadioInterface> radio_interface,
+                          bool scheduled) {
+  radio_interface->SetWakeCallback([this]() { Wake(); });
+  if (scheduled) {
+    for (size_t index : scheduled_links_) {
+      CHECK(links_[index].radio_interface->GetLinkID()
+          != radio_interface->GetLinkID(),
+          "Links '%s' and '%s' have the same TDMA link ID 0x%02x",
+          links_[index].name.c_str(), name.c_str(),
+          radio_interface->GetLinkID());
+    }
+
+    scheduled_links_.push_back(links_.size());
+  }
+
+  Link link;
+  link.name = name;
+  link.radio_interface = std::move(radio_interface);
+  link.scheduled = scheduled;
+  links_.push_back(std::move(link));
+}
+
+void LinkManager::EnableTdma(uint32_t beacon_address,
+                             uint64_t superframe_us) {
+  tdma_address_ = beacon_address;
+  superframe_us_ = superframe_us;
+}
+
+void LinkManager::SetChannelPlanClient(
+    std::unique_ptr<ChannelPlanClient> client) {
+  channel_plan_client_ = std::move(client);
+}
+
+void LinkManager::SetHandover(std::unique_ptr<LinkHandover> handover) {
+  handover_ = std::move(handover);
+}
+
+void LinkManager::Run() {
+  CHECK(!links_.empty(), "No links to run");
+  CHECK(scheduled_links_.empty() || superframe_us_ != 0,
+      "Scheduled links need TDMA to be enabled");
+
+  uint64_t next_stats_us = TimeNowUs() + stats_interval_us_;
+  while (1) {
+    uint64_t now_us = TimeNowUs();
+    uint64_t next_poll_us = now_us + kMaxSleepUs;
+    if (!scheduled_links_.empty()) {
+      next_poll_us = std::min(next_poll_us, ServiceTdma(now_us));
+      now_us = TimeNowUs();
+    }
+
+    for (auto& link : links_) {
+      if (!link.scheduled) {
+        next_poll_us = std::min(next_poll_us,
+            link.radio_interface->Poll(now_us));
+      }
+    }
+
+    if (stats_interval_us_ != 0 && now_us >= next_stats_us) {
+      ReportStats();
+      next_stats_us = now_us + stats_interval_us_;
+    }
+
+    if (channel_plan_client_ != nullptr
+        && now_us >= next_channel_assignment_us_) {
+      ServiceChannelPlan(now_us);
+      next_channel_assignment_us_ = now_us + kChannelAssignmentIntervalUs;
+    }
+
+    if (handover_ != nullptr && now_us >= next_handover_check_us_) {
+      if (handover_->IsRequested() && HandOver()) {
+        return;
+      }
+
+      next_handover_check_us_ = now_us + kHandoverCheckIntervalUs;
+    }
+
+    SleepUntil(next_poll_us);
+  }
+}
+
+bool LinkManager::HandOver() {
+  for (auto& link : links_) {
+    link.radio_interface->StopTunnel();
+  }
+
+  // A link that cannot save its state is handed over without it and resets
+  // its connection in the new process.
+  std::vector<LinkHandover::Link> handover_links;
+  for (auto& link : links_) {
+    handover_links.emplace_back();
+    LinkHandover::Link& handover_link = handover_links.back();
+    handover_link.name = link.name;
+    handover_link.tunnel_fd = link.radio_interface->GetTunnelFd();
+    LinkSnapshot snapshot;
+    if (link.radio_interface->SaveState(snapshot)) {
+      handover_link.state = snapshot.GetData();
+    } else {
+      LOGE("Failed to save the state of link '%s'", link.name.c_str());
+    }
+  }
+
+  if (!handover_->Send(handover_links)) {
+    for (auto& link : links_) {
+      link.radio_interface->StartTunnel();
+    }
+
+    return false;
+  }
+
+  return true;
+}
+
+void LinkManager::Wake() {
+  {
+    std::lock_guard<std::mutex> lock(wake_mutex_);
+    wake_pending_ = true;
+  }
+
+  wake_cv_.notify_one();
+}
+
+void LinkManager::SleepUntil(uint64_t time_us) {
+  uint64_t now_us = TimeNowUs();
+  std::unique_lock<std::mutex> lock(wake_mutex_);
+  if (!wake_pending_ && time_us > now_us) {
+    wake_cv_.wait_for(lock, std::chrono::microseconds(time_us - now_us),
+        [this]() { return wake_pending_; });
+  }
+
+  wake_pending_ = false;
+}
+
+void LinkManager::ReportStats() {
+  FILE* stats_file = nullptr;
+  if (!stats_path_.empty()) {
+    stats_file = fopen(stats_path_.c_str(), "w");
+    if (stats_file == nullptr) {
+      LOGE("Failed to open stats file '%s': %s (%d)",
+          stats_path_.c_str(), strerror(errno), errno);
+    }
+  }
+
+  for (const auto& link : links_) {
+    std::string stats = link.radio_interface->GetStats().ToString();
+    LOGI("link '%s': %s", link.name.c_str(), stats.c_str());
+    if (stats_file != nullptr) {
+      fprintf(stats_file, "link=%s %s\n", link.name.c_str(), stats.c_str());
+    }
+  }
+
+  // The peak resident set size covers the whole process, including the
+  // links of any other manager in it.
+  struct rusage usage = {};
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    LOGI("process: peak_rss_kb=%ld", usage.ru_maxrss);
+    if (stats_file != nullptr) {
+      fprintf(stats_file, "process peak_rss_kb=%ld\n", usage.ru_maxrss);
+    }
+  }
+
+  if (stats_file != nullptr) {
+    fclose(stats_file);
+  }
+}
+
+void LinkManager::ServiceChannelPlan(uint64_t now_us) {
+  if (now_us >= next_channel_report_us_) {
+    next_channel_report_us_ = now_us + kChannelReportIntervalUs;
+    for (auto& link : links_) {
+      LinkStats stats = link.radio_interface->GetStats();
+      uint64_t transfers = stats.transfers - link.reported_transfers;
+      uint64_t failures =
+          stats.transfer_failures - link.reported_transfer_failures;
+      uint32_t loss_ppm = (transfers + failures == 0)
+          ? 0 : failures * 1000000 / (transfers + failures);
+      if (!channel_plan_client_->Report(link.name,
+            link.radio_interface->GetChannel(), loss_ppm)) {
+        break;
+      }
+
+      link.reported_transfers = stats.transfers;
+      link.reported_transfer_failures = stats.transfer_failures;
+    }
+  }
+
+  for (const auto& assignment : channel_plan_client_->ReceiveAssignments()) {
+    for (auto& link : links_) {
+      if (link.name == assignment.name) {
+        LOGI("Moving link '%s' to channel %u", link.name.c_str(),
+            assignment.channel);
+        link.radio_interface->RequestChannel(assignment.channel);
+      }
+    }
+  }
+}
+
+uint64_t LinkManager::ServiceTdma(uint64_t now_us) {
+  // Superframes follow each other on a fixed grid that secondaries can
+  // predict, even if the beacon goes out late, unless the loop has fallen a
+  // whole superframe behind.
+  uint64_t superframe_end_us =
+      superframe_start_us_ + schedule_.GetSuperframeUs();
+  if (now_us >= superframe_end_us) {
+    StartSuperframe((superframe_start_us_ == 0
+        || now_us >= superframe_end_us + schedule_.GetSuperframeUs())
+        ? now_us : superframe_end_us);
+  }
+
+  // Slots are served in order at their planned times. A slot that is
+  // reached late is cut short rather than delaying the ones after it.
+  const auto& slots = schedule_.GetSlots();
+  while (next_slot_ < slots.size()) {
+    const auto& slot = slots[next_slot_];
+    uint64_t slot_start_us = superframe_start_us_ + slot.offset_us;
+    uint64_t slot_end_us = slot_start_us + slot.length_us;
+    if (now_us < slot_start_us) {
+      return slot_start_us;
+    }
+
+    if (now_us < slot_end_us) {
+      links_[scheduled_links_[next_slot_]].radio_interface->PollSlot(
+          now_us, slot_end_us);
+      now_us = TimeNowUs();
+    }
+
+    next_slot_++;
+  }
+
+  return superframe_start_us_ + schedule_.GetSuperframeUs();
+}
+
+void LinkManager::StartSuperframe(uint64_t start_us) {
+  std::vector<uint8_t> link_ids;
+  std::vector<size_t> backlogs;
+  for (size_t index : scheduled_links_) {
+    RadioInterface& radio_interface = *links_[index].radio_interface;
+    link_ids.push_back(radio_interface.GetLinkID());
+    backlogs.push_back(radio_interface.GetBacklog()
+        * radio_interface.GetWeight());
+  }
+
+  schedule_ = TdmaSchedule::Plan(superframe_us_, link_ids, backlogs);
+  superframe_start_us_ = start_us;
+  next_slot_ = 0;
+  links_[scheduled_links_.front()].radio_interface->SendTdmaBeacon(
+      tdma_address_, schedule_.EncodeBeacon(start_us));
+}
+
+}  // namespace nerfnet
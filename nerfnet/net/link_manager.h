@@ -0,0 +1,166 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_LINK_MANAGER_H_
+#define NERFNET_NET_LINK_MANAGER_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nerfnet/net/channel_plan_client.h"
+#include "nerfnet/net/link_handover.h"
+#include "nerfnet/net/radio_interface.h"
+#include "nerfnet/net/tdma_schedule.h"
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// Services a collection of radio links from a single event loop. Each link is
+// polled when its next service time arrives and the loop sleeps in between,
+// so CPU usage scales with traffic rather than with the number of links.
+class LinkManager : public NonCopyable {
+ public:
+  // Setup the link manager. Stats are logged for every link each
+  // stats_interval_us if non-zero, and also written to stats_path if it is
+  // not empty.
+  LinkManager(uint64_t stats_interval_us, const std::string& stats_path);
+
+  // Adds a link to be serviced by this manager. A scheduled link is a
+  // primary link that is served in its slot of the TDMA cell rather than
+  // polled on its own.
+  void AddLink(const std::string& name,
+               std::unique_ptr<RadioInterface> radio_interface,
+               bool scheduled = false);
+
+  // Serves the scheduled links in turn in slots of a repeating superframe,
+  // which starts with a beacon that the first scheduled link broadcasts to
+  // beacon_address. Each link gets a slot in every superframe and the rest
+  // is shared out by the bytes waiting on each link. Must be called before
+  // the event loop is run.
+  void EnableTdma(uint32_t beacon_address, uint64_t superframe_us);
+
+  // Reports the channel and loss of every link to a channel plan server and
+  // moves links to the channels that it assigns. Must be called before the
+  // event loop is run.
+  void SetChannelPlanClient(std::unique_ptr<ChannelPlanClient> client);
+
+  // Hands the links over to a new process that connects to the handover
+  // socket. Must be called before the event loop is run.
+  void SetHandover(std::unique_ptr<LinkHandover> handover);
+
+  // Runs the event loop. Only returns once the links have been handed over
+  // to a new process, after which they must not be serviced again.
+  void Run();
+
+  // Wakes the event loop to service links immediately. Safe to call from any
+  // thread.
+  void Wake();
+
+ private:
+  // The maximum amount of time to sleep between polls of the links.
+  static constexpr uint64_t kMaxSleepUs = 100000;
+
+  // The interval to report links to the channel plan server at and the
+  // interval to check for channel assignments at.
+  static constexpr uint64_t kChannelReportIntervalUs = 5000000;
+  static constexpr uint64_t kChannelAssignmentIntervalUs = 100000;
+
+  // The interval to check for a new process taking over the links at.
+  static constexpr uint64_t kHandoverCheckIntervalUs = 100000;
+
+  // A link serviced by this manager.
+  struct Link {
+    std::string name;
+    std::unique_ptr<RadioInterface> radio_interface;
+
+    // The exchange counters of the link when it was last reported to the
+    // channel plan server.
+    uint64_t reported_transfers = 0;
+    uint64_t reported_transfer_failures = 0;
+
+    // Set if the link is served in the slots of the TDMA cell.
+    bool scheduled = false;
+  };
+
+  // The interval to log stats at and the path to write them to.
+  const uint64_t stats_interval_us_;
+  const std::string stats_path_;
+
+  // The socket that a new process takes over the links from, if any, and
+  // the time of the next check for it. Declared before the links so that
+  // the new process is only told that this one is done once the links and
+  // their radios have been released.
+  std::unique_ptr<LinkHandover> handover_;
+  uint64_t next_handover_check_us_;
+
+  // The links serviced by this manager.
+  std::vector<Link> links_;
+
+  // The connection to the channel plan server, if any, and the times of the
+  // next report and check for assignments.
+  std::unique_ptr<ChannelPlanClient> channel_plan_client_;
+  uint64_t next_channel_report_us_;
+  uint64_t next_channel_assignment_us_;
+
+  // The address that TDMA beacons are sent to and the length of the
+  // superframe, which is zero unless TDMA is enabled.
+  uint32_t tdma_address_;
+  uint64_t superframe_us_;
+
+  // The indices of the scheduled links, the schedule of the current
+  // superframe, the time that it started and the next slot to serve.
+  std::vector<size_t> scheduled_links_;
+  TdmaSchedule schedule_;
+  uint64_t superframe_start_us_;
+  size_t next_slot_;
+
+  // Used to wake the event loop early.
+  std::mutex wake_mutex_;
+  std::condition_variable wake_cv_;
+  bool wake_pending_;
+
+  // Sleeps until the supplied time or until woken.
+  void SleepUntil(uint64_t time_us);
+
+  // Logs the stats for all links and writes them to the stats path.
+  void ReportStats();
+
+  // Reports links to the channel plan server when due and applies the
+  // channels that it assigns.
+  void ServiceChannelPlan(uint64_t now_us);
+
+  // Serves the slots of the TDMA cell that are due, starting a new
+  // superframe once the last one is over. Returns the time that the next
+  // slot or superframe starts.
+  uint64_t ServiceTdma(uint64_t now_us);
+
+  // Stops the tunnels of the links, saves their state and sends them to the
+  // new process. The tunnels are started again if the handover fails.
+  // Returns true if the links were handed over.
+  bool HandOver();
+
+  // Plans the slots of a superframe that starts at the supplied time and
+  // sends its beacon. The spare time is shared by backlog scaled by the
+  // weight of each link.
+  void StartSuperframe(uint64_t start_us);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_LINK_MANAGER_H_
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/link_snapshot.h"
+
+#include <cstring>
+
+#include "nerfnet/util/encoding.h"
+
+namespace nerfnet {
+
+LinkSnapshot::LinkSnapshot() : offset_(0) {}
+
+LinkSnapshot::LinkSnapshot(std::vector<uint8_t> data)
+    : data_(std::move(data)),
+      offset_(0) {}
+
+void LinkSnapshot::PutU8(uint8_t value) {
+  data_.push_back(value);
+}
+
+void LinkSnapshot::PutU32(uint32_t value) {
+  AppendBigEndianU32(data_, value);
+}
+
+void LinkSnapshot::PutU64(uint64_t value) {
+  size_t offset = data_.size();
+  data_.resize(offset + sizeof(value));
+  WriteBigEndianU64(&data_[offset], value);
+}
+
+void LinkSnapshot::PutBytes(const uint8_t* data, size_t size) {
+  PutU32(size);
+  data_.insert(data_.end(), data, data + size);
+}
+
+void LinkSnapshot::PutBytes(const std::vector<uint8_t>& data) {
+  PutBytes(data.data(), data.size());
+}
+
+bool LinkSnapshot::GetU8(uint8_t& value) {
+  const uint8_t* data = Consume(sizeof(value));
+  if (data == nullptr) {
+    return false;
+  }
+
+  value = data[0];
+  return true;
+}
+
+bool LinkSnapshot::GetU32(uint32_t& value) {
+  const uint8_t* data = Consume(sizeof(value));
+  if (data == nullptr) {
+    return false;
+  }
+
+  value = ReadBigEndianU32(data);
+  return true;
+}
+
+bool LinkSnapshot::GetU64(uint64_t& value) {
+  const uint8_t* data = Consume(sizeof(value));
+  if (data == nullptr) {
+    return false;
+  }
+
+  value = ReadBigEndianU64(data);
+  return true;
+}
+
+bool LinkSnapshot::GetBytes(uint8_t* data, size_t size) {
+  uint32_t saved_size;
+  if (!GetU32(saved_size) || saved_size != size) {
+    offset_ = data_.size() + 1;
+    return false;
+  }
+
+  const uint8_t* saved_data = Consume(size);
+  if (saved_data == nullptr) {
+    return false;
+  }
+
+  memcpy(data, saved_data, size);
+  return true;
+}
+
+bool LinkSnapshot::GetBytes(std::vector<uint8_t>& data) {
+  uint32_t size;
+  if (!GetU32(size)) {
+    return false;
+  }
+
+  const uint8_t* saved_data = Consume(size);
+  if (saved_data == nullptr) {
+    return false;
+  }
+
+  data.assign(saved_data, saved_data + size);
+  return true;
+}
+
+const uint8_t* LinkSnapshot::Consume(size_t size) {
+  if (offset_ > data_.size() || data_.size() - offset_ < size) {
+    offset_ = data_.size() + 1;
+    return nullptr;
+  }
+
+  const uint8_t* data = data_.data() + offset_;
+  offset_ += size;
+  return data;
+}
+
+}  // namespace nerfnet
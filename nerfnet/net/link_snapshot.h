@@ -0,0 +1,72 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_LINK_SNAPSHOT_H_
+#define NERFNET_NET_LINK_SNAPSHOT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nerfnet {
+
+// The state of a link saved by one process and restored by the process that
+// takes the link over, so that the connection carries on without a reset.
+// Values are appended in big-endian order and must be read back in the order
+// they were written. Reads fail once the snapshot runs out, after which
+// every further read also fails.
+class LinkSnapshot {
+ public:
+  // Setup an empty snapshot to save state into.
+  LinkSnapshot();
+
+  // Setup a snapshot to restore state from.
+  explicit LinkSnapshot(std::vector<uint8_t> data);
+
+  // Returns the saved state.
+  const std::vector<uint8_t>& GetData() const { return data_; }
+
+  // Appends values to the snapshot. Byte strings are preceded by their size.
+  void PutU8(uint8_t value);
+  void PutU32(uint32_t value);
+  void PutU64(uint64_t value);
+  void PutBytes(const uint8_t* data, size_t size);
+  void PutBytes(const std::vector<uint8_t>& data);
+
+  // Reads the next value from the snapshot. Returns false if the snapshot
+  // is too short.
+  bool GetU8(uint8_t& value);
+  bool GetU32(uint32_t& value);
+  bool GetU64(uint64_t& value);
+  bool GetBytes(uint8_t* data, size_t size);
+  bool GetBytes(std::vector<uint8_t>& data);
+
+  // Returns true if every value has been read.
+  bool IsConsumed() const { return offset_ == data_.size(); }
+
+ private:
+  // The saved state and the offset of the next value to read.
+  std::vector<uint8_t> data_;
+  size_t offset_;
+
+  // Returns a pointer to the next size bytes to read and advances past them,
+  // or nullptr if the snapshot is too short.
+  const uint8_t* Consume(size_t size);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_LINK_SNAPSHOT_H_
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/link_stats.h"
+
+#include <cinttypes>
+
+#include "nerfnet/util/string.h"
+
+namespace nerfnet {
+
+std::string LinkStats::ToString() const {
+  std::string shaping;
+  for (const auto& shaping_class : shaping_classes) {
+    shaping += StringFormat(" shape_%s_frames=%" PRIu64
+        " shape_%s_frames_delayed=%" PRIu64 " shape_%s_airtime_us=%" PRIu64,
+        shaping_class.name.c_str(), shaping_class.frames,
+        shaping_class.name.c_str(), shaping_class.frames_delayed,
+        shaping_class.name.c_str(), shaping_class.airtime_us).c_str();
+  }
+
+  return StringFormat(
+      "polls=%" PRIu64 " transfers=%" PRIu64 " transfer_failures=%" PRIu64
+      " resets=%" PRIu64 " bytes_tx=%" PRIu64 " bytes_rx=%" PRIu64
+      " packets_duplicate=%" PRIu64 " packets_unexpected=%" PRIu64
+      " retransmits_avoided=%" PRIu64 " acked_packets_lost=%" PRIu64
+      " packet_retransmits=%" PRIu64 " rx_fifo_overruns=%" PRIu64
+      " packets_stale=%" PRIu64 " packet_size=%" PRIu64
+      " bit_error_rate_ppm=%" PRIu64 " channel=%" PRIu64
+      " data_rate_kbps=%" PRIu64 " channel_switches=%" PRIu64
+      " channel_switch_failures=%" PRIu64 " gateway=%" PRIu64
+      " roams=%" PRIu64 " roam_failures=%" PRIu64
+      " clock_offset_us=%" PRId64 " clock_drift_ppb=%" PRId64
+      " one_way_delay_tx_us=%" PRIu64 " one_way_delay_rx_us=%" PRIu64
+      " queue_delay_tx_us=%" PRIu64 " queue_delay_rx_us=%" PRIu64
+      " frames_tx=%" PRIu64 " frames_rx=%" PRIu64
+      " frames_filtered=%" PRIu64 " frames_replied=%" PRIu64
+      " frames_invalid=%" PRIu64 " frames_corrupt=%" PRIu64
+      " frames_retransmitted=%" PRIu64 " frames_abandoned=%" PRIu64
+      " frames_oversized=%" PRIu64 " aead_counter_resyncs=%" PRIu64
+      " aead_rekey_timeouts=%" PRIu64
+      " control_messages_tx=%" PRIu64
+      " control_messages_rx=%" PRIu64 " datagrams_tx=%" PRIu64
+      " datagrams_rx=%" PRIu64 " datagrams_dropped=%" PRIu64
+      " broadcast_packets_tx=%" PRIu64 " broadcast_packets_rx=%" PRIu64
+      " tdma_slots=%" PRIu64 " tdma_beacons=%" PRIu64
+      " tdma_drift_ppb=%" PRId64 " frames_shaped=%" PRIu64
+      " frames_delayed=%" PRIu64 "%s",
+      polls, transfers, transfer_failures, resets, bytes_tx, bytes_rx,
+      packets_duplicate, packets_unexpected, retransmits_avoided,
+      acked_packets_lost, packet_retransmits,
+      rx_fifo_overruns, packets_stale, packet_size, bit_error_rate_ppm,
+      channel, data_rate_kbps, channel_switches, channel_switch_failures,
+      gateway, roams, roam_failures,
+      clock_offset_us, clock_drift_ppb, one_way_delay_tx_us,
+      one_way_delay_rx_us, queue_delay_tx_us, queue_delay_rx_us,
+      frames_tx, frames_rx,
+      frames_filtered, frames_replied, frames_invalid, frames_corrupt,
+      frames_retransmitted, frames_abandoned, frames_oversized,
+      aead_counter_resyncs, aead_rekey_timeouts, control_messages_tx,
+      control_messages_rx, datagrams_tx, datagrams_rx, datagrams_dropped,
+      broadcast_packets_tx, broadcast_packets_rx, tdma_slots, tdma_beacons,
+      tdma_drift_ppb, frames_shaped, frames_delayed, shaping.c_str());
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_LINK_STATS_H_
+#define NERFNET_NET_LINK_STATS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace nerfnet {
+
+// Counters collected for a single radio link.
+struct LinkStats {
+  // Counters for a class of traffic that the frames sent over the link are
+  // shaped in: the frames started, the frames that were held back because
+  // the class or the link had used up its airtime and the airtime taken by
+  // the packets of the class, including attempts that were sent again.
+  struct ShapingClassStats {
+    std::string name;
+    uint64_t frames = 0;
+    uint64_t frames_delayed = 0;
+    uint64_t airtime_us = 0;
+  };
+
+  // The number of times the link was polled by the event loop.
+  uint64_t polls = 0;
+
+  // The number of successful and failed packet exchanges.
+  uint64_t transfers = 0;
+  uint64_t transfer_failures = 0;
+
+  // The number of connection resets performed.
+  uint64_t resets = 0;
+
+  // The number of bytes sent and received over the radio.
+  uint64_t bytes_tx = 0;
+  uint64_t bytes_rx = 0;
+
+  // The number of received packets rejected as duplicates or replays and
+  // because they were not the next packet in sequence.
+  uint64_t packets_duplicate = 0;
+  uint64_t packets_unexpected = 0;
+
+  // The number of requests with a payload that the primary did not send
+  // again when the response was lost, since the radio of the secondary had
+  // acknowledged them, and the number of acknowledged requests that the
+  // secondary turned out to have lost and that were sent again.
+  uint64_t retransmits_avoided = 0;
+  uint64_t acked_packets_lost = 0;
+
+  // The number of times packets were sent again by the radio before being
+  // acknowledged or given up on.
+  uint64_t packet_retransmits = 0;
+
+  // The number of times the receive FIFO of the radio was full, when further
+  // packets are dropped, and the number of received packets discarded
+  // because a more recent response had arrived.
+  uint64_t rx_fifo_overruns = 0;
+  uint64_t packets_stale = 0;
+
+  // The size of the packets currently sent to the peer and the estimated bit
+  // error rate of the link in parts per million. These are not counters.
+  uint64_t packet_size = 0;
+  uint64_t bit_error_rate_ppm = 0;
+
+  // The channel and data rate that the link operates on, which are not
+  // counters, and the number of channel switches that succeeded and that
+  // were abandoned because no exchange succeeded on the new channel.
+  uint64_t channel = 0;
+  uint64_t data_rate_kbps = 0;
+  uint64_t channel_switches = 0;
+  uint64_t channel_switch_failures = 0;
+
+  // The gateway that carries a roaming link, which is not a counter, and
+  // the number of moves to another gateway that succeeded and that were
+  // abandoned because no exchange succeeded through the new gateway.
+  uint64_t gateway = 0;
+  uint64_t roams = 0;
+  uint64_t roam_failures = 0;
+
+  // The estimated offset of the peer clock from the local clock and the rate
+  // at which it gains on the local clock, from NTP-style clock exchanges.
+  // These are not counters.
+  int64_t clock_offset_us = 0;
+  int64_t clock_drift_ppb = 0;
+
+  // The smoothed one-way delays of control messages sent to and received
+  // from the peer, which skip the queue, and the smoothed time that other
+  // frames wait in the transmit queue of each side. A frame is delayed by
+  // the sum of the two in each direction. These are not counters.
+  uint64_t one_way_delay_tx_us = 0;
+  uint64_t one_way_delay_rx_us = 0;
+  uint64_t queue_delay_tx_us = 0;
+  uint64_t queue_delay_rx_us = 0;
+
+  // The number of complete frames sent and received over the radio.
+  uint64_t frames_tx = 0;
+  uint64_t frames_rx = 0;
+
+  // The number of frames dropped by codecs before transmission, answered
+  // locally by codecs and received frames that failed to decode.
+  uint64_t frames_filtered = 0;
+  uint64_t frames_replied = 0;
+  uint64_t frames_invalid = 0;
+
+  // The number of received frames that were corrupted, frames sent again
+  // because the peer reported corruption and frames dropped after being sent
+  // again too many times.
+  uint64_t frames_corrupt = 0;
+  uint64_t frames_retransmitted = 0;
+  uint64_t frames_abandoned = 0;
+
+  // The number of received frames dropped for growing beyond the largest
+  // frame size.
+  uint64_t frames_oversized = 0;
+
+  // The number of times the receiver of an encrypted link stepped its frame
+  // counter over frames that the peer abandoned, and the number of key
+  // rotations that were started again because no response arrived in time.
+  uint64_t aead_counter_resyncs = 0;
+  uint64_t aead_rekey_timeouts = 0;
+
+  // The number of control messages sent and received.
+  uint64_t control_messages_tx = 0;
+  uint64_t control_messages_rx = 0;
+
+  // The number of datagrams sent, received and dropped because no handler
+  // was set for their port.
+  uint64_t datagrams_tx = 0;
+  uint64_t datagrams_rx = 0;
+  uint64_t datagrams_dropped = 0;
+
+  // The number of packets broadcast to the secondaries of a group of links
+  // and received from the primary of the group.
+  uint64_t broadcast_packets_tx = 0;
+  uint64_t broadcast_packets_rx = 0;
+
+  // The number of TDMA slots that a primary link was served in, the number
+  // of TDMA beacons sent or heard and the rate at which the clock of the hub
+  // gains on that of a secondary, which is not a counter.
+  uint64_t tdma_slots = 0;
+  uint64_t tdma_beacons = 0;
+  int64_t tdma_drift_ppb = 0;
+
+  // The number of frames started by the traffic shaper of the link and the
+  // number of those that were held back for want of airtime, followed by
+  // the counters of each traffic class.
+  uint64_t frames_shaped = 0;
+  uint64_t frames_delayed = 0;
+  std::vector<ShapingClassStats> shaping_classes;
+
+  // Formats the stats as a line of space-separated key=value pairs.
+  std::string ToString() const;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_LINK_STATS_H_
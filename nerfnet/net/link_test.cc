@@ -0,0 +1,519 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "nerfnet/net/aead_codec.h"
+#include "nerfnet/net/channel_plan_client.h"
+#include "nerfnet/net/channel_plan_server.h"
+#include "nerfnet/net/compression_codec.h"
+#include "nerfnet/net/crc_codec.h"
+#include "nerfnet/net/dedup_codec.h"
+#include "nerfnet/net/iphc_codec.h"
+#include "nerfnet/net/primary_radio_interface.h"
+#include "nerfnet/net/secondary_radio_interface.h"
+#include "nerfnet/net/simulated_radio.h"
+#include "nerfnet/net/stream_socket.h"
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/non_copyable.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+namespace {
+
+// The addresses and channel used by the links under test.
+constexpr uint32_t kPrimaryAddress = 0x90019001;
+constexpr uint32_t kSecondaryAddress = 0x90009000;
+constexpr uint8_t kChannel = 20;
+
+// The time allowed for a link to deliver what is expected of it.
+constexpr uint64_t kTimeoutUs = 10000000;
+
+// The datagram ports used by the tests.
+constexpr uint8_t kEchoPort = 5;
+constexpr uint8_t kEchoReplyPort = 6;
+constexpr uint8_t kStreamPort = 7;
+
+// Adds codecs to one side of a link.
+using CodecFactory = std::function<void(RadioInterface& radio_interface,
+                                        bool primary)>;
+
+// A primary and secondary link over a simulated medium, each with a tunnel
+// that the test reads and writes frames through. The secondary is serviced
+// whenever the primary waits for a response, so the link runs in the thread
+// that polls the primary.
+class LinkPair : public NonCopyable {
+ public:
+  LinkPair(SimulatedMedium& medium, const CodecFactory& add_codecs,
+           uint32_t primary_addr = kPrimaryAddress,
+           uint32_t secondary_addr = kSecondaryAddress,
+           uint8_t channel = kChannel) {
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, primary_fds_) == 0,
+        "Failed to create primary tunnel");
+    CHECK(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, secondary_fds_) == 0,
+        "Failed to create secondary tunnel");
+
+    auto primary_radio = std::make_unique<SimulatedRadio>(medium);
+    auto secondary_radio = std::make_unique<SimulatedRadio>(medium);
+    primary_radio->SetChannel(channel);
+    secondary_radio->SetChannel(channel);
+    SimulatedRadio* primary_radio_ptr = primary_radio.get();
+    secondary_ = std::make_unique<SecondaryRadioInterface<SimulatedRadio>>(
+        std::move(secondary_radio), secondary_fds_[0],
+        primary_addr, secondary_addr);
+    primary_ = std::make_unique<PrimaryRadioInterface<SimulatedRadio>>(
+        std::move(primary_radio), primary_fds_[0],
+        primary_addr, secondary_addr, /*poll_interval_us=*/0,
+        /*idle_poll_interval_us=*/0);
+    add_codecs(*primary_, /*primary=*/true);
+    add_codecs(*secondary_, /*primary=*/false);
+
+    // The secondary is polled a second time after responding so that it is
+    // listening again before the next request is written.
+    primary_radio_ptr->SetIdleCallback([this]() {
+      uint64_t now_us = TimeNowUs();
+      secondary_->Poll(now_us);
+      secondary_->Poll(now_us);
+    });
+
+    // Put the secondary in receive mode before the first request.
+    secondary_->Poll(TimeNowUs());
+  }
+
+  ~LinkPair() {
+    primary_.reset();
+    secondary_.reset();
+    for (int fd : { primary_fds_[0], primary_fds_[1],
+                    secondary_fds_[0], secondary_fds_[1] }) {
+      close(fd);
+    }
+  }
+
+  RadioInterface& primary() { return *primary_; }
+  RadioInterface& secondary() { return *secondary_; }
+
+  // Returns the end of the tunnel of each side that the test uses.
+  int primary_tunnel() const { return primary_fds_[1]; }
+  int secondary_tunnel() const { return secondary_fds_[1]; }
+
+  // Services the link once.
+  void Poll() { primary_->Poll(TimeNowUs()); }
+
+  // Polls the link until the condition holds, failing the test if it does
+  // not hold in time.
+  void PollUntil(const std::function<bool()>& condition,
+                 const char* description);
+
+ private:
+  // The tunnels of each side. The first descriptor is owned by the link.
+  int primary_fds_[2];
+  int secondary_fds_[2];
+
+  // The two sides of the link.
+  std::unique_ptr<RadioInterface> secondary_;
+  std::unique_ptr<RadioInterface> primary_;
+};
+
+// Polls links in turn until the condition holds, failing the test if it
+// does not hold in time.
+void PollLinks(const std::vector<LinkPair*>& links,
+               const std::function<bool()>& condition, uint64_t timeout_us,
+               const char* description) {
+  uint64_t start_us = TimeNowUs();
+  while (!condition()) {
+    CHECK(TimeNowUs() - start_us < timeout_us,
+        "Timed out waiting for %s", description);
+    for (LinkPair* link : links) {
+      link->Poll();
+    }
+  }
+}
+
+void LinkPair::PollUntil(const std::function<bool()>& condition,
+                         const char* description) {
+  PollLinks({ this }, condition, kTimeoutUs, description);
+}
+
+// Writes a frame to a tunnel.
+void WriteFrame(int fd, const std::vector<uint8_t>& frame) {
+  CHECK(write(fd, frame.data(), frame.size())
+      == static_cast<ssize_t>(frame.size()), "Failed to write frame");
+}
+
+// Reads a frame from a tunnel without waiting, if one is there.
+std::optional<std::vector<uint8_t>> ReadFrame(int fd) {
+  struct pollfd tunnel_poll = {};
+  tunnel_poll.fd = fd;
+  tunnel_poll.events = POLLIN;
+  if (poll(&tunnel_poll, 1, 0) <= 0) {
+    return std::nullopt;
+  }
+
+  std::vector<uint8_t> frame(RadioInterface::kMaxFrameSize);
+  ssize_t size = read(fd, frame.data(), frame.size());
+  CHECK(size >= 0, "Failed to read frame");
+  frame.resize(size);
+  return frame;
+}
+
+// Returns a UDP packet over IPv6 between two link-local hosts, carrying a
+// payload that is compressible in part and unique to the sequence number.
+std::vector<uint8_t> MakeUdpPacket(uint16_t sequence, size_t payload_size) {
+  std::vector<uint8_t> packet(48 + payload_size, 0x00);
+  packet[0] = 0x60;
+  WriteBigEndianU16(&packet[4], 8 + payload_size);
+  packet[6] = 17;
+  packet[7] = 64;
+  packet[8] = 0xfe;
+  packet[9] = 0x80;
+  packet[23] = 0x01;
+  packet[24] = 0xfe;
+  packet[25] = 0x80;
+  packet[39] = 0x02;
+  WriteBigEndianU16(&packet[40], 5000);
+  WriteBigEndianU16(&packet[42], 5001);
+  WriteBigEndianU16(&packet[44], 8 + payload_size);
+  WriteBigEndianU16(&packet[46], sequence);
+  for (size_t i = 0; i < payload_size; i++) {
+    packet[48 + i] = (i < payload_size / 2) ? 'n' : (sequence * 31 + i);
+  }
+
+  return packet;
+}
+
+// Returns the sequence number of a frame in a run where every fourth frame
+// repeats the one before it, which the dedup codec refers to its cache for.
+uint16_t GetSequence(size_t index) {
+  return (index % 4 == 3) ? index - 1 : index;
+}
+
+// Adds the codecs that a link in tun mode uses with every option enabled.
+void AddTunCodecs(RadioInterface& radio_interface, bool primary) {
+  std::array<uint8_t, AeadCodec::kKeySize> key = {};
+  key[0] = 0x5a;
+  uint32_t local_addr = primary ? kPrimaryAddress : kSecondaryAddress;
+  uint32_t peer_addr = primary ? kSecondaryAddress : kPrimaryAddress;
+  radio_interface.AddFrameCodec(std::make_unique<IphcCodec>(
+      local_addr, peer_addr, std::nullopt));
+  radio_interface.AddFrameCodec(std::make_unique<DedupCodec>());
+  radio_interface.AddFrameCodec(std::make_unique<CompressionCodec>(
+      std::vector<uint8_t>()));
+  radio_interface.AddLinkCodec(std::make_unique<AeadCodec>(
+      key, primary, AeadCodec::kMinTagSize, /*rekey_interval_us=*/0));
+  radio_interface.AddLinkCodec(std::make_unique<CrcCodec>());
+}
+
+// Sends tunnel frames in both directions alongside datagrams that are echoed
+// by the secondary and a stream from the primary, all through the full codec
+// chain, and checks that each arrives intact.
+void TestTunnelDatagramsAndStreams() {
+  LOGI("Testing tunnel frames, datagrams and streams");
+  SimulatedMedium medium;
+  LinkPair link(medium, AddTunCodecs);
+
+  link.secondary().SetDatagramHandler(kEchoPort,
+      [&link](const uint8_t* data, size_t size) {
+        link.secondary().SendDatagram(kEchoReplyPort,
+            std::vector<uint8_t>(data, data + size));
+      });
+  std::vector<std::vector<uint8_t>> replies;
+  link.primary().SetDatagramHandler(kEchoReplyPort,
+      [&replies](const uint8_t* data, size_t size) {
+        replies.emplace_back(data, data + size);
+      });
+  StreamSocket primary_stream(link.primary(), kStreamPort);
+  StreamSocket secondary_stream(link.secondary(), kStreamPort);
+  link.PollUntil([&link]() { return link.primary().GetStats().resets > 0; },
+      "the connection");
+
+  constexpr size_t kFrameCount = 32;
+  std::vector<std::vector<uint8_t>> datagrams;
+  std::vector<uint8_t> stream_data(4096);
+  for (size_t i = 0; i < stream_data.size(); i++) {
+    stream_data[i] = i * 7;
+  }
+
+  for (size_t i = 0; i < kFrameCount; i++) {
+    uint16_t sequence = GetSequence(i);
+    WriteFrame(link.primary_tunnel(),
+        MakeUdpPacket(sequence, 64 + sequence * 8));
+    WriteFrame(link.secondary_tunnel(), MakeUdpPacket(sequence, 200));
+    datagrams.emplace_back(1 + i, static_cast<uint8_t>(i));
+    CHECK(link.primary().SendDatagram(kEchoPort, datagrams.back()),
+        "Failed to queue datagram %zu", i);
+  }
+
+  size_t stream_written = 0;
+  std::vector<uint8_t> stream_read;
+  size_t secondary_frames = 0;
+  size_t primary_frames = 0;
+  link.PollUntil([&]() {
+    stream_written += primary_stream.Write(
+        stream_data.data() + stream_written,
+        stream_data.size() - stream_written);
+    uint8_t buffer[512];
+    size_t size = secondary_stream.Read(buffer, sizeof(buffer), 0);
+    stream_read.insert(stream_read.end(), buffer, buffer + size);
+
+    while (auto frame = ReadFrame(link.secondary_tunnel())) {
+      uint16_t sequence = GetSequence(secondary_frames);
+      CHECK(*frame == MakeUdpPacket(sequence, 64 + sequence * 8),
+          "Frame %zu corrupted on the way to the secondary",
+          secondary_frames);
+      secondary_frames++;
+    }
+
+    while (auto frame = ReadFrame(link.primary_tunnel())) {
+      CHECK(*frame == MakeUdpPacket(GetSequence(primary_frames), 200),
+          "Frame %zu corrupted on the way to the primary", primary_frames);
+      primary_frames++;
+    }
+
+    return secondary_frames == kFrameCount && primary_frames == kFrameCount
+        && replies.size() == kFrameCount
+        && stream_read.size() == stream_data.size();
+  }, "frames, datagrams and the stream");
+
+  CHECK(replies == datagrams, "Datagrams corrupted");
+  CHECK(stream_read == stream_data, "Stream corrupted");
+  CHECK(!primary_stream.IsClosed() && !secondary_stream.IsClosed(),
+      "Stream closed");
+  for (auto* radio_interface : { &link.primary(), &link.secondary() }) {
+    LinkStats stats = radio_interface->GetStats();
+    CHECK(stats.frames_invalid == 0 && stats.frames_corrupt == 0
+        && stats.frames_filtered == 0 && stats.datagrams_dropped == 0,
+        "Unexpected errors: %s", stats.ToString().c_str());
+  }
+}
+
+// Adds codecs that pass frames that are not IPv6 through unmodified.
+void AddPassthroughCodecs(RadioInterface& radio_interface, bool primary) {
+  uint32_t local_addr = primary ? kPrimaryAddress : kSecondaryAddress;
+  uint32_t peer_addr = primary ? kSecondaryAddress : kPrimaryAddress;
+  radio_interface.AddFrameCodec(std::make_unique<IphcCodec>(
+      local_addr, peer_addr, std::nullopt));
+  radio_interface.AddLinkCodec(std::make_unique<CrcCodec>());
+}
+
+// Sends tunnel frames that leave the codec chain starting with the dispatch
+// byte of a datagram or control message, which are dropped rather than
+// misinterpreted by the peer, between frames that are delivered.
+void TestDispatchCollisions() {
+  LOGI("Testing dispatch byte collisions");
+  SimulatedMedium medium;
+  LinkPair link(medium, AddPassthroughCodecs);
+  size_t datagrams = 0;
+  for (uint8_t port : { 0x00, 0x3f }) {
+    link.secondary().SetDatagramHandler(port,
+        [&datagrams](const uint8_t* data, size_t size) { datagrams++; });
+  }
+
+  link.PollUntil([&link]() { return link.primary().GetStats().resets > 0; },
+      "the connection");
+
+  // IPv4 frames pass through the codecs unmodified.
+  const std::vector<uint8_t> kDelivered = { 0x45, 0x00, 0x00, 0x14, 0x01 };
+  const std::vector<std::vector<uint8_t>> kColliding = {
+    { 0x00, 0x01, 0x02 },
+    { 0x3f, 0x01, 0x02 },
+    { 0x50, 0x01, 0x02 },
+    { 0x59, 0x01, 0x02 },
+  };
+
+  WriteFrame(link.primary_tunnel(), kDelivered);
+  for (const auto& frame : kColliding) {
+    WriteFrame(link.primary_tunnel(), frame);
+  }
+
+  WriteFrame(link.primary_tunnel(), kDelivered);
+  std::vector<std::vector<uint8_t>> frames;
+  link.PollUntil([&]() {
+    while (auto frame = ReadFrame(link.secondary_tunnel())) {
+      frames.push_back(*frame);
+    }
+
+    return frames.size() >= 2;
+  }, "the delivered frames");
+
+  LinkStats stats = link.primary().GetStats();
+  CHECK(frames.size() == 2 && frames[0] == kDelivered
+      && frames[1] == kDelivered, "Colliding frame delivered");
+  CHECK(stats.frames_filtered == kColliding.size(),
+      "Expected %zu filtered frames: %s", kColliding.size(),
+      stats.ToString().c_str());
+  CHECK(datagrams == 0, "Colliding frame delivered as a datagram");
+  CHECK(link.secondary().GetStats().frames_invalid == 0,
+      "Colliding frame decoded by the secondary");
+}
+
+// Adds the codecs that apply to datagrams.
+void AddLinkCodecs(RadioInterface& radio_interface, bool primary) {
+  radio_interface.AddLinkCodec(std::make_unique<CrcCodec>());
+}
+
+// Starts several links on adjacent channels and has them report to a channel
+// plan server, as the link manager does, while each carries a stream of
+// numbered datagrams. Checks that the links are moved to evenly separated
+// channels without resetting their connections or losing a datagram.
+void TestChannelPlan() {
+  LOGI("Testing channel planning");
+  constexpr size_t kLinkCount = 3;
+  constexpr uint8_t kMinChannel = 0;
+  constexpr uint8_t kMaxChannel = 125;
+  constexpr uint8_t kFirstChannel = 60;
+  constexpr uint32_t kMinSeparation =
+      (kMaxChannel - kMinChannel) / (kLinkCount - 1);
+  constexpr uint8_t kSequencePort = 1;
+  constexpr uint32_t kMaxOutstandingDatagrams = 8;
+  constexpr uint64_t kReportIntervalUs = 100000;
+  constexpr uint64_t kPlanTimeoutUs = 30000000;
+  constexpr uint32_t kDatagramsAfterMove = 200;
+
+  // A link and the datagrams that it has carried.
+  struct PlannedLink {
+    std::string name;
+    std::unique_ptr<LinkPair> pair;
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t received_at_move = 0;
+  };
+
+  std::string path = "/tmp/nerfnet_link_test_"
+      + std::to_string(getpid()) + ".sock";
+  ChannelPlanServer server(path, kMinChannel, kMaxChannel);
+  ChannelPlanClient client(path);
+  SimulatedMedium medium;
+  std::vector<PlannedLink> links(kLinkCount);
+  std::vector<LinkPair*> pairs;
+  for (size_t i = 0; i < kLinkCount; i++) {
+    PlannedLink& link = links[i];
+    link.name = "nerf" + std::to_string(i);
+    link.pair = std::make_unique<LinkPair>(medium, AddLinkCodecs,
+        kPrimaryAddress + i, kSecondaryAddress + i, kFirstChannel + i);
+    link.pair->secondary().SetDatagramHandler(kSequencePort,
+        [&link](const uint8_t* data, size_t size) {
+          CHECK(size == 4 && ReadBigEndianU32(data) == link.received,
+              "Datagram lost on link '%s'", link.name.c_str());
+          link.received++;
+        });
+    pairs.push_back(link.pair.get());
+  }
+
+  // The links are moved once every link has moved to a channel that the
+  // secondary has followed and the channels are evenly separated.
+  auto moved = [&links]() {
+    std::vector<uint32_t> channels;
+    for (const auto& link : links) {
+      uint8_t channel = link.pair->primary().GetChannel();
+      if (channel == kFirstChannel + (&link - &links[0])
+          || link.pair->secondary().GetChannel() != channel) {
+        return false;
+      }
+
+      channels.push_back(channel);
+    }
+
+    std::sort(channels.begin(), channels.end());
+    for (size_t i = 1; i < channels.size(); i++) {
+      if (channels[i] - channels[i - 1] < kMinSeparation) {
+        return false;
+      }
+    }
+
+    return true;
+  };
+
+  uint64_t next_report_us = 0;
+  bool all_moved = false;
+  PollLinks(pairs, [&]() {
+    uint64_t now_us = TimeNowUs();
+    if (now_us >= next_report_us) {
+      next_report_us = now_us + kReportIntervalUs;
+      for (const auto& link : links) {
+        client.Report(link.name, link.pair->primary().GetChannel(), 0);
+      }
+    }
+
+    for (const auto& assignment : client.ReceiveAssignments()) {
+      for (auto& link : links) {
+        if (link.name == assignment.name) {
+          link.pair->primary().RequestChannel(assignment.channel);
+        }
+      }
+    }
+
+    for (auto& link : links) {
+      if (link.sent - link.received < kMaxOutstandingDatagrams) {
+        std::vector<uint8_t> datagram(4);
+        WriteBigEndianU32(datagram.data(), link.sent);
+        if (link.pair->primary().SendDatagram(kSequencePort, datagram)) {
+          link.sent++;
+        }
+      }
+    }
+
+    if (!all_moved && moved()) {
+      all_moved = true;
+      for (auto& link : links) {
+        link.received_at_move = link.received;
+      }
+    }
+
+    // The links must keep carrying datagrams on their new channels.
+    return all_moved && std::all_of(links.begin(), links.end(),
+        [](const PlannedLink& link) {
+          return link.received
+              >= link.received_at_move + kDatagramsAfterMove;
+        });
+  }, kPlanTimeoutUs, "the links to move");
+
+  for (const auto& link : links) {
+    for (auto* radio_interface : { &link.pair->primary(),
+                                   &link.pair->secondary() }) {
+      LinkStats stats = radio_interface->GetStats();
+      CHECK(stats.resets == 1 && stats.channel_switches == 1
+          && stats.channel_switch_failures == 0,
+          "Link '%s' did not move cleanly: %s", link.name.c_str(),
+          stats.ToString().c_str());
+    }
+
+    LOGI("Link '%s' moved to channel %u", link.name.c_str(),
+        link.pair->primary().GetChannel());
+  }
+
+  unlink(path.c_str());
+}
+
+}  // anonymous namespace
+}  // namespace nerfnet
+
+int main(int argc, char** argv) {
+  nerfnet::TestTunnelDatagramsAndStreams();
+  nerfnet::TestDispatchCollisions();
+  nerfnet::TestChannelPlan();
+  LOGI("All tests passed");
+  return 0;
+}
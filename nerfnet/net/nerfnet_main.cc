@@ -14,21 +14,53 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
 #include <fcntl.h>
+#include <fstream>
+#include <functional>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/ipv6.h>
+#include <memory>
+#include <optional>
 #include <RF24/RF24.h>
+#include <sched.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <tclap/CmdLine.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
+#include "nerfnet/net/aead_codec.h"
+#include "nerfnet/net/broadcast_receiver.h"
+#include "nerfnet/net/broadcast_sender.h"
+#include "nerfnet/net/channel_plan_client.h"
+#include "nerfnet/net/channel_plan_server.h"
+#include "nerfnet/net/compression_codec.h"
+#include "nerfnet/net/crc_codec.h"
+#include "nerfnet/net/dedup_codec.h"
+#include "nerfnet/net/ethernet_codec.h"
+#include "nerfnet/net/iphc_codec.h"
+#include "nerfnet/net/link_handover.h"
+#include "nerfnet/net/link_manager.h"
 #include "nerfnet/net/primary_radio_interface.h"
+#include "nerfnet/net/rf24_radio.h"
 #include "nerfnet/net/secondary_radio_interface.h"
+#include "nerfnet/net/simulated_radio.h"
+#include "nerfnet/net/site_survey.h"
+#include "nerfnet/net/traffic_shaper.h"
+#include "nerfnet/net/unix_socket_radio.h"
 #include "nerfnet/util/log.h"
+#include "nerfnet/util/string.h"
 
 // A description of the program.
 constexpr char kDescription[] =
@@ -37,6 +69,339 @@ constexpr char kDescription[] =
 // The version of the program.
 constexpr char kVersion[] = "0.0.1";
 
+// The highest channel that the radios can be tuned to.
+constexpr uint64_t kMaxChannel = 125;
+
+// The configuration for a single radio link and its tunnel.
+struct LinkConfig {
+  std::string interface_name;
+  bool primary;
+  bool tap;
+  uint16_t ce_pin;
+  uint16_t csn_pin;
+  std::string tunnel_ip;
+  std::string tunnel_mask;
+  std::string tunnel_ipv6;
+  uint32_t primary_addr;
+  uint32_t secondary_addr;
+  uint8_t channel;
+  nerfnet::Radio::DataRate data_rate;
+  std::string key_file;
+  bool frame_crc;
+  bool dedup;
+  bool compress;
+
+  // The chip-enable and chip-select pins of the radios of the further
+  // gateways of a roaming primary link.
+  std::vector<std::pair<uint16_t, uint16_t>> gateway_pins;
+
+  // Set for a secondary link to roam between the gateways of the primary.
+  bool roaming;
+
+  // Set for a primary link to be served in the slots of the TDMA cell of
+  // this host and for a secondary link to follow the beacons of the cell.
+  bool tdma;
+
+  // The shaping of the frames sent by this side of the link, if any.
+  std::optional<nerfnet::TrafficShaper::Config> shaping;
+
+  // The memory budget for the frames waiting to be sent over the link in
+  // kilobytes, or zero for no budget.
+  uint32_t queue_budget_kb;
+
+  // The network namespace to create the tunnel in, or empty for the
+  // namespace of this process.
+  std::string netns;
+};
+
+// Parses a non-negative integer in decimal, hexadecimal or octal that must
+// be no larger than max. Quits and logs the error, naming the value, on
+// failure.
+uint64_t ParseNumber(const std::string& name, const std::string& value,
+                     uint64_t max) {
+  char* end = nullptr;
+  errno = 0;
+  uint64_t number = strtoull(value.c_str(), &end, 0);
+  CHECK(!value.empty() && value[0] != '-' && *end == '\0' && errno == 0,
+      "%s must be a number, not '%s'", name.c_str(), value.c_str());
+  CHECK(number <= max, "%s must be at most %" PRIu64 ", not '%s'",
+      name.c_str(), max, value.c_str());
+  return number;
+}
+
+// Parses a flag that is either 0 or 1. Quits and logs the error on failure.
+bool ParseFlag(const std::string& name, const std::string& value) {
+  return ParseNumber(name, value, 1) != 0;
+}
+
+// Parses a data rate by name. Quits and logs the error on failure.
+nerfnet::Radio::DataRate ParseDataRate(const std::string& name) {
+  auto data_rate = nerfnet::Radio::ParseDataRate(name);
+  CHECK(data_rate.has_value(),
+      "Data rate must be 250kbps, 1mbps or 2mbps, not '%s'", name.c_str());
+  return data_rate.value();
+}
+
+// Parses the pins of gateway radios as ce_pin:csn_pin pairs separated by
+// '/'. Quits and logs the error on failure.
+std::vector<std::pair<uint16_t, uint16_t>> ParseGatewayPins(
+    const std::string& spec) {
+  std::vector<std::pair<uint16_t, uint16_t>> gateway_pins;
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find('/', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+
+    std::string pins = spec.substr(start, end - start);
+    start = end + 1;
+    size_t separator = pins.find(':');
+    CHECK(separator != std::string::npos,
+        "Gateway pins must be ce_pin:csn_pin, not '%s'", pins.c_str());
+    gateway_pins.emplace_back(
+        ParseNumber("Gateway ce_pin", pins.substr(0, separator), UINT16_MAX),
+        ParseNumber("Gateway csn_pin", pins.substr(separator + 1),
+            UINT16_MAX));
+  }
+
+  return gateway_pins;
+}
+
+// Parses the shaping of a link as class:rate[:burst[:weight]] entries
+// separated by '/'. The class is link, tunnel, a datagram port or a range of
+// ports such as 4-7, the rate is a percentage of the airtime, or zero for no
+// limit, and the burst is in milliseconds of airtime. An empty specification
+// disables shaping. Quits and logs the error on failure.
+std::optional<nerfnet::TrafficShaper::Config> ParseShaping(
+    const std::string& spec) {
+  if (spec.empty()) {
+    return std::nullopt;
+  }
+
+  nerfnet::TrafficShaper::Config shaping;
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find('/', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+
+    std::string entry = spec.substr(start, end - start);
+    start = end + 1;
+    std::vector<std::string> fields;
+    size_t field_start = 0;
+    while (field_start <= entry.size()) {
+      size_t field_end = entry.find(':', field_start);
+      if (field_end == std::string::npos) {
+        field_end = entry.size();
+      }
+
+      fields.push_back(entry.substr(field_start, field_end - field_start));
+      field_start = field_end + 1;
+    }
+
+    CHECK(fields.size() >= 2 && fields.size() <= 4 && !fields[0].empty(),
+        "Shaping must be class:rate[:burst[:weight]], not '%s'",
+        entry.c_str());
+    nerfnet::TrafficShaper::BucketConfig bucket;
+    double rate = std::stod(fields[1]);
+    CHECK(rate >= 0.0 && rate <= 100.0,
+        "Shaping rate must be a percentage, not '%s'", fields[1].c_str());
+    bucket.rate_us = static_cast<uint64_t>(rate * 10000.0);
+    if (fields.size() >= 3) {
+      bucket.burst_us = ParseNumber("Shaping burst", fields[2],
+          UINT32_MAX) * 1000;
+    }
+
+    if (fields.size() >= 4) {
+      bucket.weight = ParseNumber("Shaping weight", fields[3], UINT32_MAX);
+    }
+
+    if (fields[0] == "link") {
+      shaping.link = bucket;
+      continue;
+    }
+
+    nerfnet::TrafficShaper::ClassConfig class_config;
+    class_config.bucket = bucket;
+    if (fields[0] == "tunnel") {
+      class_config.name = "tunnel";
+      class_config.tunnel = true;
+    } else {
+      size_t separator = fields[0].find('-');
+      class_config.first_port = ParseNumber("Shaping port",
+          fields[0].substr(0, separator), UINT8_MAX);
+      class_config.last_port = class_config.first_port;
+      if (separator != std::string::npos) {
+        class_config.last_port = ParseNumber("Shaping port",
+            fields[0].substr(separator + 1), UINT8_MAX);
+      }
+
+      class_config.name = "port" + fields[0];
+    }
+
+    shaping.classes.push_back(class_config);
+  }
+
+  return shaping;
+}
+
+// Parses a link specification of comma-separated key=value pairs. Keys that
+// are not supplied are taken from the defaults. Quits and logs the error on
+// failure.
+LinkConfig ParseLinkConfig(const std::string& spec,
+                           const LinkConfig& defaults) {
+  LinkConfig config = defaults;
+  config.tunnel_ip.clear();
+
+  size_t start = 0;
+  while (start < spec.size()) {
+    size_t end = spec.find(',', start);
+    if (end == std::string::npos) {
+      end = spec.size();
+    }
+
+    std::string option = spec.substr(start, end - start);
+    start = end + 1;
+    size_t separator = option.find('=');
+    CHECK(separator != std::string::npos,
+        "Malformed link option '%s'", option.c_str());
+    std::string key = option.substr(0, separator);
+    std::string value = option.substr(separator + 1);
+    if (key == "interface_name") {
+      config.interface_name = value;
+    } else if (key == "mode") {
+      CHECK(value == "primary" || value == "secondary",
+          "Link mode must be primary or secondary");
+      config.primary = (value == "primary");
+    } else if (key == "tap") {
+      config.tap = ParseFlag(key, value);
+    } else if (key == "ce_pin") {
+      config.ce_pin = ParseNumber(key, value, UINT16_MAX);
+    } else if (key == "csn_pin") {
+      config.csn_pin = ParseNumber(key, value, UINT16_MAX);
+    } else if (key == "tunnel_ip") {
+      config.tunnel_ip = value;
+    } else if (key == "tunnel_mask") {
+      config.tunnel_mask = value;
+    } else if (key == "tunnel_ipv6") {
+      config.tunnel_ipv6 = value;
+    } else if (key == "primary_addr") {
+      config.primary_addr = ParseNumber(key, value, UINT32_MAX);
+    } else if (key == "secondary_addr") {
+      config.secondary_addr = ParseNumber(key, value, UINT32_MAX);
+    } else if (key == "channel") {
+      config.channel = ParseNumber(key, value, kMaxChannel);
+    } else if (key == "data_rate") {
+      config.data_rate = ParseDataRate(value);
+    } else if (key == "key_file") {
+      config.key_file = value;
+    } else if (key == "frame_crc") {
+      config.frame_crc = ParseFlag(key, value);
+    } else if (key == "dedup") {
+      config.dedup = ParseFlag(key, value);
+    } else if (key == "compress") {
+      config.compress = ParseFlag(key, value);
+    } else if (key == "gateways") {
+      config.gateway_pins = ParseGatewayPins(value);
+    } else if (key == "roaming") {
+      config.roaming = ParseFlag(key, value);
+    } else if (key == "tdma") {
+      config.tdma = ParseFlag(key, value);
+    } else if (key == "shape") {
+      config.shaping = ParseShaping(value);
+    } else if (key == "queue_kb") {
+      config.queue_budget_kb = ParseNumber(key, value,
+          UINT32_MAX / 1024);
+    } else {
+      CHECK(false, "Unknown link option '%s'", key.c_str());
+    }
+  }
+
+  CHECK(!config.tunnel_ip.empty(),
+      "Link '%s' requires a tunnel_ip", config.interface_name.c_str());
+  return config;
+}
+
+// Reads a key stored as hexadecimal characters from a file. Whitespace is
+// ignored. Quits and logs the error on failure.
+std::array<uint8_t, nerfnet::AeadCodec::kKeySize> ReadKeyFile(
+    const std::string& path) {
+  std::ifstream file(path);
+  CHECK(file.good(), "Failed to open key file '%s'", path.c_str());
+
+  std::string hex;
+  char c;
+  while (file.get(c)) {
+    if (!isspace(c)) {
+      CHECK(isxdigit(c), "Invalid character in key file '%s'", path.c_str());
+      hex.push_back(c);
+    }
+  }
+
+  std::array<uint8_t, nerfnet::AeadCodec::kKeySize> key;
+  CHECK(hex.size() == key.size() * 2, "Key file '%s' must contain %zu bytes",
+      path.c_str(), key.size());
+  for (size_t i = 0; i < key.size(); i++) {
+    key[i] = std::stoul(hex.substr(i * 2, 2), nullptr, 16);
+  }
+
+  return key;
+}
+
+// Reads a compression dictionary from a file. Quits and logs the error on
+// failure.
+std::vector<uint8_t> ReadDictionaryFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  CHECK(file.good(), "Failed to open dictionary file '%s'", path.c_str());
+  std::vector<uint8_t> dictionary((std::istreambuf_iterator<char>(file)),
+      std::istreambuf_iterator<char>());
+  CHECK(dictionary.size() <= nerfnet::CompressionCodec::kMaxDictionarySize,
+      "Dictionary file '%s' is larger than %zu bytes", path.c_str(),
+      nerfnet::CompressionCodec::kMaxDictionarySize);
+  return dictionary;
+}
+
+// Reads a file to broadcast. Quits and logs the error on failure.
+std::vector<uint8_t> ReadBroadcastFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  CHECK(file.good(), "Failed to open broadcast file '%s'", path.c_str());
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+      std::istreambuf_iterator<char>());
+  CHECK(!data.empty()
+      && data.size() <= nerfnet::BroadcastSender::kMaxObjectSize,
+      "Broadcast file '%s' must be between 1 and %zu bytes", path.c_str(),
+      nerfnet::BroadcastSender::kMaxObjectSize);
+  return data;
+}
+
+// Writes a received broadcast to a directory under the name it was sent
+// with, reduced to characters that are safe in a file name.
+void WriteBroadcastFile(const std::string& directory, const std::string& name,
+                        const std::vector<uint8_t>& data) {
+  std::string file_name = name.substr(name.rfind('/') + 1);
+  for (char& c : file_name) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '.' && c != '-'
+        && c != '_') {
+      c = '_';
+    }
+  }
+
+  if (file_name.empty() || file_name == "." || file_name == "..") {
+    file_name = "broadcast";
+  }
+
+  std::string path = directory + "/" + file_name;
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  if (!file.good()) {
+    LOGE("Failed to write broadcast to '%s'", path.c_str());
+  } else {
+    LOGI("Broadcast written to '%s'", path.c_str());
+  }
+}
+
 // Sets flags for a given interface. Quits and logs the error on failure.
 void SetInterfaceFlags(const std::string_view& device_name, int flags) {
   int fd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -77,14 +442,52 @@ void SetIPAddress(const std::string_view& device_name,
   close(fd);
 }
 
-// Opens the tunnel interface to listen on. Always returns a valid file
+// Parses an IPv6 address with an optional prefix length, such as
+// "fd00:10::1/64". The prefix length defaults to 64. Quits and logs the error
+// on failure.
+void ParseIPv6Address(const std::string& ip_and_prefix,
+                      struct in6_addr& address, uint32_t& prefix_len) {
+  std::string ip = ip_and_prefix;
+  prefix_len = 64;
+  size_t separator = ip_and_prefix.find('/');
+  if (separator != std::string::npos) {
+    ip = ip_and_prefix.substr(0, separator);
+    prefix_len = std::stoul(ip_and_prefix.substr(separator + 1));
+  }
+
+  CHECK(inet_pton(AF_INET6, ip.c_str(), &address) == 1 && prefix_len <= 128,
+      "Failed to parse IPv6 address '%s'", ip_and_prefix.c_str());
+}
+
+void SetIPv6Address(const std::string_view& device_name,
+                    const std::string& ip_and_prefix) {
+  int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+  CHECK(fd >= 0, "Failed to open socket: %s (%d)", strerror(errno), errno);
+
+  struct ifreq ifr = {};
+  strncpy(ifr.ifr_name, std::string(device_name).c_str(), IFNAMSIZ);
+  int status = ioctl(fd, SIOCGIFINDEX, &ifr);
+  CHECK(status >= 0, "Failed to get tunnel interface index: %s (%d)",
+      strerror(errno), errno);
+
+  struct in6_ifreq ifr6 = {};
+  ifr6.ifr6_ifindex = ifr.ifr_ifindex;
+  ParseIPv6Address(ip_and_prefix, ifr6.ifr6_addr, ifr6.ifr6_prefixlen);
+  status = ioctl(fd, SIOCSIFADDR, &ifr6);
+  CHECK(status >= 0, "Failed to set tunnel interface ipv6: %s (%d)",
+      strerror(errno), errno);
+  close(fd);
+}
+
+// Opens the tunnel interface to listen on. The interface carries Ethernet
+// frames if tap is set and IP packets otherwise. Always returns a valid file
 // descriptor or quits and logs the error.
-int OpenTunnel(const std::string_view& device_name) {
+int OpenTunnel(const std::string_view& device_name, bool tap) {
   int fd = open("/dev/net/tun", O_RDWR);
   CHECK(fd >= 0, "Failed to open tunnel file: %s (%d)", strerror(errno), errno);
 
   struct ifreq ifr = {};
-  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  ifr.ifr_flags = (tap ? IFF_TAP : IFF_TUN) | IFF_NO_PI;
   strncpy(ifr.ifr_name, std::string(device_name).c_str(), IFNAMSIZ);
 
   int status = ioctl(fd, TUNSETIFF, &ifr);
@@ -93,6 +496,143 @@ int OpenTunnel(const std::string_view& device_name) {
   return fd;
 }
 
+// Opens a network namespace by name, creating it in the same way as
+// `ip netns add` if it does not exist so that programs can be run in it with
+// `ip netns exec`. The loopback interface of a new namespace is brought up.
+// Always returns a valid file descriptor or quits and logs the error.
+int OpenNetworkNamespace(const std::string& name) {
+  std::string path = "/run/netns/" + name;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  CHECK(mkdir("/run/netns", 0755) == 0 || errno == EEXIST,
+      "Failed to create /run/netns: %s (%d)", strerror(errno), errno);
+  fd = open(path.c_str(), O_RDONLY | O_CREAT | O_EXCL, 0);
+  CHECK(fd >= 0, "Failed to create '%s': %s (%d)", path.c_str(),
+      strerror(errno), errno);
+  close(fd);
+
+  // Only the calling thread is moved to a new namespace, so it is created
+  // from a thread that exits once the namespace is pinned by the mount.
+  std::thread([&]() {
+    CHECK(unshare(CLONE_NEWNET) == 0,
+        "Failed to create network namespace: %s (%d)", strerror(errno), errno);
+    CHECK(mount("/proc/thread-self/ns/net", path.c_str(), "none", MS_BIND,
+          nullptr) == 0,
+        "Failed to mount network namespace: %s (%d)", strerror(errno), errno);
+    SetInterfaceFlags("lo", IFF_UP);
+  }).join();
+
+  fd = open(path.c_str(), O_RDONLY);
+  CHECK(fd >= 0, "Failed to open '%s': %s (%d)", path.c_str(),
+      strerror(errno), errno);
+  LOGI("network namespace '%s' created", name.c_str());
+  return fd;
+}
+
+// Runs a function with the calling thread in a network namespace, which is
+// created if required. Quits and logs the error on failure.
+void RunInNetworkNamespace(const std::string& name,
+                           const std::function<void()>& function) {
+  int original_fd = open("/proc/thread-self/ns/net", O_RDONLY);
+  CHECK(original_fd >= 0, "Failed to open network namespace: %s (%d)",
+      strerror(errno), errno);
+  int fd = OpenNetworkNamespace(name);
+  CHECK(setns(fd, CLONE_NEWNET) == 0,
+      "Failed to enter network namespace '%s': %s (%d)", name.c_str(),
+      strerror(errno), errno);
+  function();
+  CHECK(setns(original_fd, CLONE_NEWNET) == 0,
+      "Failed to restore network namespace: %s (%d)", strerror(errno), errno);
+  close(fd);
+  close(original_fd);
+}
+
+// Returns the prefix of the IPv6 address of the tunnel of a link that is used
+// as the context for compressed headers, if the tunnel has an IPv6 address.
+std::optional<std::array<uint8_t, 8>> GetIPv6Context(
+    const LinkConfig& config) {
+  if (config.tunnel_ipv6.empty()) {
+    return std::nullopt;
+  }
+
+  struct in6_addr address;
+  uint32_t prefix_len;
+  ParseIPv6Address(config.tunnel_ipv6, address, prefix_len);
+  std::array<uint8_t, 8> ipv6_context;
+  std::copy(&address.s6_addr[0], &address.s6_addr[8], ipv6_context.begin());
+  return ipv6_context;
+}
+
+// Opens and configures the tunnel for a link and returns its file
+// descriptor. Quits and logs the error on failure.
+int SetupTunnel(const LinkConfig& config, uint32_t local_addr) {
+  const std::string& name = config.interface_name;
+  int tunnel_fd = OpenTunnel(name, config.tap);
+  LOGI("%s '%s' opened", config.tap ? "tap" : "tunnel", name.c_str());
+  SetInterfaceFlags(name, IFF_UP);
+  LOGI("tunnel '%s' up", name.c_str());
+  SetIPAddress(name, config.tunnel_ip, config.tunnel_mask);
+  LOGI("tunnel '%s' configured with '%s' mask '%s'",
+       name.c_str(), config.tunnel_ip.c_str(), config.tunnel_mask.c_str());
+
+  if (!config.tunnel_ipv6.empty()) {
+    // Assign a link-local address derived from the radio address so that it
+    // can be elided from compressed headers.
+    auto iid = nerfnet::IphcCodec::GetInterfaceID(local_addr);
+    std::string link_local = nerfnet::StringFormat(
+        "fe80::ff:fe00:%02x%02x/64", iid[6], iid[7]);
+    SetIPv6Address(name, link_local);
+    SetIPv6Address(name, config.tunnel_ipv6);
+    LOGI("tunnel '%s' configured with '%s' and '%s'", name.c_str(),
+         link_local.c_str(), config.tunnel_ipv6.c_str());
+  }
+
+  return tunnel_fd;
+}
+
+// Creates the primary or secondary side of a link for a radio backend, with
+// a radio created from the chip-enable and chip-select pins for the link and
+// for each further gateway of a roaming primary.
+template <typename RadioType>
+std::unique_ptr<nerfnet::RadioInterface> CreateRadioInterface(
+    const std::function<std::unique_ptr<RadioType>(
+        uint16_t ce_pin, uint16_t csn_pin)>& create_radio,
+    const LinkConfig& config, int tunnel_fd, uint32_t poll_interval_us,
+    uint32_t idle_poll_interval_us, uint32_t tdma_address) {
+  auto radio = create_radio(config.ce_pin, config.csn_pin);
+  radio->SetDataRate(config.data_rate);
+  if (config.primary) {
+    auto primary = std::make_unique<nerfnet::PrimaryRadioInterface<RadioType>>(
+        std::move(radio), tunnel_fd, config.primary_addr,
+        config.secondary_addr, poll_interval_us, idle_poll_interval_us);
+    for (const auto& [ce_pin, csn_pin] : config.gateway_pins) {
+      auto gateway = create_radio(ce_pin, csn_pin);
+      gateway->SetDataRate(config.data_rate);
+      primary->AddGateway(std::move(gateway));
+    }
+
+    return primary;
+  }
+
+  CHECK(config.gateway_pins.empty(),
+      "Only primary links can have gateways");
+  auto secondary = std::make_unique<nerfnet::SecondaryRadioInterface<RadioType>>(
+      std::move(radio), tunnel_fd, config.primary_addr,
+      config.secondary_addr);
+  if (config.roaming) {
+    secondary->EnableRoaming();
+  }
+
+  if (config.tdma) {
+    secondary->EnableTdma(tdma_address);
+  }
+
+  return secondary;
+}
+
 int main(int argc, char** argv) {
   // Parse command-line arguments.
   TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
@@ -101,6 +641,9 @@ int main(int argc, char** argv) {
   TCLAP::ValueArg<uint16_t> ce_pin_arg("", "ce_pin",
       "Set to the index of the NRF24L01 chip-enable pin.", false, 22, "index",
       cmd);
+  TCLAP::ValueArg<uint16_t> csn_pin_arg("", "csn_pin",
+      "Set to the index of the NRF24L01 chip-select pin.", false, 0, "index",
+      cmd);
   TCLAP::SwitchArg primary_arg("", "primary",
       "Run this side of the network in primary mode.", false);
   TCLAP::SwitchArg secondary_arg("", "secondary",
@@ -111,7 +654,13 @@ int main(int argc, char** argv) {
   TCLAP::ValueArg<std::string> tunnel_ip_mask("", "tunnel_mask",
       "The network mask to use for the tunnel interface.", false,
       "255.255.255.0", "mask", cmd);
-  cmd.xorAdd(primary_arg, secondary_arg);
+  TCLAP::SwitchArg emulate_arg("", "emulate",
+      "Run both sides of the network on this host over a simulated radio, "
+      "with the primary and secondary tunnels in their own network "
+      "namespaces.", false);
+  std::vector<TCLAP::Arg*> mode_args = {
+      &primary_arg, &secondary_arg, &emulate_arg};
+  cmd.xorAdd(mode_args);
   TCLAP::ValueArg<uint32_t> primary_addr_arg("", "primary_addr",
       "The address to use for the primary side of nerfnet.",
       false, 0x90019001, "address", cmd);
@@ -120,50 +669,532 @@ int main(int argc, char** argv) {
       false, 0x90009000, "address", cmd);
   TCLAP::ValueArg<uint8_t> channel_arg("", "channel",
       "The channel to use for transmit/receive.", false, 1, "channel", cmd);
+  TCLAP::ValueArg<std::string> data_rate_arg("", "data_rate",
+      "The data rate to use for transmit/receive: 250kbps, 1mbps or 2mbps.",
+      false, "2mbps", "rate", cmd);
   TCLAP::ValueArg<uint32_t> poll_interval_us_arg("", "poll_interval_us",
       "Used by the primary radio only to determine how often to poll.",
       false, 100, "microseconds", cmd);
+  TCLAP::ValueArg<uint32_t> idle_poll_interval_us_arg("",
+      "idle_poll_interval_us",
+      "Used by the primary radio only to determine how often to poll when "
+      "the link is idle.", false, 2000, "microseconds", cmd);
   TCLAP::SwitchArg enable_tunnel_logs_arg("", "enable_tunnel_logs",
       "Set to enable verbose logs for read/writes from the tunnel.", cmd);
+  TCLAP::ValueArg<std::string> tunnel_ipv6_arg("", "tunnel_ipv6",
+      "The IPv6 address and prefix length to assign to the tunnel interface. "
+      "The /64 prefix of this address is used to compress IPv6 headers and "
+      "must be shared by both sides of the link.", false, "", "ip/prefix",
+      cmd);
+  TCLAP::SwitchArg tap_arg("", "tap",
+      "Set to carry Ethernet frames over a TAP device instead of IP packets "
+      "over a TUN device.", cmd);
+  TCLAP::SwitchArg tap_forward_multicast_arg("", "tap_forward_multicast",
+      "Set to forward multicast frames in TAP mode. Broadcast frames other "
+      "than ARP requests are never forwarded.", cmd);
+  TCLAP::MultiArg<std::string> link_arg("", "link",
+      "Adds a link served by this process, specified as comma-separated "
+      "key=value pairs (interface_name, mode, tap, ce_pin, csn_pin, "
+      "tunnel_ip, tunnel_mask, tunnel_ipv6, primary_addr, secondary_addr, "
+      "channel, data_rate, key_file, frame_crc, dedup, compress, gateways, "
+      "roaming, tdma, shape, queue_kb). "
+      "Options that are not supplied are taken from the other flags. May be "
+      "repeated.",
+      false, "spec", cmd);
+  TCLAP::ValueArg<uint32_t> stats_interval_s_arg("", "stats_interval_s",
+      "The interval to log link stats at, zero to disable.",
+      false, 0, "seconds", cmd);
+  TCLAP::ValueArg<std::string> stats_path_arg("", "stats_path",
+      "A file to write link stats to at every stats interval.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<std::string> key_file_arg("", "key_file",
+      "A file containing a 256-bit pre-shared key as hexadecimal characters. "
+      "Traffic is encrypted and authenticated when set.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<uint32_t> aead_tag_size_arg("", "aead_tag_size",
+      "The number of authentication tag bytes sent with each frame when "
+      "traffic is encrypted.", false, 8, "bytes", cmd);
+  TCLAP::ValueArg<uint32_t> rekey_interval_s_arg("", "rekey_interval_s",
+      "The interval to rotate encryption keys at, zero to disable. Set on "
+      "the primary.", false, 600, "seconds", cmd);
+  TCLAP::SwitchArg frame_crc_arg("", "frame_crc",
+      "Set to append a CRC32C to every frame so that frames corrupted on "
+      "the air are detected and sent again.", cmd);
+  TCLAP::SwitchArg dedup_arg("", "dedup",
+      "Set to send frames that repeat recently sent frames as references to "
+      "a cache mirrored by the peer.", cmd);
+  TCLAP::SwitchArg compress_arg("", "compress",
+      "Set to compress small frames with a context that is carried across "
+      "the frames of a link.", cmd);
+  TCLAP::ValueArg<std::string> compression_dictionary_arg("",
+      "compression_dictionary",
+      "A preset dictionary for compression, as produced by the "
+      "compression_dictionary tool. Both sides must use the same dictionary.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<std::string> channel_plan_socket_arg("",
+      "channel_plan_socket",
+      "A unix socket to coordinate channels with other co-located links "
+      "over. Links are moved to the channels assigned by the server.",
+      false, "", "path", cmd);
+  TCLAP::SwitchArg channel_plan_server_arg("", "channel_plan_server",
+      "Set to serve the channel plan on the channel plan socket for this "
+      "and other processes.", cmd);
+  TCLAP::ValueArg<uint32_t> channel_plan_min_channel_arg("",
+      "channel_plan_min_channel",
+      "The lowest channel assigned by the channel plan server.",
+      false, 0, "channel", cmd);
+  TCLAP::ValueArg<uint32_t> channel_plan_max_channel_arg("",
+      "channel_plan_max_channel",
+      "The highest channel assigned by the channel plan server.",
+      false, 125, "channel", cmd);
+  TCLAP::ValueArg<std::string> emulate_netns_arg("", "emulate_netns",
+      "The prefix of the network namespaces that emulated links are placed "
+      "in. The primary and secondary tunnels are placed in the namespaces "
+      "with '-primary' and '-secondary' appended.",
+      false, "nerfnet", "name", cmd);
+  TCLAP::ValueArg<double> emulate_bit_error_rate_arg("",
+      "emulate_bit_error_rate",
+      "The probability that each bit sent over an emulated radio is "
+      "corrupted, with --emulate or --radio_socket_dir.",
+      false, 0.0, "rate", cmd);
+  TCLAP::ValueArg<std::string> radio_socket_dir_arg("", "radio_socket_dir",
+      "Set to emulate the radios of this process with unix sockets in the "
+      "directory instead of using NRF24L01 radios, so that nerfnet processes "
+      "on the same host can be linked.", false, "", "path", cmd);
+  TCLAP::ValueArg<std::string> survey_output_arg("", "survey_output",
+      "Set on the primary to survey the link on every channel and data rate "
+      "instead of running the tunnel, writing the results to this file as "
+      "CSV. The secondary follows the survey without any flags.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<uint32_t> survey_min_channel_arg("", "survey_min_channel",
+      "The lowest channel to survey.", false, 0, "channel", cmd);
+  TCLAP::ValueArg<uint32_t> survey_max_channel_arg("", "survey_max_channel",
+      "The highest channel to survey.", false, 125, "channel", cmd);
+  TCLAP::ValueArg<uint32_t> survey_probes_arg("", "survey_probes",
+      "The number of probes to send on each channel and data rate surveyed.",
+      false, 100, "count", cmd);
+  TCLAP::ValueArg<std::string> survey_results_arg("", "survey_results",
+      "Set on the primary to move the link to the channel and data rate "
+      "with the highest goodput in the results of an earlier survey.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<uint32_t> broadcast_address_arg("", "broadcast_address",
+      "The address that objects are broadcast to. On the NRF24L01 it may "
+      "only differ from the primary address of each link in the group in the "
+      "lowest byte.", false, 0x900190ff, "address", cmd);
+  TCLAP::ValueArg<std::string> broadcast_file_arg("", "broadcast_file",
+      "Set on the primary to broadcast this file to the secondaries of every "
+      "primary link on this host, which must share a channel and data rate.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<std::string> broadcast_output_dir_arg("",
+      "broadcast_output_dir",
+      "Set on the secondary to receive broadcast files into this directory.",
+      false, "", "path", cmd);
+  TCLAP::ValueArg<std::string> gateway_pins_arg("", "gateway_pins",
+      "The pins of the radios of further gateways of a primary link that a "
+      "secondary can roam between, as ce_pin:csn_pin pairs separated by '/'. "
+      "The gateways must share the channel of the link.",
+      false, "", "pins", cmd);
+  TCLAP::SwitchArg roaming_arg("", "roaming",
+      "Set on the secondary to roam between the gateways of the primary.",
+      cmd);
+  TCLAP::SwitchArg tdma_arg("", "tdma",
+      "Set on the primary to serve the primary links of this host in turn in "
+      "the slots of a TDMA superframe, and on the secondary to follow the "
+      "beacons of the superframe.", cmd);
+  TCLAP::ValueArg<uint32_t> tdma_address_arg("", "tdma_address",
+      "The address that TDMA beacons are sent to. On the NRF24L01 it may "
+      "only differ from the primary address of each link in the cell in the "
+      "lowest byte.", false, 0x900190fe, "address", cmd);
+  TCLAP::ValueArg<uint32_t> tdma_superframe_us_arg("", "tdma_superframe_us",
+      "The length of a TDMA superframe, which bounds the time that a link "
+      "waits to be served. Up to 63750us in steps of 250us.",
+      false, 20000, "microseconds", cmd);
+  TCLAP::ValueArg<std::string> shape_arg("", "shape",
+      "Shapes the frames sent by this side of a link by airtime, as "
+      "class:rate[:burst[:weight]] entries separated by '/'. The class is "
+      "link, tunnel, a datagram port or a range of ports such as 4-7, the "
+      "rate is a percentage of the airtime, or zero for no limit, and the "
+      "burst is in milliseconds.",
+      false, "", "spec", cmd);
+  TCLAP::ValueArg<uint32_t> queue_budget_kb_arg("", "queue_budget_kb",
+      "Bounds the memory used by the frames waiting to be sent over each "
+      "link, which is allocated up front. Frames are left in the tunnel and "
+      "datagrams are refused once it is used up. Zero for no budget.",
+      false, 0, "kilobytes", cmd);
+  TCLAP::ValueArg<uint32_t> broadcast_budget_kb_arg("", "broadcast_budget_kb",
+      "The largest broadcast object that is received, which bounds the "
+      "memory used to reassemble it. Larger objects are declined. Zero for "
+      "no limit.",
+      false, 0, "kilobytes", cmd);
+  TCLAP::ValueArg<std::string> handover_socket_arg("", "handover_socket",
+      "A unix socket that a new process connects to with --takeover to take "
+      "over the links of this process without resetting their connections.",
+      false, "", "path", cmd);
+  TCLAP::SwitchArg takeover_arg("", "takeover",
+      "Set to take over the tunnels and connections of the process "
+      "listening on the handover socket once it exits, such as when "
+      "upgrading the binary.", cmd);
   cmd.parse(argc, argv);
 
-  std::string tunnel_ip = tunnel_ip_arg.getValue();
+  LinkConfig default_config;
+  default_config.interface_name = interface_name_arg.getValue();
+  default_config.primary = primary_arg.getValue();
+  default_config.tap = tap_arg.getValue();
+  default_config.ce_pin = ce_pin_arg.getValue();
+  default_config.csn_pin = csn_pin_arg.getValue();
+  default_config.tunnel_ip = tunnel_ip_arg.getValue();
+  default_config.tunnel_mask = tunnel_ip_mask.getValue();
+  default_config.tunnel_ipv6 = tunnel_ipv6_arg.getValue();
+  default_config.primary_addr = primary_addr_arg.getValue();
+  default_config.secondary_addr = secondary_addr_arg.getValue();
+  default_config.channel = channel_arg.getValue();
+  CHECK(default_config.channel <= kMaxChannel,
+      "--channel must be at most %" PRIu64, kMaxChannel);
+  default_config.data_rate = ParseDataRate(data_rate_arg.getValue());
+  default_config.key_file = key_file_arg.getValue();
+  default_config.frame_crc = frame_crc_arg.getValue();
+  default_config.dedup = dedup_arg.getValue();
+  default_config.compress = compress_arg.getValue();
+  default_config.gateway_pins = ParseGatewayPins(gateway_pins_arg.getValue());
+  default_config.roaming = roaming_arg.getValue();
+  default_config.tdma = tdma_arg.getValue();
+  default_config.shaping = ParseShaping(shape_arg.getValue());
+  default_config.queue_budget_kb = queue_budget_kb_arg.getValue();
   if (!tunnel_ip_arg.isSet()) {
-    if (primary_arg.getValue()) {
-      tunnel_ip = "192.168.10.1";
-    } else if (secondary_arg.getValue()) {
-      tunnel_ip = "192.168.10.2";
+    default_config.tunnel_ip =
+        default_config.primary ? "192.168.10.1" : "192.168.10.2";
+  }
+
+  std::vector<LinkConfig> link_configs;
+  for (const auto& spec : link_arg.getValue()) {
+    link_configs.push_back(ParseLinkConfig(spec, default_config));
+  }
+
+  if (link_configs.empty() && emulate_arg.getValue()) {
+    CHECK(!tunnel_ipv6_arg.isSet(),
+        "Use --link to set the IPv6 address of each side of an emulated link");
+    for (bool primary : {true, false}) {
+      LinkConfig config = default_config;
+      config.primary = primary;
+      config.tunnel_ip = primary ? "192.168.10.1" : "192.168.10.2";
+      link_configs.push_back(config);
     }
+  } else if (link_configs.empty()) {
+    link_configs.push_back(default_config);
   }
 
-  // Setup tunnel.
-  int tunnel_fd = OpenTunnel(interface_name_arg.getValue());
-  LOGI("tunnel '%s' opened", interface_name_arg.getValue().c_str());
-  SetInterfaceFlags(interface_name_arg.getValue(), IFF_UP);
-  LOGI("tunnel '%s' up", interface_name_arg.getValue().c_str());
-  SetIPAddress(interface_name_arg.getValue(), tunnel_ip,
-      tunnel_ip_mask.getValue());
-  LOGI("tunnel '%s' configured with '%s' mask '%s'",
-       interface_name_arg.getValue().c_str(), tunnel_ip.c_str(),
-       tunnel_ip_mask.getValue().c_str());
-
-  if (primary_arg.getValue()) {
-    nerfnet::PrimaryRadioInterface radio_interface(
-        ce_pin_arg.getValue(), tunnel_fd,
-        primary_addr_arg.getValue(), secondary_addr_arg.getValue(),
-        channel_arg.getValue(), poll_interval_us_arg.getValue());
-    radio_interface.SetTunnelLogsEnabled(enable_tunnel_logs_arg.getValue());
-    radio_interface.Run();
-  } else if (secondary_arg.getValue()) {
-    nerfnet::SecondaryRadioInterface radio_interface(
-        ce_pin_arg.getValue(), tunnel_fd,
-        primary_addr_arg.getValue(), secondary_addr_arg.getValue(),
-        channel_arg.getValue());
-    radio_interface.SetTunnelLogsEnabled(enable_tunnel_logs_arg.getValue());
-    radio_interface.Run();
-  } else {
-    CHECK(false, "Primary or secondary mode must be enabled");
+  // Emulated radios pair up by address on a shared medium, so the links of
+  // either side can be supplied in any order.
+  const double bit_error_rate = emulate_bit_error_rate_arg.getValue();
+  CHECK(bit_error_rate >= 0.0 && bit_error_rate < 1.0,
+      "Invalid bit error rate");
+  CHECK(!emulate_arg.getValue() || radio_socket_dir_arg.getValue().empty(),
+      "Emulated links cannot use unix socket radios");
+  std::unique_ptr<nerfnet::SimulatedMedium> simulated_medium;
+  if (emulate_arg.getValue()) {
+    nerfnet::SimulatedChannelConfig channel_config;
+    channel_config.bit_error_rate = bit_error_rate;
+    channel_config.real_time = true;
+    simulated_medium =
+        std::make_unique<nerfnet::SimulatedMedium>(channel_config);
+    for (auto& config : link_configs) {
+      config.netns = emulate_netns_arg.getValue()
+          + (config.primary ? "-primary" : "-secondary");
+    }
+  }
+
+  // The links of the running process are received before anything else is
+  // set up, since it only releases its radios and sockets as it exits.
+  const std::string& handover_socket = handover_socket_arg.getValue();
+  CHECK(!takeover_arg.getValue() || !handover_socket.empty(),
+      "A handover socket is required to take over links");
+  CHECK(handover_socket.empty() || !emulate_arg.getValue(),
+      "Emulated links cannot be handed over");
+  CHECK(handover_socket.empty() || survey_output_arg.getValue().empty(),
+      "Links cannot be handed over during a survey");
+  std::vector<nerfnet::LinkHandover::Link> handover_links;
+  if (takeover_arg.getValue()) {
+    CHECK(nerfnet::LinkHandover::Receive(handover_socket, handover_links),
+        "Failed to take over links from '%s'", handover_socket.c_str());
+  }
+
+  std::vector<uint8_t> compression_dictionary;
+  if (!compression_dictionary_arg.getValue().empty()) {
+    compression_dictionary =
+        ReadDictionaryFile(compression_dictionary_arg.getValue());
+  }
+
+  std::unique_ptr<nerfnet::ChannelPlanServer> channel_plan_server;
+  if (channel_plan_server_arg.getValue()) {
+    CHECK(!channel_plan_socket_arg.getValue().empty(),
+        "A channel plan socket is required to serve the channel plan");
+    CHECK(channel_plan_min_channel_arg.getValue()
+            <= channel_plan_max_channel_arg.getValue()
+        && channel_plan_max_channel_arg.getValue() < 128,
+        "Invalid channel plan range");
+    channel_plan_server = std::make_unique<nerfnet::ChannelPlanServer>(
+        channel_plan_socket_arg.getValue(),
+        channel_plan_min_channel_arg.getValue(),
+        channel_plan_max_channel_arg.getValue());
+  }
+
+  nerfnet::LinkManager link_manager(
+      static_cast<uint64_t>(stats_interval_s_arg.getValue()) * 1000000,
+      stats_path_arg.getValue());
+  if (!channel_plan_socket_arg.getValue().empty()) {
+    link_manager.SetChannelPlanClient(
+        std::make_unique<nerfnet::ChannelPlanClient>(
+            channel_plan_socket_arg.getValue()));
+  }
+
+  // The primary side of a link blocks while it waits for a response, so
+  // emulated secondary links are serviced by an event loop of their own.
+  std::unique_ptr<nerfnet::LinkManager> secondary_link_manager;
+  if (emulate_arg.getValue()) {
+    std::string stats_path = stats_path_arg.getValue();
+    if (!stats_path.empty()) {
+      stats_path += ".secondary";
+    }
+
+    secondary_link_manager = std::make_unique<nerfnet::LinkManager>(
+        static_cast<uint64_t>(stats_interval_s_arg.getValue()) * 1000000,
+        stats_path);
+    if (!channel_plan_socket_arg.getValue().empty()) {
+      secondary_link_manager->SetChannelPlanClient(
+          std::make_unique<nerfnet::ChannelPlanClient>(
+              channel_plan_socket_arg.getValue()));
+    }
+  }
+
+  std::vector<nerfnet::RadioInterface*> primary_links;
+  std::vector<std::unique_ptr<nerfnet::BroadcastReceiver>>
+      broadcast_receivers;
+  bool tdma_cell = false;
+  for (const auto& config : link_configs) {
+    // Setup tunnel.
+    const std::string& name = config.interface_name;
+    uint32_t local_addr = config.primary
+        ? config.primary_addr : config.secondary_addr;
+    uint32_t peer_addr = config.primary
+        ? config.secondary_addr : config.primary_addr;
+    auto ipv6_context = GetIPv6Context(config);
+    auto handover_link = std::find_if(handover_links.begin(),
+        handover_links.end(), [&](const nerfnet::LinkHandover::Link& link) {
+          return link.name == name;
+        });
+    int tunnel_fd = -1;
+    if (handover_link != handover_links.end()) {
+      // The tunnel taken over is already configured.
+      tunnel_fd = handover_link->tunnel_fd;
+      handover_link->tunnel_fd = -1;
+      LOGI("tunnel '%s' taken over", name.c_str());
+    } else if (config.netns.empty()) {
+      tunnel_fd = SetupTunnel(config, local_addr);
+    } else {
+      RunInNetworkNamespace(config.netns, [&]() {
+        tunnel_fd = SetupTunnel(config, local_addr);
+      });
+      LOGI("tunnel '%s' placed in network namespace '%s'", name.c_str(),
+           config.netns.c_str());
+    }
+
+    // Emulated radios ignore the pins.
+    std::unique_ptr<nerfnet::RadioInterface> radio_interface;
+    if (simulated_medium != nullptr) {
+      radio_interface = CreateRadioInterface<nerfnet::SimulatedRadio>(
+          [&](uint16_t ce_pin, uint16_t csn_pin) {
+            auto radio = std::make_unique<nerfnet::SimulatedRadio>(
+                *simulated_medium);
+            radio->SetChannel(config.channel);
+            return radio;
+          },
+          config, tunnel_fd, poll_interval_us_arg.getValue(),
+          idle_poll_interval_us_arg.getValue(), tdma_address_arg.getValue());
+    } else if (!radio_socket_dir_arg.getValue().empty()) {
+      radio_interface = CreateRadioInterface<nerfnet::UnixSocketRadio>(
+          [&](uint16_t ce_pin, uint16_t csn_pin) {
+            return std::make_unique<nerfnet::UnixSocketRadio>(
+                radio_socket_dir_arg.getValue(), config.channel,
+                bit_error_rate);
+          },
+          config, tunnel_fd, poll_interval_us_arg.getValue(),
+          idle_poll_interval_us_arg.getValue(), tdma_address_arg.getValue());
+    } else {
+      radio_interface = CreateRadioInterface<nerfnet::RF24Radio>(
+          [&](uint16_t ce_pin, uint16_t csn_pin) {
+            return std::make_unique<nerfnet::RF24Radio>(ce_pin, csn_pin,
+                config.channel);
+          },
+          config, tunnel_fd, poll_interval_us_arg.getValue(),
+          idle_poll_interval_us_arg.getValue(), tdma_address_arg.getValue());
+    }
+
+    radio_interface->SetTunnelLogsEnabled(enable_tunnel_logs_arg.getValue());
+    if (config.queue_budget_kb != 0) {
+      radio_interface->SetMemoryBudget(
+          static_cast<size_t>(config.queue_budget_kb) * 1024);
+    }
+
+    if (config.tap) {
+      radio_interface->AddFrameCodec(std::make_unique<nerfnet::EthernetCodec>(
+          tap_forward_multicast_arg.getValue()));
+    } else {
+      radio_interface->AddFrameCodec(std::make_unique<nerfnet::IphcCodec>(
+          local_addr, peer_addr, ipv6_context));
+    }
+
+    if (config.dedup) {
+      radio_interface->AddFrameCodec(
+          std::make_unique<nerfnet::DedupCodec>());
+    }
+
+    if (config.compress) {
+      radio_interface->AddFrameCodec(
+          std::make_unique<nerfnet::CompressionCodec>(compression_dictionary));
+    }
+
+    if (!config.key_file.empty()) {
+      radio_interface->AddLinkCodec(std::make_unique<nerfnet::AeadCodec>(
+          ReadKeyFile(config.key_file), config.primary,
+          aead_tag_size_arg.getValue(),
+          static_cast<uint64_t>(rekey_interval_s_arg.getValue()) * 1000000));
+      LOGI("tunnel '%s' encrypted", name.c_str());
+    }
+
+    if (config.frame_crc) {
+      radio_interface->AddLinkCodec(std::make_unique<nerfnet::CrcCodec>());
+    }
+
+    if (config.shaping.has_value()) {
+      radio_interface->SetTrafficShaper(
+          std::make_unique<nerfnet::TrafficShaper>(config.shaping.value()));
+    }
+
+    // The connection carries on from the state of the process that the link
+    // was taken over from if the codecs of the link are unchanged.
+    if (handover_link != handover_links.end()
+        && !handover_link->state.empty()) {
+      nerfnet::LinkSnapshot snapshot(std::move(handover_link->state));
+      if (radio_interface->RestoreState(snapshot) && snapshot.IsConsumed()) {
+        LOGI("link '%s' taken over without a reset", name.c_str());
+      } else {
+        LOGE("Failed to restore link '%s', the connection will be reset",
+            name.c_str());
+      }
+    }
+
+    // Probes are always echoed by the secondary so that a survey can be run
+    // from the primary alone.
+    if (config.primary) {
+      primary_links.push_back(radio_interface.get());
+    } else {
+      nerfnet::SiteSurvey::EchoProbes(*radio_interface);
+      if (!broadcast_output_dir_arg.getValue().empty()) {
+        const std::string& directory = broadcast_output_dir_arg.getValue();
+        size_t max_object_size = broadcast_budget_kb_arg.getValue() != 0
+            ? static_cast<size_t>(broadcast_budget_kb_arg.getValue()) * 1024
+            : nerfnet::BroadcastSender::kMaxObjectSize;
+        broadcast_receivers.push_back(
+            std::make_unique<nerfnet::BroadcastReceiver>(*radio_interface,
+                broadcast_address_arg.getValue(),
+                [directory](const std::string& name,
+                            const std::vector<uint8_t>& data) {
+                  WriteBroadcastFile(directory, name, data);
+                }, max_object_size));
+      }
+    }
+
+    if (secondary_link_manager != nullptr && !config.primary) {
+      secondary_link_manager->AddLink(name, std::move(radio_interface));
+    } else {
+      link_manager.AddLink(name, std::move(radio_interface),
+          /*scheduled=*/config.primary && config.tdma);
+    }
+
+    tdma_cell |= config.primary && config.tdma;
+  }
+
+  // The tunnels of links that are no longer configured are closed, which
+  // removes them unless they are persistent.
+  for (const auto& link : handover_links) {
+    if (link.tunnel_fd >= 0) {
+      LOGI("Closing tunnel '%s' that is no longer configured",
+          link.name.c_str());
+      close(link.tunnel_fd);
+    }
+  }
+
+  if (!handover_socket.empty()) {
+    link_manager.SetHandover(
+        std::make_unique<nerfnet::LinkHandover>(handover_socket));
+  }
+
+  // The first scheduled link sends the beacons, so the links of the cell
+  // are expected to share its channel and data rate.
+  if (tdma_cell) {
+    link_manager.EnableTdma(tdma_address_arg.getValue(),
+        tdma_superframe_us_arg.getValue());
+  }
+
+  CHECK((survey_output_arg.getValue().empty()
+          && survey_results_arg.getValue().empty())
+      || primary_links.size() == 1,
+      "Surveys require exactly one primary link");
+  if (!survey_results_arg.getValue().empty()) {
+    auto best = nerfnet::SiteSurvey::ReadBestResult(
+        survey_results_arg.getValue());
+    CHECK(best.has_value(), "No setting carried probes in '%s'",
+        survey_results_arg.getValue().c_str());
+    LOGI("Moving to channel %u at %s from survey results", best->channel,
+        nerfnet::Radio::GetDataRateName(best->data_rate));
+    primary_links[0]->RequestChannel(best->channel, best->data_rate);
+  }
+
+  std::unique_ptr<nerfnet::SiteSurvey> site_survey;
+  if (!survey_output_arg.getValue().empty()) {
+    CHECK(survey_min_channel_arg.getValue()
+            <= survey_max_channel_arg.getValue()
+        && survey_max_channel_arg.getValue() < 128,
+        "Invalid survey channel range");
+    nerfnet::SiteSurvey::Config survey_config;
+    survey_config.min_channel = survey_min_channel_arg.getValue();
+    survey_config.max_channel = survey_max_channel_arg.getValue();
+    survey_config.probe_count = survey_probes_arg.getValue();
+    site_survey = std::make_unique<nerfnet::SiteSurvey>(*primary_links[0],
+        survey_config);
+  }
+
+  // The first primary link broadcasts to the secondaries of all of them.
+  std::unique_ptr<nerfnet::BroadcastSender> broadcast_sender;
+  if (!broadcast_file_arg.getValue().empty()) {
+    CHECK(!primary_links.empty(), "Broadcasts require a primary link");
+    broadcast_sender = std::make_unique<nerfnet::BroadcastSender>(
+        *primary_links[0], broadcast_address_arg.getValue(), primary_links);
+    CHECK(broadcast_sender->Send(broadcast_file_arg.getValue(),
+        ReadBroadcastFile(broadcast_file_arg.getValue())),
+        "Failed to start broadcast");
+  }
+
+  if (secondary_link_manager != nullptr) {
+    std::thread([&]() { secondary_link_manager->Run(); }).detach();
+  }
+
+  if (site_survey != nullptr) {
+    // The links are serviced until the process exits, since the event loop
+    // never returns.
+    std::thread([&]() { link_manager.Run(); }).detach();
+    auto results = site_survey->Run();
+    CHECK(!results.empty(), "Site survey failed");
+    CHECK(nerfnet::SiteSurvey::WriteResults(survey_output_arg.getValue(),
+        results), "Failed to write survey results");
+    LOGI("Survey results written to '%s'",
+        survey_output_arg.getValue().c_str());
+    exit(0);
   }
 
-  return 0;
+  // The event loop only returns once the links have been handed over. The
+  // process exits without releasing the links and sockets, so the new
+  // process, which waits for this one to exit, never races with it.
+  link_manager.Run();
+  exit(0);
 }
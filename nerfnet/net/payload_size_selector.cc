@@ -0,0 +1,108 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/payload_size_selector.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+PayloadSizeSelector::PayloadSizeSelector(size_t header_size,
+                                         size_t max_packet_size)
+    : header_size_(header_size),
+      max_packet_size_(max_packet_size),
+      bit_time_us_(Radio::GetBitTimeUs(Radio::DataRate::k2Mbps)),
+      attempts_(0.0),
+      failures_(0.0),
+      bits_(0.0),
+      writes_since_update_(0),
+      packet_size_(max_packet_size) {
+  CHECK(header_size_ + kMinPayloadSize <= max_packet_size_,
+      "Packets are too small to carry a payload");
+}
+
+void PayloadSizeSelector::RecordWrite(size_t packet_size, uint8_t retransmits,
+                                      bool acknowledged) {
+  double attempts = 1.0 + retransmits;
+  attempts_ = attempts_ * kHistoryWeight + attempts;
+  failures_ = failures_ * kHistoryWeight
+      + (acknowledged ? attempts - 1.0 : attempts);
+  bits_ = bits_ * kHistoryWeight + attempts * GetAttemptBits(packet_size);
+
+  if (++writes_since_update_ < kUpdateInterval) {
+    return;
+  }
+
+  writes_since_update_ = 0;
+  double bit_error_rate = GetBitErrorRate();
+  size_t best_size = max_packet_size_;
+  double best_goodput = GetExpectedGoodput(best_size, bit_error_rate);
+  for (size_t size = header_size_ + kMinPayloadSize;
+       size < max_packet_size_; size++) {
+    double goodput = GetExpectedGoodput(size, bit_error_rate);
+    if (goodput > best_goodput) {
+      best_size = size;
+      best_goodput = goodput;
+    }
+  }
+
+  if (best_goodput
+      > GetExpectedGoodput(packet_size_, bit_error_rate) * kHysteresis) {
+    packet_size_ = best_size;
+  }
+}
+
+double PayloadSizeSelector::GetBitErrorRate() const {
+  if (attempts_ == 0.0 || failures_ == 0.0) {
+    return 0.0;
+  }
+
+  // Solve (1 - ber)^bits = success for the mean bits sent per attempt. The
+  // success rate is bounded to keep the estimate finite when every attempt
+  // has failed.
+  double success = std::max(1.0 - failures_ / attempts_, 1e-3);
+  return 1.0 - std::pow(success, attempts_ / bits_);
+}
+
+void PayloadSizeSelector::SetDataRate(Radio::DataRate data_rate) {
+  bit_time_us_ = Radio::GetBitTimeUs(data_rate);
+  attempts_ = 0.0;
+  failures_ = 0.0;
+  bits_ = 0.0;
+  writes_since_update_ = 0;
+  packet_size_ = max_packet_size_;
+}
+
+double PayloadSizeSelector::GetAttemptAirtimeUs(size_t packet_size) const {
+  return kAttemptOverheadUs + GetAttemptBits(packet_size) * bit_time_us_;
+}
+
+double PayloadSizeSelector::GetAttemptBits(size_t packet_size) {
+  return kOverheadBits + kBitsPerByte * packet_size;
+}
+
+double PayloadSizeSelector::GetExpectedGoodput(size_t packet_size,
+                                               double bit_error_rate) const {
+  double bits = GetAttemptBits(packet_size);
+  double success = std::pow(1.0 - bit_error_rate, bits);
+  return (packet_size - header_size_) * success
+      / GetAttemptAirtimeUs(packet_size);
+}
+
+}  // namespace nerfnet
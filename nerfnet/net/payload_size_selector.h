@@ -0,0 +1,119 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_PAYLOAD_SIZE_SELECTOR_H_
+#define NERFNET_NET_PAYLOAD_SIZE_SELECTOR_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "nerfnet/net/radio.h"
+
+namespace nerfnet {
+
+// Chooses the size of the packets written to a radio to maximize the expected
+// goodput per unit of airtime. Each bit of a transmission and its
+// acknowledgement is modelled as being corrupted independently, with a bit
+// error rate estimated from the number of attempts that the radio needed to
+// deliver recent packets. Longer packets carry more payload for the fixed
+// overhead of each attempt but are more likely to be corrupted, so the size
+// shrinks as the link degrades.
+class PayloadSizeSelector {
+ public:
+  // Setup the selector for packets that begin with a header of the supplied
+  // size and are at most max_packet_size bytes. The largest packets are
+  // chosen until errors are observed.
+  PayloadSizeSelector(size_t header_size, size_t max_packet_size);
+
+  // Records the outcome of writing a packet of the supplied size, which was
+  // sent again by the radio the supplied number of times and then either
+  // acknowledged or given up on.
+  void RecordWrite(size_t packet_size, uint8_t retransmits, bool acknowledged);
+
+  // Returns the size of the packets to send, including the header.
+  size_t GetPacketSize() const { return packet_size_; }
+
+  // Returns the estimated bit error rate of the link.
+  double GetBitErrorRate() const;
+
+  // Returns the airtime taken by one attempt to deliver a packet of the
+  // supplied size, which covers its acknowledgement and turning the radios
+  // around, at the current data rate.
+  double GetAttemptAirtimeUs(size_t packet_size) const;
+
+  // Sets the data rate that packets are sent at. Errors depend on the data
+  // rate, so the estimate starts again with the largest packets.
+  void SetDataRate(Radio::DataRate data_rate);
+
+ private:
+  // The smallest payload that is chosen. Every packet also costs a full
+  // exchange between the radio interfaces, so tiny payloads are avoided even
+  // when they would make the best use of the air.
+  static constexpr size_t kMinPayloadSize = 8;
+
+  // The number of bits sent over the air for each byte of a packet and the
+  // fixed number of bits of preamble, 3 byte address, packet control field
+  // and 1 byte CRC of a packet and of its acknowledgement, as configured by
+  // the RF24Radio.
+  static constexpr double kBitsPerByte = 8.0;
+  static constexpr double kOverheadBits = 2.0 * (8 + 24 + 9 + 8);
+
+  // The fixed time spent switching the radios between transmit and receive
+  // for each attempt.
+  static constexpr double kAttemptOverheadUs = 260.0;
+
+  // The weight given to past writes when recording a new one, which sets
+  // how quickly the estimate tracks changes in the link.
+  static constexpr double kHistoryWeight = 0.995;
+
+  // The number of writes between updates of the chosen packet size.
+  static constexpr uint32_t kUpdateInterval = 16;
+
+  // The relative improvement in expected goodput that is required to change
+  // the packet size, to avoid switching back and forth on noise.
+  static constexpr double kHysteresis = 1.05;
+
+  // The size of the packet header and the largest packet.
+  const size_t header_size_;
+  const size_t max_packet_size_;
+
+  // The time taken to send each bit at the data rate of the link.
+  double bit_time_us_;
+
+  // The decayed totals of transmission attempts, failed attempts and bits
+  // sent in those attempts.
+  double attempts_;
+  double failures_;
+  double bits_;
+
+  // The number of writes since the packet size was last updated.
+  uint32_t writes_since_update_;
+
+  // The size of the packets to send.
+  size_t packet_size_;
+
+  // Returns the number of bits sent over the air by an attempt to deliver a
+  // packet of the supplied size.
+  static double GetAttemptBits(size_t packet_size);
+
+  // Returns the expected payload bytes delivered per microsecond of airtime
+  // for a packet size and bit error rate.
+  double GetExpectedGoodput(size_t packet_size, double bit_error_rate) const;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_PAYLOAD_SIZE_SELECTOR_H_
@@ -18,44 +18,64 @@
 
 #include <unistd.h>
 
+#include "nerfnet/net/rf24_radio.h"
+#include "nerfnet/net/simulated_radio.h"
+#include "nerfnet/net/unix_socket_radio.h"
+#include "nerfnet/util/encoding.h"
 #include "nerfnet/util/log.h"
 #include "nerfnet/util/macros.h"
+#include "nerfnet/util/random.h"
 #include "nerfnet/util/time.h"
 
 namespace nerfnet {
 
-PrimaryRadioInterface::PrimaryRadioInterface(
-    uint16_t ce_pin, int tunnel_fd,
-    uint32_t primary_addr, uint32_t secondary_addr, uint8_t channel,
-    uint64_t poll_interval_us)
-    : RadioInterface(ce_pin, tunnel_fd, primary_addr, secondary_addr, channel),
+template <typename RadioType>
+PrimaryRadioInterface<RadioType>::PrimaryRadioInterface(
+    std::unique_ptr<RadioType> radio, int tunnel_fd,
+    uint32_t primary_addr, uint32_t secondary_addr,
+    uint64_t poll_interval_us, uint64_t idle_poll_interval_us)
+    : RadioInterface(tunnel_fd, primary_addr, secondary_addr,
+                     radio->GetChannel(), radio->GetDataRate()),
+      radio_(radio.get()),
+      gateway_(0),
+      gateway_switch_us_(0),
+      next_beacon_us_(0),
       poll_interval_us_(poll_interval_us),
+      idle_poll_interval_us_(idle_poll_interval_us),
+      poll_fail_count_(0),
       current_poll_interval_us_(poll_interval_us_),
-      connection_reset_required_(true) {
-  uint8_t writing_addr[5] = {
-    static_cast<uint8_t>(primary_addr),
-    static_cast<uint8_t>(primary_addr >> 8),
-    static_cast<uint8_t>(primary_addr >> 16),
-    static_cast<uint8_t>(primary_addr >> 24),
-    0,
-  };
-
-  uint8_t reading_addr[5] = {
-    static_cast<uint8_t>(secondary_addr),
-    static_cast<uint8_t>(secondary_addr >> 8),
-    static_cast<uint8_t>(secondary_addr >> 16),
-    static_cast<uint8_t>(secondary_addr >> 24),
-    0,
-  };
-
-  radio_.openWritingPipe(writing_addr);
-  radio_.openReadingPipe(kPipeId, reading_addr);
-}
-
-void PrimaryRadioInterface::Run() {
-  while (1) {
-    SleepUs(current_poll_interval_us_);
+      connection_reset_required_(true),
+      last_poll_us_(0),
+      idle_poll_count_(0),
+      broadcast_pending_(false) {
+  gateways_.push_back(std::move(radio));
+  gateway_qualities_.push_back(0);
+  radio_->OpenWritingPipe(primary_addr);
+  radio_->OpenReadingPipe(kPipeId, secondary_addr);
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::AddGateway(
+    std::unique_ptr<RadioType> radio) {
+  CHECK(gateways_.size() < kMaxGateways, "Too many gateways");
+  radio->OpenWritingPipe(primary_addr_);
+  radio->OpenReadingPipe(kPipeId, secondary_addr_);
+  gateways_.push_back(std::move(radio));
+  gateway_qualities_.push_back(0);
+}
+
+template <typename RadioType>
+uint64_t PrimaryRadioInterface<RadioType>::Poll(uint64_t now_us) {
+  uint64_t next_poll_us;
+  {
     std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+    next_poll_us = last_poll_us_ + GetPollIntervalUs();
+    if (now_us < next_poll_us && !slot_end_us_.has_value()) {
+      return next_poll_us;
+    }
+
+    stats_.polls++;
+    last_poll_us_ = now_us;
     if (connection_reset_required_) {
       LOGI("Resetting connection");
       if (!ConnectionReset()) {
@@ -63,112 +83,326 @@ void PrimaryRadioInterface::Run() {
         HandleTransactionFailure();
       } else {
         LOGI("Connection reset successfully");
+        stats_.resets++;
+        ConfirmChannel();
+        ConfirmGateway();
         connection_reset_required_ = false;
       }
     } else if (PerformTunnelTransfer()) {
+      stats_.transfers++;
       poll_fail_count_ = 0;
       current_poll_interval_us_ = poll_interval_us_;
     } else {
+      stats_.transfer_failures++;
       HandleTransactionFailure();
     }
+
+    CheckChannelSwitch(now_us);
+    CheckGateway(now_us);
+    if (!connection_reset_required_) {
+      ServiceClockSync(now_us);
+    }
+
+  }
+
+  // The broadcast source may send datagrams over this link, so it is invoked
+  // without the lock held.
+  broadcast_pending_ = SendBroadcasts(*radio_);
+  SendBeacons(now_us);
+  {
+    std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+    next_poll_us = last_poll_us_ + GetPollIntervalUs();
+  }
+
+  DispatchDatagrams();
+  return next_poll_us;
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::PollSlot(uint64_t now_us,
+                                                uint64_t slot_end_us) {
+  // Another exchange is only started if there is as much time left in the
+  // slot as the last one took.
+  stats_.tdma_slots++;
+  slot_end_us_ = slot_end_us;
+  while (true) {
+    Poll(now_us);
+    uint64_t exchange_end_us = TimeNowUs();
+    uint64_t exchange_us = exchange_end_us - now_us;
+    now_us = exchange_end_us;
+    if (connection_reset_required_ || poll_fail_count_ != 0
+        || idle_poll_count_ != 0 || now_us + exchange_us >= slot_end_us) {
+      break;
+    }
+  }
+
+  slot_end_us_.reset();
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::SendTdmaBeacon(
+    uint32_t address, const std::vector<uint8_t>& beacon) {
+  CHECK(!beacon.empty() && beacon.size() <= kMaxBroadcastSize,
+      "Invalid beacon size %zu", beacon.size());
+  TuneRadio(*radio_);
+  if (listening_) {
+    radio_->StopListening();
+    listening_ = false;
+  }
+
+  radio_->WriteBroadcast(address, beacon.data(), beacon.size());
+  stats_.tdma_beacons++;
+}
+
+template <typename RadioType>
+bool PrimaryRadioInterface<RadioType>::SaveState(LinkSnapshot& snapshot) {
+  // A connection that is due to be reset has no state worth handing over.
+  if (connection_reset_required_ || !RadioInterface::SaveState(snapshot)) {
+    return false;
+  }
+
+  snapshot.PutU8(gateway_);
+  snapshot.PutU32(unconfirmed_offsets_.size());
+  for (size_t offset : unconfirmed_offsets_) {
+    snapshot.PutU32(offset);
+  }
+
+  return true;
+}
+
+template <typename RadioType>
+bool PrimaryRadioInterface<RadioType>::RestoreState(LinkSnapshot& snapshot) {
+  uint8_t gateway;
+  uint32_t unconfirmed_count;
+  if (!RadioInterface::RestoreState(snapshot) || !snapshot.GetU8(gateway)
+      || !snapshot.GetU32(unconfirmed_count)
+      || unconfirmed_count > kMaxUnconfirmedRequests + 1) {
+    return false;
+  }
+
+  unconfirmed_offsets_.clear();
+  for (uint32_t i = 0; i < unconfirmed_count; i++) {
+    uint32_t offset;
+    if (!snapshot.GetU32(offset)) {
+      return false;
+    }
+
+    unconfirmed_offsets_.push_back(offset);
+  }
+
+  // The link stays on the first gateway if the gateway that carried it is
+  // no longer configured, which the secondary follows from the beacons.
+  if (gateway < gateways_.size()) {
+    SetGateway(gateway);
   }
+
+  connection_reset_required_ = false;
+  return true;
 }
 
-bool PrimaryRadioInterface::ConnectionReset() {
-  next_id_ = 1;
-  last_ack_id_.reset();
-  frame_buffer_.clear();
+template <typename RadioType>
+uint64_t PrimaryRadioInterface<RadioType>::GetPollIntervalUs() const {
+  if (idle_poll_count_ >= kIdlePollThreshold && read_buffer_.empty()
+      && control_frames_.empty() && !broadcast_pending_) {
+    return std::max(current_poll_interval_us_, idle_poll_interval_us_);
+  }
+
+  return current_poll_interval_us_;
+}
 
-  std::vector<uint8_t> request(kMaxPacketSize, 0x00);
-  auto result = Send(request);
+template <typename RadioType>
+uint64_t PrimaryRadioInterface<RadioType>::GetResponseTimeoutUs() const {
+  if (!slot_end_us_.has_value()) {
+    return kResponseTimeoutUs;
+  }
+
+  uint64_t now_us = TimeNowUs();
+  uint64_t remaining_us = (slot_end_us_.value() > now_us)
+      ? slot_end_us_.value() - now_us : 0;
+  return std::min(std::max(remaining_us, kMinSlotResponseTimeoutUs),
+      kResponseTimeoutUs);
+}
+
+template <typename RadioType>
+bool PrimaryRadioInterface<RadioType>::ConnectionReset() {
+  LinkSession session;
+  session.primary_nonce = RandomU64();
+
+  std::vector<uint8_t> request(kResetPacketSize, 0x00);
+  WriteBigEndianU64(&request[kResetNonceOffset], session.primary_nonce);
+  WriteBigEndianU64(&request[kResetSequenceOffset], tx_sequence_);
+  SealResetPacket(request);
+  auto result = Send(*radio_, request);
   if (result != RequestResult::Success) {
     LOGE("Failed to send tunnel reset request");
     return false;
   }
 
-  std::vector<uint8_t> response(kMaxPacketSize, 0x00);
-  result = Receive(response, /*timeout_us=*/100000);
+  std::vector<uint8_t> response;
+  result = Receive(*radio_, response, GetResponseTimeoutUs());
   if (result != RequestResult::Success) {
     LOGE("Failed to receive tunnel reset response");
     return false;
   }
 
-  return response[0] == 0x00;
+  if (response.size() != kResetPacketSize || response[0] != 0x00
+      || !VerifyResetPacket(response)) {
+    LOGE("Received invalid tunnel reset response");
+    return false;
+  }
+
+  session.secondary_nonce = ReadBigEndianU64(&response[kResetNonceOffset]);
+  ResetLinkState(session,
+      ReadBigEndianU64(&response[kResetSequenceOffset]));
+  unconfirmed_offsets_.clear();
+  return true;
 }
 
-bool PrimaryRadioInterface::PerformTunnelTransfer() {
+template <typename RadioType>
+bool PrimaryRadioInterface<RadioType>::PerformTunnelTransfer() {
   TunnelTxRxPacket tunnel;
-  tunnel.id = next_id_;
-  if (last_ack_id_.has_value()) {
-    tunnel.ack_id = last_ack_id_.value();
-  }
+  tunnel.id = GetID(tx_sequence_);
+  tunnel.ack_id = GetAckID();
 
-  tunnel.bytes_left = 0;
-  if (!read_buffer_.empty()) {
-    auto& frame = read_buffer_.front();
-    size_t transfer_size = GetTransferSize(frame);
-    tunnel.payload = {frame.begin(), frame.begin() + transfer_size};
-    tunnel.bytes_left = std::min(frame.size(), static_cast<size_t>(UINT8_MAX));
-  }
+  // A frame that has been sent in full is held until a response reports
+  // whether the secondary decoded it.
+  tunnel.frame_error = rx_frame_error_;
+  bool payload_sent = !IsTxFrameSent() && FillTxPayload(tunnel);
 
   std::vector<uint8_t> request;
   CHECK(EncodeTunnelTxRxPacket(tunnel, request),
       "Failed to encode tunnel packet");
 
-  auto result = Send(request);
+  auto result = Send(*radio_, request);
   if (result != RequestResult::Success) {
     LOGE("Failed to send network tunnel txrx request");
     return false;
   }
 
-  std::vector<uint8_t> response(kMaxPacketSize);
-  result = Receive(response, /*timeout_us=*/100000);
-  if (result != RequestResult::Success) {
-    LOGE("Failed to receive network tunnel txrx request");
-    return false;
-  }
-  
-  if (!DecodeTunnelTxRxPacket(response, tunnel)) {
-    return false;
+  // The radio of the secondary acknowledged the request, so it is taken to
+  // be delivered and is not sent again unless a response shows that it was
+  // lost. The acknowledgement IDs of the packets only confirm it.
+  unconfirmed_offsets_.push_back(GetTxFrameOffset());
+  AdvanceSequence();
+  if (payload_sent) {
+    AdvanceTxFrame();
   }
 
-  if (!tunnel.id.has_value() || !tunnel.ack_id.has_value()) {
-    LOGE("Missing tunnel fields");
+  if (!ReceiveTunnelResponse(tunnel)) {
+    HandleMissingResponse(payload_sent);
     return false;
   }
 
+  // The secondary has heard this request, so the channel and gateway work.
+  ConfirmChannel();
+  ConfirmGateway();
 
   bool success = true;
-  if (tunnel.ack_id.value() != next_id_) {
-    LOGE("Secondary radio failed to ack, retransmitting: "
-         "ack_id=%u, next_id=%u", tunnel.ack_id.value(), next_id_);
+  auto confirmed = GetConfirmedRequests(tunnel.ack_id.value());
+  if (!confirmed.has_value()) {
+    LOGE("Secondary radio acknowledged an unknown packet: "
+         "ack_id=%u, next_id=%u", tunnel.ack_id.value(),
+         GetID(tx_sequence_));
+    HandleMissingResponse(payload_sent);
     success = false;
   } else {
-    AdvanceID();
-    if (!read_buffer_.empty()) {
-      auto& frame = read_buffer_.front();
-      frame.erase(frame.begin(), frame.begin() + GetTransferSize(frame));
-      if (frame.empty()) {
-        read_buffer_.pop_front();
-      }
+    if (confirmed.value() < unconfirmed_offsets_.size()) {
+      size_t lost = unconfirmed_offsets_.size() - confirmed.value();
+      LOGE("Secondary radio lost %zu acknowledged packets, retransmitting",
+          lost);
+      stats_.acked_packets_lost += lost;
+      RewindRequests(confirmed.value());
+      success = false;
+    }
+
+    // The secondary reports whether it decoded a frame until the primary
+    // accepts the response that carries the report, so any response that
+    // confirms the end of the frame carries it.
+    unconfirmed_offsets_.clear();
+    if (IsTxFrameSent()) {
+      ConsumeTxFrame(tunnel.frame_error);
     }
   }
 
+  if (payload_sent || !tunnel.payload.empty()) {
+    idle_poll_count_ = 0;
+  } else if (idle_poll_count_ < kIdlePollThreshold) {
+    idle_poll_count_++;
+  }
+
   if (!ValidateID(tunnel.id.value())) {
     LOGE("Received non-sequential packet");
     success = false;
-  } else if (!tunnel.payload.empty()) {
-    frame_buffer_.insert(frame_buffer_.end(),
-        tunnel.payload.begin(), tunnel.payload.end());
-    if (tunnel.bytes_left <= kMaxPayloadSize) {
-      WriteTunnel();
+  } else {
+    // The secondary sent this response after seeing any frame error that
+    // was reported to it.
+    rx_frame_error_ = false;
+    if (!tunnel.payload.empty()) {
+      ReceiveFramePayload(tunnel);
     }
   }
 
   return success;
 }
 
-void PrimaryRadioInterface::HandleTransactionFailure() {
+template <typename RadioType>
+bool PrimaryRadioInterface<RadioType>::ReceiveTunnelResponse(
+    TunnelTxRxPacket& tunnel) {
+  std::vector<uint8_t> response;
+  auto result = Receive(*radio_, response, GetResponseTimeoutUs());
+  if (result != RequestResult::Success) {
+    LOGE("Failed to receive network tunnel txrx request");
+    return false;
+  }
+
+  if (!DecodeTunnelTxRxPacket(response, tunnel)) {
+    return false;
+  }
+
+  if (!tunnel.id.has_value() || !tunnel.ack_id.has_value()) {
+    LOGE("Missing tunnel fields");
+    return false;
+  }
+
+  return true;
+}
+
+template <typename RadioType>
+std::optional<size_t> PrimaryRadioInterface<RadioType>::GetConfirmedRequests(
+    uint8_t ack_id) const {
+  // The request before the unconfirmed ones has been accepted, so the
+  // secondary acknowledges it if it lost all of them.
+  uint64_t first_sequence = tx_sequence_ - unconfirmed_offsets_.size();
+  for (size_t confirmed = unconfirmed_offsets_.size() + 1;
+       confirmed-- > 0;) {
+    if (first_sequence + confirmed > 0
+        && GetID(first_sequence + confirmed - 1) == ack_id) {
+      return confirmed;
+    }
+  }
+
+  return std::nullopt;
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::RewindRequests(size_t index) {
+  tx_sequence_ -= unconfirmed_offsets_.size() - index;
+  RewindTxFrame(unconfirmed_offsets_[index]);
+  unconfirmed_offsets_.resize(index);
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::HandleMissingResponse(
+    bool payload_sent) {
+  if (unconfirmed_offsets_.size() > kMaxUnconfirmedRequests) {
+    RewindRequests(unconfirmed_offsets_.size() - 1);
+  } else if (payload_sent) {
+    stats_.retransmits_avoided++;
+  }
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::HandleTransactionFailure() {
   poll_fail_count_++;
   if (poll_fail_count_ > 10) {
     if (current_poll_interval_us_ < 1000000) {
@@ -179,4 +413,144 @@ void PrimaryRadioInterface::HandleTransactionFailure() {
   }
 }
 
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::HandleChannelRequest(
+    const RadioSetting& setting) {
+  if (setting.channel != channel_ || setting.data_rate != data_rate_) {
+    SendChannelSwitch(setting, /*switch_on_delivery=*/true);
+  }
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::HandleChannelSwitch(
+    const RadioSetting& setting) {
+  LOGI("Secondary requested channel %u at %s", setting.channel,
+      Radio::GetDataRateName(setting.data_rate));
+  HandleChannelRequest(setting);
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::SendBeacons(uint64_t now_us) {
+  if (gateways_.size() < 2 || now_us < next_beacon_us_) {
+    return;
+  }
+
+  next_beacon_us_ = now_us + kBeaconIntervalUs;
+  if (listening_) {
+    radio_->StopListening();
+    listening_ = false;
+  }
+
+  // The gateways that do not carry the link are only tuned when they send a
+  // beacon.
+  uint8_t beacon[kBeaconSize] = {kBeaconMarker, 0,
+      static_cast<uint8_t>(gateway_)};
+  for (size_t i = 0; i < gateways_.size(); i++) {
+    RadioType& radio = *gateways_[i];
+    if (i != gateway_) {
+      radio.SetChannel(radio_channel_);
+      radio.SetDataRate(radio_data_rate_);
+    }
+
+    beacon[1] = i;
+    radio.WriteBroadcast(GetBeaconAddress(), beacon, sizeof(beacon));
+  }
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::SwitchGateway(size_t gateway) {
+  previous_gateway_ = gateway_;
+  gateway_switch_us_ = TimeNowUs();
+  SetGateway(gateway);
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::SetGateway(size_t gateway) {
+  if (listening_) {
+    radio_->StopListening();
+    listening_ = false;
+  }
+
+  // The link state is shared by all gateways, so the new gateway carries on
+  // with the same session and sequence numbers and nothing queued is lost.
+  gateway_ = gateway;
+  radio_ = gateways_[gateway].get();
+  radio_->SetChannel(radio_channel_);
+  radio_->SetDataRate(radio_data_rate_);
+  stats_.gateway = gateway;
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::ConfirmGateway() {
+  if (previous_gateway_.has_value()) {
+    LOGI("Roamed from gateway %zu to gateway %zu", previous_gateway_.value(),
+        gateway_);
+    previous_gateway_.reset();
+    stats_.roams++;
+  }
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::CheckGateway(uint64_t now_us) {
+  if (previous_gateway_.has_value()) {
+    if (now_us >= gateway_switch_us_ + kGatewaySwitchTimeoutUs) {
+      LOGE("No exchange through gateway %zu, returning to gateway %zu",
+          gateway_, previous_gateway_.value());
+      SetGateway(previous_gateway_.value());
+      previous_gateway_.reset();
+      stats_.roam_failures++;
+    }
+
+    return;
+  }
+
+  if (poll_fail_count_ < kMaxGatewayFailures) {
+    return;
+  }
+
+  size_t best_gateway = gateway_;
+  for (size_t i = 0; i < gateways_.size(); i++) {
+    if (gateway_qualities_[i] > gateway_qualities_[best_gateway]) {
+      best_gateway = i;
+    }
+  }
+
+  if (best_gateway != gateway_) {
+    LOGE("Exchanges through gateway %zu are failing, moving to gateway %zu",
+        gateway_, best_gateway);
+    SwitchGateway(best_gateway);
+    poll_fail_count_ = 0;
+    current_poll_interval_us_ = poll_interval_us_;
+  }
+}
+
+template <typename RadioType>
+void PrimaryRadioInterface<RadioType>::HandleControlMessage(
+    ControlMessageType type, const uint8_t* data, size_t size) {
+  if (type != ControlMessageType::RoamReport) {
+    RadioInterface::HandleControlMessage(type, data, size);
+    return;
+  } else if (size < 1) {
+    LOGE("Ignoring invalid roam report");
+    return;
+  }
+
+  for (size_t i = 1; i < size && i <= gateways_.size(); i++) {
+    gateway_qualities_[i - 1] = data[i];
+  }
+
+  uint8_t gateway = data[0];
+  if (gateway < gateways_.size() && gateway != gateway_
+      && !previous_gateway_.has_value()) {
+    LOGI("Secondary requested gateway %u", gateway);
+    SwitchGateway(gateway);
+  }
+}
+
+// Backends that are only known at run time use the virtual interface.
+template class PrimaryRadioInterface<RF24Radio>;
+template class PrimaryRadioInterface<SimulatedRadio>;
+template class PrimaryRadioInterface<UnixSocketRadio>;
+template class PrimaryRadioInterface<Radio>;
+
 }  // namespace nerfnet
@@ -17,41 +17,179 @@
 #ifndef NERFNET_NET_PRIMARY_RADIO_INTERFACE_H_
 #define NERFNET_NET_PRIMARY_RADIO_INTERFACE_H_
 
+#include <deque>
 #include <optional>
 
 #include "nerfnet/net/radio_interface.h"
 
 namespace nerfnet {
 
-// The primary mode radio interface.
+// The primary mode radio interface. The radio backend is a template parameter
+// so that the calls made to the radio for every packet are direct. It is
+// instantiated for the RF24Radio, SimulatedRadio and UnixSocketRadio, and for
+// the Radio interface to support backends that are chosen at run time.
+template <typename RadioType>
 class PrimaryRadioInterface : public RadioInterface {
  public:
   // Setup the primary radio link.
-  PrimaryRadioInterface(uint16_t ce_pin, int tunnel_fd,
+  PrimaryRadioInterface(std::unique_ptr<RadioType> radio, int tunnel_fd,
                         uint32_t primary_addr, uint32_t secondary_addr,
-                        uint8_t channel, uint64_t poll_interval_us);
+                        uint64_t poll_interval_us,
+                        uint64_t idle_poll_interval_us);
 
-  // Runs the interface.
-  void Run();
+  // Adds the radio of another gateway that the link can be carried by, so
+  // that a secondary that moves about can roam between gateways without
+  // resetting the connection. The gateways take turns sending beacons on the
+  // channel of the link, and the link moves to the gateway that the
+  // secondary asks for. Must be called before the link is serviced.
+  void AddGateway(std::unique_ptr<RadioType> radio);
+
+  // Polls the secondary radio if the poll interval has elapsed.
+  uint64_t Poll(uint64_t now_us) override;
+
+  // Exchanges with the secondary back to back until the slot ends or the
+  // link runs out of payloads to exchange.
+  void PollSlot(uint64_t now_us, uint64_t slot_end_us) override;
+
+  // Broadcasts a TDMA beacon from the radio that carries the link.
+  void SendTdmaBeacon(uint32_t address,
+                      const std::vector<uint8_t>& beacon) override;
+
+  // Saves and restores the gateway that carries the link along with the
+  // state of the connection. The connection is not reset once restored.
+  bool SaveState(LinkSnapshot& snapshot) override;
+  bool RestoreState(LinkSnapshot& snapshot) override;
 
  private:
+  // The number of consecutive exchanges without payload before the link is
+  // considered idle.
+  static constexpr int kIdlePollThreshold = 10;
+
+  // The time to wait for a response from the secondary and the shortest time
+  // that this is cut to at the end of a TDMA slot, which leaves a secondary
+  // that does not follow the beacons time to notice the request.
+  static constexpr uint64_t kResponseTimeoutUs = 100000;
+  static constexpr uint64_t kMinSlotResponseTimeoutUs = 5000;
+
+  // The time allowed for an exchange to succeed through a new gateway
+  // before returning to the previous one, and the number of consecutive
+  // failed exchanges after which the link moves to the gateway with the best
+  // beacons without waiting to be asked.
+  static constexpr uint64_t kGatewaySwitchTimeoutUs = 250000;
+  static constexpr int kMaxGatewayFailures = 3;
+
+  // The most requests that are taken to be delivered on the strength of the
+  // acknowledgement from the radio of the secondary before a response
+  // confirms them. This keeps the acknowledgement IDs that the secondary
+  // responds with unambiguous.
+  static constexpr size_t kMaxUnconfirmedRequests = 4;
+
+  // The radios of the gateways that can carry the link, starting with the
+  // radio that the link was created with, and the radio and index of the
+  // gateway that carries it.
+  std::vector<std::unique_ptr<RadioType>> gateways_;
+  RadioType* radio_;
+  size_t gateway_;
+
+  // The gateway that the link moved from and the time of the move, while no
+  // exchange has succeeded through the new gateway.
+  std::optional<size_t> previous_gateway_;
+  uint64_t gateway_switch_us_;
+
+  // The quality of the beacons of each gateway last reported by the
+  // secondary, from 0 to 255.
+  std::vector<uint8_t> gateway_qualities_;
+
+  // The time that the next beacons are due.
+  uint64_t next_beacon_us_;
+
   // The interval between poll operations to the secondary radio.
   const uint64_t poll_interval_us_;
 
+  // The interval between poll operations while the link is idle.
+  const uint64_t idle_poll_interval_us_;
+
   // Logic for poll backoff when the secondary radio is not responding.
   int poll_fail_count_;
   uint64_t current_poll_interval_us_;
   bool connection_reset_required_;
 
+  // The time of the last poll and the number of consecutive exchanges that
+  // did not carry a payload in either direction.
+  uint64_t last_poll_us_;
+  int idle_poll_count_;
+
+  // Set while the broadcast source may have packets to send, which keeps
+  // the link from polling at the idle rate.
+  bool broadcast_pending_;
+
+  // The end of the TDMA slot that the link is being serviced in, if any.
+  std::optional<uint64_t> slot_end_us_;
+
+  // The offset of the frame being sent before each request that the radio of
+  // the secondary acknowledged and that no response has confirmed yet,
+  // oldest first. These requests took the sequence numbers just before the
+  // next one.
+  std::deque<size_t> unconfirmed_offsets_;
+
+  // Returns the interval to wait before the next poll. The read buffer lock
+  // must be held.
+  uint64_t GetPollIntervalUs() const;
+
+  // Returns the time to wait for a response from the secondary, which is
+  // limited by the end of the current slot.
+  uint64_t GetResponseTimeoutUs() const;
+
   // Requests that a new connection be opened.
   bool ConnectionReset();
 
   // Sends and receives messages to exchange network packets.
   bool PerformTunnelTransfer();
 
+  // Receives and decodes the response to a tunnel request.
+  bool ReceiveTunnelResponse(TunnelTxRxPacket& tunnel);
+
+  // Returns the number of unconfirmed requests that the secondary has
+  // accepted according to the acknowledgement ID of a response, or nullopt if
+  // the ID belongs to none of them or to the request before them.
+  std::optional<size_t> GetConfirmedRequests(uint8_t ack_id) const;
+
+  // Forgets the unconfirmed requests from an index onwards, which are sent
+  // again with the same sequence numbers and payloads.
+  void RewindRequests(size_t index);
+
+  // Sends the latest request again if no response confirms it and too many
+  // requests are already unconfirmed.
+  void HandleMissingResponse(bool payload_sent);
+
   // Updates the backoff configuration in the light of a failure.
   void HandleTransactionFailure();
 
+  // Sends a beacon from each gateway if they are due.
+  void SendBeacons(uint64_t now_us);
+
+  // Moves the link to another gateway, remembering the current one to return
+  // to if no exchange succeeds through the new one in time.
+  void SwitchGateway(size_t gateway);
+
+  // Makes a gateway carry the link.
+  void SetGateway(size_t gateway);
+
+  // Marks the current gateway as working once an exchange has succeeded
+  // through it.
+  void ConfirmGateway();
+
+  // Returns to the previous gateway if the new one has not been confirmed in
+  // time, and moves to the gateway with the best beacons if the current one
+  // keeps failing.
+  void CheckGateway(uint64_t now_us);
+
+  // RadioInterface methods.
+  void HandleChannelRequest(const RadioSetting& setting) override;
+  void HandleChannelSwitch(const RadioSetting& setting) override;
+  void HandleControlMessage(ControlMessageType type,
+                            const uint8_t* data, size_t size) override;
+
 };
 
 }  // namespace nerfnet
@@ -0,0 +1,58 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/radio.h"
+
+namespace nerfnet {
+
+double Radio::GetBitTimeUs(DataRate data_rate) {
+  switch (data_rate) {
+    case DataRate::k250Kbps:
+      return 4.0;
+    case DataRate::k1Mbps:
+      return 1.0;
+    case DataRate::k2Mbps:
+      return 0.5;
+  }
+
+  return 0.5;
+}
+
+const char* Radio::GetDataRateName(DataRate data_rate) {
+  switch (data_rate) {
+    case DataRate::k250Kbps:
+      return "250kbps";
+    case DataRate::k1Mbps:
+      return "1mbps";
+    case DataRate::k2Mbps:
+      return "2mbps";
+  }
+
+  return "unknown";
+}
+
+std::optional<Radio::DataRate> Radio::ParseDataRate(const std::string& name) {
+  for (DataRate data_rate : {DataRate::k250Kbps, DataRate::k1Mbps,
+                             DataRate::k2Mbps}) {
+    if (name == GetDataRateName(data_rate)) {
+      return data_rate;
+    }
+  }
+
+  return std::nullopt;
+}
+
+}  // namespace nerfnet
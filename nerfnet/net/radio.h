@@ -0,0 +1,107 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_RADIO_H_
+#define NERFNET_NET_RADIO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// The interface to an NRF24L01 style packet radio. Implementations handle
+// acknowledgements and retries, so a write only succeeds once the packet has
+// been acknowledged by the receiver. Packets vary in length up to 32 bytes.
+class Radio : public NonCopyable {
+ public:
+  virtual ~Radio() = default;
+
+  // A packet read from the radio.
+  struct RxPacket {
+    // The pipe that the packet was received on.
+    uint8_t pipe;
+
+    // The contents of the packet.
+    std::vector<uint8_t> data;
+  };
+
+  // The rates that packets are sent over the air at. Lower rates take longer
+  // to send each packet but are received at lower signal levels.
+  enum class DataRate : uint8_t {
+    k250Kbps = 0,
+    k1Mbps = 1,
+    k2Mbps = 2,
+  };
+
+  // Returns the time taken to send a bit at a data rate.
+  static double GetBitTimeUs(DataRate data_rate);
+
+  // Returns the name of a data rate, such as "2mbps", and parses a data rate
+  // from its name.
+  static const char* GetDataRateName(DataRate data_rate);
+  static std::optional<DataRate> ParseDataRate(const std::string& name);
+
+  // Sets the address that packets are transmitted to.
+  virtual void OpenWritingPipe(uint32_t address) = 0;
+
+  // Sets the address that packets are received on for the supplied pipe.
+  virtual void OpenReadingPipe(uint8_t pipe, uint32_t address) = 0;
+
+  // Sets and returns the channel that the radio operates on. The channel may
+  // be changed at any time and takes effect for the next packet.
+  virtual void SetChannel(uint8_t channel) = 0;
+  virtual uint8_t GetChannel() = 0;
+
+  // Sets and returns the data rate that the radio operates at. Packets are
+  // only received from radios using the same data rate. The data rate may be
+  // changed at any time and takes effect for the next packet.
+  virtual void SetDataRate(DataRate data_rate) = 0;
+  virtual DataRate GetDataRate() = 0;
+
+  // Places the radio in receive or transmit mode.
+  virtual void StartListening() = 0;
+  virtual void StopListening() = 0;
+
+  // Transmits a packet. Returns true if the packet was acknowledged.
+  virtual bool Write(const uint8_t* data, size_t size) = 0;
+
+  // Transmits a packet to an address without asking for an acknowledgement,
+  // so that every radio listening on the address may receive it. The packet
+  // is sent once and may be lost.
+  virtual void WriteBroadcast(uint32_t address, const uint8_t* data,
+                              size_t size) = 0;
+
+  // Returns the number of times the last packet written was sent again
+  // before it was acknowledged or the write failed.
+  virtual uint8_t GetRetransmitCount() = 0;
+
+  // Returns true if a received packet is available to be read.
+  virtual bool Available() = 0;
+
+  // Drains the receive FIFO, appending every packet waiting in it to the
+  // supplied list in the order they were received. Returns true if packets
+  // may have been dropped because the FIFO was full.
+  virtual bool ReadAll(std::vector<RxPacket>& packets) = 0;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_RADIO_H_
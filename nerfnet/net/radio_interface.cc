@@ -16,74 +16,306 @@
 
 #include "nerfnet/net/radio_interface.h"
 
+#include <cstring>
+#include <poll.h>
 #include <unistd.h>
 
+#include "nerfnet/util/crc32c.h"
+#include "nerfnet/util/encoding.h"
 #include "nerfnet/util/log.h"
 #include "nerfnet/util/time.h"
 
 namespace nerfnet {
 
-RadioInterface::RadioInterface(uint16_t ce_pin, int tunnel_fd,
-                               uint32_t primary_addr, uint32_t secondary_addr,
-                               uint8_t channel)
-    : radio_(ce_pin, 0),
-      tunnel_fd_(tunnel_fd),
+RadioInterface::RadioInterface(int tunnel_fd, uint32_t primary_addr,
+                               uint32_t secondary_addr, uint8_t channel,
+                               Radio::DataRate data_rate)
+    : tunnel_fd_(tunnel_fd),
       primary_addr_(primary_addr),
       secondary_addr_(secondary_addr),
-      tunnel_thread_(&RadioInterface::TunnelThread, this),
-      next_id_(1),
-      tunnel_logs_enabled_(false) {
-  CHECK(channel < 128, "Channel must be between 0 and 127");
-  CHECK(radio_.begin(), "Failed to start NRF24L01");
-  radio_.setChannel(channel);
-  radio_.setPALevel(RF24_PA_MAX);
-  radio_.setDataRate(RF24_2MBPS);
-  radio_.setAddressWidth(3);
-  radio_.setAutoAck(1);
-  radio_.setRetries(0, 15);
-  radio_.setCRCLength(RF24_CRC_8);
-  CHECK(radio_.isChipConnected(), "NRF24L01 is unavailable");
+      running_(false),
+      max_buffered_frames_(kMaxBufferedFrames),
+      frame_pool_size_(0),
+      tx_frame_encoded_(false),
+      tx_sequence_(0),
+      tunnel_logs_enabled_(false),
+      listening_(false),
+      rx_frame_error_(false),
+      channel_(channel),
+      data_rate_(data_rate),
+      radio_channel_(channel),
+      radio_data_rate_(data_rate),
+      channel_switch_us_(0),
+      payload_size_selector_(kPacketHeaderSize, kMaxPacketSize),
+      clock_request_us_(0),
+      queue_delay_us_(0.0),
+      broadcast_address_(0),
+      broadcast_pipe_open_(false),
+      peer_backlog_(0) {
+  frame_buffer_.reserve(kMaxEncodedFrameSize);
+  payload_size_selector_.SetDataRate(data_rate);
+  stats_.packet_size = payload_size_selector_.GetPacketSize();
+  stats_.channel = channel_;
+  stats_.data_rate_kbps = 1000.0 / Radio::GetBitTimeUs(data_rate);
+  StartTunnel();
 }
 
 RadioInterface::~RadioInterface() {
+  StopTunnel();
+}
+
+void RadioInterface::StopTunnel() {
   running_ = false;
-  tunnel_thread_.join();
+  if (tunnel_thread_.joinable()) {
+    tunnel_thread_.join();
+  }
 }
 
-RadioInterface::RequestResult RadioInterface::Send(
-    const std::vector<uint8_t>& request) {
-  radio_.stopListening();
+void RadioInterface::StartTunnel() {
+  if (tunnel_fd_ >= 0 && !tunnel_thread_.joinable()) {
+    running_ = true;
+    tunnel_thread_ = std::thread(&RadioInterface::TunnelThread, this);
+  }
+}
 
-  if (request.size() > kMaxPacketSize) {
-    LOGE("Request is too large (%zu vs %zu)", request.size(), kMaxPacketSize);
-    return RequestResult::Malformed;
+bool RadioInterface::SaveState(LinkSnapshot& snapshot) {
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  snapshot.PutU8(kSnapshotVersion);
+  snapshot.PutU64(tx_sequence_);
+  rx_window_.Save(snapshot);
+  snapshot.PutU8(rx_frame_error_);
+  snapshot.PutBytes(frame_buffer_);
+  snapshot.PutU8(channel_);
+  snapshot.PutU8(static_cast<uint8_t>(data_rate_.load()));
+
+  // Frames already encoded for transmission depend on the codec state that
+  // is saved with them, so they are sent as they are.
+  snapshot.PutU8(tx_frame_encoded_);
+  snapshot.PutU32(read_buffer_.size());
+  for (const auto& frame : read_buffer_) {
+    SaveTxFrame(snapshot, frame);
   }
 
-  if (!radio_.write(request.data(), request.size())) {
-    LOGE("Failed to write request");
-    return RequestResult::TransmitError;
+  snapshot.PutU32(control_frames_.size());
+  for (const auto& frame : control_frames_) {
+    SaveTxFrame(snapshot, frame);
   }
 
-  while (!radio_.txStandBy()) {
-    LOGI("Waiting for transmit standby");
+  snapshot.PutU32(frame_codecs_.size() + link_codecs_.size());
+  for (const auto& codec : frame_codecs_) {
+    if (!codec->SaveState(snapshot)) {
+      return false;
+    }
+  }
+
+  for (const auto& codec : link_codecs_) {
+    if (!codec->SaveState(snapshot)) {
+      return false;
+    }
   }
 
-  return RequestResult::Success;
+  return true;
 }
 
-RadioInterface::RequestResult RadioInterface::Receive(
-    std::vector<uint8_t>& response, uint64_t timeout_us) {
-  radio_.startListening();
-  uint64_t start_us = TimeNowUs();
-  while (!radio_.available()) {
-    if (timeout_us != 0 && (start_us + timeout_us) < TimeNowUs()) {
-      LOGE("Timeout receiving response");
-      return RequestResult::Timeout;
+bool RadioInterface::RestoreState(LinkSnapshot& snapshot) {
+  // Codecs may send control messages as they are restored, which requires
+  // the lock.
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  uint8_t version;
+  if (!snapshot.GetU8(version) || version != kSnapshotVersion) {
+    LOGE("Unsupported link state version");
+    return false;
+  }
+
+  uint8_t rx_frame_error;
+  uint8_t channel;
+  uint8_t data_rate;
+  if (!snapshot.GetU64(tx_sequence_) || !rx_window_.Restore(snapshot)
+      || !snapshot.GetU8(rx_frame_error)
+      || !snapshot.GetBytes(frame_buffer_)
+      || !snapshot.GetU8(channel) || !snapshot.GetU8(data_rate)
+      || data_rate > static_cast<uint8_t>(Radio::DataRate::k2Mbps)) {
+    return false;
+  }
+
+  rx_frame_error_ = rx_frame_error;
+  SetSetting({channel, static_cast<Radio::DataRate>(data_rate)});
+
+  uint8_t tx_frame_encoded;
+  uint32_t frame_count;
+  if (!snapshot.GetU8(tx_frame_encoded) || !snapshot.GetU32(frame_count)) {
+    return false;
+  }
+
+  // The frames saved are queued ahead of any read from the tunnel since.
+  std::deque<TxFrame> frames;
+  for (uint32_t i = 0; i < frame_count; i++) {
+    frames.emplace_back();
+    if (!RestoreTxFrame(snapshot, frames.back())) {
+      return false;
+    }
+  }
+
+  read_buffer_.insert(read_buffer_.begin(), frames.begin(), frames.end());
+  tx_frame_encoded_ = tx_frame_encoded && frame_count != 0;
+  if (!snapshot.GetU32(frame_count)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < frame_count; i++) {
+    control_frames_.emplace_back();
+    if (!RestoreTxFrame(snapshot, control_frames_.back())) {
+      return false;
+    }
+  }
+
+  uint32_t codec_count;
+  if (!snapshot.GetU32(codec_count)
+      || codec_count != frame_codecs_.size() + link_codecs_.size()) {
+    LOGE("Saved link state does not match the codecs of the link");
+    return false;
+  }
+
+  for (auto& codec : frame_codecs_) {
+    if (!codec->RestoreState(snapshot)) {
+      return false;
+    }
+  }
+
+  for (auto& codec : link_codecs_) {
+    if (!codec->RestoreState(snapshot)) {
+      return false;
     }
   }
 
-  radio_.read(response.data(), response.size());
-  return RequestResult::Success;
+  return true;
+}
+
+void RadioInterface::SetDatagramHandler(uint8_t port,
+                                        DatagramHandler handler) {
+  CHECK(port < kMaxDatagramPorts, "Invalid datagram port %u", port);
+  datagram_handlers_[port] = std::move(handler);
+}
+
+bool RadioInterface::SendDatagram(uint8_t port,
+                                  const std::vector<uint8_t>& message) {
+  CHECK(port < kMaxDatagramPorts, "Invalid datagram port %u", port);
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  if (read_buffer_.size() >= max_buffered_frames_
+      || message.size() > kMaxFrameSize) {
+    return false;
+  }
+
+  // The dispatch byte is written ahead of the message as it is queued, so
+  // the message is not moved along to make room for it once it is sent.
+  read_buffer_.push_back({port, AllocateFrame()});
+  auto& frame = read_buffer_.back().data;
+  frame.push_back(kDatagramDispatch | port);
+  frame.insert(frame.end(), message.begin(), message.end());
+  read_buffer_.back().queued_us = TimeNowUs();
+  if (wake_callback_) {
+    wake_callback_();
+  }
+
+  return true;
+}
+
+void RadioInterface::SetBroadcastSource(uint32_t address,
+                                        BroadcastSource source) {
+  broadcast_address_ = address;
+  broadcast_source_ = std::move(source);
+}
+
+void RadioInterface::SetBroadcastHandler(uint32_t address,
+                                         DatagramHandler handler) {
+  broadcast_address_ = address;
+  broadcast_handler_ = std::move(handler);
+}
+
+void RadioInterface::RequestChannel(uint8_t channel) {
+  RequestChannel(channel, data_rate_);
+}
+
+void RadioInterface::RequestChannel(uint8_t channel,
+                                    Radio::DataRate data_rate) {
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  HandleChannelRequest({channel, data_rate});
+  if (wake_callback_) {
+    wake_callback_();
+  }
+}
+
+void RadioInterface::RecordWrite(size_t size, uint8_t retransmits,
+                                 bool acknowledged) {
+  // The airtime is taken before recording the write, which may change the
+  // estimates it is based on.
+  if (tx_shaping_class_.has_value()) {
+    double airtime_us = payload_size_selector_.GetAttemptAirtimeUs(size)
+        * (1 + retransmits);
+    shaper_->Charge(tx_shaping_class_.value(), airtime_us);
+    stats_.shaping_classes[tx_shaping_class_.value()].airtime_us +=
+        static_cast<uint64_t>(airtime_us);
+    tx_shaping_class_.reset();
+  }
+
+  payload_size_selector_.RecordWrite(size, retransmits, acknowledged);
+  stats_.packet_retransmits += retransmits;
+  stats_.packet_size = payload_size_selector_.GetPacketSize();
+  stats_.bit_error_rate_ppm = static_cast<uint64_t>(
+      payload_size_selector_.GetBitErrorRate() * 1e6);
+  if (acknowledged) {
+    stats_.bytes_tx += size;
+  }
+}
+
+void RadioInterface::SetWakeCallback(std::function<void()> callback) {
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  wake_callback_ = std::move(callback);
+}
+
+void RadioInterface::AddFrameCodec(std::unique_ptr<FrameCodec> codec) {
+  codec->SetControlChannel(this);
+  frame_codecs_.push_back(std::move(codec));
+}
+
+void RadioInterface::AddLinkCodec(std::unique_ptr<FrameCodec> codec) {
+  codec->SetControlChannel(this);
+  link_codecs_.push_back(std::move(codec));
+}
+
+void RadioInterface::SetMemoryBudget(size_t bytes) {
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  max_buffered_frames_ = bytes / kMaxEncodedFrameSize;
+  CHECK(max_buffered_frames_ >= kMinBufferedFrames,
+      "Memory budget of %zu bytes is too small, at least %zu are required",
+      bytes, kMinBufferedFrames * kMaxEncodedFrameSize);
+  frame_pool_size_ = max_buffered_frames_;
+  frame_pool_.resize(frame_pool_size_);
+  for (auto& frame : frame_pool_) {
+    frame.reserve(kMaxEncodedFrameSize);
+  }
+}
+
+void RadioInterface::SetTrafficShaper(std::unique_ptr<TrafficShaper> shaper) {
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  shaper_ = std::move(shaper);
+  stats_.shaping_classes.clear();
+  for (size_t i = 0; i < shaper_->GetClassCount(); i++) {
+    stats_.shaping_classes.push_back({shaper_->GetClassName(i)});
+  }
+}
+
+LinkStats RadioInterface::GetStats() const {
+  LinkStats stats = stats_;
+  for (const auto& codec : frame_codecs_) {
+    codec->AddStats(stats);
+  }
+
+  for (const auto& codec : link_codecs_) {
+    codec->AddStats(stats);
+  }
+
+  return stats;
 }
 
 size_t RadioInterface::GetReadBufferSize() {
@@ -91,35 +323,520 @@ size_t RadioInterface::GetReadBufferSize() {
   return read_buffer_.size();
 }
 
-size_t RadioInterface::GetTransferSize(const std::vector<uint8_t>& frame) {
-  return std::min(frame.size(), static_cast<size_t>(kMaxPayloadSize));
+std::vector<uint8_t> RadioInterface::AllocateFrame() {
+  if (frame_pool_.empty()) {
+    std::vector<uint8_t> frame;
+    if (frame_pool_size_ != 0) {
+      frame.reserve(kMaxEncodedFrameSize);
+    }
+
+    return frame;
+  }
+
+  std::vector<uint8_t> frame = std::move(frame_pool_.back());
+  frame_pool_.pop_back();
+  return frame;
+}
+
+void RadioInterface::ReleaseFrame(std::vector<uint8_t>& frame) {
+  // Datagrams and control messages arrive in storage of any size, so only
+  // storage that can hold any frame and is no larger than needed is kept.
+  if (frame_pool_.size() < frame_pool_size_
+      && frame.capacity() >= kMaxFrameSize
+      && frame.capacity() <= kMaxEncodedFrameSize) {
+    frame.clear();
+    frame_pool_.push_back(std::move(frame));
+  }
+}
+
+size_t RadioInterface::GetBacklog() {
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  return GetQueuedBytes() + peer_backlog_;
+}
+
+void RadioInterface::PollSlot(uint64_t now_us, uint64_t slot_end_us) {
+  CHECK(false, "Only primary links can be scheduled");
+}
+
+void RadioInterface::SendTdmaBeacon(uint32_t address,
+                                    const std::vector<uint8_t>& beacon) {
+  CHECK(false, "Only primary links send TDMA beacons");
+}
+
+size_t RadioInterface::GetQueuedBytes() const {
+  size_t queued_bytes = 0;
+  for (const auto& frame : read_buffer_) {
+    if (frame.port != kControlPort) {
+      queued_bytes += frame.data.size() - frame.offset;
+    }
+  }
+
+  return queued_bytes;
+}
+
+size_t RadioInterface::GetTransferSize(const TxFrame& frame) {
+  return std::min(frame.data.size() - frame.offset,
+      payload_size_selector_.GetPacketSize() - kPacketHeaderSize);
+}
+
+RadioInterface::TxFrame* RadioInterface::GetTxFrame() {
+  while (!tx_frame_encoded_
+      && (!read_buffer_.empty() || !control_frames_.empty())) {
+    // Control messages are sent ahead of frames that have not been encoded.
+    if (!control_frames_.empty()) {
+      read_buffer_.push_front(std::move(control_frames_.front()));
+      control_frames_.pop_front();
+    } else if (shaper_ != nullptr && !SelectShapedFrame()) {
+      return nullptr;
+    }
+
+    auto& frame = read_buffer_.front();
+    auto result = FrameCodec::Result::Forward;
+    size_t encoded_codecs = 0;
+    if (frame.port == kControlPort) {
+      StampClockMessage(frame.data);
+      stats_.control_messages_tx++;
+    } else if (frame.port != kTunnelPort) {
+      stats_.datagrams_tx++;
+    } else {
+      for (auto& codec : frame_codecs_) {
+        result = codec->Encode(frame.data);
+        encoded_codecs++;
+        if (result != FrameCodec::Result::Forward) {
+          break;
+        }
+      }
+
+      // Tunnel frames must not be mistaken for datagrams or control
+      // messages by the peer.
+      if (result == FrameCodec::Result::Forward && !frame.data.empty()
+          && ((frame.data[0] & kDatagramDispatchMask) == kDatagramDispatch
+              || (frame.data[0] & kControlDispatchMask) == kControlDispatch)) {
+        result = FrameCodec::Result::Drop;
+      }
+    }
+
+    if (result == FrameCodec::Result::Forward && !frame.data.empty()) {
+      for (auto& codec : link_codecs_) {
+        result = codec->Encode(frame.data);
+        if (result != FrameCodec::Result::Forward) {
+          break;
+        }
+      }
+    }
+
+    if (result == FrameCodec::Result::Forward && !frame.data.empty()) {
+      tx_frame_encoded_ = true;
+
+      // Control messages are sent ahead of the queue, so only other frames
+      // contribute to the queue delay.
+      if (frame.port != kControlPort) {
+        double delay_us = static_cast<double>(TimeNowUs() - frame.queued_us);
+        queue_delay_us_ += kQueueDelayWeight * (delay_us - queue_delay_us_);
+        stats_.queue_delay_tx_us = static_cast<uint64_t>(queue_delay_us_);
+      }
+    } else {
+      if (result == FrameCodec::Result::Reply) {
+        WriteTunnelFrame(frame.data);
+        stats_.frames_replied++;
+      } else {
+        stats_.frames_filtered++;
+      }
+
+      AbandonTxFrame(encoded_codecs);
+      ReleaseFrame(frame.data);
+      read_buffer_.pop_front();
+    }
+  }
+
+  return read_buffer_.empty() ? nullptr : &read_buffer_.front();
+}
+
+bool RadioInterface::SelectShapedFrame() {
+  // The first frame of each class is the next one it sends, so frames keep
+  // their order within a class. Control messages left in the read buffer
+  // are sent first.
+  size_t class_count = shaper_->GetClassCount();
+  std::vector<bool> waiting(class_count, false);
+  std::vector<std::deque<TxFrame>::iterator> heads(class_count);
+  std::optional<std::deque<TxFrame>::iterator> control_frame;
+  size_t waiting_count = 0;
+  for (auto frame = read_buffer_.begin();
+       frame != read_buffer_.end() && waiting_count < class_count; frame++) {
+    if (frame->port == kControlPort) {
+      control_frame = frame;
+      break;
+    }
+
+    size_t class_index = shaper_->Classify(frame->port == kTunnelPort,
+                                           frame->port);
+    if (!waiting[class_index]) {
+      waiting[class_index] = true;
+      heads[class_index] = frame;
+      waiting_count++;
+    }
+  }
+
+  std::deque<TxFrame>::iterator selected_frame;
+  if (control_frame.has_value()) {
+    selected_frame = control_frame.value();
+  } else {
+    uint64_t now_us = TimeNowUs();
+    auto selected = shaper_->SelectClass(waiting, now_us);
+    for (size_t i = 0; i < class_count; i++) {
+      if (waiting[i] && !shaper_->IsConforming(i, now_us)) {
+        heads[i]->shaping_delayed = true;
+      }
+    }
+
+    if (!selected.has_value()) {
+      return false;
+    }
+
+    selected_frame = heads[selected.value()];
+    selected_frame->shaping_class = selected.value();
+    auto& class_stats = stats_.shaping_classes[selected.value()];
+    class_stats.frames++;
+    stats_.frames_shaped++;
+    if (selected_frame->shaping_delayed) {
+      class_stats.frames_delayed++;
+      stats_.frames_delayed++;
+    }
+  }
+
+  if (selected_frame != read_buffer_.begin()) {
+    TxFrame frame = std::move(*selected_frame);
+    read_buffer_.erase(selected_frame);
+    read_buffer_.push_front(std::move(frame));
+  }
+
+  return true;
+}
+
+bool RadioInterface::FillTxPayload(TunnelTxRxPacket& tunnel) {
+  TxFrame* frame = GetTxFrame();
+  if (frame == nullptr) {
+    return false;
+  }
+
+  // The size is recorded since the packet size may change before the
+  // payload is acknowledged.
+  frame->in_flight = GetTransferSize(*frame);
+  tx_shaping_class_ = frame->shaping_class;
+  auto start = frame->data.begin() + frame->offset;
+  tunnel.payload = {start, start + frame->in_flight};
+  tunnel.bytes_left = std::min(frame->data.size() - frame->offset,
+      static_cast<size_t>(kBytesLeftMask));
+  return true;
+}
+
+void RadioInterface::ConsumeTxFrame(bool frame_error) {
+  auto& frame = read_buffer_.front();
+  frame.offset += frame.in_flight;
+  frame.in_flight = 0;
+  if (frame.offset < frame.data.size()) {
+    return;
+  }
+
+  // The encoded frame is kept until it has been decoded by the peer so that
+  // it can be sent again unchanged if it was corrupted.
+  if (frame_error && frame.retransmits < kMaxFrameRetransmits) {
+    frame.offset = 0;
+    frame.retransmits++;
+    stats_.frames_retransmitted++;
+    return;
+  }
+
+  if (frame_error) {
+    stats_.frames_abandoned++;
+    if (frame.port == kTunnelPort) {
+      AbandonTxFrame(frame_codecs_.size());
+    }
+  } else {
+    stats_.frames_tx++;
+    if (frame.setting.has_value()) {
+      SwitchChannel(frame.setting.value());
+    }
+  }
+
+  ReleaseFrame(frame.data);
+  read_buffer_.pop_front();
+  tx_frame_encoded_ = false;
 }
 
-void RadioInterface::AdvanceID() {
-  next_id_++;
-  if (next_id_ > kIDMask) {
-    next_id_ = 1;
+void RadioInterface::AbandonTxFrame(size_t codec_count) {
+  for (size_t i = 0; i < codec_count; i++) {
+    frame_codecs_[i]->AbandonFrame();
   }
 }
 
+size_t RadioInterface::GetTxFrameOffset() const {
+  return tx_frame_encoded_ ? read_buffer_.front().offset : 0;
+}
+
+bool RadioInterface::IsTxFrameSent() const {
+  return tx_frame_encoded_
+      && read_buffer_.front().offset == read_buffer_.front().data.size();
+}
+
+void RadioInterface::AdvanceTxFrame() {
+  auto& frame = read_buffer_.front();
+  frame.offset += frame.in_flight;
+  frame.in_flight = 0;
+}
+
+void RadioInterface::RewindTxFrame(size_t offset) {
+  if (tx_frame_encoded_) {
+    auto& frame = read_buffer_.front();
+    frame.offset = offset;
+    frame.in_flight = 0;
+  }
+}
+
+void RadioInterface::ResetLinkState(const LinkSession& session,
+                                    uint64_t peer_sequence) {
+  rx_window_.Reset(peer_sequence);
+  frame_buffer_.clear();
+  rx_frame_error_ = false;
+  peer_backlog_ = 0;
+  tx_shaping_class_.reset();
+
+  // A frame that has been encoded may depend on codec state that is about to
+  // be discarded and may have been partially delivered, so it is dropped.
+  if (tx_frame_encoded_) {
+    ReleaseFrame(read_buffer_.front().data);
+    read_buffer_.pop_front();
+    tx_frame_encoded_ = false;
+  }
+
+  // Control messages only apply to the connection they were sent on, except
+  // for channel switches that have yet to be announced.
+  for (auto frame = control_frames_.begin();
+       frame != control_frames_.end();) {
+    if (!frame->setting.has_value()) {
+      frame = control_frames_.erase(frame);
+    } else {
+      frame++;
+    }
+  }
+
+  for (auto frame = read_buffer_.begin(); frame != read_buffer_.end();) {
+    if (frame->port == kControlPort && !frame->setting.has_value()) {
+      frame = read_buffer_.erase(frame);
+    } else {
+      frame++;
+    }
+  }
+
+  for (auto& codec : frame_codecs_) {
+    codec->Reset(session);
+  }
+
+  for (auto& codec : link_codecs_) {
+    codec->Reset(session);
+  }
+}
+
+void RadioInterface::SealResetPacket(std::vector<uint8_t>& packet) {
+  WriteLittleEndianU32(&packet[kResetCrcOffset],
+      Crc32c(packet.data(), kResetCrcOffset));
+}
+
+bool RadioInterface::VerifyResetPacket(const std::vector<uint8_t>& packet) {
+  return Crc32c(packet.data(), kResetCrcOffset)
+      == ReadLittleEndianU32(&packet[kResetCrcOffset]);
+}
+
+void RadioInterface::SwitchChannel(const RadioSetting& setting) {
+  if (setting.channel == channel_ && setting.data_rate == data_rate_) {
+    return;
+  }
+
+  LOGI("Switching from channel %u at %s to %u at %s", channel_.load(),
+      Radio::GetDataRateName(data_rate_), setting.channel,
+      Radio::GetDataRateName(setting.data_rate));
+  if (!previous_setting_.has_value()) {
+    previous_setting_ = GetSetting();
+  }
+
+  channel_switch_us_ = TimeNowUs();
+  SetSetting(setting);
+}
+
+void RadioInterface::ConfirmChannel() {
+  if (previous_setting_.has_value()) {
+    LOGI("Switched to channel %u at %s", channel_.load(),
+        Radio::GetDataRateName(data_rate_));
+    previous_setting_.reset();
+    stats_.channel_switches++;
+  }
+}
+
+void RadioInterface::CheckChannelSwitch(uint64_t now_us) {
+  if (!previous_setting_.has_value()
+      || now_us < channel_switch_us_ + kChannelSwitchTimeoutUs) {
+    return;
+  }
+
+  LOGE("No exchange on channel %u at %s, returning to channel %u at %s",
+      channel_.load(), Radio::GetDataRateName(data_rate_),
+      previous_setting_->channel,
+      Radio::GetDataRateName(previous_setting_->data_rate));
+  SetSetting(previous_setting_.value());
+  previous_setting_.reset();
+  stats_.channel_switch_failures++;
+}
+
+void RadioInterface::SetSetting(const RadioSetting& setting) {
+  channel_ = setting.channel;
+  data_rate_ = setting.data_rate;
+  stats_.channel = setting.channel;
+  stats_.data_rate_kbps = 1000.0 / Radio::GetBitTimeUs(setting.data_rate);
+}
+
+void RadioInterface::SendChannelSwitch(const RadioSetting& setting,
+                                       bool switch_on_delivery) {
+  SendControlMessage(ControlMessageType::ChannelSwitch,
+      {setting.channel, static_cast<uint8_t>(setting.data_rate)});
+  if (switch_on_delivery) {
+    control_frames_.back().setting = setting;
+  }
+}
+
+void RadioInterface::ServiceClockSync(uint64_t now_us) {
+  if (now_us - clock_request_us_ < kClockSyncIntervalUs) {
+    return;
+  }
+
+  // The times are written when the request is sent. An earlier request that
+  // has not been answered is abandoned.
+  clock_request_us_ = now_us;
+  clock_origin_us_.reset();
+  SendControlMessage(ControlMessageType::ClockRequest,
+      std::vector<uint8_t>(kClockMessageSize, 0x00));
+}
+
+void RadioInterface::StampClockMessage(std::vector<uint8_t>& frame) {
+  auto type = static_cast<ControlMessageType>(
+      frame[0] & ~kControlDispatchMask);
+  if ((type != ControlMessageType::ClockRequest
+          && type != ControlMessageType::ClockResponse)
+      || frame.size() != kClockMessageSize + 1) {
+    return;
+  }
+
+  uint64_t now_us = TimeNowUs();
+  uint8_t* message = &frame[1];
+  WriteBigEndianU64(&message[kClockTransmitOffset], now_us);
+  WriteBigEndianU32(&message[kClockQueueDelayOffset],
+      std::min(queue_delay_us_, static_cast<double>(UINT32_MAX)));
+  if (type == ControlMessageType::ClockRequest) {
+    clock_origin_us_ = now_us;
+  }
+}
+
+void RadioInterface::HandleClockMessage(ControlMessageType type,
+                                        const uint8_t* data, size_t size) {
+  uint64_t now_us = TimeNowUs();
+  if (size != kClockMessageSize) {
+    LOGE("Ignoring invalid clock message");
+    return;
+  }
+
+  stats_.queue_delay_rx_us = ReadBigEndianU32(&data[kClockQueueDelayOffset]);
+  if (type == ControlMessageType::ClockRequest) {
+    std::vector<uint8_t> response(kClockMessageSize, 0x00);
+    WriteBigEndianU64(&response[kClockOriginOffset],
+        ReadBigEndianU64(&data[kClockTransmitOffset]));
+    WriteBigEndianU64(&response[kClockReceiveOffset], now_us);
+    SendControlMessage(ControlMessageType::ClockResponse, std::move(response));
+    return;
+  }
+
+  // Responses to requests that were abandoned or sent on an earlier
+  // connection are ignored.
+  uint64_t origin_us = ReadBigEndianU64(&data[kClockOriginOffset]);
+  if (clock_origin_us_ != origin_us) {
+    return;
+  }
+
+  clock_origin_us_.reset();
+  clock_sync_.AddSample(origin_us,
+      ReadBigEndianU64(&data[kClockReceiveOffset]),
+      ReadBigEndianU64(&data[kClockTransmitOffset]), now_us);
+  stats_.clock_offset_us = clock_sync_.GetOffsetUs(now_us);
+  stats_.clock_drift_ppb = clock_sync_.GetDriftPpb();
+  stats_.one_way_delay_tx_us = clock_sync_.GetTxDelayUs();
+  stats_.one_way_delay_rx_us = clock_sync_.GetRxDelayUs();
+}
+
+uint8_t RadioInterface::GetID(uint64_t sequence) {
+  return 1 + (sequence % kIDMask);
+}
+
+std::optional<uint8_t> RadioInterface::GetAckID() const {
+  auto sequence = rx_window_.GetLastAccepted();
+  if (!sequence.has_value()) {
+    return std::nullopt;
+  }
+
+  return GetID(sequence.value());
+}
+
+void RadioInterface::AdvanceSequence() {
+  tx_sequence_++;
+}
+
 bool RadioInterface::ValidateID(uint8_t id) {
-  if (!last_ack_id_.has_value()
-      || (last_ack_id_.value() == kIDMask && id == 1)
-      || (id == (last_ack_id_.value() + 1))) {
-    last_ack_id_ = id;
-    return true;
+  // Recover the full sequence number closest to the one expected. IDs up to
+  // half the ID space ahead are treated as newer and the rest as older.
+  uint64_t expected = rx_window_.GetNext();
+  uint64_t offset = (id - 1 + kIDMask - (expected % kIDMask)) % kIDMask;
+  uint64_t sequence = expected + offset;
+  if (offset > kIDMask / 2 && sequence >= kIDMask) {
+    sequence -= kIDMask;
   }
 
-  return false;
+  if (!rx_window_.Check(sequence)) {
+    stats_.packets_duplicate++;
+    return false;
+  }
+
+  // Packets are delivered in order by the link, so anything other than the
+  // next packet is the result of corruption or injection.
+  if (sequence != expected) {
+    stats_.packets_unexpected++;
+    return false;
+  }
+
+  rx_window_.Accept(sequence);
+  return true;
 }
 
 void RadioInterface::TunnelThread() {
-  // The maximum number of network frames to buffer here.
-  constexpr size_t kMaxBufferedFrames = 1024;
-
-  running_ = true;
-  uint8_t buffer[3200];
+  uint8_t buffer[kMaxFrameSize];
   while (running_) {
+    // Frames are left in the tunnel while the read buffer is full, where the
+    // kernel drops them once its own queue fills.
+    if (GetReadBufferSize() >= max_buffered_frames_) {
+      SleepUs(1000);
+      continue;
+    }
+
+    // The tunnel is polled with a timeout so that the thread notices when it
+    // is stopped, and only read once a frame is waiting so that no frame is
+    // read once it has been stopped.
+    struct pollfd tunnel_poll = {};
+    tunnel_poll.fd = tunnel_fd_;
+    tunnel_poll.events = POLLIN;
+    int result = poll(&tunnel_poll, 1, kTunnelPollTimeoutMs);
+    if (result < 0 && errno != EINTR) {
+      LOGE("Failed to poll tunnel: %s (%d)", strerror(errno), errno);
+      continue;
+    } else if (result <= 0 || !running_) {
+      continue;
+    }
+
     int bytes_read = read(tunnel_fd_, buffer, sizeof(buffer));
     if (bytes_read < 0) {
       LOGE("Failed to read: %s (%d)", strerror(errno), errno);
@@ -128,21 +845,71 @@ void RadioInterface::TunnelThread() {
 
     {
       std::lock_guard<std::mutex> lock(read_buffer_mutex_);
-      read_buffer_.emplace_back(&buffer[0], &buffer[bytes_read]);
+      read_buffer_.push_back({kTunnelPort, AllocateFrame()});
+      read_buffer_.back().data.assign(&buffer[0], &buffer[bytes_read]);
+      read_buffer_.back().queued_us = TimeNowUs();
       if (tunnel_logs_enabled_) {
-        LOGI("Read %zu bytes from the tunnel", read_buffer_.back().size());
+        LOGI("Read %zu bytes from the tunnel",
+            read_buffer_.back().data.size());
+      }
+
+      if (wake_callback_) {
+        wake_callback_();
       }
     }
+  }
+}
 
-    while (GetReadBufferSize() > kMaxBufferedFrames && running_) {
-      SleepUs(1000);
+void RadioInterface::SaveTxFrame(LinkSnapshot& snapshot,
+                                 const TxFrame& frame) {
+  snapshot.PutU8(frame.port);
+  snapshot.PutBytes(frame.data);
+  snapshot.PutU32(frame.offset);
+  snapshot.PutU32(frame.in_flight);
+  snapshot.PutU8(frame.retransmits);
+  snapshot.PutU8(frame.setting.has_value());
+  if (frame.setting.has_value()) {
+    snapshot.PutU8(frame.setting->channel);
+    snapshot.PutU8(static_cast<uint8_t>(frame.setting->data_rate));
+  }
+}
+
+bool RadioInterface::RestoreTxFrame(LinkSnapshot& snapshot, TxFrame& frame) {
+  uint32_t offset;
+  uint32_t in_flight;
+  uint8_t has_setting;
+  if (!snapshot.GetU8(frame.port) || !snapshot.GetBytes(frame.data)
+      || !snapshot.GetU32(offset) || !snapshot.GetU32(in_flight)
+      || !snapshot.GetU8(frame.retransmits)
+      || !snapshot.GetU8(has_setting)) {
+    return false;
+  }
+
+  if (offset + in_flight > frame.data.size()) {
+    return false;
+  }
+
+  frame.offset = offset;
+  frame.in_flight = in_flight;
+  frame.queued_us = TimeNowUs();
+  if (has_setting) {
+    uint8_t channel;
+    uint8_t data_rate;
+    if (!snapshot.GetU8(channel) || !snapshot.GetU8(data_rate)
+        || data_rate > static_cast<uint8_t>(Radio::DataRate::k2Mbps)) {
+      return false;
     }
+
+    frame.setting = RadioSetting{channel,
+        static_cast<Radio::DataRate>(data_rate)};
   }
+
+  return true;
 }
 
 bool RadioInterface::DecodeTunnelTxRxPacket(
     const std::vector<uint8_t>& request, TunnelTxRxPacket& tunnel) {
-  if (request.size() != kMaxPacketSize) {
+  if (request.size() < kPacketHeaderSize) {
     LOGE("Received short TxRx packet");
     return false;
   }
@@ -159,12 +926,12 @@ bool RadioInterface::DecodeTunnelTxRxPacket(
     tunnel.ack_id = ack_id_value;
   }
 
-  tunnel.payload.clear();
-  uint8_t size_value = request[1];
-  tunnel.bytes_left = size_value;
-  if (size_value > 0) {
-    size_value = std::min(size_value, static_cast<uint8_t>(kMaxPayloadSize));
-    tunnel.payload = {request.begin() + 2, request.begin() + 2 + size_value};
+  tunnel.frame_error = (request[1] & kFrameErrorBit) != 0;
+  tunnel.bytes_left = request[1] & kBytesLeftMask;
+  tunnel.payload = {request.begin() + kPacketHeaderSize, request.end()};
+  if (tunnel.payload.size() > tunnel.bytes_left) {
+    LOGE("TxRx packet payload exceeds bytes left");
+    return false;
   }
 
   return true;
@@ -172,7 +939,12 @@ bool RadioInterface::DecodeTunnelTxRxPacket(
 
 bool RadioInterface::EncodeTunnelTxRxPacket(
     const TunnelTxRxPacket& tunnel, std::vector<uint8_t>& request) {
-  request.resize(kMaxPacketSize, 0x00);
+  if (tunnel.payload.size() > kMaxPayloadSize) {
+    LOGE("TxRx packet payload is too large");
+    return false;
+  }
+
+  request.assign(kPacketHeaderSize + tunnel.payload.size(), 0x00);
   if (tunnel.id.has_value()) {
     request[0] = tunnel.id.value();
   }
@@ -181,27 +953,178 @@ bool RadioInterface::EncodeTunnelTxRxPacket(
     request[0] |= (tunnel.ack_id.value() << 4);
   }
 
-   if (tunnel.payload.size() > kMaxPayloadSize) {
-    LOGE("TxRx packet payload is too large");
+  if (tunnel.bytes_left > kBytesLeftMask) {
+    LOGE("TxRx packet bytes left is too large");
     return false;
   }
 
   request[1] = tunnel.bytes_left;
+  if (tunnel.frame_error) {
+    request[1] |= kFrameErrorBit;
+  }
+
   for (size_t i = 0; i < tunnel.payload.size(); i++) {
-    request[2 + i] = tunnel.payload[i];
+    request[kPacketHeaderSize + i] = tunnel.payload[i];
   }
 
   return true;
 }
 
-void RadioInterface::WriteTunnel() {
-  int bytes_written = write(tunnel_fd_,
-      frame_buffer_.data(), frame_buffer_.size());
-  if (tunnel_logs_enabled_) {
-    LOGI("Writing %d bytes to the tunnel", frame_buffer_.size());
+void RadioInterface::ReceiveFramePayload(const TunnelTxRxPacket& tunnel) {
+  if (frame_buffer_.size() + tunnel.payload.size() > kMaxEncodedFrameSize) {
+    LOGE("Dropping oversized frame");
+    stats_.frames_oversized++;
+    frame_buffer_.clear();
+    return;
+  }
+
+  frame_buffer_.insert(frame_buffer_.end(),
+      tunnel.payload.begin(), tunnel.payload.end());
+  if (tunnel.bytes_left == tunnel.payload.size()) {
+    HandleFrame();
+  }
+}
+
+void RadioInterface::HandleFrame() {
+  stats_.frames_rx++;
+  // Link codecs cover the frame as it was sent, so a failure to decode is
+  // treated as corruption and the peer is asked to send the frame again.
+  for (auto codec = link_codecs_.rbegin();
+       codec != link_codecs_.rend(); codec++) {
+    if (!(*codec)->Decode(frame_buffer_)) {
+      LOGE("Failed to decode frame, requesting retransmission");
+      stats_.frames_corrupt++;
+      rx_frame_error_ = true;
+      frame_buffer_.clear();
+      return;
+    }
+  }
+
+  if (!frame_buffer_.empty()
+      && (frame_buffer_[0] & kDatagramDispatchMask) == kDatagramDispatch) {
+    // The datagram takes the storage of the frame buffer, which is replaced
+    // from the pool that it is returned to once dispatched.
+    uint8_t port = frame_buffer_[0] & ~kDatagramDispatchMask;
+    rx_datagrams_.push_back({port, std::move(frame_buffer_)});
+    frame_buffer_ = AllocateFrame();
+    return;
   }
 
+  // Control messages are handled immediately so that they take effect before
+  // any frames that follow them.
+  if (!frame_buffer_.empty()
+      && (frame_buffer_[0] & kControlDispatchMask) == kControlDispatch) {
+    stats_.control_messages_rx++;
+    auto type = static_cast<ControlMessageType>(
+        frame_buffer_[0] & ~kControlDispatchMask);
+    HandleControlMessage(type, frame_buffer_.data() + 1,
+        frame_buffer_.size() - 1);
+    frame_buffer_.clear();
+    return;
+  }
+
+  for (auto codec = frame_codecs_.rbegin();
+       codec != frame_codecs_.rend(); codec++) {
+    if (!(*codec)->Decode(frame_buffer_)) {
+      LOGE("Failed to decode frame");
+      stats_.frames_invalid++;
+      frame_buffer_.clear();
+      return;
+    }
+  }
+
+  WriteTunnelFrame(frame_buffer_);
   frame_buffer_.clear();
+}
+
+void RadioInterface::DispatchDatagrams() {
+  std::vector<RxDatagram> datagrams;
+  {
+    std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+    datagrams.swap(rx_datagrams_);
+  }
+
+  for (const auto& datagram : datagrams) {
+    const auto& handler = datagram_handlers_[datagram.port];
+    if (handler) {
+      stats_.datagrams_rx++;
+      handler(datagram.frame.data() + 1, datagram.frame.size() - 1);
+    } else {
+      stats_.datagrams_dropped++;
+    }
+  }
+
+  if (!datagrams.empty()) {
+    std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+    for (auto& datagram : datagrams) {
+      ReleaseFrame(datagram.frame);
+    }
+  }
+
+  for (const auto& broadcast : rx_broadcasts_) {
+    broadcast_handler_(broadcast.data(), broadcast.size());
+  }
+
+  rx_broadcasts_.clear();
+}
+
+void RadioInterface::SendControlMessage(ControlMessageType type,
+                                        std::vector<uint8_t> message) {
+  message.insert(message.begin(),
+      kControlDispatch | static_cast<uint8_t>(type));
+  control_frames_.push_back({kControlPort, std::move(message)});
+}
+
+void RadioInterface::HandleControlMessage(ControlMessageType type,
+                                          const uint8_t* data, size_t size) {
+  if (type == ControlMessageType::ChannelSwitch) {
+    if (size != 2 || data[0] >= 128
+        || data[1] > static_cast<uint8_t>(Radio::DataRate::k2Mbps)) {
+      LOGE("Ignoring invalid channel switch");
+    } else {
+      HandleChannelSwitch({data[0], static_cast<Radio::DataRate>(data[1])});
+    }
+
+    return;
+  } else if (type == ControlMessageType::ClockRequest
+      || type == ControlMessageType::ClockResponse) {
+    HandleClockMessage(type, data, size);
+    return;
+  } else if (type == ControlMessageType::Backlog) {
+    if (size != 4) {
+      LOGE("Ignoring invalid backlog report");
+    } else {
+      peer_backlog_ = ReadBigEndianU32(data);
+    }
+
+    return;
+  }
+
+  for (auto& codec : link_codecs_) {
+    if (codec->HandleControlMessage(type, data, size)) {
+      return;
+    }
+  }
+
+  for (auto& codec : frame_codecs_) {
+    if (codec->HandleControlMessage(type, data, size)) {
+      return;
+    }
+  }
+
+  LOGE("Unhandled control message %u", static_cast<uint8_t>(type));
+}
+
+void RadioInterface::WriteTunnelFrame(const std::vector<uint8_t>& frame) {
+  if (tunnel_fd_ < 0) {
+    return;
+  }
+
+  int bytes_written = write(tunnel_fd_, frame.data(), frame.size());
+  if (tunnel_logs_enabled_) {
+    LOGI("Writing %zu bytes to the tunnel", frame.size());
+  }
+
   if (bytes_written < 0) {
     LOGE("Failed to write to tunnel %s (%d)", strerror(errno), errno);
   }
@@ -17,26 +17,69 @@
 #ifndef NERFNET_NET_RADIO_INTERFACE_H_
 #define NERFNET_NET_RADIO_INTERFACE_H_
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <RF24/RF24.h>
 #include <thread>
 #include <vector>
 
+#include "nerfnet/net/clock_sync.h"
+#include "nerfnet/net/frame_codec.h"
+#include "nerfnet/net/link_snapshot.h"
+#include "nerfnet/net/link_stats.h"
+#include "nerfnet/net/payload_size_selector.h"
+#include "nerfnet/net/radio.h"
+#include "nerfnet/net/replay_window.h"
+#include "nerfnet/net/traffic_shaper.h"
+#include "nerfnet/util/log.h"
 #include "nerfnet/util/non_copyable.h"
+#include "nerfnet/util/time.h"
 
 namespace nerfnet {
 
-// The interface to send/receive data using an RF24 radio.
-class RadioInterface : public NonCopyable {
+// The interface to send/receive data using an RF24 radio. Frames are read
+// from and written to a tunnel device and datagrams can also be exchanged
+// directly by the application through this interface.
+//
+// The radio is owned by the primary and secondary implementations, which are
+// templates over the radio backend so that the calls made to the radio for
+// every packet are bound at compile time. The methods that use the radio
+// take it as an argument for the same reason.
+class RadioInterface : public NonCopyable, private ControlChannel {
  public:
-  // Setup the radio interface.
-  RadioInterface(uint16_t ce_pin, int tunnel_fd,
-                 uint32_t primary_addr, uint32_t secondary_addr,
-                 uint8_t channel);
-  ~RadioInterface();
+  // Setup the radio interface for a radio tuned to the supplied channel and
+  // data rate. The tunnel is not used if tunnel_fd is negative, in which case
+  // only datagrams are exchanged.
+  RadioInterface(int tunnel_fd, uint32_t primary_addr,
+                 uint32_t secondary_addr, uint8_t channel,
+                 Radio::DataRate data_rate);
+  virtual ~RadioInterface();
+
+  // The number of ports available for datagrams.
+  static constexpr uint8_t kMaxDatagramPorts = 64;
+
+  // The maximum size of a packet that is broadcast.
+  static constexpr size_t kMaxBroadcastSize = 32;
+
+  // The largest frame read from the tunnel or sent as a datagram and the
+  // largest frame received from the peer, which leaves room for the bytes
+  // added by codecs.
+  static constexpr size_t kMaxFrameSize = 3200;
+  static constexpr size_t kMaxEncodedFrameSize = kMaxFrameSize + 256;
+
+  // A handler for datagrams received on a port. The data is only valid for
+  // the duration of the call.
+  using DatagramHandler = std::function<void(const uint8_t* data,
+                                             size_t size)>;
+
+  // Supplies the next packet to broadcast. Returns false if there is nothing
+  // to send.
+  using BroadcastSource = std::function<bool(std::vector<uint8_t>& packet)>;
 
   // The possible results of a request operation.
   enum class RequestResult {
@@ -55,20 +98,290 @@ class RadioInterface : public NonCopyable {
 
   void SetTunnelLogsEnabled(bool enabled) { tunnel_logs_enabled_ = enabled; }
 
+  // Sets a callback that is invoked from the tunnel thread when a frame is
+  // read from the tunnel. Used to wake an event loop that is servicing this
+  // link.
+  void SetWakeCallback(std::function<void()> callback);
+
+  // Adds a codec to apply to frames exchanged over this link. Codecs are
+  // applied in the order they are added when encoding and in reverse order
+  // when decoding. Must be called before the link is serviced.
+  void AddFrameCodec(std::unique_ptr<FrameCodec> codec);
+
+  // Adds a codec to apply to every frame exchanged over this link, including
+  // datagrams. Link codecs are applied after the frame codecs when encoding
+  // and before them when decoding, so they are suited to transformations
+  // such as encryption that must cover all traffic. Must be called before the
+  // link is serviced.
+  void AddLinkCodec(std::unique_ptr<FrameCodec> codec);
+
+  // Bounds the memory used by frames waiting to be sent to the supplied
+  // number of bytes, counting each frame at the largest encoded size. The
+  // storage for the frames is allocated up front and reused. Frames are left
+  // in the tunnel and datagrams are refused while the budget is used up.
+  // Must be called before the link is serviced.
+  void SetMemoryBudget(size_t bytes);
+
+  // Shapes the frames sent over this link by the airtime that they take.
+  // Control messages are never held back. Must be called before the link is
+  // serviced.
+  void SetTrafficShaper(std::unique_ptr<TrafficShaper> shaper);
+
+  // Sets the handler for datagrams received on a port. Handlers are invoked
+  // from the thread servicing the link and may send datagrams. Must be called
+  // before the link is serviced.
+  void SetDatagramHandler(uint8_t port, DatagramHandler handler);
+
+  // Queues a datagram to be sent to a port on the peer. The message is copied
+  // into storage from the frame pool. Safe to call from any thread. Returns
+  // false if the transmit queue is full or the message is larger than
+  // kMaxFrameSize.
+  bool SendDatagram(uint8_t port, const std::vector<uint8_t>& message);
+
+  // Sets the source of packets that the primary side of the link broadcasts
+  // to an address after each exchange with the secondary. Broadcasts are
+  // sent once without acknowledgement and skip the codecs, so that they can
+  // be heard by the secondary of every link on the same channel and data
+  // rate. The source is invoked from the thread servicing the link and may
+  // send datagrams. Must be called before the link is serviced.
+  void SetBroadcastSource(uint32_t address, BroadcastSource source);
+
+  // Sets the handler for packets broadcast to an address, which the
+  // secondary side of the link listens for alongside requests from the
+  // primary. The handler is invoked from the thread servicing the link and
+  // may send datagrams. Must be called before the link is serviced.
+  void SetBroadcastHandler(uint32_t address, DatagramHandler handler);
+
+  // Asks for the link to move to a new channel. The primary announces the
+  // channel to the secondary and both sides switch once the announcement has
+  // been delivered, while the secondary passes the request on to the
+  // primary. Each side returns to the previous channel if no exchange
+  // succeeds on the new one. Safe to call from any thread.
+  void RequestChannel(uint8_t channel);
+
+  // Asks for the link to move to a new channel and data rate together, which
+  // is coordinated with the peer in the same way as a channel alone. Safe to
+  // call from any thread.
+  void RequestChannel(uint8_t channel, Radio::DataRate data_rate);
+
+  // Returns the channel and data rate that the link operates on. Safe to
+  // call from any thread.
+  uint8_t GetChannel() const { return channel_; }
+  Radio::DataRate GetDataRate() const { return data_rate_; }
+
+  // Services the link without blocking indefinitely. Returns the time in
+  // microseconds at which the link next needs to be serviced.
+  virtual uint64_t Poll(uint64_t now_us) = 0;
+
+  // Returns the ID of the link in a TDMA cell, which is the lowest byte of
+  // the primary address.
+  uint8_t GetLinkID() const { return primary_addr_ & 0xff; }
+
+  // Returns the number of bytes waiting to be exchanged over the link in
+  // either direction, counting those that the peer last reported as waiting
+  // on its side. Safe to call from any thread.
+  size_t GetBacklog();
+
+  // Returns the weight of the link when sharing the airtime of a TDMA cell
+  // with other links.
+  uint32_t GetWeight() const {
+    return shaper_ != nullptr ? shaper_->GetLinkWeight() : 1;
+  }
+
+  // Services the link during a slot of a TDMA superframe, in which it has
+  // the channel to itself until slot_end_us, in place of Poll. Only the
+  // primary side of a link can be scheduled.
+  virtual void PollSlot(uint64_t now_us, uint64_t slot_end_us);
+
+  // Broadcasts the beacon that starts a TDMA superframe to an address. Only
+  // the primary side of a link sends beacons.
+  virtual void SendTdmaBeacon(uint32_t address,
+                              const std::vector<uint8_t>& beacon);
+
+  // Returns the counters collected for this link, including those kept by
+  // its codecs.
+  LinkStats GetStats() const;
+
+  // Returns the file descriptor of the tunnel, or negative if there is none.
+  int GetTunnelFd() const { return tunnel_fd_; }
+
+  // Stops reading from the tunnel, leaving the frames that have been read in
+  // the read buffer, and starts reading again. Used while the link is handed
+  // over to another process.
+  void StopTunnel();
+  void StartTunnel();
+
+  // Saves the state of the connection with the peer, including the frames
+  // waiting to be sent and the state of the codecs, so that another process
+  // can carry on with the connection. The tunnel must be stopped and the
+  // link must not be serviced afterwards. Returns false if the state cannot
+  // be saved.
+  virtual bool SaveState(LinkSnapshot& snapshot);
+
+  // Restores the state saved by another process for the same link. Must be
+  // called once the codecs have been added and before the link is serviced.
+  // Returns false if the snapshot does not match the link, in which case the
+  // connection is reset as it would be for a new process.
+  virtual bool RestoreState(LinkSnapshot& snapshot);
+
  protected:
   // The number of microseconds to poll over.
   static constexpr uint32_t kPollIntervalUs = 1000;
 
-  // The maximum size of a packet.
+  // The interval between checks for a response while waiting for one, which
+  // leaves the processor idle rather than spinning on the radio. This is
+  // short next to the time that the peer takes to respond.
+  static constexpr uint64_t kResponseCheckIntervalUs = 200;
+
+  // The maximum size of a packet and the size of the header of a TxRx
+  // packet. Packets vary in length, so the payload of a TxRx packet is the
+  // remainder of the packet after the header.
   static constexpr size_t kMaxPacketSize = 32;
-  static constexpr size_t kMaxPayloadSize = kMaxPacketSize - 2;
+  static constexpr size_t kPacketHeaderSize = 2;
+  static constexpr size_t kMaxPayloadSize = kMaxPacketSize - kPacketHeaderSize;
 
-  // The default pipe to use for sending data.
+  // The default pipe to use for sending data, the pipe that broadcasts are
+  // received on, the pipe that a roaming secondary hears the beacons of
+  // gateways on and the pipe that the beacons of a TDMA cell are heard on.
   static constexpr uint8_t kPipeId = 1;
-
-  // The mask for IDs.
+  static constexpr uint8_t kBroadcastPipeId = 2;
+  static constexpr uint8_t kBeaconPipeId = 3;
+  static constexpr uint8_t kTdmaPipeId = 4;
+
+  // Beacons are sent to the primary address with this bit of the lowest byte
+  // flipped, so that they can be told apart from requests on the NRF24L01,
+  // which only allows the lowest byte of the addresses of most pipes to
+  // differ.
+  static constexpr uint32_t kBeaconAddressBit = 0x80;
+
+  // The interval between beacons from each gateway of a roaming link and the
+  // contents of a beacon, which are a marker, the ID of the gateway that
+  // sent it and the ID of the gateway that carries the link.
+  static constexpr uint64_t kBeaconIntervalUs = 10000;
+  static constexpr uint8_t kBeaconMarker = 0xb5;
+  static constexpr size_t kBeaconSize = 3;
+
+  // The largest number of gateways that a roaming link may have.
+  static constexpr size_t kMaxGateways = 8;
+
+  // The maximum number of packets broadcast after each exchange, which
+  // leaves the radio free to poll at the usual rate.
+  static constexpr size_t kMaxBroadcastsPerPoll = 8;
+
+  // The bytes left field of a packet. The top bit is set to report that the
+  // last frame received from the peer failed to decode and must be sent
+  // again.
+  static constexpr uint8_t kFrameErrorBit = 0x80;
+  static constexpr uint8_t kBytesLeftMask = 0x7f;
+
+  // The number of times a frame is sent again after failing to decode before
+  // it is dropped.
+  static constexpr uint8_t kMaxFrameRetransmits = 3;
+
+  // The time allowed for an exchange to succeed on a new channel and data
+  // rate before returning to the previous ones.
+  static constexpr uint64_t kChannelSwitchTimeoutUs = 250000;
+
+  // The mask for IDs. IDs are derived from sequence numbers and take values
+  // from 1 to kIDMask, zero marks a missing ID.
   static constexpr uint8_t kIDMask = 0x0f;
 
+  // The maximum number of frames to queue for transmission without a memory
+  // budget and the fewest that a memory budget must leave room for.
+  static constexpr size_t kMaxBufferedFrames = 1024;
+  static constexpr size_t kMinBufferedFrames = 4;
+
+  // The ports used to mark frames that are exchanged with the tunnel and
+  // control messages.
+  static constexpr uint8_t kTunnelPort = 0xff;
+  static constexpr uint8_t kControlPort = 0xfe;
+
+  // The dispatch bits that mark a datagram frame. The remaining bits of the
+  // first byte of the frame carry the port. Codecs never produce frames that
+  // begin with these bits.
+  static constexpr uint8_t kDatagramDispatchMask = 0xc0;
+  static constexpr uint8_t kDatagramDispatch = 0x00;
+
+  // The dispatch bits that mark a control frame. The remaining bits of the
+  // first byte of the frame carry the message type.
+  static constexpr uint8_t kControlDispatchMask = 0xf0;
+  static constexpr uint8_t kControlDispatch = 0x50;
+
+  // The offsets of the nonce, the sequence number of the next packet and the
+  // CRC32C of the preceding bytes that are carried in connection reset
+  // packets.
+  static constexpr size_t kResetNonceOffset = 2;
+  static constexpr size_t kResetSequenceOffset = 10;
+  static constexpr size_t kResetCrcOffset = 18;
+  static constexpr size_t kResetPacketSize = kResetCrcOffset + 4;
+
+  // The interval between clock requests sent to the peer.
+  static constexpr uint64_t kClockSyncIntervalUs = 1000000;
+
+  // The offsets of the origin, receive and transmit times and the transmit
+  // queue delay of the sender in clock messages. Requests and responses
+  // have the same size so that they take the same number of packets in
+  // each direction.
+  static constexpr size_t kClockOriginOffset = 0;
+  static constexpr size_t kClockReceiveOffset = 8;
+  static constexpr size_t kClockTransmitOffset = 16;
+  static constexpr size_t kClockQueueDelayOffset = 24;
+  static constexpr size_t kClockMessageSize = kClockQueueDelayOffset + 4;
+
+  // The weight given to each new transmit queue delay.
+  static constexpr double kQueueDelayWeight = 0.125;
+
+  // The version of the layout of saved link state. A process only takes over
+  // the links of a process that saved them with the same version.
+  static constexpr uint8_t kSnapshotVersion = 2;
+
+  // The time that the tunnel thread waits for a frame before checking
+  // whether it has been stopped.
+  static constexpr int kTunnelPollTimeoutMs = 100;
+
+  // A channel and data rate for the link to operate on.
+  struct RadioSetting {
+    uint8_t channel;
+    Radio::DataRate data_rate;
+  };
+
+  // A frame queued for transmission.
+  struct TxFrame {
+    // The datagram port of the frame, kTunnelPort or kControlPort.
+    uint8_t port;
+
+    // The contents of the frame.
+    std::vector<uint8_t> data;
+
+    // The number of bytes of the encoded frame that have been delivered and
+    // the number of bytes in flight to the peer.
+    size_t offset = 0;
+    size_t in_flight = 0;
+
+    // The number of times the frame has been sent again.
+    uint8_t retransmits = 0;
+
+    // The channel and data rate to switch to once the frame has been
+    // delivered.
+    std::optional<RadioSetting> setting;
+
+    // The time that the frame was queued.
+    uint64_t queued_us = 0;
+
+    // The traffic class that the frame was started in, once chosen by the
+    // traffic shaper, and whether it was held back for want of airtime.
+    std::optional<size_t> shaping_class;
+    bool shaping_delayed = false;
+  };
+
+  // A datagram that has been received and is waiting to be dispatched.
+  struct RxDatagram {
+    uint8_t port;
+
+    // The received frame, including the port header.
+    std::vector<uint8_t> frame;
+  };
+
   // A tunnel Tx/Rx request exchanged between systems.
   struct TunnelTxRxPacket {
     std::optional<uint8_t> id;
@@ -76,10 +389,10 @@ class RadioInterface : public NonCopyable {
 
     uint8_t bytes_left = 0;
     std::vector<uint8_t> payload;
-  };
 
-  // The underlying radio.
-  RF24 radio_;
+    // Set if the last frame received by the sender failed to decode.
+    bool frame_error = false;
+  };
 
   // The file descriptor for the network tunnel.
   const int tunnel_fd_;
@@ -92,55 +405,488 @@ class RadioInterface : public NonCopyable {
   std::thread tunnel_thread_;
   std::atomic<bool> running_;
 
-  // The buffer of data read and lock.
+  // The buffer of frames to transmit and lock.
   std::mutex read_buffer_mutex_;
-  std::deque<std::vector<uint8_t>> read_buffer_;
+  std::deque<TxFrame> read_buffer_;
+
+  // The maximum number of frames in the read buffer, which is set by the
+  // memory budget, and the storage of frames that have been sent, which is
+  // reused for frames read from the tunnel. Guarded by the read buffer
+  // mutex. Storage is only kept once a memory budget is set.
+  size_t max_buffered_frames_;
+  std::vector<std::vector<uint8_t>> frame_pool_;
+  size_t frame_pool_size_;
+
+  // Control messages waiting to be moved to the head of the read buffer.
+  // Guarded by the read buffer mutex.
+  std::deque<TxFrame> control_frames_;
+
+  // Set to true once the frame at the head of the read buffer has been
+  // encoded for transmission.
+  bool tx_frame_encoded_;
+
+  // The codecs to apply to frames exchanged over this link.
+  std::vector<std::unique_ptr<FrameCodec>> frame_codecs_;
+
+  // The codecs to apply to all frames exchanged over this link.
+  std::vector<std::unique_ptr<FrameCodec>> link_codecs_;
 
   // The frame buffer for the currently incoming frame. Written out to
-  // the tunnel interface when completely received.
+  // the tunnel interface or dispatched as a datagram when completely received.
+  // Never grows beyond kMaxEncodedFrameSize.
   std::vector<uint8_t> frame_buffer_;
 
-  // The next ID for packet ID generation.
-  uint8_t next_id_;
+  // The handlers for datagrams received on each port.
+  std::array<DatagramHandler, kMaxDatagramPorts> datagram_handlers_;
+
+  // Datagrams that have been received but not yet dispatched. Guarded by the
+  // read buffer mutex.
+  std::vector<RxDatagram> rx_datagrams_;
 
-  // The last ID that needs to be acknowledged.
-  std::optional<uint8_t> last_ack_id_;
+  // The sequence number of the next packet to send. Sequence numbers are not
+  // reset with the connection and only their low bits are sent as IDs.
+  uint64_t tx_sequence_;
+
+  // The sequence numbers of packets received from the peer.
+  ReplayWindow rx_window_;
 
   // Whether to log successful tunnel read/write operations.
   bool tunnel_logs_enabled_;
 
-  // Sends a message over the radio.
-  RequestResult Send(const std::vector<uint8_t>& request);
+  // Invoked when a frame is read from the tunnel. Guarded by the read buffer
+  // mutex.
+  std::function<void()> wake_callback_;
+
+  // Set to true while the radio is in receive mode to avoid reconfiguring the
+  // radio on every receive.
+  bool listening_;
+
+  // Set when a frame received from the peer fails to decode. The primary
+  // clears it when it accepts the next response, which the secondary sent
+  // after seeing the error, and the secondary clears it once the primary
+  // acknowledges a response that reported it.
+  bool rx_frame_error_;
+
+  // The channel and data rate that the link operates on and those that the
+  // radio is tuned to, which follow the link at the next exchange.
+  std::atomic<uint8_t> channel_;
+  std::atomic<Radio::DataRate> data_rate_;
+  uint8_t radio_channel_;
+  Radio::DataRate radio_data_rate_;
+
+  // The channel and data rate that the link switched from and the time of
+  // the switch, while the new ones have not yet carried a successful
+  // exchange.
+  std::optional<RadioSetting> previous_setting_;
+  uint64_t channel_switch_us_;
+
+  // Chooses the size of the TxRx packets sent to the peer.
+  PayloadSizeSelector payload_size_selector_;
+
+  // Estimates the clock of the peer from the times in clock messages.
+  ClockSync clock_sync_;
+
+  // The time that the last clock request was queued and the time that it
+  // was sent, while a response is awaited.
+  uint64_t clock_request_us_;
+  std::optional<uint64_t> clock_origin_us_;
+
+  // The smoothed time that frames wait in the read buffer before they are
+  // sent.
+  double queue_delay_us_;
+
+  // The counters collected for this link.
+  LinkStats stats_;
+
+  // The address that packets are broadcast to or received from, the source
+  // of packets to broadcast and the handler for received broadcasts.
+  uint32_t broadcast_address_;
+  BroadcastSource broadcast_source_;
+  DatagramHandler broadcast_handler_;
+
+  // Set once the radio listens for broadcasts.
+  bool broadcast_pipe_open_;
+
+  // Broadcasts that have been received but not yet dispatched. Only accessed
+  // by the thread servicing the link.
+  std::vector<std::vector<uint8_t>> rx_broadcasts_;
+
+  // Beacons from the gateways of a roaming link that have been received but
+  // not yet handled. Only accessed by the thread servicing the link.
+  std::vector<std::vector<uint8_t>> rx_beacons_;
+
+  // Beacons from the hub of a TDMA cell that have been received but not yet
+  // handled. Only accessed by the thread servicing the link.
+  std::vector<std::vector<uint8_t>> rx_tdma_beacons_;
+
+  // The number of bytes that the peer last reported as waiting to be sent.
+  // Guarded by the read buffer mutex.
+  size_t peer_backlog_;
+
+  // Shapes the frames sent over the link, if set, and the traffic class of
+  // the payload of the packet being sent, which is charged for its airtime.
+  // Guarded by the read buffer mutex.
+  std::unique_ptr<TrafficShaper> shaper_;
+  std::optional<size_t> tx_shaping_class_;
 
-  // Reads a message from the radio.
-  RequestResult Receive(std::vector<uint8_t>& response,
+  // Sends a message over the radio.
+  template <typename RadioType>
+  RequestResult Send(RadioType& radio, const std::vector<uint8_t>& request);
+
+  // Reads a message from the radio. Only the most recent packet is a
+  // response to the last request sent, so any packets received before it are
+  // discarded as stale.
+  template <typename RadioType>
+  RequestResult Receive(RadioType& radio, std::vector<uint8_t>& response,
                         uint64_t timeout_us = 0);
 
+  // Sends packets from the broadcast source until it runs out or the limit
+  // for a poll is reached. Returns true if the source may have more to send.
+  // The read buffer lock must not be held.
+  template <typename RadioType>
+  bool SendBroadcasts(RadioType& radio);
+
+  // Reads every packet waiting in the receive FIFO of the radio in a single
+  // pass. Broadcasts and beacons are set aside to be handled separately.
+  // Returns false if there were no other packets.
+  template <typename RadioType>
+  bool ReceiveAll(RadioType& radio,
+                  std::vector<std::vector<uint8_t>>& packets);
+
+  // Places the radio in receive mode and returns true if a message is
+  // available to be read.
+  template <typename RadioType>
+  bool Available(RadioType& radio);
+
+  // Tunes the radio to the channel and data rate of the link if they have
+  // changed.
+  template <typename RadioType>
+  void TuneRadio(RadioType& radio);
+
+  // Records the outcome of a write to the radio and charges its airtime to
+  // the traffic class of the payload that it carried.
+  void RecordWrite(size_t size, uint8_t retransmits, bool acknowledged);
+
+  // Packets read from the radio, which are kept to avoid allocating storage
+  // for each batch.
+  std::vector<Radio::RxPacket> rx_packets_;
+
   // Returns the size of the read buffer.
   size_t GetReadBufferSize();
 
-  // Returns the size of the next payload to send.
-  size_t GetTransferSize(const std::vector<uint8_t>& frame);
-
-  // Advances the packet ID counter.
-  void AdvanceID();
-
-  // Returns true if the supplied ID is the next ID.
+  // Returns storage for a frame from the pool, or new storage if the pool is
+  // empty, and returns the storage of a frame that has been sent to the
+  // pool. The read buffer lock must be held.
+  std::vector<uint8_t> AllocateFrame();
+  void ReleaseFrame(std::vector<uint8_t>& frame);
+
+  // Returns the number of bytes of frames in the read buffer that are yet to
+  // be delivered to the peer, leaving out control messages. The read buffer
+  // lock must be held.
+  size_t GetQueuedBytes() const;
+
+  // Returns the size of the next payload to send from a frame, which is
+  // limited by the packet size chosen for the link.
+  size_t GetTransferSize(const TxFrame& frame);
+
+  // Moves the next frame chosen by the traffic shaper to the head of the
+  // read buffer. Returns false if every frame waiting must wait for airtime.
+  // The read buffer lock must be held.
+  bool SelectShapedFrame();
+
+  // Returns the frame at the head of the read buffer, encoding it for
+  // transmission if required, or nullptr if there is nothing to send. The
+  // read buffer lock must be held.
+  TxFrame* GetTxFrame();
+
+  // Populates the payload of a packet with the next bytes of the frame at the
+  // head of the read buffer. Returns false if there is nothing to send. The
+  // read buffer lock must be held.
+  bool FillTxPayload(TunnelTxRxPacket& tunnel);
+
+  // Marks the payload from the frame at the head of the read buffer as
+  // delivered. If the payload completed the frame and the peer reported a
+  // frame error, the frame is sent again. The read buffer lock must be held.
+  void ConsumeTxFrame(bool frame_error);
+
+  // Tells the first codec_count frame codecs that the last tunnel frame they
+  // encoded will not be decoded by the peer.
+  void AbandonTxFrame(size_t codec_count);
+
+  // Returns the number of bytes of the frame at the head of the read buffer
+  // that have been sent, or zero if no frame is being sent, and whether all
+  // of it has been sent. The read buffer lock must be held.
+  size_t GetTxFrameOffset() const;
+  bool IsTxFrameSent() const;
+
+  // Marks the payload in flight as sent without releasing the frame if it
+  // is complete, which waits for ConsumeTxFrame once the peer has reported
+  // whether it decoded the frame. The read buffer lock must be held.
+  void AdvanceTxFrame();
+
+  // Moves the frame at the head of the read buffer back to an offset that
+  // was sent from before, when the peer lost payloads that were thought to
+  // be delivered. The read buffer lock must be held.
+  void RewindTxFrame(size_t offset);
+
+  // Discards the state shared with the peer when the connection is reset and
+  // starts a new session. The peer sequence is the sequence number of the
+  // next packet the peer will send. The read buffer lock must be held.
+  void ResetLinkState(const LinkSession& session, uint64_t peer_sequence);
+
+  // Adds and checks the CRC of a connection reset packet. The state carried
+  // in reset packets must not be corrupted, since the radio CRC is weak.
+  void SealResetPacket(std::vector<uint8_t>& packet);
+  bool VerifyResetPacket(const std::vector<uint8_t>& packet);
+
+  // Returns the channel and data rate that the link operates on.
+  RadioSetting GetSetting() const { return {channel_, data_rate_}; }
+
+  // Returns the address that the gateways of a roaming link send beacons to.
+  uint32_t GetBeaconAddress() const {
+    return primary_addr_ ^ kBeaconAddressBit;
+  }
+
+  // Moves the link to a new channel and data rate, remembering the current
+  // ones to return to if the new ones do not carry an exchange in time.
+  void SwitchChannel(const RadioSetting& setting);
+
+  // Sets the channel and data rate that the link operates on.
+  void SetSetting(const RadioSetting& setting);
+
+  // Marks the current channel as working once an exchange has succeeded on
+  // it.
+  void ConfirmChannel();
+
+  // Returns to the previous channel and data rate if the new ones have not
+  // been confirmed in time.
+  void CheckChannelSwitch(uint64_t now_us);
+
+  // Queues a channel switch message for the peer. The link switches to the
+  // channel and data rate once the message has been delivered if
+  // switch_on_delivery is set. The read buffer lock must be held.
+  void SendChannelSwitch(const RadioSetting& setting,
+                         bool switch_on_delivery);
+
+  // Handles a local request to move the link to a new channel and data
+  // rate. The read buffer lock must be held.
+  virtual void HandleChannelRequest(const RadioSetting& setting) = 0;
+
+  // Handles a channel switch message from the peer. The read buffer lock
+  // must be held.
+  virtual void HandleChannelSwitch(const RadioSetting& setting) = 0;
+
+  // Queues a clock request for the peer if one is due. The read buffer lock
+  // must be held.
+  void ServiceClockSync(uint64_t now_us);
+
+  // Writes the transmit time and queue delay into a clock message that is
+  // about to be sent. Other control messages are left unchanged.
+  void StampClockMessage(std::vector<uint8_t>& frame);
+
+  // Answers a clock request or adds the times in a clock response to the
+  // estimate of the peer clock. The read buffer lock must be held.
+  void HandleClockMessage(ControlMessageType type,
+                          const uint8_t* data, size_t size);
+
+  // Returns the ID sent for a sequence number.
+  static uint8_t GetID(uint64_t sequence);
+
+  // Returns the ID of the last packet accepted from the peer since the
+  // connection was reset, which is sent to acknowledge it.
+  std::optional<uint8_t> GetAckID() const;
+
+  // Advances the packet sequence number.
+  void AdvanceSequence();
+
+  // Returns true if the supplied ID is that of the next packet from the peer
+  // and records its sequence number. Duplicates, replays and packets that are
+  // out of sequence are counted and rejected.
   bool ValidateID(uint8_t id);
 
   // Reads from the tunnel and buffers data read.
   void TunnelThread();
 
+  // Saves and restores a frame waiting to be sent.
+  static void SaveTxFrame(LinkSnapshot& snapshot, const TxFrame& frame);
+  static bool RestoreTxFrame(LinkSnapshot& snapshot, TxFrame& frame);
+
   // Encode/decode functions for TunnelTxRxPackets.
   bool DecodeTunnelTxRxPacket(const std::vector<uint8_t>& request,
       TunnelTxRxPacket& tunnel);
   bool EncodeTunnelTxRxPacket(const TunnelTxRxPacket& tunnel,
       std::vector<uint8_t>& request);
 
-  // Writes the current frame buffer to the tunnel.
-  void WriteTunnel();
+  // Appends the payload of a packet to the frame being received and handles
+  // the frame once it is complete. A frame that grows beyond the largest
+  // frame size, such as after a corrupted bytes left field, is dropped. The
+  // read buffer lock must be held.
+  void ReceiveFramePayload(const TunnelTxRxPacket& tunnel);
+
+  // Queues the current frame buffer for dispatch if it is a datagram,
+  // otherwise decodes it and writes it to the tunnel. The read buffer lock
+  // must be held.
+  void HandleFrame();
+
+  // Invokes the handlers for datagrams and broadcasts that have been
+  // received. The read buffer lock must not be held.
+  void DispatchDatagrams();
+
+  // Writes a frame to the tunnel.
+  void WriteTunnelFrame(const std::vector<uint8_t>& frame);
+
+  // ControlChannel method. The read buffer lock must be held.
+  void SendControlMessage(ControlMessageType type,
+                          std::vector<uint8_t> message) override;
+
+  // Handles a control message received from the peer by offering it to the
+  // codecs. The read buffer lock must be held.
+  virtual void HandleControlMessage(ControlMessageType type,
+                                    const uint8_t* data, size_t size);
 };
 
+template <typename RadioType>
+RadioInterface::RequestResult RadioInterface::Send(
+    RadioType& radio, const std::vector<uint8_t>& request) {
+  TuneRadio(radio);
+  if (listening_) {
+    radio.StopListening();
+    listening_ = false;
+  }
+
+  if (request.size() > kMaxPacketSize) {
+    LOGE("Request is too large (%zu vs %zu)", request.size(), kMaxPacketSize);
+    return RequestResult::Malformed;
+  }
+
+  bool acknowledged = radio.Write(request.data(), request.size());
+  RecordWrite(request.size(), radio.GetRetransmitCount(), acknowledged);
+  if (!acknowledged) {
+    LOGE("Failed to write request");
+    return RequestResult::TransmitError;
+  }
+
+  return RequestResult::Success;
+}
+
+template <typename RadioType>
+bool RadioInterface::SendBroadcasts(RadioType& radio) {
+  if (!broadcast_source_) {
+    return false;
+  }
+
+  std::vector<uint8_t> packet;
+  for (size_t i = 0; i < kMaxBroadcastsPerPoll; i++) {
+    packet.clear();
+    if (!broadcast_source_(packet)) {
+      return false;
+    }
+
+    CHECK(!packet.empty() && packet.size() <= kMaxBroadcastSize,
+        "Invalid broadcast size %zu", packet.size());
+    TuneRadio(radio);
+    if (listening_) {
+      radio.StopListening();
+      listening_ = false;
+    }
+
+    radio.WriteBroadcast(broadcast_address_, packet.data(), packet.size());
+    stats_.broadcast_packets_tx++;
+  }
+
+  return true;
+}
+
+template <typename RadioType>
+RadioInterface::RequestResult RadioInterface::Receive(
+    RadioType& radio, std::vector<uint8_t>& response, uint64_t timeout_us) {
+  uint64_t start_us = TimeNowUs();
+  std::vector<std::vector<uint8_t>> packets;
+  while (!ReceiveAll(radio, packets)) {
+    uint64_t now_us = TimeNowUs();
+    if (timeout_us != 0 && (start_us + timeout_us) < now_us) {
+      LOGE("Timeout receiving response");
+      return RequestResult::Timeout;
+    }
+
+    uint64_t sleep_us = kResponseCheckIntervalUs;
+    if (timeout_us != 0) {
+      sleep_us = std::min(sleep_us, start_us + timeout_us + 1 - now_us);
+    }
+
+    SleepUs(sleep_us);
+  }
+
+  stats_.packets_stale += packets.size() - 1;
+  response = std::move(packets.back());
+  return RequestResult::Success;
+}
+
+template <typename RadioType>
+bool RadioInterface::ReceiveAll(RadioType& radio,
+                                std::vector<std::vector<uint8_t>>& packets) {
+  if (!Available(radio)) {
+    return false;
+  }
+
+  rx_packets_.clear();
+  if (radio.ReadAll(rx_packets_)) {
+    stats_.rx_fifo_overruns++;
+  }
+
+  for (auto& packet : rx_packets_) {
+    if (packet.pipe == kBroadcastPipeId && broadcast_handler_) {
+      stats_.broadcast_packets_rx++;
+      rx_broadcasts_.push_back(std::move(packet.data));
+      continue;
+    } else if (packet.pipe == kBeaconPipeId) {
+      rx_beacons_.push_back(std::move(packet.data));
+      continue;
+    } else if (packet.pipe == kTdmaPipeId) {
+      rx_tdma_beacons_.push_back(std::move(packet.data));
+      continue;
+    } else if (packet.pipe != kPipeId) {
+      LOGE("Received packet on unexpected pipe %u", packet.pipe);
+      continue;
+    }
+
+    stats_.bytes_rx += packet.data.size();
+    packets.push_back(std::move(packet.data));
+  }
+
+  return !packets.empty();
+}
+
+template <typename RadioType>
+bool RadioInterface::Available(RadioType& radio) {
+  TuneRadio(radio);
+  if (broadcast_handler_ && !broadcast_pipe_open_) {
+    radio.OpenReadingPipe(kBroadcastPipeId, broadcast_address_);
+    broadcast_pipe_open_ = true;
+  }
+
+  if (!listening_) {
+    radio.StartListening();
+    listening_ = true;
+  }
+
+  return radio.Available();
+}
+
+template <typename RadioType>
+void RadioInterface::TuneRadio(RadioType& radio) {
+  if (radio_channel_ != channel_) {
+    radio_channel_ = channel_;
+    radio.SetChannel(radio_channel_);
+  }
+
+  if (radio_data_rate_ != data_rate_) {
+    radio_data_rate_ = data_rate_;
+    radio.SetDataRate(radio_data_rate_);
+    payload_size_selector_.SetDataRate(radio_data_rate_);
+  }
+}
+
 }  // namespace nerfnet
 
 #endif  // NERFNET_NET_RADIO_INTERFACE_H_
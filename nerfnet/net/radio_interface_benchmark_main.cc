@@ -0,0 +1,169 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <memory>
+#include <tclap/CmdLine.h>
+#include <vector>
+
+#include "nerfnet/net/primary_radio_interface.h"
+#include "nerfnet/net/secondary_radio_interface.h"
+#include "nerfnet/net/simulated_radio.h"
+#include "nerfnet/util/cycle_counter.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/time.h"
+
+// A description of the program.
+constexpr char kDescription[] =
+    "Measures the host time spent on each exchange of the radio link with "
+    "the radio backend bound at compile time and through the virtual Radio "
+    "interface.";
+
+// The version of the program.
+constexpr char kVersion[] = "0.0.1";
+
+// The addresses used by the link.
+constexpr uint32_t kPrimaryAddress = 0x90019001;
+constexpr uint32_t kSecondaryAddress = 0x90009000;
+
+// The port and size of the datagrams used to fill the link.
+constexpr uint8_t kDatagramPort = 1;
+constexpr size_t kDatagramSize = 64;
+
+// The result of a benchmark run.
+struct BenchmarkResult {
+  // The number of exchanges completed.
+  uint64_t exchanges = 0;
+
+  // The time and cycles spent per exchange.
+  double ns_per_exchange = 0.0;
+  double cycles_per_exchange = 0.0;
+};
+
+// Runs the primary and secondary sides of a simulated link in this thread
+// until the number of exchanges have completed. The secondary is serviced
+// whenever the primary waits for a response, so the time measured is the
+// host overhead of both sides with no airtime. The RadioType selects the
+// backend that the link is instantiated for.
+template <typename RadioType>
+BenchmarkResult RunBenchmark(uint64_t exchanges, bool payload,
+                             nerfnet::CycleCounter& cycle_counter,
+                             double cpu_mhz) {
+  nerfnet::SimulatedMedium medium;
+  auto primary_radio = std::make_unique<nerfnet::SimulatedRadio>(medium);
+  auto secondary_radio = std::make_unique<nerfnet::SimulatedRadio>(medium);
+  nerfnet::SimulatedRadio* primary_radio_ptr = primary_radio.get();
+
+  nerfnet::SecondaryRadioInterface<RadioType> secondary(
+      std::unique_ptr<RadioType>(std::move(secondary_radio)), -1,
+      kPrimaryAddress, kSecondaryAddress);
+  nerfnet::PrimaryRadioInterface<RadioType> primary(
+      std::unique_ptr<RadioType>(std::move(primary_radio)), -1,
+      kPrimaryAddress, kSecondaryAddress, /*poll_interval_us=*/0,
+      /*idle_poll_interval_us=*/0);
+
+  // The secondary is polled a second time after responding so that it is
+  // listening again before the next request is written.
+  primary_radio_ptr->SetIdleCallback([&]() {
+    uint64_t now_us = nerfnet::TimeNowUs();
+    secondary.Poll(now_us);
+    secondary.Poll(now_us);
+  });
+
+  // Put the secondary in receive mode and establish the connection.
+  secondary.Poll(nerfnet::TimeNowUs());
+  while (primary.GetStats().resets == 0) {
+    primary.Poll(nerfnet::TimeNowUs());
+  }
+
+  std::vector<uint8_t> datagram(kDatagramSize, 0xa5);
+  auto fill_queue = [&]() {
+    if (payload) {
+      while (primary.SendDatagram(kDatagramPort, datagram)) {}
+    }
+  };
+
+  fill_queue();
+  if (cycle_counter.IsAvailable()) {
+    cycle_counter.Start();
+  }
+
+  uint64_t start_transfers = primary.GetStats().transfers;
+  uint64_t start_us = nerfnet::TimeNowUs();
+  while (primary.GetStats().transfers - start_transfers < exchanges) {
+    primary.Poll(nerfnet::TimeNowUs());
+    fill_queue();
+  }
+
+  BenchmarkResult result;
+  uint64_t elapsed_us = nerfnet::TimeNowUs() - start_us;
+  result.exchanges = primary.GetStats().transfers - start_transfers;
+  result.ns_per_exchange = elapsed_us * 1000.0 / result.exchanges;
+  if (cycle_counter.IsAvailable()) {
+    result.cycles_per_exchange =
+        static_cast<double>(cycle_counter.Stop()) / result.exchanges;
+  } else {
+    result.cycles_per_exchange = result.ns_per_exchange * cpu_mhz / 1000.0;
+  }
+
+  return result;
+}
+
+// Prints a row of the results table.
+void PrintResult(const char* backend, bool payload,
+                 const BenchmarkResult& result) {
+  printf("%-10s %8s %12.1f %12.1f\n", backend, payload ? "yes" : "no",
+      result.ns_per_exchange, result.cycles_per_exchange);
+}
+
+int main(int argc, char** argv) {
+  // Parse command-line arguments.
+  TCLAP::CmdLine cmd(kDescription, ' ', kVersion);
+  TCLAP::ValueArg<uint64_t> exchanges_arg("", "exchanges",
+      "The number of exchanges to measure for each configuration.",
+      false, 100000, "count", cmd);
+  TCLAP::ValueArg<double> cpu_mhz_arg("", "cpu_mhz",
+      "The clock frequency used to estimate cycles when the cycle counter is "
+      "not available. Read from cpufreq when not set.",
+      false, 0.0, "mhz", cmd);
+  cmd.parse(argc, argv);
+
+  const uint64_t exchanges = exchanges_arg.getValue();
+  CHECK(exchanges > 0, "At least one exchange is required");
+
+  nerfnet::CycleCounter cycle_counter;
+  double cpu_mhz = cpu_mhz_arg.isSet()
+      ? cpu_mhz_arg.getValue() : nerfnet::GetCpuMhz();
+  if (cycle_counter.IsAvailable()) {
+    LOGI("cycles: measured");
+  } else if (cpu_mhz > 0.0) {
+    LOGI("cycles: estimated at %.0f MHz", cpu_mhz);
+  } else {
+    LOGW("cycles: unavailable, set --cpu_mhz to estimate");
+  }
+
+  printf("%-10s %8s %12s %12s\n", "backend", "payload", "ns/exchange",
+      "cycles/exch");
+  for (bool payload : {false, true}) {
+    PrintResult("static", payload,
+        RunBenchmark<nerfnet::SimulatedRadio>(exchanges, payload,
+            cycle_counter, cpu_mhz));
+    PrintResult("virtual", payload,
+        RunBenchmark<nerfnet::Radio>(exchanges, payload,
+            cycle_counter, cpu_mhz));
+  }
+
+  return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/replay_window.h"
+
+namespace nerfnet {
+
+ReplayWindow::ReplayWindow() {
+  Reset(0);
+}
+
+void ReplayWindow::Reset(uint64_t next_sequence) {
+  next_sequence_ = next_sequence;
+  bitmap_ = UINT64_MAX;
+  accepted_ = false;
+}
+
+std::optional<uint64_t> ReplayWindow::GetLastAccepted() const {
+  if (!accepted_) {
+    return std::nullopt;
+  }
+
+  return next_sequence_ - 1;
+}
+
+bool ReplayWindow::Check(uint64_t sequence) const {
+  if (sequence >= next_sequence_) {
+    return true;
+  }
+
+  uint64_t age = next_sequence_ - 1 - sequence;
+  return age < kSize && (bitmap_ & (1ull << age)) == 0;
+}
+
+void ReplayWindow::Accept(uint64_t sequence) {
+  accepted_ = true;
+  if (sequence >= next_sequence_) {
+    uint64_t shift = sequence - next_sequence_ + 1;
+    bitmap_ = (shift < kSize) ? ((bitmap_ << shift) | 1) : 1;
+    next_sequence_ = sequence + 1;
+  } else {
+    bitmap_ |= 1ull << (next_sequence_ - 1 - sequence);
+  }
+}
+
+void ReplayWindow::Save(LinkSnapshot& snapshot) const {
+  snapshot.PutU64(next_sequence_);
+  snapshot.PutU64(bitmap_);
+  snapshot.PutU8(accepted_);
+}
+
+bool ReplayWindow::Restore(LinkSnapshot& snapshot) {
+  uint8_t accepted;
+  if (!snapshot.GetU64(next_sequence_) || !snapshot.GetU64(bitmap_)
+      || !snapshot.GetU8(accepted)) {
+    return false;
+  }
+
+  accepted_ = accepted;
+  return true;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_REPLAY_WINDOW_H_
+#define NERFNET_NET_REPLAY_WINDOW_H_
+
+#include <cstdint>
+#include <optional>
+
+#include "nerfnet/net/link_snapshot.h"
+
+namespace nerfnet {
+
+// Tracks the sequence numbers received from a peer to reject duplicates and
+// replays. A bitmap records which of the most recent sequence numbers have
+// been seen, so checks are constant time and packets may arrive out of order
+// within the window.
+class ReplayWindow {
+ public:
+  // The number of sequence numbers below the highest one received that are
+  // tracked. Older sequence numbers are rejected.
+  static constexpr uint64_t kSize = 64;
+
+  // Setup the window with no sequence numbers seen.
+  ReplayWindow();
+
+  // Resets the window so that the supplied sequence number is expected next
+  // and all sequence numbers before it are treated as seen.
+  void Reset(uint64_t next_sequence);
+
+  // Returns the sequence number following the highest one received.
+  uint64_t GetNext() const { return next_sequence_; }
+
+  // Returns the highest sequence number accepted since the last reset.
+  std::optional<uint64_t> GetLastAccepted() const;
+
+  // Returns true if the sequence number has not been seen and is not too old
+  // to be tracked.
+  bool Check(uint64_t sequence) const;
+
+  // Marks a sequence number as seen. The sequence number must have passed
+  // Check.
+  void Accept(uint64_t sequence);
+
+  // Saves the window to a snapshot and restores it again. Returns false if
+  // the snapshot is truncated.
+  void Save(LinkSnapshot& snapshot) const;
+  bool Restore(LinkSnapshot& snapshot);
+
+ private:
+  // The sequence number following the highest one received.
+  uint64_t next_sequence_;
+
+  // Bit n is set if the sequence number n below next_sequence_ - 1 has been
+  // seen.
+  uint64_t bitmap_;
+
+  // Set to true once a sequence number has been accepted after a reset.
+  bool accepted_;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_REPLAY_WINDOW_H_
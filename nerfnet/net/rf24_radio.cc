@@ -0,0 +1,140 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/rf24_radio.h"
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+namespace {
+
+// Converts an address to the byte format used by the radio.
+void GetRadioAddress(uint32_t address, uint8_t radio_address[5]) {
+  radio_address[0] = static_cast<uint8_t>(address);
+  radio_address[1] = static_cast<uint8_t>(address >> 8);
+  radio_address[2] = static_cast<uint8_t>(address >> 16);
+  radio_address[3] = static_cast<uint8_t>(address >> 24);
+  radio_address[4] = 0;
+}
+
+}  // anonymous namespace
+
+RF24Radio::RF24Radio(uint16_t ce_pin, uint16_t csn_pin, uint8_t channel)
+    : radio_(ce_pin, csn_pin),
+      data_rate_(DataRate::k2Mbps),
+      writing_address_(0),
+      pipe_address_(0) {
+  CHECK(channel < 128, "Channel must be between 0 and 127");
+  CHECK(radio_.begin(), "Failed to start NRF24L01");
+  radio_.setChannel(channel);
+  radio_.setPALevel(RF24_PA_MAX);
+  radio_.setAddressWidth(3);
+  radio_.setAutoAck(1);
+  radio_.enableDynamicPayloads();
+  radio_.enableDynamicAck();
+  SetDataRate(data_rate_);
+  radio_.setCRCLength(RF24_CRC_8);
+  CHECK(radio_.isChipConnected(), "NRF24L01 is unavailable");
+}
+
+void RF24Radio::OpenWritingPipe(uint32_t address) {
+  writing_address_ = address;
+  uint8_t radio_address[5];
+  GetRadioAddress(address, radio_address);
+  radio_.openWritingPipe(radio_address);
+}
+
+void RF24Radio::OpenReadingPipe(uint8_t pipe, uint32_t address) {
+  if (pipe == 1) {
+    pipe_address_ = address;
+  } else if (pipe > 1) {
+    CHECK(((address ^ pipe_address_) & 0x00ffff00) == 0,
+        "Address 0x%08x of pipe %u must only differ from 0x%08x in the "
+        "lowest byte", address, pipe, pipe_address_);
+  }
+
+  uint8_t radio_address[5];
+  GetRadioAddress(address, radio_address);
+  radio_.openReadingPipe(pipe, radio_address);
+}
+
+void RF24Radio::SetChannel(uint8_t channel) {
+  CHECK(channel < 128, "Channel must be between 0 and 127");
+  radio_.setChannel(channel);
+}
+
+void RF24Radio::SetDataRate(DataRate data_rate) {
+  // The acknowledgement takes longer to arrive at 250kbps, so the radio must
+  // wait 500us rather than 250us before sending again.
+  uint8_t retry_delay = 0;
+  if (data_rate == DataRate::k250Kbps) {
+    CHECK(radio_.setDataRate(RF24_250KBPS), "Failed to set data rate");
+    retry_delay = 1;
+  } else if (data_rate == DataRate::k1Mbps) {
+    CHECK(radio_.setDataRate(RF24_1MBPS), "Failed to set data rate");
+  } else {
+    CHECK(radio_.setDataRate(RF24_2MBPS), "Failed to set data rate");
+  }
+
+  radio_.setRetries(retry_delay, 15);
+  data_rate_ = data_rate;
+}
+
+bool RF24Radio::Write(const uint8_t* data, size_t size) {
+  if (!radio_.write(data, size)) {
+    return false;
+  }
+
+  while (!radio_.txStandBy()) {
+    LOGI("Waiting for transmit standby");
+  }
+
+  return true;
+}
+
+void RF24Radio::WriteBroadcast(uint32_t address, const uint8_t* data,
+                               size_t size) {
+  uint8_t radio_address[5];
+  GetRadioAddress(address, radio_address);
+  radio_.openWritingPipe(radio_address);
+  radio_.write(data, size, /*multicast=*/true);
+  GetRadioAddress(writing_address_, radio_address);
+  radio_.openWritingPipe(radio_address);
+}
+
+bool RF24Radio::ReadAll(std::vector<RxPacket>& packets) {
+  // Packets that arrive while the FIFO is full are not acknowledged and are
+  // dropped by the radio.
+  bool fifo_full = radio_.rxFifoFull();
+  uint8_t pipe;
+  while (radio_.available(&pipe)) {
+    // A corrupt length is reported as zero after the FIFO is flushed.
+    uint8_t size = radio_.getDynamicPayloadSize();
+    if (size == 0) {
+      break;
+    }
+
+    RxPacket packet;
+    packet.pipe = pipe;
+    packet.data.resize(size);
+    radio_.read(packet.data.data(), size);
+    packets.push_back(std::move(packet));
+  }
+
+  return fifo_full;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_RF24_RADIO_H_
+#define NERFNET_NET_RF24_RADIO_H_
+
+#include <RF24/RF24.h>
+
+#include "nerfnet/net/radio.h"
+
+namespace nerfnet {
+
+// A radio backed by an NRF24L01 attached to the SPI bus.
+class RF24Radio final : public Radio {
+ public:
+  // Setup the radio on the supplied pins and channel. Quits and logs the error
+  // if the radio is unavailable.
+  RF24Radio(uint16_t ce_pin, uint16_t csn_pin, uint8_t channel);
+
+  // Radio methods. Those called for every packet are defined here so that
+  // they are inlined into the link.
+  void OpenWritingPipe(uint32_t address) override;
+  void OpenReadingPipe(uint8_t pipe, uint32_t address) override;
+  void SetChannel(uint8_t channel) override;
+  uint8_t GetChannel() override { return radio_.getChannel(); }
+  void SetDataRate(DataRate data_rate) override;
+  DataRate GetDataRate() override { return data_rate_; }
+  void StartListening() override { radio_.startListening(); }
+  void StopListening() override { radio_.stopListening(); }
+  bool Write(const uint8_t* data, size_t size) override;
+  void WriteBroadcast(uint32_t address, const uint8_t* data,
+                      size_t size) override;
+  uint8_t GetRetransmitCount() override { return radio_.getARC(); }
+  bool Available() override { return radio_.available(); }
+  bool ReadAll(std::vector<RxPacket>& packets) override;
+
+ private:
+  // The underlying radio.
+  RF24 radio_;
+
+  // The data rate that the radio operates at.
+  DataRate data_rate_;
+
+  // The address that packets are written to, which is restored after a
+  // broadcast.
+  uint32_t writing_address_;
+
+  // The address of reading pipe 1. The radio only stores the lowest byte of
+  // the addresses of pipes 2 to 5 and takes the rest from pipe 1.
+  uint32_t pipe_address_;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_RF24_RADIO_H_
@@ -16,78 +16,211 @@
 
 #include "nerfnet/net/secondary_radio_interface.h"
 
+#include <algorithm>
 #include <unistd.h>
 #include <vector>
 
+#include "nerfnet/net/rf24_radio.h"
+#include "nerfnet/net/simulated_radio.h"
+#include "nerfnet/net/unix_socket_radio.h"
+#include "nerfnet/util/encoding.h"
 #include "nerfnet/util/log.h"
+#include "nerfnet/util/random.h"
 #include "nerfnet/util/time.h"
 
 namespace nerfnet {
 
-SecondaryRadioInterface::SecondaryRadioInterface(
-    uint16_t ce_pin, int tunnel_fd,
-    uint32_t primary_addr, uint32_t secondary_addr, uint8_t channel)
-    : RadioInterface(ce_pin, tunnel_fd, primary_addr, secondary_addr, channel),
-      payload_in_flight_(false) {
-  uint8_t writing_addr[5] = {
-    static_cast<uint8_t>(secondary_addr),
-    static_cast<uint8_t>(secondary_addr >> 8),
-    static_cast<uint8_t>(secondary_addr >> 16),
-    static_cast<uint8_t>(secondary_addr >> 24),
-    0,
-  };
-
-  uint8_t reading_addr[5] = {
-    static_cast<uint8_t>(primary_addr),
-    static_cast<uint8_t>(primary_addr >> 8),
-    static_cast<uint8_t>(primary_addr >> 16),
-    static_cast<uint8_t>(primary_addr >> 24),
-    0,
-  };
-
-  radio_.openWritingPipe(writing_addr);
-  radio_.openReadingPipe(kPipeId, reading_addr);
+template <typename RadioType>
+SecondaryRadioInterface<RadioType>::SecondaryRadioInterface(
+    std::unique_ptr<RadioType> radio, int tunnel_fd,
+    uint32_t primary_addr, uint32_t secondary_addr)
+    : RadioInterface(tunnel_fd, primary_addr, secondary_addr,
+                     radio->GetChannel(), radio->GetDataRate()),
+      radio_(std::move(radio)),
+      roaming_(false),
+      gateway_qualities_(),
+      gateway_beacons_(),
+      roam_measure_us_(0),
+      roam_report_us_(0),
+      backlog_report_us_(0),
+      reported_backlog_(0),
+      payload_in_flight_(false),
+      last_payload_us_(0) {
+  radio_->OpenWritingPipe(secondary_addr);
+  radio_->OpenReadingPipe(kPipeId, primary_addr);
 }
 
-void SecondaryRadioInterface::Run() {
-  uint8_t packet[kMaxPacketSize];
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::EnableRoaming() {
+  roaming_ = true;
+  radio_->OpenReadingPipe(kBeaconPipeId, GetBeaconAddress());
+}
+
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::EnableTdma(uint32_t beacon_address) {
+  tdma_tracker_.emplace(GetLinkID());
+  radio_->OpenReadingPipe(kTdmaPipeId, beacon_address);
+}
+
+template <typename RadioType>
+uint64_t SecondaryRadioInterface<RadioType>::Poll(uint64_t now_us) {
+  stats_.polls++;
+  {
+    std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+    ServiceClockSync(now_us);
+    ServiceRoaming(now_us);
+    ServiceBacklogReport(now_us);
+  }
+
+  std::vector<std::vector<uint8_t>> requests;
+  bool received = ReceiveAll(*radio_, requests);
+  for (const auto& beacon : rx_beacons_) {
+    HandleBeacon(beacon);
+  }
+
+  rx_beacons_.clear();
+  for (const auto& beacon : rx_tdma_beacons_) {
+    if (tdma_tracker_.has_value()
+        && tdma_tracker_->AddBeacon(beacon.data(), beacon.size(), now_us)) {
+      stats_.tdma_beacons++;
+      stats_.tdma_drift_ppb = tdma_tracker_->GetDriftPpb();
+    }
+  }
+
+  rx_tdma_beacons_.clear();
+
+  // Broadcasts arrive back to back, so the radio is checked often while they
+  // are being received to avoid overrunning the receive FIFO.
+  if (!rx_broadcasts_.empty()) {
+    last_payload_us_ = now_us;
+    if (!received) {
+      DispatchDatagrams();
+    }
+  }
 
-  while (1) {
-    std::vector<uint8_t> request(kMaxPacketSize, 0x00);
-    auto result = Receive(request);
-    if (result == RequestResult::Success) {
-      HandleRequest(request);
+  if (received) {
+    // The primary radio only waits for a response to its latest request, so
+    // earlier requests in the batch are processed without responding.
+    for (size_t i = 0; i < requests.size(); i++) {
+      const auto& request = requests[i];
+      HandleRequest(request, /*respond=*/i + 1 == requests.size());
+      if (payload_in_flight_ || (request.size() > kPacketHeaderSize
+          && request[0] != 0x00)) {
+        last_payload_us_ = now_us;
+      }
     }
+
+    stats_.packets_stale += requests.size() - 1;
+    DispatchDatagrams();
+    return now_us;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+    CheckChannelSwitch(now_us);
+  }
+
+  uint64_t next_poll_us = now_us + kIdlePollIntervalUs;
+  if (now_us - last_payload_us_ < kActivePeriodUs) {
+    next_poll_us = now_us + kActivePollIntervalUs;
+  }
+
+  return GetTdmaPollUs(now_us, next_poll_us);
+}
+
+template <typename RadioType>
+bool SecondaryRadioInterface<RadioType>::SaveState(LinkSnapshot& snapshot) {
+  if (!RadioInterface::SaveState(snapshot)) {
+    return false;
   }
+
+  snapshot.PutU8(payload_in_flight_);
+  snapshot.PutU8(pending_setting_.has_value());
+  if (pending_setting_.has_value()) {
+    snapshot.PutU8(pending_setting_->channel);
+    snapshot.PutU8(static_cast<uint8_t>(pending_setting_->data_rate));
+  }
+
+  return true;
 }
 
-void SecondaryRadioInterface::HandleRequest(
-    const std::vector<uint8_t>& request) {
-  if (request.size() != kMaxPacketSize) {
+template <typename RadioType>
+bool SecondaryRadioInterface<RadioType>::RestoreState(
+    LinkSnapshot& snapshot) {
+  uint8_t payload_in_flight;
+  uint8_t has_pending_setting;
+  if (!RadioInterface::RestoreState(snapshot)
+      || !snapshot.GetU8(payload_in_flight)
+      || !snapshot.GetU8(has_pending_setting)) {
+    return false;
+  }
+
+  payload_in_flight_ = payload_in_flight;
+  if (has_pending_setting) {
+    uint8_t channel;
+    uint8_t data_rate;
+    if (!snapshot.GetU8(channel) || !snapshot.GetU8(data_rate)
+        || data_rate > static_cast<uint8_t>(Radio::DataRate::k2Mbps)) {
+      return false;
+    }
+
+    pending_setting_ = RadioSetting{channel,
+        static_cast<Radio::DataRate>(data_rate)};
+  }
+
+  return true;
+}
+
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::HandleRequest(
+    const std::vector<uint8_t>& request, bool respond) {
+  if (request.size() < kPacketHeaderSize) {
     LOGE("Received short packet");
   } else if (request[0] == 0x00) {
-    HandleNetworkTunnelReset();
+    HandleNetworkTunnelReset(request, respond);
   } else {
-    HandleNetworkTunnelTxRx(request);
+    HandleNetworkTunnelTxRx(request, respond);
   }
 }
 
-void SecondaryRadioInterface::HandleNetworkTunnelReset() {
-  next_id_ = 1;
-  last_ack_id_.reset();
-  frame_buffer_.clear();
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::HandleNetworkTunnelReset(
+    const std::vector<uint8_t>& request, bool respond) {
+  if (request.size() != kResetPacketSize || !VerifyResetPacket(request)) {
+    LOGE("Ignoring corrupted tunnel reset request");
+    return;
+  }
+
+  LinkSession session;
+  session.primary_nonce = ReadBigEndianU64(&request[kResetNonceOffset]);
+  session.secondary_nonce = RandomU64();
+
+  std::lock_guard<std::mutex> lock(read_buffer_mutex_);
+  ResetLinkState(session,
+      ReadBigEndianU64(&request[kResetSequenceOffset]));
   payload_in_flight_ = false;
+  reported_backlog_ = 0;
+  ConfirmChannel();
+  if (!respond) {
+    return;
+  }
 
   LOGI("Responding to tunnel reset request");
-  std::vector<uint8_t> response(kMaxPacketSize, 0x00);
-  auto status = Send(response);
+  std::vector<uint8_t> response(kResetPacketSize, 0x00);
+  WriteBigEndianU64(&response[kResetNonceOffset], session.secondary_nonce);
+  WriteBigEndianU64(&response[kResetSequenceOffset], tx_sequence_);
+  SealResetPacket(response);
+  auto status = Send(*radio_, response);
   if (status != RequestResult::Success) {
     LOGE("Failed to send tunnel reset response");
+  } else {
+    stats_.resets++;
   }
 }
 
-void SecondaryRadioInterface::HandleNetworkTunnelTxRx(
-    const std::vector<uint8_t>& request) {
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::HandleNetworkTunnelTxRx(
+    const std::vector<uint8_t>& request, bool respond) {
   TunnelTxRxPacket tunnel;
   if (!DecodeTunnelTxRxPacket(request, tunnel)) {
     return;
@@ -95,50 +228,46 @@ void SecondaryRadioInterface::HandleNetworkTunnelTxRx(
 
   std::lock_guard<std::mutex> lock(read_buffer_mutex_);
   if (!tunnel.id.has_value()
-      || (last_ack_id_.has_value() && !tunnel.ack_id.has_value())) {
+      || (GetAckID().has_value() && !tunnel.ack_id.has_value())) {
     LOGE("Missing tunnel fields");
     return;
   }
 
-  if (!ValidateID(tunnel.id.value())) {
-    LOGE("Received non-sequential packet: %u vs %u",
-        last_ack_id_.value(), tunnel.id.value());
-  } else if (!tunnel.payload.empty()) {
-    frame_buffer_.insert(frame_buffer_.end(),
-        tunnel.payload.begin(), tunnel.payload.end());
-    if (tunnel.bytes_left <= kMaxPayloadSize) {
-      WriteTunnel();
-    }
-  }
+  ConfirmChannel();
 
+  // The acknowledgement is handled before the payload, since the primary has
+  // seen any frame error reported in the acknowledged response, while the
+  // payload may complete a frame that fails to decode.
   if (tunnel.ack_id.has_value()) {
-    if (tunnel.ack_id.value() != next_id_) {
+    if (tunnel.ack_id.value() != GetID(tx_sequence_)) {
       LOGE("Primary radio failed to ack, retransmitting");
     } else {
-      AdvanceID();
+      AdvanceSequence();
+      rx_frame_error_ = false;
       if (payload_in_flight_) {
-        if (!read_buffer_.empty()) {
-          auto& frame = read_buffer_.front();
-          size_t transfer_size = GetTransferSize(frame);
-          frame.erase(frame.begin(), frame.begin() + transfer_size);
-          if (frame.empty()) {
-            read_buffer_.pop_front();
-          }
-        }
-
+        ConsumeTxFrame(tunnel.frame_error);
         payload_in_flight_ = false;
       }
     }
   }
 
-  tunnel.id = next_id_;
-  tunnel.ack_id = last_ack_id_.value();
+  if (!ValidateID(tunnel.id.value())) {
+    LOGE("Received non-sequential packet: %u vs %u",
+        GetID(rx_window_.GetNext()), tunnel.id.value());
+  } else if (!tunnel.payload.empty()) {
+    ReceiveFramePayload(tunnel);
+  }
+
+  if (!respond) {
+    return;
+  }
+
+  tunnel.id = GetID(tx_sequence_);
+  tunnel.ack_id = GetAckID();
   tunnel.bytes_left = 0;
-  if (!read_buffer_.empty()) {
-    auto& frame = read_buffer_.front();
-    size_t transfer_size = GetTransferSize(frame);
-    tunnel.payload = {frame.begin(), frame.begin() + transfer_size};
-    tunnel.bytes_left = std::min(frame.size(), static_cast<size_t>(UINT8_MAX));
+  tunnel.payload.clear();
+  tunnel.frame_error = rx_frame_error_;
+  if (FillTxPayload(tunnel)) {
     payload_in_flight_ = true;
   }
 
@@ -147,10 +276,172 @@ void SecondaryRadioInterface::HandleNetworkTunnelTxRx(
     return;
   }
 
-  auto status = Send(response);
+  auto status = Send(*radio_, response);
   if (status != RequestResult::Success) {
     LOGE("Failed to send network tunnel txrx response");
+    stats_.transfer_failures++;
+  } else {
+    stats_.transfers++;
+  }
+
+  // The primary switches once it sees the acknowledgement of the
+  // announcement. If it was lost, both sides return to this channel.
+  if (pending_setting_.has_value()) {
+    SwitchChannel(pending_setting_.value());
+    pending_setting_.reset();
+  }
+}
+
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::HandleChannelRequest(
+    const RadioSetting& setting) {
+  if (setting.channel != channel_ || setting.data_rate != data_rate_) {
+    SendChannelSwitch(setting, /*switch_on_delivery=*/false);
+  }
+}
+
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::HandleChannelSwitch(
+    const RadioSetting& setting) {
+  pending_setting_ = setting;
+}
+
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::HandleBeacon(
+    const std::vector<uint8_t>& beacon) {
+  if (!roaming_ || beacon.size() != kBeaconSize
+      || beacon[0] != kBeaconMarker || beacon[1] >= kMaxGateways
+      || beacon[2] >= kMaxGateways) {
+    return;
   }
+
+  gateway_beacons_[beacon[1]]++;
+  gateway_ = beacon[2];
+  stats_.gateway = beacon[2];
 }
 
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::ServiceRoaming(uint64_t now_us) {
+  if (!roaming_ || now_us < roam_measure_us_ + kRoamIntervalUs) {
+    return;
+  }
+
+  // Each gateway is expected to send a beacon every beacon interval.
+  double expected_beacons = static_cast<double>(now_us - roam_measure_us_)
+      / kBeaconIntervalUs;
+  roam_measure_us_ = now_us;
+  size_t gateway_count = 0;
+  for (size_t i = 0; i < kMaxGateways; i++) {
+    double quality = std::min(1.0, gateway_beacons_[i] / expected_beacons);
+    gateway_qualities_[i] += kRoamQualityWeight
+        * (quality - gateway_qualities_[i]);
+    gateway_beacons_[i] = 0;
+    if (gateway_qualities_[i] > 0.0) {
+      gateway_count = i + 1;
+    }
+  }
+
+  if (!gateway_.has_value() || gateway_count == 0) {
+    return;
+  }
+
+  double current_quality = gateway_qualities_[gateway_.value()];
+  size_t best_gateway = gateway_.value();
+  for (size_t i = 0; i < gateway_count; i++) {
+    if (gateway_qualities_[i] > gateway_qualities_[best_gateway]) {
+      best_gateway = i;
+    }
+  }
+
+  bool move = current_quality < kRoamQualityThreshold
+      && gateway_qualities_[best_gateway]
+          > current_quality + kRoamQualityMargin;
+  uint64_t report_interval_us = move
+      ? kRoamRequestIntervalUs : kRoamReportIntervalUs;
+  if (now_us < roam_report_us_ + report_interval_us) {
+    return;
+  }
+
+  // The primary also uses the qualities to pick a gateway if the current one
+  // stops carrying exchanges before it is asked to move.
+  roam_report_us_ = now_us;
+  std::vector<uint8_t> report = {static_cast<uint8_t>(
+      move ? best_gateway : kMaxGateways)};
+  for (size_t i = 0; i < gateway_count; i++) {
+    report.push_back(static_cast<uint8_t>(gateway_qualities_[i] * 255.0));
+  }
+
+  if (move) {
+    LOGI("Asking to move from gateway %u to gateway %zu", gateway_.value(),
+        best_gateway);
+  }
+
+  SendControlMessage(ControlMessageType::RoamReport, std::move(report));
+}
+
+template <typename RadioType>
+void SecondaryRadioInterface<RadioType>::ServiceBacklogReport(
+    uint64_t now_us) {
+  if (!tdma_tracker_.has_value()
+      || now_us < backlog_report_us_ + kBacklogReportIntervalUs) {
+    return;
+  }
+
+  // Each report takes an exchange of its own, so the backlog is only
+  // reported once it has moved by a good part of the last report.
+  size_t backlog = std::min(GetQueuedBytes(),
+      static_cast<size_t>(UINT32_MAX));
+  size_t change = (backlog > reported_backlog_)
+      ? backlog - reported_backlog_ : reported_backlog_ - backlog;
+  if (change < kMinBacklogChange + reported_backlog_ / 2) {
+    return;
+  }
+
+  backlog_report_us_ = now_us;
+  reported_backlog_ = backlog;
+  std::vector<uint8_t> report(4);
+  WriteBigEndianU32(report.data(), backlog);
+  SendControlMessage(ControlMessageType::Backlog, std::move(report));
+}
+
+template <typename RadioType>
+uint64_t SecondaryRadioInterface<RadioType>::GetTdmaPollUs(
+    uint64_t now_us, uint64_t next_poll_us) const {
+  // Broadcasts may be sent in the slot of any link of the cell, so a
+  // secondary that listens for them keeps checking the radio. An active link
+  // also keeps its poll rate, the radio only sleeps between slots when idle.
+  if (!tdma_tracker_.has_value() || broadcast_handler_
+      || !tdma_tracker_->IsSynchronized(now_us)
+      || now_us - last_payload_us_ < kActivePeriodUs) {
+    return next_poll_us;
+  }
+
+  // The radio is checked often around the beacon, since the time that it is
+  // read is taken as the time that it arrived, and during the slot.
+  uint64_t beacon_us = tdma_tracker_->GetNextBeaconUs(now_us - kTdmaGuardUs);
+  if (beacon_us <= now_us + kTdmaGuardUs) {
+    return now_us + kActivePollIntervalUs;
+  }
+
+  uint64_t wake_us = beacon_us - kTdmaGuardUs;
+  uint64_t slot_start_us;
+  uint64_t slot_end_us;
+  if (tdma_tracker_->GetNextSlot(now_us - kTdmaGuardUs, slot_start_us,
+          slot_end_us)) {
+    if (slot_start_us <= now_us + kTdmaGuardUs) {
+      return now_us + kActivePollIntervalUs;
+    }
+
+    wake_us = std::min(wake_us, slot_start_us - kTdmaGuardUs);
+  }
+
+  return wake_us;
+}
+
+// Backends that are only known at run time use the virtual interface.
+template class SecondaryRadioInterface<RF24Radio>;
+template class SecondaryRadioInterface<SimulatedRadio>;
+template class SecondaryRadioInterface<UnixSocketRadio>;
+template class SecondaryRadioInterface<Radio>;
+
 }  // namespace nerfnet
@@ -17,31 +17,146 @@
 #ifndef NERFNET_NET_SECONDARY_RADIO_INTERFACE_H_
 #define NERFNET_NET_SECONDARY_RADIO_INTERFACE_H_
 
+#include <optional>
+
 #include "nerfnet/net/radio_interface.h"
+#include "nerfnet/net/tdma_tracker.h"
 
 namespace nerfnet {
 
-// The secondary mode radio interface.
+// The secondary mode radio interface. It is instantiated for the same radio
+// backends as the PrimaryRadioInterface.
+template <typename RadioType>
 class SecondaryRadioInterface : public RadioInterface {
  public:
   // Setup the secondary radio link.
-  SecondaryRadioInterface(uint16_t ce_pin, int tunnel_fd,
-                          uint32_t primary_addr, uint32_t secondary_addr,
-                          uint8_t channel);
+  SecondaryRadioInterface(std::unique_ptr<RadioType> radio, int tunnel_fd,
+                          uint32_t primary_addr, uint32_t secondary_addr);
+
+  // Listens for the beacons of the gateways of a roaming primary and asks
+  // the primary to move the link to the gateway with the best beacons once
+  // the current gateway fades, while the link still carries the request.
+  // Must be called before the link is serviced.
+  void EnableRoaming();
+
+  // Follows the beacons that the hub of a TDMA cell sends to an address,
+  // reporting the bytes waiting on this side so that the slot of the link is
+  // sized to them and only checking for requests around the beacons and the
+  // slot of the link. Must be called before the link is serviced.
+  void EnableTdma(uint32_t beacon_address);
+
+  // Checks for a request from the primary radio and responds to it.
+  uint64_t Poll(uint64_t now_us) override;
 
-  // Runs the interface listening for commands and responding.
-  void Run();
+  // Saves and restores the payload in flight to the primary and any channel
+  // switch waiting to be made along with the state of the connection.
+  bool SaveState(LinkSnapshot& snapshot) override;
+  bool RestoreState(LinkSnapshot& snapshot) override;
 
  protected:
+  // The interval to check for requests while the link is carrying payloads.
+  static constexpr uint64_t kActivePollIntervalUs = 100;
+
+  // The interval to check for requests while the link is idle.
+  static constexpr uint64_t kIdlePollIntervalUs = 1000;
+
+  // The period after the last payload for which the link is considered active.
+  static constexpr uint64_t kActivePeriodUs = 10000;
+
+  // The interval at which the quality of the beacons of each gateway is
+  // measured and the weight given to each new measurement.
+  static constexpr uint64_t kRoamIntervalUs = 100000;
+  static constexpr double kRoamQualityWeight = 0.5;
+
+  // The move to another gateway is asked for once the beacon quality of the
+  // current gateway falls below the threshold and another gateway is better
+  // by the margin.
+  static constexpr double kRoamQualityThreshold = 0.7;
+  static constexpr double kRoamQualityMargin = 0.2;
+
+  // The intervals at which the quality of the gateways is reported and at
+  // which a move is asked for again until the primary makes it.
+  static constexpr uint64_t kRoamReportIntervalUs = 500000;
+  static constexpr uint64_t kRoamRequestIntervalUs = 250000;
+
+  // The time before and after the predicted beacons and slots of a TDMA cell
+  // that requests are checked for, which covers errors in the prediction.
+  static constexpr uint64_t kTdmaGuardUs = 500;
+
+  // The shortest interval between reports of the bytes waiting to be sent
+  // and the smallest change that is reported. Smaller backlogs are carried
+  // by the shortest slot.
+  static constexpr uint64_t kBacklogReportIntervalUs = 100000;
+  static constexpr size_t kMinBacklogChange = 256;
+
+  // The underlying radio.
+  const std::unique_ptr<RadioType> radio_;
+
+  // Set once the link listens for beacons.
+  bool roaming_;
+
+  // The smoothed fraction of beacons heard from each gateway and the number
+  // heard since the last measurement.
+  std::array<double, kMaxGateways> gateway_qualities_;
+  std::array<uint32_t, kMaxGateways> gateway_beacons_;
+
+  // The gateway that carries the link, as announced in beacons.
+  std::optional<uint8_t> gateway_;
+
+  // The times of the last measurement of the beacons and of the last report
+  // sent to the primary.
+  uint64_t roam_measure_us_;
+  uint64_t roam_report_us_;
+
+  // Follows the superframes of a TDMA cell, if enabled.
+  std::optional<TdmaTracker> tdma_tracker_;
+
+  // The time of the last backlog report and the backlog that it carried.
+  uint64_t backlog_report_us_;
+  size_t reported_backlog_;
+
   // Set to true while a payload is in flight.
   bool payload_in_flight_;
 
-  // Handles a request from the primary radio.
-  void HandleRequest(const std::vector<uint8_t>& request);
+  // The time that a payload was last exchanged with the primary radio.
+  uint64_t last_payload_us_;
+
+  // The channel and data rate announced by the primary, which are switched
+  // to once a response acknowledging the announcement has been sent.
+  std::optional<RadioSetting> pending_setting_;
+
+  // Handles a request from the primary radio, sending a response if respond
+  // is true.
+  void HandleRequest(const std::vector<uint8_t>& request, bool respond);
 
   // Request handlers.
-  void HandleNetworkTunnelReset();
-  void HandleNetworkTunnelTxRx(const std::vector<uint8_t>& request);
+  void HandleNetworkTunnelReset(const std::vector<uint8_t>& request,
+                                bool respond);
+  void HandleNetworkTunnelTxRx(const std::vector<uint8_t>& request,
+                               bool respond);
+
+  // Counts a beacon received from a gateway.
+  void HandleBeacon(const std::vector<uint8_t>& beacon);
+
+  // Measures the quality of the beacons of each gateway when due and reports
+  // it to the primary, asking to move to a better gateway if the current one
+  // has faded. The read buffer lock must be held.
+  void ServiceRoaming(uint64_t now_us);
+
+  // Reports the bytes waiting to be sent to the hub of a TDMA cell if they
+  // have changed notably and a report is due. The read buffer lock must be
+  // held.
+  void ServiceBacklogReport(uint64_t now_us);
+
+  // Returns the time to next check for requests, which in a TDMA cell is
+  // soon while a beacon or the slot of the link is due and the start of the
+  // next one otherwise. The next poll time is kept outside a cell and while
+  // the link is active.
+  uint64_t GetTdmaPollUs(uint64_t now_us, uint64_t next_poll_us) const;
+
+  // RadioInterface methods.
+  void HandleChannelRequest(const RadioSetting& setting) override;
+  void HandleChannelSwitch(const RadioSetting& setting) override;
 };
 
 }  // namespace nerfnet
@@ -0,0 +1,298 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/simulated_radio.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/random.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+
+SimulatedMedium::SimulatedMedium()
+    : SimulatedMedium(SimulatedChannelConfig()) {}
+
+SimulatedMedium::SimulatedMedium(const SimulatedChannelConfig& config)
+    : config_(config),
+      random_(RandomU64()) {}
+
+bool SimulatedMedium::IsCorrupted(size_t bits, double bit_error_rate) {
+  if (bit_error_rate <= 0.0) {
+    return false;
+  }
+
+  double success = std::pow(1.0 - bit_error_rate, bits);
+  return std::uniform_real_distribution<double>()(random_) >= success;
+}
+
+SimulatedRadio::SimulatedRadio(SimulatedMedium& medium)
+    : medium_(medium),
+      channel_(0),
+      data_rate_(DataRate::k2Mbps),
+      last_write_us_(0),
+      retransmit_count_(0),
+      writing_address_(0),
+      listening_(false),
+      rx_fifo_overrun_(false) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  medium_.radios_.push_back(this);
+}
+
+SimulatedRadio::~SimulatedRadio() {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  auto& radios = medium_.radios_;
+  radios.erase(std::remove(radios.begin(), radios.end(), this), radios.end());
+}
+
+void SimulatedRadio::OpenWritingPipe(uint32_t address) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  writing_address_ = address;
+}
+
+void SimulatedRadio::OpenReadingPipe(uint8_t pipe, uint32_t address) {
+  CHECK(pipe < kPipeCount, "Invalid pipe %u", pipe);
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  reading_addresses_[pipe] = address;
+}
+
+void SimulatedRadio::SetChannel(uint8_t channel) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  channel_ = channel;
+}
+
+uint8_t SimulatedRadio::GetChannel() {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  return channel_;
+}
+
+void SimulatedRadio::SetDataRate(DataRate data_rate) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  data_rate_ = data_rate;
+}
+
+Radio::DataRate SimulatedRadio::GetDataRate() {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  return data_rate_;
+}
+
+void SimulatedRadio::StartListening() {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  listening_ = true;
+}
+
+void SimulatedRadio::StopListening() {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  listening_ = false;
+}
+
+bool SimulatedRadio::Write(const uint8_t* data, size_t size) {
+  // The attempts are decided up front so that the time they take can be
+  // spent before the packet arrives. A packet that is received but whose
+  // acknowledgement is lost is sent again and discarded by the receiver, so
+  // it is only delivered once.
+  uint8_t attempts = 0;
+  bool received = false;
+  bool acknowledged = false;
+  double bit_time_us;
+  {
+    std::lock_guard<std::mutex> lock(medium_.mutex_);
+    bit_time_us = GetBitTimeUs(data_rate_);
+    double bit_error_rate = GetBitErrorRate(FindReceiver(writing_address_));
+    while (attempts < SimulatedMedium::kMaxAttempts && !acknowledged) {
+      attempts++;
+      received = received || !medium_.IsCorrupted(
+          SimulatedMedium::kOverheadBits + size * 8, bit_error_rate);
+      acknowledged = received && !medium_.IsCorrupted(
+          SimulatedMedium::kOverheadBits, bit_error_rate);
+    }
+  }
+
+  // Each attempt sends the packet and waits for its acknowledgement.
+  uint64_t attempt_us = SimulatedMedium::kAttemptOverheadUs
+      + bit_time_us * (2 * SimulatedMedium::kOverheadBits + size * 8);
+  if (medium_.config_.real_time) {
+    SleepUs(attempts * attempt_us);
+  }
+
+  if (Deliver(data, size, received)) {
+    retransmit_count_ = attempts - 1;
+    return acknowledged;
+  }
+
+  // The radio keeps trying when the packet is not received for any reason.
+  if (medium_.config_.real_time) {
+    SleepUs((SimulatedMedium::kMaxAttempts - attempts) * attempt_us);
+  }
+
+  retransmit_count_ = SimulatedMedium::kMaxAttempts - 1;
+  return false;
+}
+
+bool SimulatedRadio::Deliver(const uint8_t* data, size_t size,
+                             bool received) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  uint64_t now_us = TimeNowUs();
+  bool collision = HasCollision(now_us);
+  last_write_us_ = now_us;
+  if (collision || !received) {
+    return false;
+  }
+
+  SimulatedRadio* receiver = FindReceiver(writing_address_);
+  return receiver != nullptr
+      && receiver->Receive(writing_address_, data, size);
+}
+
+void SimulatedRadio::WriteBroadcast(uint32_t address, const uint8_t* data,
+                                    size_t size) {
+  // Without an acknowledgement, the transmission ends once the transmitter
+  // has settled and sent the packet.
+  if (medium_.config_.real_time) {
+    SleepUs(SimulatedMedium::kAttemptOverheadUs / 2 + GetBitTimeUs(
+        GetDataRate()) * (SimulatedMedium::kOverheadBits + size * 8));
+  }
+
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  uint64_t now_us = TimeNowUs();
+  bool collision = HasCollision(now_us);
+  last_write_us_ = now_us;
+  if (collision) {
+    return;
+  }
+
+  // Each receiver hears the packet with its own errors.
+  for (SimulatedRadio* radio : medium_.radios_) {
+    if (radio != this && radio->channel_ == channel_
+        && radio->data_rate_ == data_rate_
+        && !medium_.IsCorrupted(SimulatedMedium::kOverheadBits + size * 8,
+            GetBitErrorRate(radio))) {
+      radio->Receive(address, data, size);
+    }
+  }
+}
+
+bool SimulatedRadio::Receive(uint32_t address, const uint8_t* data,
+                             size_t size) {
+  auto pipe = GetReceivingPipe(address);
+  if (!pipe.has_value()) {
+    return false;
+  }
+
+  if (rx_fifo_.size() >= kRxFifoSize) {
+    rx_fifo_overrun_ = true;
+    return false;
+  }
+
+  rx_fifo_.push_back({pipe.value(), std::vector<uint8_t>(data, data + size)});
+  return true;
+}
+
+uint8_t SimulatedRadio::GetRetransmitCount() {
+  return retransmit_count_;
+}
+
+bool SimulatedRadio::Available() {
+  {
+    std::lock_guard<std::mutex> lock(medium_.mutex_);
+    if (!rx_fifo_.empty() || !idle_callback_) {
+      return !rx_fifo_.empty();
+    }
+  }
+
+  idle_callback_();
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  return !rx_fifo_.empty();
+}
+
+bool SimulatedRadio::ReadAll(std::vector<RxPacket>& packets) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  for (auto& packet : rx_fifo_) {
+    packets.push_back(std::move(packet));
+  }
+
+  rx_fifo_.clear();
+  bool overrun = rx_fifo_overrun_;
+  rx_fifo_overrun_ = false;
+  return overrun;
+}
+
+void SimulatedRadio::SetIdleCallback(std::function<void()> callback) {
+  idle_callback_ = std::move(callback);
+}
+
+void SimulatedRadio::SetBitErrorRate(double bit_error_rate) {
+  std::lock_guard<std::mutex> lock(medium_.mutex_);
+  bit_error_rate_ = bit_error_rate;
+}
+
+SimulatedRadio* SimulatedRadio::FindReceiver(uint32_t address) const {
+  for (SimulatedRadio* radio : medium_.radios_) {
+    if (radio != this && radio->channel_ == channel_
+        && radio->data_rate_ == data_rate_
+        && radio->GetReceivingPipe(address).has_value()) {
+      return radio;
+    }
+  }
+
+  return nullptr;
+}
+
+double SimulatedRadio::GetBitErrorRate(const SimulatedRadio* peer) const {
+  double bit_error_rate = bit_error_rate_.value_or(
+      medium_.config_.bit_error_rate);
+  if (peer != nullptr) {
+    bit_error_rate = std::max(bit_error_rate, peer->bit_error_rate_.value_or(
+        medium_.config_.bit_error_rate));
+  }
+
+  return bit_error_rate;
+}
+
+std::optional<uint8_t> SimulatedRadio::GetReceivingPipe(
+    uint32_t address) const {
+  if (listening_) {
+    for (uint8_t pipe = 0; pipe < kPipeCount; pipe++) {
+      if (reading_addresses_[pipe] == address) {
+        return pipe;
+      }
+    }
+  }
+
+  return std::nullopt;
+}
+
+bool SimulatedRadio::HasCollision(uint64_t now_us) const {
+  for (const SimulatedRadio* radio : medium_.radios_) {
+    // The peer of this radio takes turns with it rather than interfering.
+    bool peer = std::find(reading_addresses_.begin(),
+        reading_addresses_.end(), radio->writing_address_)
+        != reading_addresses_.end();
+    int separation = abs(static_cast<int>(radio->channel_) - channel_);
+    if (radio != this && !peer && radio->last_write_us_ != 0
+        && now_us - radio->last_write_us_ < SimulatedMedium::kPacketAirtimeUs
+        && separation <= SimulatedMedium::kInterferenceChannels) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+}  // namespace nerfnet
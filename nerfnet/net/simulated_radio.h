@@ -0,0 +1,200 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_SIMULATED_RADIO_H_
+#define NERFNET_NET_SIMULATED_RADIO_H_
+
+#include <array>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "nerfnet/net/radio.h"
+
+namespace nerfnet {
+
+class SimulatedRadio;
+
+// The quality and timing of the channels of a simulated medium.
+struct SimulatedChannelConfig {
+  // The probability that each bit sent over the air is corrupted, which loses
+  // the packet or its acknowledgement.
+  double bit_error_rate = 0.0;
+
+  // Set to make writes take as long as the NRF24L01 takes to send a packet and
+  // any retries, so that the link runs at the speed of the radio.
+  bool real_time = false;
+};
+
+// The medium shared by a group of simulated radios. A packet written by one
+// radio is delivered to the radio that is listening on the destination
+// address on the same channel. Packets collide with those written at the
+// same time on nearby channels, which models adjacent-channel interference
+// between co-located links.
+class SimulatedMedium : public NonCopyable {
+ public:
+  // Setup a medium with ideal channels that take no time to send packets.
+  SimulatedMedium();
+
+  // Setup a medium with the supplied channel quality and timing.
+  explicit SimulatedMedium(const SimulatedChannelConfig& config);
+
+ private:
+  friend class SimulatedRadio;
+
+  // The time taken to send a packet and the number of channels either side
+  // of a packet that it interferes with.
+  static constexpr uint64_t kPacketAirtimeUs = 200;
+  static constexpr uint8_t kInterferenceChannels = 2;
+
+  // The number of attempts made to deliver a packet, as configured by the
+  // RF24Radio, and the bits of preamble, 3 byte address, packet control field
+  // and 1 byte CRC that are sent with every packet and acknowledgement.
+  static constexpr uint8_t kMaxAttempts = 16;
+  static constexpr size_t kOverheadBits = 8 + 24 + 9 + 8;
+
+  // The fixed time spent switching between transmit and receive for each
+  // attempt.
+  static constexpr double kAttemptOverheadUs = 260.0;
+
+  // The quality and timing of the channels.
+  const SimulatedChannelConfig config_;
+
+  // Guards the radios and their receive state.
+  std::mutex mutex_;
+
+  // Decides which transmissions are corrupted. Guarded by the mutex.
+  std::mt19937_64 random_;
+
+  // Returns true if a transmission of the supplied number of bits is
+  // corrupted with the supplied bit error rate. The mutex must be held.
+  bool IsCorrupted(size_t bits, double bit_error_rate);
+
+  // The radios attached to this medium.
+  std::vector<SimulatedRadio*> radios_;
+};
+
+// A radio that exchanges packets with other simulated radios in the same
+// process. Like the NRF24L01, packets are only received and acknowledged while
+// the receiver is listening and has space in its receive FIFO, and writes are
+// retried when the packet or its acknowledgement is corrupted. Used to run the
+// link protocol without hardware.
+class SimulatedRadio final : public Radio {
+ public:
+  // Setup the radio and attach it to the medium.
+  explicit SimulatedRadio(SimulatedMedium& medium);
+  ~SimulatedRadio();
+
+  // Radio methods.
+  void OpenWritingPipe(uint32_t address) override;
+  void OpenReadingPipe(uint8_t pipe, uint32_t address) override;
+  void SetChannel(uint8_t channel) override;
+  uint8_t GetChannel() override;
+  void SetDataRate(DataRate data_rate) override;
+  DataRate GetDataRate() override;
+  void StartListening() override;
+  void StopListening() override;
+  bool Write(const uint8_t* data, size_t size) override;
+  void WriteBroadcast(uint32_t address, const uint8_t* data,
+                      size_t size) override;
+  uint8_t GetRetransmitCount() override;
+  bool Available() override;
+  bool ReadAll(std::vector<RxPacket>& packets) override;
+
+  // Sets the bit error rate of transmissions between this radio and any
+  // other, in place of that of the medium, to emulate a radio that is
+  // further away. The higher rate of the two radios applies.
+  void SetBitErrorRate(double bit_error_rate);
+
+  // Sets a callback that is invoked when Available is called with an empty
+  // receive FIFO. Used to run the peer in the same thread, such as in
+  // benchmarks.
+  void SetIdleCallback(std::function<void()> callback);
+
+ private:
+  // The number of packets that can be held in the receive FIFO.
+  static constexpr size_t kRxFifoSize = 3;
+
+  // The number of reading pipes supported.
+  static constexpr size_t kPipeCount = 6;
+
+  // The medium that this radio is attached to.
+  SimulatedMedium& medium_;
+
+  // The channel and data rate that the radio operates on and the time that
+  // it last started sending a packet. Guarded by the medium mutex.
+  uint8_t channel_;
+  DataRate data_rate_;
+  uint64_t last_write_us_;
+
+  // The number of retries needed by the last write. Only accessed by the
+  // thread using the radio.
+  uint8_t retransmit_count_;
+
+  // The address that packets are written to. Guarded by the medium mutex.
+  uint32_t writing_address_;
+
+  // The addresses that packets are received on. Guarded by the medium mutex,
+  // as is the rest of the receive state.
+  std::array<std::optional<uint32_t>, kPipeCount> reading_addresses_;
+  bool listening_;
+  std::deque<RxPacket> rx_fifo_;
+
+  // Set when a packet is dropped because the receive FIFO is full.
+  bool rx_fifo_overrun_;
+
+  // Invoked when the receive FIFO is empty, if set. Not guarded.
+  std::function<void()> idle_callback_;
+
+  // The bit error rate of transmissions to and from this radio, if it
+  // differs from that of the medium.
+  std::optional<double> bit_error_rate_;
+
+  // Returns the radio that receives packets sent to an address, if any. The
+  // medium mutex must be held.
+  SimulatedRadio* FindReceiver(uint32_t address) const;
+
+  // Returns the bit error rate of transmissions between this radio and a
+  // peer, or of this radio alone if there is no peer. The medium mutex must
+  // be held.
+  double GetBitErrorRate(const SimulatedRadio* peer) const;
+
+  // Places a packet in the receive FIFO of the radio listening on the
+  // writing address if it was received and did not collide. Returns false if
+  // the packet was not delivered.
+  bool Deliver(const uint8_t* data, size_t size, bool received);
+
+  // Places a packet in the receive FIFO of this radio if it is listening on
+  // the address. Returns false if the FIFO is full. The medium mutex must be
+  // held.
+  bool Receive(uint32_t address, const uint8_t* data, size_t size);
+
+  // Returns the pipe that this radio will receive a packet sent to the
+  // address on, if any.
+  std::optional<uint8_t> GetReceivingPipe(uint32_t address) const;
+
+  // Returns true if a packet written now on the channel of this radio would
+  // collide with a packet written by a radio other than its peer. The medium
+  // mutex must be held.
+  bool HasCollision(uint64_t now_us) const;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_SIMULATED_RADIO_H_
@@ -0,0 +1,308 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/site_survey.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/random.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+namespace {
+
+// The columns written for each setting.
+constexpr char kResultsHeader[] =
+    "channel,data_rate,connected,probes_sent,probes_received,loss,"
+    "goodput_kbps,rtt_p50_us,rtt_p90_us,rtt_p99_us";
+
+// Returns a percentile of a sorted list of times, or zero if it is empty.
+uint64_t GetPercentile(const std::vector<uint64_t>& sorted_us,
+                       double percentile) {
+  if (sorted_us.empty()) {
+    return 0;
+  }
+
+  size_t index = static_cast<size_t>(sorted_us.size() * percentile);
+  return sorted_us[std::min(index, sorted_us.size() - 1)];
+}
+
+}  // anonymous namespace
+
+double SiteSurvey::Result::GetLoss() const {
+  if (probes_sent == 0) {
+    return 1.0;
+  }
+
+  return 1.0 - static_cast<double>(probes_received) / probes_sent;
+}
+
+SiteSurvey::SiteSurvey(RadioInterface& radio_interface, const Config& config)
+    : radio_interface_(radio_interface),
+      config_(config),
+      burst_(0),
+      last_echo_us_(0) {
+  CHECK(config_.min_channel <= config_.max_channel
+      && config_.max_channel < 128, "Invalid survey channel range");
+  CHECK(config_.probe_size >= kProbeHeaderSize,
+      "Probes must be at least %zu bytes", kProbeHeaderSize);
+  radio_interface_.SetDatagramHandler(kProbePort,
+      [this](const uint8_t* data, size_t size) {
+        HandleEcho(data, size);
+      });
+}
+
+void SiteSurvey::EchoProbes(RadioInterface& radio_interface) {
+  radio_interface.SetDatagramHandler(kProbePort,
+      [&radio_interface](const uint8_t* data, size_t size) {
+        radio_interface.SendDatagram(kProbePort,
+            std::vector<uint8_t>(data, data + size));
+      });
+}
+
+std::vector<SiteSurvey::Result> SiteSurvey::Run() {
+  uint8_t start_channel = radio_interface_.GetChannel();
+  Radio::DataRate start_data_rate = radio_interface_.GetDataRate();
+
+  // Probes are only echoed once the link has connected.
+  LOGI("Waiting for the link to connect");
+  bool connected = false;
+  uint64_t start_us = TimeNowUs();
+  while (!connected && TimeNowUs() - start_us < kConnectTimeoutUs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    burst_++;
+    probes_in_flight_.clear();
+    rtts_us_.clear();
+    SendProbe(0);
+    connected = echo_cv_.wait_for(lock,
+        std::chrono::microseconds(kProbeTimeoutUs),
+        [this]() { return !rtts_us_.empty(); });
+  }
+
+  std::vector<Result> results;
+  if (!connected) {
+    LOGE("Link did not connect");
+    return results;
+  }
+
+  for (Radio::DataRate data_rate : config_.data_rates) {
+    for (int channel = config_.min_channel; channel <= config_.max_channel;
+         channel++) {
+      results.push_back(SurveySetting(channel, data_rate));
+      const Result& result = results.back();
+      LOGI("Channel %u at %s: loss %.3f, goodput %.1f kbps, rtt p50 %" PRIu64
+           "us p99 %" PRIu64 "us", result.channel,
+           Radio::GetDataRateName(result.data_rate), result.GetLoss(),
+           result.goodput_kbps, result.rtt_p50_us, result.rtt_p99_us);
+    }
+  }
+
+  radio_interface_.RequestChannel(start_channel, start_data_rate);
+  if (!WaitForSetting(start_channel, start_data_rate, kSwitchTimeoutUs)) {
+    LOGE("Failed to return to channel %u at %s", start_channel,
+        Radio::GetDataRateName(start_data_rate));
+  }
+
+  return results;
+}
+
+bool SiteSurvey::WriteResults(const std::string& path,
+                              const std::vector<Result>& results) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    LOGE("Failed to open '%s': %s (%d)", path.c_str(), strerror(errno),
+        errno);
+    return false;
+  }
+
+  fprintf(file, "%s\n", kResultsHeader);
+  for (const auto& result : results) {
+    fprintf(file, "%u,%s,%d,%u,%u,%.4f,%.1f,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+        "\n", result.channel, Radio::GetDataRateName(result.data_rate),
+        result.connected, result.probes_sent, result.probes_received,
+        result.GetLoss(), result.goodput_kbps, result.rtt_p50_us,
+        result.rtt_p90_us, result.rtt_p99_us);
+  }
+
+  bool success = !ferror(file);
+  success &= (fclose(file) == 0);
+  if (!success) {
+    LOGE("Failed to write '%s'", path.c_str());
+  }
+
+  return success;
+}
+
+std::optional<SiteSurvey::Result> SiteSurvey::ReadBestResult(
+    const std::string& path) {
+  std::ifstream file(path);
+  CHECK(file.good(), "Failed to open survey results '%s'", path.c_str());
+
+  std::string line;
+  CHECK(std::getline(file, line) && line == kResultsHeader,
+      "Survey results '%s' have an unexpected header", path.c_str());
+
+  std::optional<Result> best;
+  while (std::getline(file, line)) {
+    Result result;
+    unsigned int channel;
+    char data_rate_name[16];
+    int connected;
+    double loss;
+    CHECK(sscanf(line.c_str(), "%u,%15[^,],%d,%u,%u,%lf,%lf,%" SCNu64 ",%"
+            SCNu64 ",%" SCNu64, &channel, data_rate_name, &connected,
+            &result.probes_sent, &result.probes_received, &loss,
+            &result.goodput_kbps, &result.rtt_p50_us, &result.rtt_p90_us,
+            &result.rtt_p99_us) == 10 && channel < 128,
+        "Malformed survey result '%s'", line.c_str());
+    auto data_rate = Radio::ParseDataRate(data_rate_name);
+    CHECK(data_rate.has_value(), "Unknown data rate '%s'", data_rate_name);
+    result.channel = channel;
+    result.data_rate = data_rate.value();
+    result.connected = (connected != 0);
+    if (result.connected && result.probes_received > 0
+        && (!best.has_value() || result.goodput_kbps > best->goodput_kbps)) {
+      best = result;
+    }
+  }
+
+  return best;
+}
+
+bool SiteSurvey::WaitForSetting(uint8_t channel, Radio::DataRate data_rate,
+                                uint64_t timeout_us) {
+  uint64_t start_us = TimeNowUs();
+  while (radio_interface_.GetChannel() != channel
+      || radio_interface_.GetDataRate() != data_rate) {
+    if (TimeNowUs() - start_us > timeout_us) {
+      return false;
+    }
+
+    SleepUs(1000);
+  }
+
+  return true;
+}
+
+SiteSurvey::Result SiteSurvey::SurveySetting(uint8_t channel,
+                                             Radio::DataRate data_rate) {
+  Result result;
+  result.channel = channel;
+  result.data_rate = data_rate;
+  radio_interface_.RequestChannel(channel, data_rate);
+  if (!WaitForSetting(channel, data_rate, kSwitchTimeoutUs)) {
+    LOGE("Failed to move to channel %u at %s", channel,
+        Radio::GetDataRateName(data_rate));
+    return result;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  burst_++;
+  probes_in_flight_.clear();
+  rtts_us_.clear();
+  uint64_t start_us = TimeNowUs();
+  last_echo_us_ = start_us;
+  result.connected = true;
+  while (result.probes_sent < config_.probe_count
+      || !probes_in_flight_.empty()) {
+    // The link returns to the previous setting if this one stops carrying
+    // exchanges, which ends the burst.
+    if (radio_interface_.GetChannel() != channel
+        || radio_interface_.GetDataRate() != data_rate) {
+      LOGE("Link left channel %u at %s", channel,
+          Radio::GetDataRateName(data_rate));
+      result.connected = false;
+      break;
+    }
+
+    uint64_t now_us = TimeNowUs();
+    for (auto probe = probes_in_flight_.begin();
+         probe != probes_in_flight_.end();) {
+      if (now_us - probe->second >= kProbeTimeoutUs) {
+        probe = probes_in_flight_.erase(probe);
+      } else {
+        probe++;
+      }
+    }
+
+    if (result.probes_sent < config_.probe_count
+        && probes_in_flight_.size() < kMaxProbesInFlight
+        && SendProbe(result.probes_sent)) {
+      result.probes_sent++;
+    } else {
+      echo_cv_.wait_for(lock, std::chrono::milliseconds(10));
+    }
+  }
+
+  std::sort(rtts_us_.begin(), rtts_us_.end());
+  result.probes_received = rtts_us_.size();
+  if (last_echo_us_ > start_us) {
+    result.goodput_kbps = 1000.0 * result.probes_received
+        * config_.probe_size * 8 / (last_echo_us_ - start_us);
+  }
+
+  result.rtt_p50_us = GetPercentile(rtts_us_, 0.50);
+  result.rtt_p90_us = GetPercentile(rtts_us_, 0.90);
+  result.rtt_p99_us = GetPercentile(rtts_us_, 0.99);
+  return result;
+}
+
+bool SiteSurvey::SendProbe(uint32_t sequence) {
+  // The remainder of the probe is random so that it is not made smaller by
+  // any codec.
+  std::vector<uint8_t> probe(config_.probe_size);
+  WriteLittleEndianU32(&probe[0], burst_);
+  WriteLittleEndianU32(&probe[4], sequence);
+  GetRandomBytes(&probe[kProbeHeaderSize], probe.size() - kProbeHeaderSize);
+  if (!radio_interface_.SendDatagram(kProbePort, probe)) {
+    return false;
+  }
+
+  probes_in_flight_[sequence] = TimeNowUs();
+  return true;
+}
+
+void SiteSurvey::HandleEcho(const uint8_t* data, size_t size) {
+  uint64_t now_us = TimeNowUs();
+  if (size < kProbeHeaderSize) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (ReadLittleEndianU32(&data[0]) != burst_) {
+    return;
+  }
+
+  auto probe = probes_in_flight_.find(ReadLittleEndianU32(&data[4]));
+  if (probe == probes_in_flight_.end()) {
+    return;
+  }
+
+  rtts_us_.push_back(now_us - probe->second);
+  last_echo_us_ = now_us;
+  probes_in_flight_.erase(probe);
+  echo_cv_.notify_all();
+}
+
+}  // namespace nerfnet
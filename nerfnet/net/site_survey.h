@@ -0,0 +1,155 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_SITE_SURVEY_H_
+#define NERFNET_NET_SITE_SURVEY_H_
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "nerfnet/net/radio_interface.h"
+
+namespace nerfnet {
+
+// Measures how well a link performs on each of a range of channels and data
+// rates. The primary moves the link through the settings with channel
+// switches, which the secondary follows in lockstep, and sends a burst of
+// probe datagrams on each setting that the secondary echoes back. Settings
+// that do not carry exchanges are abandoned by both sides as with any other
+// channel switch, so the survey carries on from the last working setting.
+class SiteSurvey : public NonCopyable {
+ public:
+  // The port that probes are exchanged on.
+  static constexpr uint8_t kProbePort = RadioInterface::kMaxDatagramPorts - 1;
+
+  // The settings to survey and the traffic sent on each.
+  struct Config {
+    // The range of channels to survey, inclusive.
+    uint8_t min_channel = 0;
+    uint8_t max_channel = 125;
+
+    // The data rates to survey on each channel.
+    std::vector<Radio::DataRate> data_rates = {Radio::DataRate::k250Kbps,
+        Radio::DataRate::k1Mbps, Radio::DataRate::k2Mbps};
+
+    // The number of probes sent on each setting and the size of each probe.
+    uint32_t probe_count = 100;
+    size_t probe_size = 64;
+  };
+
+  // The measurements made on a single setting.
+  struct Result {
+    uint8_t channel = 0;
+    Radio::DataRate data_rate = Radio::DataRate::k2Mbps;
+
+    // Set if the link moved to the setting and stayed on it for the burst.
+    bool connected = false;
+
+    // The number of probes sent and echoed back.
+    uint32_t probes_sent = 0;
+    uint32_t probes_received = 0;
+
+    // The probe bytes echoed back per second over the burst, in kbit/s.
+    double goodput_kbps = 0.0;
+
+    // Percentiles of the round trip times of the probes that were echoed.
+    uint64_t rtt_p50_us = 0;
+    uint64_t rtt_p90_us = 0;
+    uint64_t rtt_p99_us = 0;
+
+    // Returns the fraction of probes that were not echoed.
+    double GetLoss() const;
+  };
+
+  // Setup a survey over the primary side of a link. Must be created before
+  // the link is serviced.
+  SiteSurvey(RadioInterface& radio_interface, const Config& config);
+
+  // Echoes probes received on the secondary side of a link. Must be called
+  // before the link is serviced.
+  static void EchoProbes(RadioInterface& radio_interface);
+
+  // Runs the survey while the link is serviced by another thread, then
+  // returns the link to the setting that it started on. Returns the results
+  // for every setting, or an empty list if the link never connected.
+  std::vector<Result> Run();
+
+  // Writes results as CSV with a header row. Returns false on failure.
+  static bool WriteResults(const std::string& path,
+                           const std::vector<Result>& results);
+
+  // Reads results written by WriteResults and returns the one with the
+  // highest goodput, if any setting carried probes. Quits and logs the error
+  // if the file is malformed.
+  static std::optional<Result> ReadBestResult(const std::string& path);
+
+ private:
+  // The time allowed for the link to connect before the survey starts and
+  // for the link to move to each setting.
+  static constexpr uint64_t kConnectTimeoutUs = 10000000;
+  static constexpr uint64_t kSwitchTimeoutUs = 1000000;
+
+  // The number of probes that may be awaiting an echo at once and the time
+  // after which a probe is counted as lost.
+  static constexpr size_t kMaxProbesInFlight = 8;
+  static constexpr uint64_t kProbeTimeoutUs = 500000;
+
+  // The size of the header of a probe, which carries the burst and the
+  // sequence number of the probe.
+  static constexpr size_t kProbeHeaderSize = 8;
+
+  // The link that is surveyed and the settings to survey.
+  RadioInterface& radio_interface_;
+  const Config config_;
+
+  // Guards the state of the current burst, which is shared with the thread
+  // servicing the link.
+  std::mutex mutex_;
+  std::condition_variable echo_cv_;
+
+  // The number of the current burst, which distinguishes late echoes from
+  // earlier bursts.
+  uint32_t burst_;
+
+  // The send times of probes awaiting an echo by sequence number.
+  std::map<uint32_t, uint64_t> probes_in_flight_;
+
+  // The round trip times of the probes echoed in the current burst and the
+  // time of the last echo.
+  std::vector<uint64_t> rtts_us_;
+  uint64_t last_echo_us_;
+
+  // Waits for the link to operate on a setting. Returns false on timeout.
+  bool WaitForSetting(uint8_t channel, Radio::DataRate data_rate,
+                      uint64_t timeout_us);
+
+  // Moves the link to a setting and measures it.
+  Result SurveySetting(uint8_t channel, Radio::DataRate data_rate);
+
+  // Sends a probe in the current burst. The mutex must be held.
+  bool SendProbe(uint32_t sequence);
+
+  // Handles a probe echoed by the peer.
+  void HandleEcho(const uint8_t* data, size_t size);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_SITE_SURVEY_H_
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/stream_socket.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+StreamSocket::StreamSocket(RadioInterface& radio_interface, uint8_t port)
+    : radio_interface_(radio_interface),
+      port_(port),
+      tx_sequence_(0),
+      rx_sequence_(0),
+      closed_(false) {
+  radio_interface_.SetDatagramHandler(port_,
+      [this](const uint8_t* data, size_t size) {
+        HandleSegment(data, size);
+      });
+}
+
+size_t StreamSocket::Write(const uint8_t* data, size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  size_t written = 0;
+  while (written < size && !closed_) {
+    size_t segment_size = std::min(size - written, kMaxSegmentSize);
+    std::vector<uint8_t> segment;
+    segment.reserve(segment_size + 1);
+    segment.push_back(tx_sequence_);
+    segment.insert(segment.end(), data + written,
+        data + written + segment_size);
+    if (!radio_interface_.SendDatagram(port_, segment)) {
+      break;
+    }
+
+    tx_sequence_++;
+    written += segment_size;
+  }
+
+  return written;
+}
+
+size_t StreamSocket::Read(uint8_t* data, size_t size, uint64_t timeout_us) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  rx_cv_.wait_for(lock, std::chrono::microseconds(timeout_us),
+      [this]() { return !rx_buffer_.empty() || closed_; });
+
+  size_t read_size = std::min(size, rx_buffer_.size());
+  std::copy(rx_buffer_.begin(), rx_buffer_.begin() + read_size, data);
+  rx_buffer_.erase(rx_buffer_.begin(), rx_buffer_.begin() + read_size);
+  return read_size;
+}
+
+bool StreamSocket::IsClosed() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return closed_;
+}
+
+void StreamSocket::HandleSegment(const uint8_t* data, size_t size) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size == 0 || closed_) {
+      return;
+    }
+
+    if (data[0] != rx_sequence_) {
+      LOGE("Stream segment lost on port %u, closing", port_);
+      closed_ = true;
+    } else {
+      rx_sequence_++;
+      rx_buffer_.insert(rx_buffer_.end(), data + 1, data + size);
+    }
+  }
+
+  rx_cv_.notify_all();
+}
+
+}  // namespace nerfnet
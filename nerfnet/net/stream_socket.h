@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_STREAM_SOCKET_H_
+#define NERFNET_NET_STREAM_SOCKET_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "nerfnet/net/radio_interface.h"
+
+namespace nerfnet {
+
+// An ordered byte stream carried in datagrams on a single port. The link
+// delivers frames in order, so segments only carry a sequence number to detect
+// frames that were lost when the connection was reset. The stream is closed
+// when that happens.
+class StreamSocket : public NonCopyable {
+ public:
+  // Setup the stream on the supplied port of the link. Must be created before
+  // the link is serviced.
+  StreamSocket(RadioInterface& radio_interface, uint8_t port);
+
+  // Writes data to the stream. Returns the number of bytes accepted, which
+  // is less than size if the transmit queue fills up or the stream is
+  // closed. The rest of the data is written by calling again from there.
+  size_t Write(const uint8_t* data, size_t size);
+
+  // Reads up to size bytes from the stream, waiting up to timeout_us for data
+  // to arrive. Returns the number of bytes read, which is zero on timeout or
+  // if the stream is closed.
+  size_t Read(uint8_t* data, size_t size, uint64_t timeout_us);
+
+  // Returns true if a segment was lost and the stream was closed.
+  bool IsClosed();
+
+ private:
+  // The maximum number of bytes carried in a single segment.
+  static constexpr size_t kMaxSegmentSize = 254;
+
+  // The link and port that this stream is carried over.
+  RadioInterface& radio_interface_;
+  const uint8_t port_;
+
+  // Guards the state of the stream.
+  std::mutex mutex_;
+  std::condition_variable rx_cv_;
+
+  // The data that has been received and not yet read.
+  std::deque<uint8_t> rx_buffer_;
+
+  // The sequence numbers of the next segments to send and receive.
+  uint8_t tx_sequence_;
+  uint8_t rx_sequence_;
+
+  // Set once a segment has been lost.
+  bool closed_;
+
+  // Handles a segment received from the peer.
+  void HandleSegment(const uint8_t* data, size_t size);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_STREAM_SOCKET_H_
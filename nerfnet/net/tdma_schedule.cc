@@ -0,0 +1,132 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/tdma_schedule.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <numeric>
+
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+TdmaSchedule::TdmaSchedule() : superframe_us_(0) {}
+
+TdmaSchedule TdmaSchedule::Plan(uint64_t superframe_us,
+                                const std::vector<uint8_t>& link_ids,
+                                const std::vector<size_t>& backlogs) {
+  CHECK(link_ids.size() == backlogs.size(), "Missing backlogs");
+  CHECK(link_ids.size() <= kMaxSlots, "Too many links for a TDMA cell");
+  CHECK(superframe_us <= kMaxSuperframeUs, "Superframe is too long");
+  uint64_t superframe_units = superframe_us / kSlotUnitUs;
+  uint64_t min_slot_units = kMinSlotUs / kSlotUnitUs;
+  uint64_t slot_units = superframe_units - kBeaconSlotUs / kSlotUnitUs;
+  CHECK(superframe_units * kSlotUnitUs > kBeaconSlotUs
+      && slot_units >= min_slot_units * link_ids.size(),
+      "Superframe of %" PRIu64 "us is too short for %zu links",
+      superframe_us, link_ids.size());
+
+  // Links with nothing waiting keep the shortest slot, which is enough for
+  // a few exchanges, so that traffic that appears is carried within a
+  // superframe. Whatever is left over after sharing the spare time goes to
+  // the link with the most waiting.
+  uint64_t spare_units = slot_units - min_slot_units * link_ids.size();
+  uint64_t total_backlog = std::accumulate(backlogs.begin(), backlogs.end(),
+      static_cast<uint64_t>(0));
+  std::vector<uint64_t> lengths(link_ids.size(), min_slot_units);
+  if (total_backlog != 0) {
+    uint64_t shared_units = 0;
+    for (size_t i = 0; i < link_ids.size(); i++) {
+      uint64_t share = spare_units * backlogs[i] / total_backlog;
+      lengths[i] += share;
+      shared_units += share;
+    }
+
+    size_t busiest = std::max_element(backlogs.begin(), backlogs.end())
+        - backlogs.begin();
+    lengths[busiest] += spare_units - shared_units;
+  }
+
+  TdmaSchedule schedule;
+  schedule.superframe_us_ = superframe_units * kSlotUnitUs;
+  uint64_t offset_us = kBeaconSlotUs;
+  for (size_t i = 0; i < link_ids.size(); i++) {
+    Slot slot;
+    slot.link_id = link_ids[i];
+    slot.offset_us = offset_us;
+    slot.length_us = lengths[i] * kSlotUnitUs;
+    offset_us += slot.length_us;
+    schedule.slots_.push_back(slot);
+  }
+
+  return schedule;
+}
+
+std::vector<uint8_t> TdmaSchedule::EncodeBeacon(uint64_t start_us) const {
+  std::vector<uint8_t> beacon(kBeaconHeaderSize);
+  beacon[0] = kBeaconMarker;
+  WriteBigEndianU32(&beacon[1], static_cast<uint32_t>(start_us));
+  beacon[5] = superframe_us_ / kSlotUnitUs;
+  for (const auto& slot : slots_) {
+    beacon.push_back(slot.link_id);
+    beacon.push_back(slot.length_us / kSlotUnitUs);
+  }
+
+  return beacon;
+}
+
+bool TdmaSchedule::DecodeBeacon(const uint8_t* data, size_t size,
+                                TdmaSchedule& schedule, uint32_t& start_us) {
+  if (size < kBeaconHeaderSize || size > kMaxBeaconSize
+      || (size - kBeaconHeaderSize) % kBeaconSlotSize != 0
+      || data[0] != kBeaconMarker || data[5] == 0) {
+    return false;
+  }
+
+  // Slots follow each other from the end of the beacon.
+  schedule.superframe_us_ = data[5] * kSlotUnitUs;
+  schedule.slots_.clear();
+  uint64_t offset_us = kBeaconSlotUs;
+  for (size_t i = kBeaconHeaderSize; i < size; i += kBeaconSlotSize) {
+    Slot slot;
+    slot.link_id = data[i];
+    slot.offset_us = offset_us;
+    slot.length_us = data[i + 1] * kSlotUnitUs;
+    offset_us += slot.length_us;
+    schedule.slots_.push_back(slot);
+  }
+
+  if (offset_us > schedule.superframe_us_) {
+    return false;
+  }
+
+  start_us = ReadBigEndianU32(&data[1]);
+  return true;
+}
+
+const TdmaSchedule::Slot* TdmaSchedule::FindSlot(uint8_t link_id) const {
+  for (const auto& slot : slots_) {
+    if (slot.link_id == link_id) {
+      return &slot;
+    }
+  }
+
+  return nullptr;
+}
+
+}  // namespace nerfnet
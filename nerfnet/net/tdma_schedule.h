@@ -0,0 +1,102 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_TDMA_SCHEDULE_H_
+#define NERFNET_NET_TDMA_SCHEDULE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nerfnet {
+
+// The layout of a superframe of a TDMA cell, in which the primary links of a
+// hub that share a channel take turns to exchange with their secondaries.
+// Each superframe starts with a beacon that carries the layout, followed by a
+// slot for every link in which it has the channel to itself. Every link gets
+// a slot in every superframe, which bounds the time a frame waits for its
+// link to be served, and the rest of the superframe is shared out in
+// proportion to the number of bytes that each link has waiting.
+class TdmaSchedule {
+ public:
+  // A slot of the superframe that is assigned to a link. Links are known by
+  // the lowest byte of their primary address.
+  struct Slot {
+    uint8_t link_id = 0;
+
+    // The time from the start of the superframe to the start of the slot and
+    // the length of the slot.
+    uint64_t offset_us = 0;
+    uint64_t length_us = 0;
+  };
+
+  // The unit that the lengths of superframes and slots are carried in, the
+  // longest superframe that can be described and the shortest slot.
+  static constexpr uint64_t kSlotUnitUs = 250;
+  static constexpr uint64_t kMaxSuperframeUs = 255 * kSlotUnitUs;
+  static constexpr uint64_t kMinSlotUs = 4 * kSlotUnitUs;
+
+  // The time at the start of each superframe that is left for the beacon.
+  static constexpr uint64_t kBeaconSlotUs = kSlotUnitUs;
+
+  // The size of the header of a beacon and of each slot that it describes,
+  // which limit the number of links in a cell to what fits in one packet.
+  static constexpr size_t kBeaconHeaderSize = 6;
+  static constexpr size_t kBeaconSlotSize = 2;
+  static constexpr size_t kMaxBeaconSize = 32;
+  static constexpr size_t kMaxSlots =
+      (kMaxBeaconSize - kBeaconHeaderSize) / kBeaconSlotSize;
+
+  // Setup an empty schedule.
+  TdmaSchedule();
+
+  // Plans a superframe for links identified by link_ids, each of which has
+  // the number of bytes in the matching entry of backlogs waiting to be
+  // exchanged. The slots are laid out in the order of the links. The
+  // superframe must be long enough to give every link the shortest slot.
+  static TdmaSchedule Plan(uint64_t superframe_us,
+                           const std::vector<uint8_t>& link_ids,
+                           const std::vector<size_t>& backlogs);
+
+  // Encodes a beacon that announces this schedule for a superframe that
+  // starts at a time on the clock of the hub.
+  std::vector<uint8_t> EncodeBeacon(uint64_t start_us) const;
+
+  // Decodes a beacon into a schedule and the time on the clock of the hub
+  // that the superframe started, which is truncated to 32 bits. Returns
+  // false if the beacon is invalid.
+  static bool DecodeBeacon(const uint8_t* data, size_t size,
+                           TdmaSchedule& schedule, uint32_t& start_us);
+
+  // Returns the length of the superframe and its slots.
+  uint64_t GetSuperframeUs() const { return superframe_us_; }
+  const std::vector<Slot>& GetSlots() const { return slots_; }
+
+  // Returns the slot assigned to a link, or nullptr if it has none.
+  const Slot* FindSlot(uint8_t link_id) const;
+
+ private:
+  // Marks the first byte of a beacon.
+  static constexpr uint8_t kBeaconMarker = 0xd7;
+
+  // The length of the superframe and its slots.
+  uint64_t superframe_us_;
+  std::vector<Slot> slots_;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_TDMA_SCHEDULE_H_
@@ -0,0 +1,182 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/tdma_tracker.h"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+TdmaTracker::TdmaTracker(uint8_t link_id)
+    : link_id_(link_id),
+      reference_local_us_(0.0),
+      rate_(1.0) {}
+
+bool TdmaTracker::AddBeacon(const uint8_t* data, size_t size,
+                            uint64_t local_us) {
+  TdmaSchedule schedule;
+  uint32_t start_us;
+  if (!TdmaSchedule::DecodeBeacon(data, size, schedule, start_us)) {
+    return false;
+  }
+
+  // The hub sends the low bits of its clock, which are extended from the
+  // latest beacon.
+  FitPoint point = {start_us, local_us};
+  if (!fit_points_.empty()) {
+    const FitPoint& latest = fit_points_.back();
+    point.hub_us = latest.hub_us + static_cast<int32_t>(
+        start_us - static_cast<uint32_t>(latest.hub_us));
+
+    // A beacon that is read long after it was expected was left waiting in
+    // the radio, so only its schedule is used. One far from where it was
+    // expected otherwise means that the hub has restarted, so the earlier
+    // beacons are no longer useful.
+    int64_t error_us = static_cast<int64_t>(
+        local_us - ToLocalTimeUs(point.hub_us));
+    if (IsSynchronized(local_us) && error_us > kMaxBeaconDelayUs
+        && point.hub_us > latest.hub_us) {
+      schedule_ = schedule;
+      return true;
+    } else if (point.hub_us <= latest.hub_us
+        || static_cast<uint64_t>(std::llabs(error_us))
+            > schedule.GetSuperframeUs()) {
+      LOGI("TDMA beacon is %" PRId64 "us from its expected time, "
+          "resynchronizing", error_us);
+      fit_points_.clear();
+      point.hub_us = start_us;
+    }
+  }
+
+  schedule_ = schedule;
+  fit_points_.push_back(point);
+  if (fit_points_.size() > kMaxFitPoints) {
+    fit_points_.pop_front();
+  }
+
+  UpdateEstimate();
+  return true;
+}
+
+bool TdmaTracker::IsSynchronized(uint64_t local_us) const {
+  if (fit_points_.empty()) {
+    return false;
+  }
+
+  uint64_t hub_us = ToHubTimeUs(local_us);
+  const FitPoint& latest = fit_points_.back();
+  return hub_us < latest.hub_us
+      || hub_us - latest.hub_us
+          < kMaxMissedSuperframes * schedule_.GetSuperframeUs();
+}
+
+uint64_t TdmaTracker::GetNextBeaconUs(uint64_t local_us) const {
+  return ToLocalTimeUs(GetSuperframeStartUs(local_us)
+      + schedule_.GetSuperframeUs());
+}
+
+bool TdmaTracker::GetNextSlot(uint64_t local_us, uint64_t& start_us,
+                              uint64_t& end_us) const {
+  const TdmaSchedule::Slot* slot = schedule_.FindSlot(link_id_);
+  if (slot == nullptr || !IsSynchronized(local_us)) {
+    return false;
+  }
+
+  uint64_t superframe_start_us = GetSuperframeStartUs(local_us);
+  if (ToHubTimeUs(local_us)
+      >= superframe_start_us + slot->offset_us + slot->length_us) {
+    superframe_start_us += schedule_.GetSuperframeUs();
+  }
+
+  start_us = ToLocalTimeUs(superframe_start_us + slot->offset_us);
+  end_us = ToLocalTimeUs(
+      superframe_start_us + slot->offset_us + slot->length_us);
+  return true;
+}
+
+int64_t TdmaTracker::GetDriftPpb() const {
+  // The hub clock gains when less local time passes for each microsecond of
+  // it.
+  return std::llround((1.0 / rate_ - 1.0) * 1e9);
+}
+
+void TdmaTracker::UpdateEstimate() {
+  const FitPoint& latest = fit_points_.back();
+  if (latest.hub_us - fit_points_.front().hub_us < kMinFitSpanUs) {
+    reference_local_us_ = static_cast<double>(latest.local_us);
+    rate_ = 1.0;
+    return;
+  }
+
+  // A least squares line through the beacons, with times measured back from
+  // the latest so that the intercept is the local time that it was sent.
+  // Beacons are only ever noticed late, which shifts the line but not its
+  // slope.
+  double sum_hub = 0.0;
+  double sum_local = 0.0;
+  for (const auto& point : fit_points_) {
+    sum_hub -= static_cast<double>(latest.hub_us - point.hub_us);
+    sum_local -= static_cast<double>(latest.local_us - point.local_us);
+  }
+
+  double count = static_cast<double>(fit_points_.size());
+  double mean_hub = sum_hub / count;
+  double mean_local = sum_local / count;
+  double covariance = 0.0;
+  double variance = 0.0;
+  for (const auto& point : fit_points_) {
+    double hub = -static_cast<double>(latest.hub_us - point.hub_us)
+        - mean_hub;
+    double local = -static_cast<double>(latest.local_us - point.local_us)
+        - mean_local;
+    covariance += hub * local;
+    variance += hub * hub;
+  }
+
+  rate_ = covariance / variance;
+  reference_local_us_ = static_cast<double>(latest.local_us)
+      + mean_local - rate_ * mean_hub;
+}
+
+uint64_t TdmaTracker::ToLocalTimeUs(uint64_t hub_us) const {
+  double elapsed_us = static_cast<double>(static_cast<int64_t>(
+      hub_us - fit_points_.back().hub_us));
+  return std::llround(reference_local_us_ + rate_ * elapsed_us);
+}
+
+uint64_t TdmaTracker::ToHubTimeUs(uint64_t local_us) const {
+  double elapsed_us = static_cast<double>(local_us) - reference_local_us_;
+  return fit_points_.back().hub_us
+      + std::llround(elapsed_us / rate_);
+}
+
+uint64_t TdmaTracker::GetSuperframeStartUs(uint64_t local_us) const {
+  // Superframes repeat from the latest beacon until the next one is heard.
+  uint64_t latest_us = fit_points_.back().hub_us;
+  uint64_t hub_us = ToHubTimeUs(local_us);
+  if (hub_us < latest_us) {
+    return latest_us;
+  }
+
+  uint64_t superframe_us = schedule_.GetSuperframeUs();
+  return latest_us + (hub_us - latest_us) / superframe_us * superframe_us;
+}
+
+}  // namespace nerfnet
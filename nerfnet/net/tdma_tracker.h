@@ -0,0 +1,111 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_TDMA_TRACKER_H_
+#define NERFNET_NET_TDMA_TRACKER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "nerfnet/net/tdma_schedule.h"
+
+namespace nerfnet {
+
+// Follows the superframes of a TDMA cell on the clock of a secondary, so that
+// it knows when its link will be served. Each beacon carries the time on the
+// clock of the hub that its superframe started, and a line fitted through
+// these times and the local times that the beacons arrived corrects for the
+// drift between the two clocks. Superframes are predicted to repeat with the
+// last schedule heard while beacons are missed.
+class TdmaTracker {
+ public:
+  // Setup a tracker for the slots of the link with the supplied ID, which is
+  // the lowest byte of the primary address of the link.
+  explicit TdmaTracker(uint8_t link_id);
+
+  // Adds a beacon received at a local time. Returns false if the beacon is
+  // invalid.
+  bool AddBeacon(const uint8_t* data, size_t size, uint64_t local_us);
+
+  // Returns true if a beacon has been heard recently enough to predict the
+  // superframes at a local time.
+  bool IsSynchronized(uint64_t local_us) const;
+
+  // Returns the local time that the superframe after the one in progress at
+  // a local time starts, when its beacon is sent. Only valid while
+  // synchronized.
+  uint64_t GetNextBeaconUs(uint64_t local_us) const;
+
+  // Finds the local times that the slot of the link starts and ends in the
+  // superframe in progress at a local time, or in the next one if the slot
+  // has passed. Returns false if the link has no slot or the tracker is not
+  // synchronized.
+  bool GetNextSlot(uint64_t local_us, uint64_t& start_us,
+                   uint64_t& end_us) const;
+
+  // Returns the estimated rate at which the hub clock gains on the local
+  // clock in parts per billion.
+  int64_t GetDriftPpb() const;
+
+ private:
+  // The number of beacons that the clocks are fitted to and the span of
+  // time that they must cover before the drift is estimated.
+  static constexpr size_t kMaxFitPoints = 32;
+  static constexpr uint64_t kMinFitSpanUs = 100000;
+
+  // The number of superframes that are predicted without hearing a beacon.
+  static constexpr uint64_t kMaxMissedSuperframes = 8;
+
+  // The longest that a beacon can be read after it was expected and still
+  // be used to fit the clocks.
+  static constexpr int64_t kMaxBeaconDelayUs = 1000;
+
+  // The times on each clock that a beacon was sent and received.
+  struct FitPoint {
+    uint64_t hub_us;
+    uint64_t local_us;
+  };
+
+  // The ID of the link that slots are tracked for.
+  const uint8_t link_id_;
+
+  // The schedule of the latest beacon.
+  TdmaSchedule schedule_;
+
+  // The times of recent beacons, oldest first.
+  std::deque<FitPoint> fit_points_;
+
+  // The fitted local time that the latest beacon was sent and the local
+  // time that passes for each microsecond of the hub clock.
+  double reference_local_us_;
+  double rate_;
+
+  // Fits the line through the times of recent beacons.
+  void UpdateEstimate();
+
+  // Converts between times on the clock of the hub and local times.
+  uint64_t ToLocalTimeUs(uint64_t hub_us) const;
+  uint64_t ToHubTimeUs(uint64_t local_us) const;
+
+  // Returns the hub time that the superframe in progress at a local time
+  // started.
+  uint64_t GetSuperframeStartUs(uint64_t local_us) const;
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_TDMA_TRACKER_H_
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/traffic_shaper.h"
+
+#include <algorithm>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+TrafficShaper::TrafficShaper(const Config& config)
+    : class_configs_(config.classes),
+      link_(CreateBucket("link", config.link)),
+      service_us_(0.0) {
+  for (const auto& class_config : class_configs_) {
+    CHECK(class_config.tunnel
+        || class_config.first_port <= class_config.last_port,
+        "Invalid ports for traffic class '%s'", class_config.name.c_str());
+    classes_.push_back(CreateBucket(class_config.name, class_config.bucket));
+  }
+
+  classes_.push_back(CreateBucket(kDefaultClassName, BucketConfig()));
+}
+
+size_t TrafficShaper::Classify(bool tunnel, uint8_t port) const {
+  for (size_t i = 0; i < class_configs_.size(); i++) {
+    const auto& class_config = class_configs_[i];
+    if (tunnel ? class_config.tunnel
+        : (!class_config.tunnel && port >= class_config.first_port
+            && port <= class_config.last_port)) {
+      return i;
+    }
+  }
+
+  return class_configs_.size();
+}
+
+bool TrafficShaper::IsConforming(size_t class_index, uint64_t now_us) {
+  // Both buckets are topped up so that neither loses airtime while the
+  // other is empty.
+  bool class_conforming = Refill(classes_[class_index], now_us);
+  return Refill(link_, now_us) && class_conforming;
+}
+
+std::optional<size_t> TrafficShaper::SelectClass(
+    const std::vector<bool>& waiting, uint64_t now_us) {
+  CHECK(waiting.size() == classes_.size(), "Missing traffic classes");
+  std::optional<size_t> selected;
+  for (size_t i = 0; i < classes_.size(); i++) {
+    if (!waiting[i]) {
+      classes_[i].service_us = std::max(classes_[i].service_us, service_us_);
+    } else if (IsConforming(i, now_us) && (!selected.has_value()
+        || classes_[i].service_us < classes_[*selected].service_us)) {
+      selected = i;
+    }
+  }
+
+  if (selected.has_value()) {
+    service_us_ = classes_[*selected].service_us;
+  }
+
+  return selected;
+}
+
+void TrafficShaper::Charge(size_t class_index, double airtime_us) {
+  Bucket& bucket = classes_[class_index];
+  bucket.service_us += airtime_us / bucket.weight;
+  if (bucket.rate_us != 0) {
+    bucket.tokens_us -= airtime_us;
+  }
+
+  if (link_.rate_us != 0) {
+    link_.tokens_us -= airtime_us;
+  }
+}
+
+TrafficShaper::Bucket TrafficShaper::CreateBucket(
+    const std::string& name, const BucketConfig& config) {
+  CHECK(config.weight != 0, "Traffic '%s' must have a weight", name.c_str());
+  Bucket bucket;
+  bucket.name = name;
+  bucket.rate_us = config.rate_us;
+  bucket.burst_us = config.burst_us;
+  if (bucket.burst_us == 0) {
+    bucket.burst_us = std::max(config.rate_us / 10, kMinBurstUs);
+  }
+
+  bucket.weight = config.weight;
+  bucket.tokens_us = bucket.burst_us;
+  bucket.refill_us = 0;
+  bucket.service_us = 0.0;
+  return bucket;
+}
+
+bool TrafficShaper::Refill(Bucket& bucket, uint64_t now_us) {
+  if (bucket.rate_us == 0) {
+    return true;
+  }
+
+  if (now_us > bucket.refill_us && bucket.refill_us != 0) {
+    bucket.tokens_us = std::min(bucket.burst_us, bucket.tokens_us
+        + static_cast<double>(bucket.rate_us)
+            * (now_us - bucket.refill_us) / 1e6);
+  }
+
+  bucket.refill_us = now_us;
+  return bucket.tokens_us > 0.0;
+}
+
+}  // namespace nerfnet
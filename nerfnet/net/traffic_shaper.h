@@ -0,0 +1,161 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_TRAFFIC_SHAPER_H_
+#define NERFNET_NET_TRAFFIC_SHAPER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// Shapes the frames that one side of a link sends with token buckets that
+// are filled with airtime rather than bytes. A packet costs the time taken to
+// send it and its acknowledgement at the data rate of the link and to turn
+// the radios around, for every attempt, so a class that is sent slowly or
+// over a poor channel uses up its share sooner. Frames are sorted into
+// classes by port, each with its own bucket and weight, and every frame is
+// also charged to a bucket for the link as a whole. A frame may only be
+// started while the buckets of its class and the link are not empty, and the
+// classes that may send share the airtime in proportion to their weights.
+// Frames are never split between classes, so a bucket may be overdrawn by
+// the rest of a frame and is repaid before the class sends again.
+class TrafficShaper : public NonCopyable {
+ public:
+  // A bucket of airtime and the weight of the traffic charged to it.
+  struct BucketConfig {
+    // The airtime in microseconds added to the bucket every second, or zero
+    // for no limit, and the most airtime that may be saved up for a burst.
+    // The burst defaults to a tenth of a second at the rate.
+    uint64_t rate_us = 0;
+    uint64_t burst_us = 0;
+
+    // The share of the airtime given to this traffic when it competes with
+    // other traffic that may also send.
+    uint32_t weight = 1;
+  };
+
+  // A class of traffic, which matches tunnel frames or a range of datagram
+  // ports.
+  struct ClassConfig {
+    // The name that the counters of the class are reported under.
+    std::string name;
+
+    // Set to match tunnel frames, otherwise the first and last datagram
+    // ports that are matched.
+    bool tunnel = false;
+    uint8_t first_port = 0;
+    uint8_t last_port = 0;
+
+    BucketConfig bucket;
+  };
+
+  // The shaping applied to the frames sent by one side of a link.
+  struct Config {
+    // The bucket that every frame sent over the link is charged to. Its
+    // weight sets the share of the link in the airtime of a TDMA cell.
+    BucketConfig link;
+
+    // The classes that frames are sorted into, in the order they are
+    // matched. Frames that match none of them, such as datagrams on other
+    // ports, are in a default class without a limit and with a weight of one.
+    std::vector<ClassConfig> classes;
+  };
+
+  // The name of the default class.
+  static constexpr char kDefaultClassName[] = "default";
+
+  // Setup the shaper with full buckets.
+  explicit TrafficShaper(const Config& config);
+
+  // Returns the number of classes, including the default class, which is
+  // last.
+  size_t GetClassCount() const { return classes_.size(); }
+
+  // Returns the name of a class.
+  const std::string& GetClassName(size_t class_index) const {
+    return classes_[class_index].name;
+  }
+
+  // Returns the weight of the link.
+  uint32_t GetLinkWeight() const { return link_.weight; }
+
+  // Returns the class of a frame from the tunnel or sent to a datagram port.
+  size_t Classify(bool tunnel, uint8_t port) const;
+
+  // Returns true if a class may start a frame at a time, which requires that
+  // neither its bucket nor that of the link is empty.
+  bool IsConforming(size_t class_index, uint64_t now_us);
+
+  // Returns the class to start the next frame from, given whether each class
+  // has a frame waiting, or nothing if every class with a frame waiting must
+  // wait for airtime. Of the classes that may send, the one that has
+  // received the least airtime for its weight is chosen.
+  std::optional<size_t> SelectClass(const std::vector<bool>& waiting,
+                                    uint64_t now_us);
+
+  // Charges the airtime spent sending a packet of a frame in a class.
+  void Charge(size_t class_index, double airtime_us);
+
+ private:
+  // A token bucket of airtime.
+  struct Bucket {
+    std::string name;
+    uint64_t rate_us;
+    double burst_us;
+    uint32_t weight;
+
+    // The airtime available, which may be negative once overdrawn, and the
+    // time it was last topped up.
+    double tokens_us;
+    uint64_t refill_us;
+
+    // The airtime received by the class divided by its weight, which is used
+    // to share the airtime between classes that may send.
+    double service_us;
+  };
+
+  // The shortest default burst, which allows at least a full frame of
+  // packets to be sent at the lowest data rate.
+  static constexpr uint64_t kMinBurstUs = 20000;
+
+  // The classes that frames are matched against and the bucket of the link.
+  std::vector<ClassConfig> class_configs_;
+  std::vector<Bucket> classes_;
+  Bucket link_;
+
+  // The service of the class that was last chosen, which classes that were
+  // idle are brought up to so that they do not save up a share of the
+  // airtime while they have nothing to send.
+  double service_us_;
+
+  // Returns a full bucket for a configuration.
+  static Bucket CreateBucket(const std::string& name,
+                             const BucketConfig& config);
+
+  // Tops up a bucket with the airtime earned since it was last topped up
+  // and returns true if it is not empty.
+  static bool Refill(Bucket& bucket, uint64_t now_us);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_TRAFFIC_SHAPER_H_
@@ -0,0 +1,424 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/net/unix_socket_radio.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nerfnet/util/encoding.h"
+#include "nerfnet/util/log.h"
+#include "nerfnet/util/random.h"
+#include "nerfnet/util/string.h"
+#include "nerfnet/util/time.h"
+
+namespace nerfnet {
+namespace {
+
+// The time to wait for datagrams before checking whether the receive thread
+// should exit.
+constexpr int kPollTimeoutMs = 100;
+
+// Returns a path for the socket of a radio that is unique on this host.
+std::string GetUniquePath(const std::string& directory) {
+  static std::atomic<uint32_t> count(0);
+  return StringFormat("%s/radio-%d-%u", directory.c_str(), getpid(),
+      count++);
+}
+
+// Fills a socket address with a path. Quits and logs the error on failure.
+socklen_t GetSocketAddress(const std::string& path,
+                           struct sockaddr_un& address) {
+  address = {};
+  address.sun_family = AF_UNIX;
+  CHECK(path.size() < sizeof(address.sun_path),
+      "Socket path '%s' is too long", path.c_str());
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return sizeof(address);
+}
+
+// Opens a datagram socket bound to the supplied path. Quits and logs the
+// error on failure.
+int OpenBoundSocket(const std::string& directory, const std::string& path) {
+  CHECK(mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST,
+      "Failed to create '%s': %s (%d)", directory.c_str(),
+      strerror(errno), errno);
+
+  struct sockaddr_un address;
+  socklen_t address_size = GetSocketAddress(path, address);
+  int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  CHECK(fd >= 0, "Failed to open socket: %s (%d)", strerror(errno), errno);
+  unlink(path.c_str());
+  CHECK(bind(fd, reinterpret_cast<struct sockaddr*>(&address),
+      address_size) == 0, "Failed to bind socket '%s': %s (%d)",
+      path.c_str(), strerror(errno), errno);
+  return fd;
+}
+
+}  // anonymous namespace
+
+UnixSocketRadio::UnixSocketRadio(const std::string& directory,
+                                 uint8_t channel, double bit_error_rate)
+    : directory_(directory),
+      path_(GetUniquePath(directory)),
+      bit_error_rate_(bit_error_rate),
+      socket_fd_(OpenBoundSocket(directory_, path_)),
+      running_(true),
+      channel_(channel),
+      data_rate_(DataRate::k2Mbps),
+      writing_address_(0),
+      listening_(false),
+      listening_us_(0),
+      rx_fifo_overrun_(false),
+      tx_id_(0),
+      tx_acknowledged_(false),
+      random_(RandomU64()),
+      retransmit_count_(0) {
+  CHECK(channel < 128, "Channel must be between 0 and 127");
+  receive_thread_ = std::thread(&UnixSocketRadio::ReceiveThread, this);
+}
+
+UnixSocketRadio::~UnixSocketRadio() {
+  running_ = false;
+  receive_thread_.join();
+  close(socket_fd_);
+
+  // Links to this radio are removed unless another radio has since taken
+  // over the address.
+  for (const auto& address : reading_addresses_) {
+    if (address.has_value()) {
+      std::string address_path = GetAddressPath(address.value());
+      char target[PATH_MAX];
+      ssize_t size = readlink(address_path.c_str(), target, sizeof(target));
+      if (size > 0 && std::string(target, size) == path_.c_str()) {
+        unlink(address_path.c_str());
+      }
+
+      unlink(GetGroupMemberPath(address.value()).c_str());
+    }
+  }
+
+  unlink(path_.c_str());
+}
+
+void UnixSocketRadio::OpenWritingPipe(uint32_t address) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  writing_address_ = address;
+}
+
+void UnixSocketRadio::OpenReadingPipe(uint8_t pipe, uint32_t address) {
+  CHECK(pipe < kPipeCount, "Invalid pipe %u", pipe);
+  std::string address_path = GetAddressPath(address);
+  unlink(address_path.c_str());
+  CHECK(symlink(path_.c_str(), address_path.c_str()) == 0,
+      "Failed to link '%s': %s (%d)", address_path.c_str(),
+      strerror(errno), errno);
+
+  // The radio also joins the group of radios that receive broadcasts sent to
+  // the address.
+  std::string group_path = GetGroupPath(address);
+  std::string member_path = GetGroupMemberPath(address);
+  CHECK(mkdir(group_path.c_str(), 0755) == 0 || errno == EEXIST,
+      "Failed to create '%s': %s (%d)", group_path.c_str(),
+      strerror(errno), errno);
+  unlink(member_path.c_str());
+  CHECK(symlink(path_.c_str(), member_path.c_str()) == 0,
+      "Failed to link '%s': %s (%d)", member_path.c_str(),
+      strerror(errno), errno);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto& previous_address = reading_addresses_[pipe];
+  if (previous_address.has_value() && previous_address.value() != address
+      && std::count(reading_addresses_.begin(), reading_addresses_.end(),
+          previous_address) == 1) {
+    unlink(GetGroupMemberPath(previous_address.value()).c_str());
+  }
+
+  reading_addresses_[pipe] = address;
+  last_packets_[pipe].clear();
+}
+
+void UnixSocketRadio::SetChannel(uint8_t channel) {
+  CHECK(channel < 128, "Channel must be between 0 and 127");
+  std::lock_guard<std::mutex> lock(mutex_);
+  channel_ = channel;
+}
+
+uint8_t UnixSocketRadio::GetChannel() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return channel_;
+}
+
+void UnixSocketRadio::SetDataRate(DataRate data_rate) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  data_rate_ = data_rate;
+}
+
+Radio::DataRate UnixSocketRadio::GetDataRate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return data_rate_;
+}
+
+void UnixSocketRadio::StartListening() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  listening_ = true;
+  listening_us_ = TimeNowUs();
+}
+
+void UnixSocketRadio::StopListening() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  listening_ = false;
+}
+
+bool UnixSocketRadio::Write(const uint8_t* data, size_t size) {
+  std::vector<uint8_t> datagram(kHeaderSize + size);
+  struct sockaddr_un address;
+  socklen_t address_size;
+  double bit_time_us;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tx_id_ = (tx_id_ + 1) & 0x03;
+    tx_acknowledged_ = false;
+    bit_time_us = GetBitTimeUs(data_rate_);
+    datagram[0] = kKindPacket;
+    datagram[1] = channel_;
+    datagram[2] = static_cast<uint8_t>(data_rate_);
+    datagram[3] = tx_id_;
+    WriteLittleEndianU32(&datagram[4], writing_address_);
+    address_size = GetSocketAddress(GetAddressPath(writing_address_),
+        address);
+  }
+
+  // The packet arrives once the transmitter has settled and the packet has
+  // been sent. The attempt then waits for the acknowledgement to be sent.
+  std::copy(data, data + size, &datagram[kHeaderSize]);
+  uint64_t packet_us = kTurnaroundUs
+      + static_cast<uint64_t>(bit_time_us * (kOverheadBits + size * 8));
+  uint64_t attempt_us = kAttemptOverheadUs
+      + static_cast<uint64_t>(bit_time_us * (2 * kOverheadBits + size * 8));
+  for (uint8_t attempt = 0; attempt < kMaxAttempts; attempt++) {
+    uint64_t start_us = TimeNowUs();
+    SleepUs(packet_us);
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!IsCorrupted(kOverheadBits + size * 8)) {
+      // The peer may not exist yet, which is the same as it not listening.
+      sendto(socket_fd_, datagram.data(), datagram.size(), MSG_DONTWAIT,
+          reinterpret_cast<struct sockaddr*>(&address), address_size);
+    }
+
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::microseconds(attempt_us - packet_us + kAckGraceUs);
+    if (ack_cv_.wait_until(lock, deadline,
+            [this]() { return tx_acknowledged_; })) {
+      lock.unlock();
+      uint64_t elapsed_us = TimeNowUs() - start_us;
+      if (elapsed_us < attempt_us) {
+        SleepUs(attempt_us - elapsed_us);
+      }
+
+      retransmit_count_ = attempt;
+      return true;
+    }
+  }
+
+  retransmit_count_ = kMaxAttempts - 1;
+  return false;
+}
+
+void UnixSocketRadio::WriteBroadcast(uint32_t address, const uint8_t* data,
+                                     size_t size) {
+  std::vector<uint8_t> datagram(kHeaderSize + size);
+  double bit_time_us;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bit_time_us = GetBitTimeUs(data_rate_);
+    datagram[0] = kKindBroadcast;
+    datagram[1] = channel_;
+    datagram[2] = static_cast<uint8_t>(data_rate_);
+    datagram[3] = 0;
+    WriteLittleEndianU32(&datagram[4], address);
+  }
+
+  std::copy(data, data + size, &datagram[kHeaderSize]);
+  SleepUs(kTurnaroundUs
+      + static_cast<uint64_t>(bit_time_us * (kOverheadBits + size * 8)));
+
+  std::string group_path = GetGroupPath(address);
+  DIR* group = opendir(group_path.c_str());
+  if (group == nullptr) {
+    return;
+  }
+
+  std::string own_name = path_.substr(path_.rfind('/') + 1).c_str();
+  while (struct dirent* entry = readdir(group)) {
+    std::string name = entry->d_name;
+    if (name == "." || name == ".." || name == own_name) {
+      continue;
+    }
+
+    // Links left by radios that have exited are removed as they are found.
+    std::string member_path = StringFormat("%s/%s", group_path.c_str(),
+        name.c_str());
+    struct sockaddr_un member;
+    socklen_t member_size = GetSocketAddress(member_path, member);
+    if (sendto(socket_fd_, datagram.data(), datagram.size(), MSG_DONTWAIT,
+            reinterpret_cast<struct sockaddr*>(&member), member_size) < 0
+        && (errno == ECONNREFUSED || errno == ENOENT)) {
+      unlink(member_path.c_str());
+    }
+  }
+
+  closedir(group);
+}
+
+bool UnixSocketRadio::Available() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !rx_fifo_.empty();
+}
+
+bool UnixSocketRadio::ReadAll(std::vector<RxPacket>& packets) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& packet : rx_fifo_) {
+    packets.push_back(std::move(packet));
+  }
+
+  rx_fifo_.clear();
+  bool overrun = rx_fifo_overrun_;
+  rx_fifo_overrun_ = false;
+  return overrun;
+}
+
+std::string UnixSocketRadio::GetAddressPath(uint32_t address) const {
+  return StringFormat("%s/%08x", directory_.c_str(), address);
+}
+
+std::string UnixSocketRadio::GetGroupPath(uint32_t address) const {
+  return StringFormat("%s/%08x.group", directory_.c_str(), address);
+}
+
+std::string UnixSocketRadio::GetGroupMemberPath(uint32_t address) const {
+  return StringFormat("%s/%08x.group/%s", directory_.c_str(), address,
+      path_.substr(path_.rfind('/') + 1).c_str());
+}
+
+bool UnixSocketRadio::IsCorrupted(size_t bits) {
+  if (bit_error_rate_ <= 0.0) {
+    return false;
+  }
+
+  double success = std::pow(1.0 - bit_error_rate_, bits);
+  return std::uniform_real_distribution<double>()(random_) >= success;
+}
+
+void UnixSocketRadio::ReceiveThread() {
+  struct pollfd fd = {socket_fd_, POLLIN, 0};
+  uint8_t buffer[kHeaderSize + 32];
+  while (running_) {
+    int status = poll(&fd, 1, kPollTimeoutMs);
+    if (status < 0) {
+      LOGE("Failed to poll socket: %s (%d)", strerror(errno), errno);
+      continue;
+    } else if (status == 0) {
+      continue;
+    }
+
+    struct sockaddr_un sender = {};
+    socklen_t sender_size = sizeof(sender);
+    ssize_t size = recvfrom(socket_fd_, buffer, sizeof(buffer), MSG_DONTWAIT,
+        reinterpret_cast<struct sockaddr*>(&sender), &sender_size);
+    if (size >= static_cast<ssize_t>(kHeaderSize)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      HandleDatagram(buffer, size, sender, sender_size);
+    }
+  }
+}
+
+void UnixSocketRadio::HandleDatagram(const uint8_t* data, size_t size,
+                                     const struct sockaddr_un& sender,
+                                     socklen_t sender_size) {
+  uint8_t kind = data[0];
+  uint8_t channel = data[1];
+  uint8_t data_rate = data[2];
+  uint8_t id = data[3];
+  uint32_t address = ReadLittleEndianU32(&data[4]);
+  if (channel != channel_ || data_rate != static_cast<uint8_t>(data_rate_)) {
+    return;
+  }
+
+  if (kind == kKindAck) {
+    if (id == tx_id_ && address == writing_address_) {
+      tx_acknowledged_ = true;
+      ack_cv_.notify_all();
+    }
+
+    return;
+  }
+
+  // Packets are missed while transmitting and while the receiver settles.
+  if ((kind != kKindPacket && kind != kKindBroadcast) || !listening_
+      || TimeNowUs() - listening_us_ < kTurnaroundUs) {
+    return;
+  }
+
+  auto pipe = std::find(reading_addresses_.begin(), reading_addresses_.end(),
+      address);
+  if (pipe == reading_addresses_.end()) {
+    return;
+  }
+
+  // A broadcast is heard once by each receiver, with its own errors.
+  size_t pipe_index = pipe - reading_addresses_.begin();
+  if (kind == kKindBroadcast) {
+    if (rx_fifo_.size() >= kRxFifoSize) {
+      rx_fifo_overrun_ = true;
+    } else if (!IsCorrupted(kOverheadBits + (size - kHeaderSize) * 8)) {
+      rx_fifo_.push_back({static_cast<uint8_t>(pipe_index),
+          std::vector<uint8_t>(&data[kHeaderSize], &data[size])});
+    }
+
+    return;
+  }
+
+  // The ID is kept with the packet to recognize it when it is sent again.
+  std::vector<uint8_t> packet(&data[3], &data[size]);
+  if (packet != last_packets_[pipe_index]) {
+    if (rx_fifo_.size() >= kRxFifoSize) {
+      rx_fifo_overrun_ = true;
+      return;
+    }
+
+    rx_fifo_.push_back({static_cast<uint8_t>(pipe_index),
+        std::vector<uint8_t>(&data[kHeaderSize], &data[size])});
+    last_packets_[pipe_index] = std::move(packet);
+  }
+
+  if (!IsCorrupted(kOverheadBits)) {
+    uint8_t ack[kHeaderSize] = {kKindAck, channel, data_rate, id};
+    WriteLittleEndianU32(&ack[4], address);
+    sendto(socket_fd_, ack, sizeof(ack), MSG_DONTWAIT,
+        reinterpret_cast<const struct sockaddr*>(&sender), sender_size);
+  }
+}
+
+}  // namespace nerfnet
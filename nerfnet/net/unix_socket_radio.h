@@ -0,0 +1,182 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_NET_UNIX_SOCKET_RADIO_H_
+#define NERFNET_NET_UNIX_SOCKET_RADIO_H_
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <vector>
+
+#include "nerfnet/net/radio.h"
+
+namespace nerfnet {
+
+// A radio that carries packets as datagrams over unix sockets in a shared
+// directory, so that separate processes on one host can be linked. Each
+// radio binds a socket of its own and links the reading addresses that it
+// opens to it, which works across network namespaces. Like the NRF24L01,
+// packets are acknowledged by a thread that acts as the radio hardware,
+// writes are retried until acknowledged, and packets are only received while
+// listening, starting shortly after the radio turns around. Radios sharing a
+// directory must use distinct reading addresses, although any number of them
+// receive broadcasts sent to an address.
+class UnixSocketRadio final : public Radio {
+ public:
+  // Setup the radio in the supplied directory, which is created if required.
+  // Packets and acknowledgements are corrupted with the supplied bit error
+  // rate. Quits and logs the error on failure.
+  UnixSocketRadio(const std::string& directory, uint8_t channel,
+                  double bit_error_rate);
+  ~UnixSocketRadio();
+
+  // Radio methods.
+  void OpenWritingPipe(uint32_t address) override;
+  void OpenReadingPipe(uint8_t pipe, uint32_t address) override;
+  void SetChannel(uint8_t channel) override;
+  uint8_t GetChannel() override;
+  void SetDataRate(DataRate data_rate) override;
+  DataRate GetDataRate() override;
+  void StartListening() override;
+  void StopListening() override;
+  bool Write(const uint8_t* data, size_t size) override;
+  void WriteBroadcast(uint32_t address, const uint8_t* data,
+                      size_t size) override;
+  uint8_t GetRetransmitCount() override { return retransmit_count_; }
+  bool Available() override;
+  bool ReadAll(std::vector<RxPacket>& packets) override;
+
+ private:
+  // The number of packets that can be held in the receive FIFO and the
+  // number of reading pipes supported.
+  static constexpr size_t kRxFifoSize = 3;
+  static constexpr size_t kPipeCount = 6;
+
+  // The number of attempts made to deliver a packet, as configured by the
+  // RF24Radio, and the bits of preamble, 3 byte address, packet control field
+  // and 1 byte CRC that are sent with every packet and acknowledgement.
+  static constexpr uint8_t kMaxAttempts = 16;
+  static constexpr size_t kOverheadBits = 8 + 24 + 9 + 8;
+
+  // The fixed time spent switching between transmit and receive for each
+  // attempt and the time taken to start receiving after entering receive
+  // mode.
+  static constexpr uint64_t kAttemptOverheadUs = 260;
+  static constexpr uint64_t kTurnaroundUs = 130;
+
+  // The time waited for an acknowledgement beyond the attempt before sending
+  // again, which is the retransmit delay configured by the RF24Radio and also
+  // allows the host time to deliver the acknowledgement.
+  static constexpr uint64_t kAckGraceUs = 250;
+
+  // The kinds of datagram exchanged between radios and the size of their
+  // header, which carries the kind, the channel, the data rate, the packet
+  // ID and the destination address. Broadcasts are neither acknowledged nor
+  // sent again.
+  static constexpr uint8_t kKindPacket = 0;
+  static constexpr uint8_t kKindAck = 1;
+  static constexpr uint8_t kKindBroadcast = 2;
+  static constexpr size_t kHeaderSize = 8;
+
+  // The directory that sockets are placed in and the path of the socket of
+  // this radio.
+  const std::string directory_;
+  const std::string path_;
+
+  // The probability that each bit sent is corrupted.
+  const double bit_error_rate_;
+
+  // The socket of this radio.
+  const int socket_fd_;
+
+  // Set to false to stop the receive thread.
+  std::atomic<bool> running_;
+
+  // Guards the state below, which is shared with the receive thread.
+  std::mutex mutex_;
+
+  // Signalled when an acknowledgement is received.
+  std::condition_variable ack_cv_;
+
+  // The channel and data rate that the radio operates on and the address
+  // that packets are written to.
+  uint8_t channel_;
+  DataRate data_rate_;
+  uint32_t writing_address_;
+
+  // The addresses that packets are received on and the ID and contents of
+  // the last packet received on each pipe, which are used to discard
+  // packets sent again when their acknowledgement was lost.
+  std::array<std::optional<uint32_t>, kPipeCount> reading_addresses_;
+  std::array<std::vector<uint8_t>, kPipeCount> last_packets_;
+
+  // Whether the radio is listening and the time that it started.
+  bool listening_;
+  uint64_t listening_us_;
+
+  // The received packets and whether a packet was dropped because they
+  // filled the FIFO.
+  std::deque<RxPacket> rx_fifo_;
+  bool rx_fifo_overrun_;
+
+  // The ID of the packet being written and whether it was acknowledged.
+  uint8_t tx_id_;
+  bool tx_acknowledged_;
+
+  // Decides which transmissions are corrupted.
+  std::mt19937_64 random_;
+
+  // The number of retries needed by the last write. Only accessed by the
+  // thread using the radio.
+  uint8_t retransmit_count_;
+
+  // Acts as the radio hardware by receiving packets and acknowledgements.
+  std::thread receive_thread_;
+
+  // Returns the path of the socket that receives packets sent to an address.
+  std::string GetAddressPath(uint32_t address) const;
+
+  // Returns the path of the directory that holds a link to every radio that
+  // receives broadcasts sent to an address, and the path of the link to this
+  // radio within it.
+  std::string GetGroupPath(uint32_t address) const;
+  std::string GetGroupMemberPath(uint32_t address) const;
+
+  // Returns true if a transmission of the supplied number of bits is
+  // corrupted. The mutex must be held.
+  bool IsCorrupted(size_t bits);
+
+  // Receives datagrams until the radio is destroyed.
+  void ReceiveThread();
+
+  // Handles a datagram from another radio. The mutex must be held.
+  void HandleDatagram(const uint8_t* data, size_t size,
+                      const struct sockaddr_un& sender,
+                      socklen_t sender_size);
+};
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_NET_UNIX_SOCKET_RADIO_H_
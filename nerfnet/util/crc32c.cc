@@ -0,0 +1,114 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/util/crc32c.h"
+
+#include <array>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#include <cstring>
+#else
+#include "nerfnet/util/encoding.h"
+#endif
+
+namespace nerfnet {
+namespace {
+
+#if defined(__ARM_FEATURE_CRC32)
+
+// Consumes the buffer 8 bytes at a time with the CRC instructions. The loads
+// are unaligned, which ARMv8 supports.
+uint32_t Update(uint32_t crc, const uint8_t* data, size_t size) {
+  for (; size >= 8; data += 8, size -= 8) {
+    uint64_t value;
+    memcpy(&value, data, sizeof(value));
+    crc = __crc32cd(crc, value);
+  }
+
+  for (; size > 0; data++, size--) {
+    crc = __crc32cb(crc, *data);
+  }
+
+  return crc;
+}
+
+constexpr char kImplementation[] = "armv8";
+
+#else
+
+// The reversed Castagnoli polynomial.
+constexpr uint32_t kPolynomial = 0x82f63b78;
+
+// The tables used to process 8 bytes at a time. Table 0 is the byte-wise
+// table and table n advances a byte through n more zero bytes.
+using Tables = std::array<std::array<uint32_t, 256>, 8>;
+
+constexpr Tables GenerateTables() {
+  Tables tables = {};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ ((crc & 1) ? kPolynomial : 0);
+    }
+
+    tables[0][i] = crc;
+  }
+
+  for (size_t table = 1; table < tables.size(); table++) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t previous = tables[table - 1][i];
+      tables[table][i] = (previous >> 8) ^ tables[0][previous & 0xff];
+    }
+  }
+
+  return tables;
+}
+
+constexpr Tables kTables = GenerateTables();
+
+uint32_t Update(uint32_t crc, const uint8_t* data, size_t size) {
+  for (; size >= 8; data += 8, size -= 8) {
+    uint32_t low = ReadLittleEndianU32(&data[0]) ^ crc;
+    uint32_t high = ReadLittleEndianU32(&data[4]);
+    crc = kTables[7][low & 0xff] ^ kTables[6][(low >> 8) & 0xff]
+        ^ kTables[5][(low >> 16) & 0xff] ^ kTables[4][low >> 24]
+        ^ kTables[3][high & 0xff] ^ kTables[2][(high >> 8) & 0xff]
+        ^ kTables[1][(high >> 16) & 0xff] ^ kTables[0][high >> 24];
+  }
+
+  for (; size > 0; data++, size--) {
+    crc = (crc >> 8) ^ kTables[0][(crc ^ *data) & 0xff];
+  }
+
+  return crc;
+}
+
+constexpr char kImplementation[] = "slice-by-8";
+
+#endif  // defined(__ARM_FEATURE_CRC32)
+
+}  // anonymous namespace
+
+uint32_t Crc32c(const uint8_t* data, size_t size, uint32_t crc) {
+  return ~Update(~crc, data, size);
+}
+
+const char* GetCrc32cImplementation() {
+  return kImplementation;
+}
+
+}  // namespace nerfnet
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_UTIL_CRC32C_H_
+#define NERFNET_UTIL_CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nerfnet {
+
+// Computes the CRC32C (Castagnoli) checksum of a buffer, continuing from a
+// previous checksum if supplied. Uses the ARMv8 CRC instructions when they
+// are available and slice-by-8 tables otherwise.
+uint32_t Crc32c(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+// Returns the name of the implementation in use.
+const char* GetCrc32cImplementation();
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_UTIL_CRC32C_H_
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/util/cycle_counter.h"
+
+#include <fstream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace nerfnet {
+
+CycleCounter::CycleCounter() {
+  struct perf_event_attr attr = {};
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+CycleCounter::~CycleCounter() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+void CycleCounter::Start() {
+  ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+uint64_t CycleCounter::Stop() {
+  ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+  uint64_t cycles = 0;
+  if (read(fd_, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+    return 0;
+  }
+
+  return cycles;
+}
+
+double GetCpuMhz() {
+  std::ifstream file("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
+  uint64_t khz = 0;
+  file >> khz;
+  return khz / 1000.0;
+}
+
+}  // namespace nerfnet
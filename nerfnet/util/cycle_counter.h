@@ -0,0 +1,54 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_UTIL_CYCLE_COUNTER_H_
+#define NERFNET_UTIL_CYCLE_COUNTER_H_
+
+#include <cstdint>
+
+#include "nerfnet/util/non_copyable.h"
+
+namespace nerfnet {
+
+// Counts the CPU cycles spent by this thread using the kernel performance
+// counters. Not all kernels expose the cycle counter to unprivileged users,
+// in which case the cycles are estimated from the clock frequency.
+class CycleCounter : public NonCopyable {
+ public:
+  CycleCounter();
+  ~CycleCounter();
+
+  // Returns true if the cycle counter is available.
+  bool IsAvailable() const { return fd_ >= 0; }
+
+  // Starts counting cycles from zero.
+  void Start();
+
+  // Stops counting and returns the number of cycles since Start.
+  uint64_t Stop();
+
+ private:
+  // The performance counter.
+  int fd_;
+};
+
+// Returns the maximum frequency of the first core in MHz or zero if it is
+// not known.
+double GetCpuMhz();
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_UTIL_CYCLE_COUNTER_H_
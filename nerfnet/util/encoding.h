@@ -0,0 +1,90 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_UTIL_ENCODING_H_
+#define NERFNET_UTIL_ENCODING_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace nerfnet {
+
+// Reads big-endian integers from the supplied buffer.
+inline uint16_t ReadBigEndianU16(const uint8_t* data) {
+  return (static_cast<uint16_t>(data[0]) << 8) | data[1];
+}
+
+inline uint32_t ReadBigEndianU32(const uint8_t* data) {
+  return (static_cast<uint32_t>(ReadBigEndianU16(data)) << 16)
+      | ReadBigEndianU16(data + 2);
+}
+
+inline uint64_t ReadBigEndianU64(const uint8_t* data) {
+  return (static_cast<uint64_t>(ReadBigEndianU32(data)) << 32)
+      | ReadBigEndianU32(data + 4);
+}
+
+// Writes big-endian integers to the supplied buffer.
+inline void WriteBigEndianU16(uint8_t* data, uint16_t value) {
+  data[0] = value >> 8;
+  data[1] = value;
+}
+
+inline void WriteBigEndianU32(uint8_t* data, uint32_t value) {
+  WriteBigEndianU16(data, value >> 16);
+  WriteBigEndianU16(data + 2, value);
+}
+
+inline void WriteBigEndianU64(uint8_t* data, uint64_t value) {
+  WriteBigEndianU32(data, value >> 32);
+  WriteBigEndianU32(data + 4, value);
+}
+
+// Appends big-endian integers to the supplied buffer.
+inline void AppendBigEndianU16(std::vector<uint8_t>& buffer, uint16_t value) {
+  buffer.push_back(value >> 8);
+  buffer.push_back(value);
+}
+
+inline void AppendBigEndianU32(std::vector<uint8_t>& buffer, uint32_t value) {
+  AppendBigEndianU16(buffer, value >> 16);
+  AppendBigEndianU16(buffer, value);
+}
+
+// Reads little-endian integers from the supplied buffer.
+inline uint32_t ReadLittleEndianU32(const uint8_t* data) {
+  return static_cast<uint32_t>(data[0])
+      | (static_cast<uint32_t>(data[1]) << 8)
+      | (static_cast<uint32_t>(data[2]) << 16)
+      | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+// Writes little-endian integers to the supplied buffer.
+inline void WriteLittleEndianU32(uint8_t* data, uint32_t value) {
+  data[0] = value;
+  data[1] = value >> 8;
+  data[2] = value >> 16;
+  data[3] = value >> 24;
+}
+
+inline void WriteLittleEndianU64(uint8_t* data, uint64_t value) {
+  WriteLittleEndianU32(data, value);
+  WriteLittleEndianU32(data + 4, value >> 32);
+}
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_UTIL_ENCODING_H_
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "nerfnet/util/random.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/random.h>
+
+#include "nerfnet/util/log.h"
+
+namespace nerfnet {
+
+void GetRandomBytes(uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t bytes_read = getrandom(data, size, 0);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+
+    CHECK(bytes_read > 0, "Failed to read random bytes: %s (%d)",
+        strerror(errno), errno);
+    data += bytes_read;
+    size -= bytes_read;
+  }
+}
+
+uint64_t RandomU64() {
+  uint64_t value;
+  GetRandomBytes(reinterpret_cast<uint8_t*>(&value), sizeof(value));
+  return value;
+}
+
+}  // namespace nerfnet
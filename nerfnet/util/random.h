@@ -0,0 +1,34 @@
+/*
+ * Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NERFNET_UTIL_RANDOM_H_
+#define NERFNET_UTIL_RANDOM_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nerfnet {
+
+// Fills the buffer with random bytes from the kernel that are suitable for use
+// as keys and nonces.
+void GetRandomBytes(uint8_t* data, size_t size);
+
+// Returns a random number from the kernel.
+uint64_t RandomU64();
+
+}  // namespace nerfnet
+
+#endif  // NERFNET_UTIL_RANDOM_H_
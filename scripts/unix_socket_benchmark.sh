@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Copyright 2020 Andrew Rossignol andrew.rossignol@gmail.com
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Links a primary and a secondary nerfnet process over unix socket radios on
+# this host, then measures the throughput of the link with iperf and the CPU
+# time used by each side. Each process runs in a network namespace of its own
+# so that traffic between the tunnels crosses the link. Must be run as root.
+#
+# usage: unix_socket_benchmark.sh [nerfnet binary] [seconds] [bit error rate]
+
+set -euo pipefail
+
+NERFNET=$(realpath "${1:-build/nerfnet/net/nerfnet}")
+DURATION=${2:-10}
+BIT_ERROR_RATE=${3:-0}
+
+NETNS_PREFIX=nerfnet-benchmark
+SOCKET_DIR=$(mktemp -d)
+PIDS=()
+
+cleanup() {
+  kill "${PIDS[@]}" 2> /dev/null || true
+  wait 2> /dev/null || true
+  ip netns delete "$NETNS_PREFIX-primary" 2> /dev/null || true
+  ip netns delete "$NETNS_PREFIX-secondary" 2> /dev/null || true
+  rm -rf "$SOCKET_DIR"
+}
+
+trap cleanup EXIT
+
+# Prints the user and system CPU time used by a process in clock ticks.
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+for side in primary secondary; do
+  ip netns add "$NETNS_PREFIX-$side"
+  ip netns exec "$NETNS_PREFIX-$side" ip link set lo up
+  ip netns exec "$NETNS_PREFIX-$side" "$NERFNET" --$side \
+      --radio_socket_dir "$SOCKET_DIR" \
+      --emulate_bit_error_rate "$BIT_ERROR_RATE" \
+      > "$SOCKET_DIR/$side.log" 2>&1 &
+  PIDS+=($!)
+done
+
+PRIMARY_PID=${PIDS[0]}
+SECONDARY_PID=${PIDS[1]}
+
+# Allow the link to be established before starting the server.
+sleep 2
+ip netns exec "$NETNS_PREFIX-secondary" iperf -s > /dev/null 2>&1 &
+PIDS+=($!)
+sleep 1
+
+PRIMARY_START=$(cpu_ticks "$PRIMARY_PID")
+SECONDARY_START=$(cpu_ticks "$SECONDARY_PID")
+RESULT=$(ip netns exec "$NETNS_PREFIX-primary" \
+    iperf -c 192.168.10.2 -t "$DURATION" -y C | tail -n 1)
+PRIMARY_END=$(cpu_ticks "$PRIMARY_PID")
+SECONDARY_END=$(cpu_ticks "$SECONDARY_PID")
+
+# The CPU usage is reported as a percentage of one core.
+TICKS_PER_SECOND=$(getconf CLK_TCK)
+BITS_PER_SECOND=$(echo "$RESULT" | cut -d, -f9)
+awk -v bps="$BITS_PER_SECOND" -v duration="$DURATION" \
+    -v ticks="$TICKS_PER_SECOND" \
+    -v primary=$((PRIMARY_END - PRIMARY_START)) \
+    -v secondary=$((SECONDARY_END - SECONDARY_START)) 'BEGIN {
+  printf "throughput:     %.1f kbit/s\n", bps / 1000
+  printf "primary cpu:    %.1f%%\n", 100 * primary / ticks / duration
+  printf "secondary cpu:  %.1f%%\n", 100 * secondary / ticks / duration
+}'